@@ -9,7 +9,21 @@
 /* 
  * Demos are represented by the demo data type, pointing to a linked list of
  * blocks, each in turn pointing to a linked list of messages.
+ *
+ * Messages and blocks handed to the library must have every field the
+ * caller does not set zeroed, payload and share in particular, or freeing
+ * them follows a stray pointer. Create them with demo_message_new() and
+ * demo_block_new(), or calloc().
+ */
+
+/* Refcounted message data, see demo_context_share()
  */
+typedef struct _demo_payload demo_payload;
+
+/* Reference count of a message list shared by cloned blocks, see
+ * demo_clone()
+ */
+typedef struct _demo_block_share demo_block_share;
 
 typedef struct _message {
   uint32_t size;
@@ -17,6 +31,7 @@ typedef struct _message {
   uint8_t *data;
   struct _message *next;
   struct _message *prev;
+  demo_payload *payload; // if set, data is shared and must not be changed
 } message;
 
 typedef struct _block {
@@ -25,6 +40,7 @@ typedef struct _block {
   message *messages;
   struct _block *next;
   struct _block *prev;
+  demo_block_share *share; // if set, messages are shared with clones
 } block;
 
 typedef struct _demo {
@@ -33,6 +49,22 @@ typedef struct _demo {
   block *blocks;
 } demo;
 
+/* Streaming writer, see demo_writer_open()
+ */
+typedef struct _demo_writer demo_writer;
+
+/* Push parser, see demo_parser_new()
+ */
+typedef struct _demo_parser demo_parser;
+
+/* Reader following a demo still being recorded, see demo_follow_open()
+ */
+typedef struct _demo_follower demo_follower;
+
+/* Pending async write, see WRITEFLAG_ASYNC
+ */
+typedef struct _demo_write_handle demo_write_handle;
+
 typedef struct _flagfield {
   void *flag;
   void *value;
@@ -41,10 +73,62 @@ typedef struct _flagfield {
 /* Return data type
  */
 
-/* Progress callback function type
+/* Progress callback function type. The offset wraps beyond 4 GB, see
+ * progress64_cb_t.
  */
 typedef void (*progress_cb_t)(unsigned int);
 
+/* Progress callback function type, with the full offset into the demo
+ */
+typedef void (*progress64_cb_t)(uint64_t offset);
+
+/* Where a read stands, see READFLAG_PROGRESS_FN
+ */
+typedef struct _demo_progress {
+  uint64_t bytes;  // offset into the demo file
+  uint64_t total;  // size of the file when reading started, 0 if unknown
+  uint64_t blocks; // blocks read so far
+  double elapsed;  // seconds since reading started
+} demo_progress;
+
+/* Timed progress callback function type. Returning anything but 0 cancels
+ * the read, which then fails with DEMO_CANCELLED.
+ */
+typedef int (*demo_progress_cb_t)(void *ctx, const demo_progress *p);
+
+/* Scan callback function type. Receives a header demo (protocol and track,
+ * no blocks) and the block just read. Setting *b to NULL takes ownership of
+ * the block, otherwise it is freed when the callback returns.
+ */
+typedef int (*scan_cb_t)(void *ctx, demo *header, block **b);
+
+/* Layout of a registered protocol, see demo_register_protocol(). Starts as
+ * that of its base, with 2 byte coords and 1 byte angles.
+ */
+typedef struct _demo_protocol_layout {
+  uint32_t coord_size; // bytes per coord, 2 to 4
+  uint32_t angle_size; // bytes per angle, 1 to 4
+  int32_t size[256];   // fixed payload size by type, DEMO_SIZE_BASE keeps
+                       // the base's
+} demo_protocol_layout;
+
+/* Protocol layout callback type. Receives the protocol flags of the demo's
+ * SERVERINFO (0 without has_flags) and adjusts the layout to them.
+ * Returning anything but DEMO_OK fails the read with that code.
+ */
+typedef int (*demo_protocol_select_t)(void *ctx, uint32_t flags,
+                                      demo_protocol_layout *layout);
+
+/* A protocol extending one the reader knows, see demo_register_protocol()
+ */
+typedef struct _demo_protocol_def {
+  uint32_t number;   // as sent in SERVERINFO and VERSION
+  uint32_t base;     // PROTOCOL_NETQUAKE, PROTOCOL_FITZQUAKE or PROTOCOL_BJP3
+  int has_flags;     // a 32 bit flags word follows the number in SERVERINFO
+  demo_protocol_select_t select; // may be NULL
+  void *ctx;
+} demo_protocol_def;
+
 /*****************************************************************************
  *                                                                           *
  *                API                                                        *
@@ -64,10 +148,147 @@ typedef void (*progress_cb_t)(unsigned int);
  *         and the demo pointer will remain unchanged.
  *
  * @long Reads a quake demo file from a supplied file name or FILE pointer,
- *       and returns it for processing.
+ *       and returns it for processing. A READFLAG_PROGRESS_FN callback is
+ *       called between blocks once per READFLAG_PROGRESS_MS milliseconds
+ *       (default 250). If it cancels, everything read so far is freed and
+ *       DEMO_CANCELLED is returned. A seekable READFLAG_FP file is left
+ *       right after the last byte parsed; a pipe is read ahead past it.
  */
 extern int demo_read(flagfield *flags, demo **demo);
 
+/**
+ * @function demo_scan
+ *
+ * @input flags Tag - value array describing the desired operation,
+ *              constructed out of READFLAG* tags.
+ *
+ * @input cb    Callback receiving each block in file order.
+ *
+ * @input ctx   Passed on to the callback.
+ *
+ * @return DEMO_OK upon success, or when the callback stops the scan by
+ *         returning DEMO_SCAN_STOP. Any other value returned by the
+ *         callback stops the scan and is returned. Upon failure, an error
+ *         code will be returned.
+ *
+ * @long Reads a quake demo file block by block without building the full
+ *       demo, so that only one block is held in memory at a time. Progress
+ *       is reported and may be cancelled as in demo_read(). A seekable
+ *       READFLAG_FP file is left right after the last block scanned, also
+ *       when the callback stops the scan.
+ */
+extern int demo_scan(flagfield *flags, scan_cb_t cb, void *ctx);
+
+/**
+ * @function demo_parser_new
+ *
+ * @input p Where to write a pointer to the new parser.
+ *
+ * @return DEMO_OK upon success, DEMO_NO_MEMORY otherwise.
+ *
+ * @long Creates a parser that is pushed the demo data in chunks of any
+ *       size with demo_parser_feed(), e.g. as it arrives over the network.
+ */
+extern int demo_parser_new(demo_parser **p);
+
+/**
+ * @function demo_parser_feed
+ *
+ * @input p   The parser.
+ *
+ * @input buf The next chunk of demo data, starting with the cd track line.
+ *
+ * @input len Length of the chunk, which may end anywhere.
+ *
+ * @input cb  Called for every block the chunk completes, as in demo_scan().
+ *
+ * @input ctx Passed on to the callback.
+ *
+ * @return DEMO_OK upon success. Upon failure, an error code or the value
+ *         the callback returned will be returned, and the parser must not
+ *         be fed any further.
+ *
+ * @long Parses the blocks completed by the chunk. An incomplete block, or
+ *       cd track header, is kept and finished by the following chunks.
+ */
+extern int demo_parser_feed(demo_parser *p, const void *buf, size_t len,
+                            scan_cb_t cb, void *ctx);
+
+/**
+ * @function demo_parser_close
+ *
+ * @input p The parser.
+ *
+ * @return DEMO_OK if the data ended after a complete block,
+ *         DEMO_UNEXPECTED_EOF if it ended in the middle of one.
+ *
+ * @long Frees the parser and anything still buffered in it.
+ */
+extern int demo_parser_close(demo_parser *p);
+
+/**
+ * @function demo_follow_open
+ *
+ * @input flags Tag - value array describing the desired operation,
+ *              constructed out of READFLAG* tags. READFLAG_READAHEAD is
+ *              not supported.
+ *
+ * @input f     Where to write a pointer to the new follower.
+ *
+ * @return DEMO_OK upon success. Upon failure, an error code will be
+ *         returned.
+ *
+ * @long Opens a demo file that may still be growing, e.g. one a server is
+ *       recording. Blocks are then read with demo_follow_next(). A
+ *       READFLAG_FP stream is read through its descriptor from then on,
+ *       bytes it has already buffered from a pipe are not seen.
+ */
+extern int demo_follow_open(flagfield *flags, demo_follower **f);
+
+/**
+ * @function demo_follow_next
+ *
+ * @input f          The follower.
+ *
+ * @input timeout_ms How long to wait for the file to grow, in milliseconds.
+ *                   0 does not wait, a negative value waits forever.
+ *
+ * @input header     Where to write the protocol and track known so far,
+ *                   or NULL.
+ *
+ * @input b          Where to write a pointer to the next block, which the
+ *                   caller must free with demo_free_block().
+ *
+ * @return DEMO_OK upon success, DEMO_PENDING if no complete block arrived
+ *         in time, DEMO_CANCELLED if a READFLAG_PROGRESS_FN callback
+ *         cancelled. Once the writer of a pipe or socket has closed it,
+ *         DEMO_END_OF_STREAM after the last complete block, or
+ *         DEMO_UNEXPECTED_EOF if it stopped in the middle of a block. Any
+ *         other error is final.
+ *
+ * @long Returns the blocks one at a time as they are completed. The end of
+ *       the file in the middle of a block is not an error, the position
+ *       and parser state are kept and reading resumes there once the file
+ *       has grown. Only the bytes that have arrived are read, straight
+ *       from the file descriptor: a pipe or socket is waited on with
+ *       poll(), so the timeout holds however little the writer sends, a
+ *       regular file is checked for growth every 50 ms.
+ */
+extern int demo_follow_next(demo_follower *f, int timeout_ms, demo *header,
+                            block **b);
+
+/**
+ * @function demo_follow_close
+ *
+ * @input f The follower.
+ *
+ * @return DEMO_OK.
+ *
+ * @long Frees the follower. A file opened by demo_follow_open() is closed,
+ *       a supplied FILE pointer is not.
+ */
+extern int demo_follow_close(demo_follower *f);
+
 /**
  * @function demo_write
  *
@@ -80,9 +301,172 @@ extern int demo_read(flagfield *flags, demo **demo);
  *         returned, and the possibly partly written file might be unplayable.
  *
  * @long Writes quake demo data pointed to by the demo pointer to a file.
+ *       With WRITEFLAG_ASYNC, the demo is serialized into memory and the
+ *       call returns without waiting for the disk. DEMO_OK then only means
+ *       the write was started, the result comes from demo_write_wait().
+ *       The demo may be freed as soon as demo_write() returns.
  */
 extern int demo_write(flagfield *flags, demo *demo);
 
+/**
+ * @function demo_write_wait
+ *
+ * @input h Handle returned through WRITEFLAG_ASYNC.
+ *
+ * @return DEMO_OK upon success. Upon failure, an error code will be
+ *         returned, and the possibly partly written file might be unplayable.
+ *
+ * @long Waits until an async write is finished and frees the handle. Must
+ *       be called exactly once for every handle.
+ */
+extern int demo_write_wait(demo_write_handle *h);
+
+/**
+ * @function demo_write_poll
+ *
+ * @input h Handle returned through WRITEFLAG_ASYNC.
+ *
+ * @return DEMO_PENDING while the write is running, otherwise what
+ *         demo_write_wait() will return.
+ *
+ * @long Checks an async write without blocking. The handle stays valid.
+ */
+extern int demo_write_poll(demo_write_handle *h);
+
+/**
+ * @function demo_writer_open
+ *
+ * @input flags Tag - value array describing the desired operation,
+ *              constructed out of WRITEFLAG* tags.
+ *
+ * @input track The cd track to write.
+ *
+ * @input w     Where to write a pointer to the new writer.
+ *
+ * @return DEMO_OK upon success. Upon failure, an error code will be
+ *         returned, and nothing is written.
+ *
+ * @long Starts writing a demo one block at a time, for producers that
+ *       never hold the whole demo in memory.
+ */
+extern int demo_writer_open(flagfield *flags, int32_t track, demo_writer **w);
+
+/**
+ * @function demo_writer_block
+ *
+ * @input w The writer.
+ *
+ * @input b The block to append. Its length must match its messages.
+ *
+ * @return DEMO_OK upon success. Upon failure, an error code will be
+ *         returned, and the partly written file might be unplayable.
+ *
+ * @long Appends one block. Empty blocks are skipped, as in demo_write().
+ */
+extern int demo_writer_block(demo_writer *w, block *b);
+
+/**
+ * @function demo_writer_raw
+ *
+ * @input w    The writer.
+ *
+ * @input data Blocks as they are stored in a demo file, headers included.
+ *
+ * @input len  Number of bytes.
+ *
+ * @return DEMO_OK upon success, DEMO_CANNOT_WRITE otherwise.
+ *
+ * @long Appends blocks copied from another demo file without parsing them.
+ *       The data is not checked, it must consist of whole blocks.
+ */
+extern int demo_writer_raw(demo_writer *w, const void *data, size_t len);
+
+/**
+ * @function demo_writer_close
+ *
+ * @input w The writer.
+ *
+ * @return DEMO_OK upon success, DEMO_CANNOT_WRITE if the buffered data
+ *         could not be flushed.
+ *
+ * @long Flushes the written data and frees the writer. A file opened by
+ *       demo_writer_open() is closed, a supplied FILE pointer is not.
+ */
+extern int demo_writer_close(demo_writer *w);
+
+/**
+ * @function demo_clone
+ *
+ * @input src The demo to clone.
+ *
+ * @input dst Where to write a pointer to the clone.
+ *
+ * @return DEMO_OK upon success, DEMO_NO_MEMORY otherwise.
+ *
+ * @long Makes a copy of the demo that shares the messages of every block
+ *       with src, so only the block list itself is allocated. Either demo
+ *       may be changed and freed independently, as long as the messages of
+ *       a block are only changed after demo_block_unshare(). Blocks may be
+ *       unlinked, relinked, given new angles or freed freely. Updates src's
+ *       reference counts, so must not run while another thread uses src.
+ */
+extern int demo_clone(demo *src, demo **dst);
+
+/**
+ * @function demo_block_unshare
+ *
+ * @input b The block about to be changed.
+ *
+ * @return DEMO_OK upon success, DEMO_NO_MEMORY otherwise, in which case
+ *         the block is unchanged.
+ *
+ * @long Gives a block of a cloned demo its own copy of its messages, unless
+ *       it already holds the only reference. Message data that is a shared
+ *       payload stays shared, see demo_message_unshare(). Does nothing to
+ *       blocks that are not shared.
+ */
+extern int demo_block_unshare(block *b);
+
+/**
+ * @function demo_message_unshare
+ *
+ * @input m A message of an unshared block.
+ *
+ * @return DEMO_OK upon success, DEMO_NO_MEMORY otherwise, in which case
+ *         the message is unchanged.
+ *
+ * @long Gives a message whose data is a shared payload a private, malloc()ed
+ *       copy of the data, which may then be changed.
+ */
+extern int demo_message_unshare(message *m);
+
+/**
+ * @function demo_message_new
+ *
+ * @input type Message type.
+ *
+ * @input size Payload size. The data is allocated zeroed, NULL for 0.
+ *
+ * @input m    Where to write a pointer to the new message.
+ *
+ * @return DEMO_OK upon success, DEMO_NO_MEMORY otherwise.
+ *
+ * @long Allocates an unlinked message with all other fields cleared, to be
+ *       filled in, linked into a block and freed by the library.
+ */
+extern int demo_message_new(uint32_t type, uint32_t size, message **m);
+
+/**
+ * @function demo_block_new
+ *
+ * @input b Where to write a pointer to the new block.
+ *
+ * @return DEMO_OK upon success, DEMO_NO_MEMORY otherwise.
+ *
+ * @long Allocates an unlinked, empty block with all fields cleared.
+ */
+extern int demo_block_new(block **b);
+
 /**
  * @function demo_free
  *
@@ -107,6 +491,43 @@ extern int demo_free(demo *demo);
  */
 extern int demo_free_data(demo *demo);
 
+/**
+ * @function demo_free_block
+ *
+ * @input b The block to free.
+ *
+ * @return DEMO_OK.
+ *
+ * @long Frees a single block and its messages. The block must already be
+ *       unlinked from any demo.
+ */
+extern int demo_free_block(block *b);
+
+/**
+ * @function demo_free_message
+ *
+ * @input m The message to free.
+ *
+ * @return DEMO_OK.
+ *
+ * @long Frees a single message and its data. The message must already be
+ *       unlinked from its block.
+ */
+extern int demo_free_message(message *m);
+
+/**
+ * @function demo_free_message_data
+ *
+ * @input m The message whose data to free.
+ *
+ * @return DEMO_OK.
+ *
+ * @long Frees the data of a message, or releases it if it is shared, and
+ *       sets data to NULL and size to 0. Call this before giving a message
+ *       new data.
+ */
+extern int demo_free_message_data(message *m);
+
 /**
  * @function demo_error
  *
@@ -120,6 +541,42 @@ extern int demo_free_data(demo *demo);
  */
 extern char *demo_error(int errcode);
 
+/**
+ * @function demo_register_protocol
+ *
+ * @input def The protocol, copied.
+ *
+ * @return DEMO_OK upon success, DEMO_BAD_PARAMS if the number is 0, taken
+ *         or the base is not one the reader knows, DEMO_NO_MEMORY if
+ *         DEMO_MAX_PROTOCOLS are registered already.
+ *
+ * @long Makes the readers accept demos of another protocol, one that lays
+ *       out its messages like its base apart from the sizes of coords,
+ *       angles and fixed size messages. The layout is chosen when a demo's
+ *       SERVERINFO is read: it starts as the base's, select() adjusts it
+ *       to the protocol flags that follow the number, and the coord and
+ *       angle dependent sizes are scaled to match. The layout built for a
+ *       set of flags is kept and shared by all demos using it, select()
+ *       must not call back into the library.
+ *
+ *       Only reading knows about registered protocols. The decoders of
+ *       demo_simd.h fail with DEMO_BAD_PARAMS, and conversion from them
+ *       with DEMO_CANNOT_CONVERT. Register before reading, a protocol
+ *       cannot be unregistered.
+ */
+extern int demo_register_protocol(const demo_protocol_def *def);
+
+/**
+ * @function demo_serverinfo_header
+ *
+ * @input m A SERVERINFO message.
+ *
+ * @return The size of the header before the map title: protocol number,
+ *         protocol flags if the protocol has them, max clients and game
+ *         type. 0 if m is not a SERVERINFO message or too short.
+ */
+extern size_t demo_serverinfo_header(const message *m);
+
 
 /*****************************************************************************
  *                                                                           *
@@ -134,6 +591,14 @@ extern char *demo_error(int errcode);
 #define READFLAG_FILENAME        (void *)100
 #define READFLAG_FP              (void *)101
 #define READFLAG_PROGRESS_CB     (void *)102
+#define READFLAG_READAHEAD       (void *)103 // value: chunk size, 0 for default
+#define READFLAG_EVENTS          (void *)104 // value: demo_events *
+#define READFLAG_CONTEXT         (void *)105 // value: demo_context *
+#define READFLAG_HASHES          (void *)106 // value: demo_hashes *
+#define READFLAG_PROGRESS64_CB   (void *)107 // value: progress64_cb_t
+#define READFLAG_PROGRESS_FN     (void *)108 // value: demo_progress_cb_t
+#define READFLAG_PROGRESS_CTX    (void *)109 // value: void *, for the above
+#define READFLAG_PROGRESS_MS     (void *)110 // value: interval, 0 for default
 #define READFLAG_END             (void *)800
 
 /*****************************************************************************
@@ -143,6 +608,7 @@ extern char *demo_error(int errcode);
 #define WRITEFLAG_FILENAME       (void *)200
 #define WRITEFLAG_FP             (void *)201
 #define WRITEFLAG_REPLACE        (void *)202
+#define WRITEFLAG_ASYNC          (void *)203 // value: demo_write_handle **
 #define WRITEFLAG_END            (void *)800
 
 /*****************************************************************************
@@ -160,6 +626,11 @@ extern char *demo_error(int errcode);
 #define DEMO_UNEXPECTED_EOF      7
 #define DEMO_BAD_PARAMS          8
 #define DEMO_NO_MEMORY           9
+#define DEMO_SCAN_STOP           10
+#define DEMO_PENDING             11
+#define DEMO_CANNOT_CONVERT      12
+#define DEMO_CANCELLED           13
+#define DEMO_END_OF_STREAM       14
 #define DEMO_INTERNAL_1          50
 
 #define DEMO_BAD_FILE            DEMO_CORRUPT_DEMO // obsolete
@@ -170,11 +641,16 @@ extern char *demo_error(int errcode);
  *                                                                           *
  *****************************************************************************/
 
+// the protocols the reader knows, others extending them can be added with
+// demo_register_protocol()
 #define PROTOCOL_UNKNOWN         0
 #define PROTOCOL_NETQUAKE        15
 #define PROTOCOL_FITZQUAKE       666
 #define PROTOCOL_BJP3            10002
 
+#define DEMO_MAX_PROTOCOLS       16 // registered ones
+#define DEMO_SIZE_BASE           -1 // see demo_protocol_layout
+
 /*****************************************************************************
  *                                                                           *
  *                DEMO MESSAGE TYPES                                         *
@@ -0,0 +1,108 @@
+#ifndef DEMO_AIM_H
+#define DEMO_AIM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include "demo.h"
+#include "demo_angles.h"
+
+// DATA TYPES
+
+#define AIM_HISTOGRAM_BINS       64
+
+/* Tuning of the aim analysis. Velocities are in degrees per second of
+ * server time, accelerations in degrees per second squared.
+ */
+typedef struct _aim_params {
+  float velocity_bin;     // width of a velocity histogram bin
+  float acceleration_bin; // width of an acceleration histogram bin
+  float snap_velocity;    // a snap reaches at least this velocity...
+  float settle_velocity;  // ...and drops below this one the frame after
+} aim_params;
+
+/* Aim statistics over one angle series. Frames are pairs of consecutive
+ * blocks with increasing server time; the last histogram bins also count
+ * everything beyond the histogram range.
+ */
+typedef struct _aim_stats {
+  uint32_t frames;
+  uint32_t snaps;
+  float mean_velocity;
+  float peak_velocity;
+  float peak_acceleration;
+  uint32_t velocity_hist[AIM_HISTOGRAM_BINS];
+  uint32_t acceleration_hist[AIM_HISTOGRAM_BINS];
+} aim_stats;
+
+/*****************************************************************************
+ *                                                                           *
+ *                API                                                        *
+ *                                                                           *
+ *****************************************************************************/
+
+/**
+ * @function demo_aim_defaults
+ *
+ * @input params Parameters to fill with the defaults.
+ *
+ * @return DEMO_OK.
+ */
+extern int demo_aim_defaults(aim_params *params);
+
+/**
+ * @function demo_aim_deltas
+ *
+ * @input series   Angle series, see demo_angles.h.
+ * @input dpitch   Where to write count pitch deltas, or NULL.
+ * @input dyaw     Where to write count yaw deltas, or NULL.
+ * @input velocity Where to write count angular velocities, or NULL.
+ *
+ * @return DEMO_OK upon success, DEMO_BAD_PARAMS on a NULL series.
+ *
+ * @long Entry n holds the change from entry n - 1 to n, wrapped into
+ *       [-180, 180] degrees. Entry 0, and entries whose time did not
+ *       advance, get a velocity of -1.
+ */
+extern int demo_aim_deltas(const angle_series *series, float *dpitch,
+                           float *dyaw, float *velocity);
+
+/**
+ * @function demo_aim_analyse
+ *
+ * @input series Angle series, see demo_angles.h.
+ * @input params Analysis parameters, or NULL for the defaults.
+ * @input stats  Where to write the statistics.
+ *
+ * @return DEMO_OK upon success, DEMO_BAD_PARAMS on bad input.
+ *
+ * @long Computes velocity and acceleration histograms and snap statistics
+ *       for one demo, using vector kernels where the CPU supports them
+ *       (see demo_simd.h).
+ */
+extern int demo_aim_analyse(const angle_series *series,
+                            const aim_params *params, aim_stats *stats);
+
+/**
+ * @function demo_aim_batch
+ *
+ * @input series Array of n angle series.
+ * @input n      Number of series.
+ * @input params Analysis parameters, or NULL for the defaults.
+ * @input stats  Array of n statistics to write.
+ *
+ * @return DEMO_OK upon success, or the first error encountered.
+ *
+ * @long Runs demo_aim_analyse() over many demos.
+ */
+extern int demo_aim_batch(const angle_series *series, size_t n,
+                          const aim_params *params, aim_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DEMO_AIM_H
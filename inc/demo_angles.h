@@ -0,0 +1,81 @@
+#ifndef DEMO_ANGLES_H
+#define DEMO_ANGLES_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include "demo.h"
+
+// DATA TYPES
+
+/* Per block view angles and server time, as structure of arrays. The n-th
+ * entry of each array belongs to the n-th block of the demo.
+ */
+typedef struct _angle_series {
+  float *time;
+  float *pitch;
+  float *yaw;
+  float *roll;
+  size_t count;
+  size_t capacity;
+} angle_series;
+
+/*****************************************************************************
+ *                                                                           *
+ *                API                                                        *
+ *                                                                           *
+ *****************************************************************************/
+
+/**
+ * @function demo_extract_angles
+ *
+ * @input d      The demo to extract angles from.
+ *
+ * @input series Where to write the angles. If capacity is 0, the arrays
+ *               are allocated by the library and must be released with
+ *               demo_angles_free(). Otherwise the caller supplied arrays
+ *               are filled, up to capacity entries each.
+ *
+ * @return DEMO_OK upon success. DEMO_BAD_PARAMS if the caller supplied
+ *         arrays are too small, in which case count holds the number of
+ *         entries needed. DEMO_NO_MEMORY if allocation fails.
+ *
+ * @long Fills one entry per block with the block angles, paired with the
+ *       time of the latest TIME message seen in or before the block (0
+ *       until the first one).
+ */
+extern int demo_extract_angles(demo *d, angle_series *series);
+
+/**
+ * @function demo_scan_angles
+ *
+ * @input flags  Tag - value array describing the desired operation,
+ *               constructed out of READFLAG* tags.
+ *
+ * @input series Where to write the angles, as for demo_extract_angles().
+ *
+ * @return As for demo_extract_angles(), or any error from demo_scan().
+ *
+ * @long Same as demo_extract_angles(), but reads the demo file through
+ *       demo_scan() without building the full demo.
+ */
+extern int demo_scan_angles(flagfield *flags, angle_series *series);
+
+/**
+ * @function demo_angles_free
+ *
+ * @input series Series whose arrays were allocated by the library.
+ *
+ * @return DEMO_OK.
+ *
+ * @long Frees the arrays and resets the series to empty.
+ */
+extern int demo_angles_free(angle_series *series);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DEMO_ANGLES_H
@@ -0,0 +1,168 @@
+#ifndef DEMO_CACHE_H
+#define DEMO_CACHE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include "demo.h"
+
+// DATA TYPES
+
+/* On disk layout of a .ldc cache file. All offsets are from the start of
+ * the file and 8 byte aligned, all values are in host byte order.
+ */
+#define LDC_MAGIC                "LDC1"
+#define LDC_VERSION              1
+#define LDC_BYTE_ORDER           0x01020304
+
+typedef struct _ldc_header {
+  char magic[4];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t protocol;
+  int32_t track;
+  uint32_t reserved;
+  uint64_t block_count;
+  uint64_t message_count;
+  uint64_t payload_size;
+  uint64_t block_offset;
+  uint64_t message_offset;
+  uint64_t payload_offset;
+} ldc_header;
+
+/* Block table entry. The messages of a block are message_count consecutive
+ * entries of the message table, starting at first_message.
+ */
+typedef struct _ldc_block {
+  uint32_t length;
+  float angles[3];
+  uint64_t first_message;
+  uint32_t message_count;
+  uint32_t reserved;
+} ldc_block;
+
+/* Message table entry. The payload is size bytes of the payload pool,
+ * starting at offset.
+ */
+typedef struct _ldc_message {
+  uint32_t type;
+  uint32_t size;
+  uint64_t offset;
+} ldc_message;
+
+/* Read only view of a mapped cache file. The tables point straight into
+ * the mapping, use demo_cache_messages() and demo_cache_data() to follow
+ * the indices in them safely.
+ */
+typedef struct _demo_cache {
+  uint32_t protocol;
+  int32_t track;
+  uint64_t block_count;
+  uint64_t message_count;
+  uint64_t payload_size;
+  const ldc_block *blocks;
+  const ldc_message *messages;
+  const uint8_t *payload;
+  void *map;
+  size_t map_size;
+} demo_cache;
+
+/*****************************************************************************
+ *                                                                           *
+ *                API                                                        *
+ *                                                                           *
+ *****************************************************************************/
+
+/**
+ * @function demo_save_cache
+ *
+ * @input filename Name of the cache file to write, usually ending in .ldc.
+ *
+ * @input d        The demo to store.
+ *
+ * @return DEMO_OK upon success. DEMO_CANNOT_OPEN_DEMO or DEMO_CANNOT_WRITE
+ *         if the file could not be written, DEMO_CORRUPT_DEMO if a block
+ *         length does not match its messages.
+ *
+ * @long Writes the demo with offsets in place of pointers. The file is
+ *       written under a temporary name and renamed into place, so readers
+ *       that have the old cache mapped are not disturbed.
+ */
+extern int demo_save_cache(const char *filename, demo *d);
+
+/**
+ * @function demo_load_cache
+ *
+ * @input filename Name of the cache file.
+ *
+ * @input c        Where to write a pointer to the new view.
+ *
+ * @return DEMO_OK upon success. DEMO_CANNOT_OPEN_DEMO if the file cannot
+ *         be opened or mapped, DEMO_CORRUPT_DEMO if it is not a cache of
+ *         this version and byte order, or its tables do not fit in it.
+ *
+ * @long Maps the file and sets up the view in constant time. Nothing is
+ *       parsed or copied; pages are read in as they are touched.
+ */
+extern int demo_load_cache(const char *filename, demo_cache **c);
+
+/**
+ * @function demo_cache_messages
+ *
+ * @input c The cache.
+ *
+ * @input b A block of the cache.
+ *
+ * @return Pointer to the first of the block's b->message_count messages,
+ *         or NULL if they lie outside the message table.
+ */
+extern const ldc_message *demo_cache_messages(const demo_cache *c,
+                                              const ldc_block *b);
+
+/**
+ * @function demo_cache_data
+ *
+ * @input c The cache.
+ *
+ * @input m A message of the cache.
+ *
+ * @return Pointer to the m->size payload bytes of the message, or NULL if
+ *         they lie outside the payload pool.
+ */
+extern const uint8_t *demo_cache_data(const demo_cache *c,
+                                      const ldc_message *m);
+
+/**
+ * @function demo_cache_demo
+ *
+ * @input c The cache.
+ *
+ * @input d Where to write a pointer to the new demo.
+ *
+ * @return DEMO_OK upon success, DEMO_CORRUPT_DEMO if the cache indices are
+ *         out of range, DEMO_NO_MEMORY if allocation fails.
+ *
+ * @long Builds an ordinary demo from the cache, for the functions that
+ *       want one. Free it with demo_free(); the cache may be freed first.
+ */
+extern int demo_cache_demo(const demo_cache *c, demo **d);
+
+/**
+ * @function demo_cache_free
+ *
+ * @input c The cache.
+ *
+ * @return DEMO_OK.
+ *
+ * @long Unmaps the file and frees the view.
+ */
+extern int demo_cache_free(demo_cache *c);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DEMO_CACHE_H
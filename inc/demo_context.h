@@ -0,0 +1,196 @@
+#ifndef DEMO_CONTEXT_H
+#define DEMO_CONTEXT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include "demo.h"
+
+// DATA TYPES
+
+/* State shared by all demos read with the same READFLAG_CONTEXT, e.g. by
+ * every demo a process keeps loaded. Opaque, see demo_context_new(). All
+ * functions may be called from several threads at once.
+ */
+typedef struct _demo_context demo_context;
+
+/* The names a SERVERINFO message precaches, as string ids of the context.
+ * Indices are those the protocol uses, models[1] is the map's world model,
+ * models[0] and sounds[0] are unused and 0. Read only, lives as long as the
+ * context, and shared by all levels with the same names.
+ */
+typedef struct _demo_precache {
+  uint32_t title;
+  uint32_t model_count;
+  uint32_t sound_count;
+  const uint32_t *models;
+  const uint32_t *sounds;
+} demo_precache;
+
+/*****************************************************************************
+ *                                                                           *
+ *                API                                                        *
+ *                                                                           *
+ *****************************************************************************/
+
+/**
+ * @function demo_context_new
+ *
+ * @input c Where to write a pointer to the new context.
+ *
+ * @return DEMO_OK upon success, DEMO_NO_MEMORY otherwise.
+ */
+extern int demo_context_new(demo_context **c);
+
+/**
+ * @function demo_context_intern
+ *
+ * @input c  The context.
+ *
+ * @input s  The string.
+ *
+ * @input id Where to write the id of the string.
+ *
+ * @return DEMO_OK upon success, DEMO_NO_MEMORY otherwise.
+ *
+ * @long Equal strings get the same id, which stays valid as long as the
+ *       context. Id 0 is the empty string.
+ */
+extern int demo_context_intern(demo_context *c, const char *s, uint32_t *id);
+
+/**
+ * @function demo_context_string
+ *
+ * @input c  The context.
+ *
+ * @input id A string id.
+ *
+ * @return The string, or "" for an unknown id. The pointer stays valid as
+ *         long as the context.
+ */
+extern const char *demo_context_string(const demo_context *c, uint32_t id);
+
+/**
+ * @function demo_context_precache
+ *
+ * @input c          The context.
+ *
+ * @input serverinfo A SERVERINFO message.
+ *
+ * @input p          Where to write a pointer to the precache, or NULL.
+ *
+ * @return DEMO_OK upon success. DEMO_BAD_PARAMS if the message is no
+ *         SERVERINFO, DEMO_CORRUPT_DEMO if its lists are not terminated,
+ *         DEMO_NO_MEMORY if allocation fails.
+ *
+ * @long Demos read with READFLAG_CONTEXT have their precaches interned
+ *       while they are parsed, so this only finds the existing one.
+ */
+extern int demo_context_precache(demo_context *c, const message *serverinfo,
+                                 const demo_precache **p);
+
+/**
+ * @function demo_precache_model
+ *
+ * @input c     The context.
+ *
+ * @input p     A precache of the context.
+ *
+ * @input index A model index, as in entity and baseline messages.
+ *
+ * @return The model name, or NULL if the index is not precached.
+ */
+extern const char *demo_precache_model(const demo_context *c,
+                                       const demo_precache *p,
+                                       uint32_t index);
+
+/**
+ * @function demo_precache_sound
+ *
+ * @input c     The context.
+ *
+ * @input p     A precache of the context.
+ *
+ * @input index A sound index, as in SOUND messages.
+ *
+ * @return The sound name, or NULL if the index is not precached.
+ */
+extern const char *demo_precache_sound(const demo_context *c,
+                                       const demo_precache *p,
+                                       uint32_t index);
+
+/**
+ * @function demo_context_share
+ *
+ * @input c The context whose payload store to use, or NULL.
+ *
+ * @input m The message.
+ *
+ * @return DEMO_OK upon success, DEMO_NO_MEMORY otherwise.
+ *
+ * @long Turns the message's data into a shared, refcounted payload. If the
+ *       store already holds the same bytes, the message's own copy is
+ *       freed and it references that payload instead. Without a context the
+ *       data is only made refcounted. Messages that are already shared are
+ *       left alone. Shared data must not be changed, and is released by
+ *       demo_free_message() or demo_free_message_data().
+ */
+extern int demo_context_share(demo_context *c, message *m);
+
+/**
+ * @function demo_context_share_block
+ *
+ * @input c The context.
+ *
+ * @input b The block.
+ *
+ * @return DEMO_OK upon success, DEMO_NO_MEMORY otherwise.
+ *
+ * @long Shares the messages of the block that describe the level rather
+ *       than a moment in it: server info, light styles, baselines, static
+ *       entities and sounds, stuff text, cd track, sky and fog. Demos of
+ *       the same map mostly repeat these byte for byte. Demos read with
+ *       READFLAG_CONTEXT have this done to every block.
+ */
+extern int demo_context_share_block(demo_context *c, block *b);
+
+/**
+ * @function demo_payload_retain
+ *
+ * @input p A payload.
+ *
+ * @long Takes another reference, for another message sharing the data.
+ */
+extern void demo_payload_retain(demo_payload *p);
+
+/**
+ * @function demo_payload_release
+ *
+ * @input p A payload.
+ *
+ * @long Drops a reference, freeing the payload with the last one. Used by
+ *       the free functions, see demo_free_message_data().
+ */
+extern void demo_payload_release(demo_payload *p);
+
+/**
+ * @function demo_context_free
+ *
+ * @input c The context.
+ *
+ * @return DEMO_OK.
+ *
+ * @long Frees the context with all its strings and precaches. Demos read
+ *       with it stay valid, their shared payloads outlive the store, but
+ *       they must not be freed while this runs.
+ */
+extern int demo_context_free(demo_context *c);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DEMO_CONTEXT_H
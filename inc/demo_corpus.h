@@ -0,0 +1,244 @@
+#ifndef DEMO_CORPUS_H
+#define DEMO_CORPUS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include "demo.h"
+
+// DATA TYPES
+
+/* On disk layout of a corpus index. All offsets are from the start of the
+ * file and 8 byte aligned, all values are in host byte order. Strings are
+ * referenced by their offset in the string pool, which starts with an
+ * empty string, so a reference of 0 means none.
+ */
+#define CORPUS_MAGIC             "LDX1"
+#define CORPUS_VERSION           3
+#define CORPUS_BYTE_ORDER        0x01020304
+
+typedef struct _corpus_header {
+  char magic[4];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t reserved;
+  uint64_t entry_count;
+  uint64_t level_count;
+  uint64_t name_count;
+  uint64_t string_size;
+  uint64_t entry_offset;
+  uint64_t level_offset;
+  uint64_t name_offset;
+  uint64_t string_offset;
+} corpus_header;
+
+/* One demo file. Entries are sorted by path. status is the result of
+ * parsing the demo, if it is not DEMO_OK the other fields describe the part
+ * read before the error. fingerprint is that of demo_hashes_fingerprint(),
+ * or for a demo that failed to parse the demo_hash64() of the whole file.
+ * The modification time is in seconds and nanoseconds, as far as the file
+ * system keeps them.
+ */
+typedef struct _corpus_entry {
+  uint64_t path;
+  uint64_t size;
+  int64_t mtime;
+  uint32_t mtime_nsec;
+  uint32_t reserved;
+  uint64_t fingerprint;
+  uint64_t first_level;
+  uint64_t first_name;
+  uint32_t level_count;
+  uint32_t name_count;
+  uint32_t protocol;
+  int32_t track;
+  float duration;
+  int32_t status;
+} corpus_entry;
+
+/* One level of a demo, from a SERVERINFO message up to the next one.
+ * offset is the file offset of the block holding the SERVERINFO message.
+ */
+typedef struct _corpus_level {
+  uint64_t map;
+  uint64_t title;
+  uint64_t offset;
+  uint64_t first_block;
+  uint64_t block_count;
+  float start_time;
+  float end_time;
+} corpus_level;
+
+/* Read only view of a mapped corpus index. Each entry's levels and player
+ * names are slices of the level and name tables, the name table holds
+ * string references.
+ */
+typedef struct _demo_corpus {
+  uint64_t entry_count;
+  uint64_t level_count;
+  uint64_t name_count;
+  uint64_t string_size;
+  const corpus_entry *entries;
+  const corpus_level *levels;
+  const uint64_t *names;
+  const char *strings;
+  void *map;
+  size_t map_size;
+} demo_corpus;
+
+/* Counts from demo_corpus_update()
+ */
+typedef struct _corpus_stats {
+  size_t scanned;
+  size_t reused;
+  size_t removed;
+  size_t failed;
+} corpus_stats;
+
+/* Query for demo_corpus_query(). Every criterion left at its default from
+ * demo_corpus_query_init() matches any demo.
+ */
+typedef struct _corpus_query {
+  uint32_t protocol;
+  const char *map;
+  const char *player;
+  float min_duration;
+  float max_duration;
+} corpus_query;
+
+/* Query callback function type. Any value other than DEMO_OK ends the
+ * query, DEMO_SCAN_STOP without an error.
+ */
+typedef int (*corpus_cb_t)(void *ctx, const demo_corpus *c,
+                           const corpus_entry *e);
+
+/*****************************************************************************
+ *                                                                           *
+ *                API                                                        *
+ *                                                                           *
+ *****************************************************************************/
+
+/**
+ * @function demo_corpus_update
+ *
+ * @input filename Name of the corpus index file.
+ *
+ * @input dir      Directory holding the demos, searched recursively for
+ *                 files ending in .dem.
+ *
+ * @input stats    Where to write what was done, or NULL.
+ *
+ * @return DEMO_OK upon success. DEMO_CANNOT_OPEN_DEMO if the directory
+ *         cannot be read, DEMO_CANNOT_WRITE if the index cannot be written.
+ *
+ * @long Builds the index, or brings an existing one up to date. Demos whose
+ *       size and modification time, to the nanosecond, are unchanged are
+ *       taken over from the old index, only new and changed ones are read.
+ *       So are demos modified no earlier than the old index was written,
+ *       which a file system with coarse timestamps may show unchanged
+ *       after another write. Entries of removed
+ *       files are dropped. Demos that fail to parse are kept with their
+ *       error in status, so they are not read again until they change.
+ *       The new index replaces the old one atomically.
+ */
+extern int demo_corpus_update(const char *filename, const char *dir,
+                              corpus_stats *stats);
+
+/**
+ * @function demo_corpus_open
+ *
+ * @input filename Name of the corpus index file.
+ *
+ * @input c        Where to write a pointer to the new view.
+ *
+ * @return DEMO_OK upon success. DEMO_CANNOT_OPEN_DEMO if the file cannot
+ *         be opened or mapped, DEMO_CORRUPT_DEMO if it is not an index of
+ *         this version and byte order.
+ *
+ * @long Maps the index in constant time.
+ */
+extern int demo_corpus_open(const char *filename, demo_corpus **c);
+
+/**
+ * @function demo_corpus_string
+ *
+ * @input c   The corpus.
+ *
+ * @input ref A string reference from one of the tables.
+ *
+ * @return The string, or "" if the reference is out of range.
+ */
+extern const char *demo_corpus_string(const demo_corpus *c, uint64_t ref);
+
+/**
+ * @function demo_corpus_levels
+ *
+ * @input c The corpus.
+ *
+ * @input e An entry of the corpus.
+ *
+ * @return Pointer to the first of the entry's e->level_count levels, or
+ *         NULL if they lie outside the level table.
+ */
+extern const corpus_level *demo_corpus_levels(const demo_corpus *c,
+                                              const corpus_entry *e);
+
+/**
+ * @function demo_corpus_names
+ *
+ * @input c The corpus.
+ *
+ * @input e An entry of the corpus.
+ *
+ * @return Pointer to the first of the entry's e->name_count player name
+ *         references, or NULL if they lie outside the name table.
+ */
+extern const uint64_t *demo_corpus_names(const demo_corpus *c,
+                                         const corpus_entry *e);
+
+/**
+ * @function demo_corpus_query_init
+ *
+ * @input q The query to reset.
+ *
+ * @long Sets every criterion to match any demo.
+ */
+extern void demo_corpus_query_init(corpus_query *q);
+
+/**
+ * @function demo_corpus_query
+ *
+ * @input c   The corpus.
+ *
+ * @input q   The query. map matches any level of a demo, both map and
+ *            player compare case insensitively. Durations are in seconds,
+ *            max_duration is exclusive.
+ *
+ * @input cb  Called for every matching entry, in path order.
+ *
+ * @input ctx Passed on to the callback.
+ *
+ * @return DEMO_OK upon success, or the error the callback returned.
+ */
+extern int demo_corpus_query(const demo_corpus *c, const corpus_query *q,
+                             corpus_cb_t cb, void *ctx);
+
+/**
+ * @function demo_corpus_close
+ *
+ * @input c The corpus.
+ *
+ * @return DEMO_OK.
+ *
+ * @long Unmaps the index and frees the view.
+ */
+extern int demo_corpus_close(demo_corpus *c);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DEMO_CORPUS_H
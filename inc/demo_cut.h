@@ -0,0 +1,107 @@
+#ifndef DEMO_CUT_H
+#define DEMO_CUT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include "demo.h"
+
+// DATA TYPES
+
+/* A time range of a demo file, see demo_splice()
+ */
+typedef struct _demo_clip {
+  flagfield *flags; // READFLAG_FILENAME or READFLAG_FP, others are ignored
+  float start;
+  float end;
+} demo_clip;
+
+/* How demo_split() writes the levels
+ */
+typedef struct _demo_split_params {
+  const char *prefix; // level n goes to <prefix><n>.dem, n from 001
+  int replace;        // overwrite existing files
+  int threads;        // writer threads, 0 for one per cpu
+} demo_split_params;
+
+/*****************************************************************************
+ *                                                                           *
+ *                API                                                        *
+ *                                                                           *
+ *****************************************************************************/
+
+/**
+ * @function demo_cut
+ *
+ * @input rflags READFLAG* tags describing the demo to read. Only
+ *               READFLAG_FILENAME and READFLAG_FP are used.
+ * @input start  Start of the range, in demo time.
+ * @input end    End of the range, not before start.
+ * @input wflags WRITEFLAG* tags describing the demo to write.
+ *               WRITEFLAG_ASYNC is not supported.
+ *
+ * @return DEMO_OK upon success. Upon failure, an error code will be
+ *         returned, and the possibly partly written file might be
+ *         unplayable.
+ *
+ * @long Writes the part of a demo from start to end as a demo of its own:
+ *       the signon blocks of the level, from its SERVERINFO to its first
+ *       frame, then the frame holding start and the following ones up to
+ *       the last one before end. Blocks are copied as they are. Frames are
+ *       recognized by the TIME message they start with and skipped using
+ *       their length, only other blocks are parsed. The range is taken
+ *       from the first level reaching start, and ends with that level.
+ */
+extern int demo_cut(flagfield *rflags, float start, float end,
+                    flagfield *wflags);
+
+/**
+ * @function demo_splice
+ *
+ * @input clips  The ranges to join, in order.
+ * @input count  Number of ranges.
+ * @input wflags WRITEFLAG* tags describing the demo to write.
+ *               WRITEFLAG_ASYNC is not supported.
+ *
+ * @return As demo_cut().
+ *
+ * @long Writes the ranges one after the other as demo_cut() does, each
+ *       with its own signon, so the result plays like a demo with one
+ *       level per range. The cd track is that of the first demo.
+ */
+extern int demo_splice(const demo_clip *clips, size_t count,
+                       flagfield *wflags);
+
+/**
+ * @function demo_split
+ *
+ * @input rflags READFLAG* tags describing the demo to read, which must be
+ *               a file that can be read at any offset. Only
+ *               READFLAG_FILENAME and READFLAG_FP are used.
+ * @input params Where to write the levels.
+ * @input levels Where to write the number of levels written, or NULL.
+ *
+ * @return DEMO_OK upon success, DEMO_BAD_PARAMS if the demo cannot be read
+ *         at any offset, DEMO_FILE_EXISTS if a level file exists and
+ *         replace is not set. Upon any other failure, an error code will
+ *         be returned.
+ *
+ * @long Writes every level of a multi-level demo, from one SERVERINFO to
+ *       the next, to a demo file of its own. A skip scan as in demo_cut()
+ *       finds the levels, then the writer threads copy their blocks from
+ *       the file in parallel, each level as is. The cd track line of each
+ *       file is that of the source demo, the track the recorder forced
+ *       (usually -1); each level's music stays in its CDTRACK message.
+ *       Blocks before the first SERVERINFO go with the first level.
+ */
+extern int demo_split(flagfield *rflags, const demo_split_params *params,
+                      uint32_t *levels);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DEMO_CUT_H
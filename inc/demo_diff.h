@@ -0,0 +1,80 @@
+#ifndef DEMO_DIFF_H
+#define DEMO_DIFF_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include "demo.h"
+
+// DATA TYPES
+
+/* Kinds of diff operations
+ */
+#define DIFF_SAME                0 // a_count identical blocks
+#define DIFF_REMOVED             1 // a_count blocks only in a
+#define DIFF_INSERTED            2 // b_count blocks only in b
+#define DIFF_CHANGED             3 // one block of a replaced by one of b
+
+/* One operation of a diff. Blocks are numbered from 0 in each demo, and
+ * the operations cover both demos in order. For DIFF_CHANGED a_block and
+ * b_block are the two blocks, and the messages that differ are a_count
+ * messages from a_message in a_block, replaced by b_count messages from
+ * b_message in b_block; the messages before and after are identical.
+ */
+typedef struct _diff_op {
+  int kind;
+  uint64_t a_first;
+  uint64_t b_first;
+  uint64_t a_count;
+  uint64_t b_count;
+  block *a_block;
+  block *b_block;
+  uint32_t a_message;
+  uint32_t b_message;
+} diff_op;
+
+/* Diff callback function type. Any value other than DEMO_OK ends the diff,
+ * DEMO_SCAN_STOP without an error.
+ */
+typedef int (*diff_cb_t)(void *ctx, const diff_op *op);
+
+/*****************************************************************************
+ *                                                                           *
+ *                API                                                        *
+ *                                                                           *
+ *****************************************************************************/
+
+/**
+ * @function demo_diff
+ *
+ * @input a   The original demo.
+ *
+ * @input b   The demo to compare it with.
+ *
+ * @input cb  Called for every operation, in block order.
+ *
+ * @input ctx Passed on to the callback.
+ *
+ * @return DEMO_OK upon success, DEMO_NO_MEMORY if allocation fails, or the
+ *         error the callback returned.
+ *
+ * @long Aligns the demos block by block on their demo_hash_block() hashes,
+ *       so blocks with equal hashes count as identical. Common runs at the
+ *       start and end are matched first, then blocks occurring once in
+ *       each demo anchor the alignment of the rest, patience diff style.
+ *       Stretches without such anchors are aligned with a bounded Myers
+ *       diff, or failing that replaced as a whole. Replaced stretches pair
+ *       their blocks in order into DIFF_CHANGED operations, whatever is
+ *       left over is removed or inserted. Runs time near linear in the
+ *       number of blocks.
+ */
+extern int demo_diff(demo *a, demo *b, diff_cb_t cb, void *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DEMO_DIFF_H
@@ -0,0 +1,173 @@
+#ifndef DEMO_EVENTS_H
+#define DEMO_EVENTS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include "demo.h"
+
+// DATA TYPES
+
+/* Per message type event index of a demo, see demo_events_new(). Opaque.
+ */
+typedef struct _demo_events demo_events;
+
+/* One message. level is the number of the level in the demo, counting from
+ * 0 and up by one at every SERVERINFO after the first. block is the number
+ * of the block in the demo, counting from 0, message that of the message
+ * within the block. time is that of the latest TIME message of the level
+ * seen in or before the message, 0 until the first one.
+ */
+typedef struct _event_ref {
+  uint32_t level;
+  uint32_t block;
+  uint32_t message;
+  float time;
+} event_ref;
+
+/* Query callback function type. Any value other than DEMO_OK ends the
+ * query, DEMO_SCAN_STOP without an error.
+ */
+typedef int (*event_cb_t)(void *ctx, uint32_t type, const event_ref *e);
+
+#define EVENT_TYPES              256 // message types are one byte
+#define EVENT_ALL_LEVELS         -1 // see demo_events_query()
+
+/*****************************************************************************
+ *                                                                           *
+ *                API                                                        *
+ *                                                                           *
+ *****************************************************************************/
+
+/**
+ * @function demo_events_new
+ *
+ * @input ev     Where to write a pointer to the new, empty index.
+ *
+ * @input types  Message types to index, or NULL for all of them.
+ *
+ * @input ntypes Number of entries in types.
+ *
+ * @return DEMO_OK upon success, DEMO_BAD_PARAMS for a type of
+ *         EVENT_TYPES or above, DEMO_NO_MEMORY if allocation fails.
+ *
+ * @long Fill the index by passing it to demo_read() or demo_scan() with
+ *       READFLAG_EVENTS, or from a demo already read with
+ *       demo_events_build(). Entity updates make up most messages of a
+ *       demo, leaving them out keeps the index small.
+ */
+extern int demo_events_new(demo_events **ev, const uint32_t *types,
+                           size_t ntypes);
+
+/**
+ * @function demo_events_add
+ *
+ * @input ev The index.
+ *
+ * @input b  The next block of the demo.
+ *
+ * @return DEMO_OK upon success, DEMO_NO_MEMORY otherwise.
+ *
+ * @long Appends the messages of one block. Blocks are numbered in the
+ *       order they are added.
+ */
+extern int demo_events_add(demo_events *ev, block *b);
+
+/**
+ * @function demo_events_build
+ *
+ * @input ev The index, which should be empty.
+ *
+ * @input d  The demo.
+ *
+ * @return DEMO_OK upon success, DEMO_NO_MEMORY otherwise.
+ *
+ * @long Adds every block of the demo.
+ */
+extern int demo_events_build(demo_events *ev, demo *d);
+
+/**
+ * @function demo_events_levels
+ *
+ * @input ev The index.
+ *
+ * @return The number of levels of the blocks added so far, 0 before the
+ *         first block.
+ */
+extern uint32_t demo_events_levels(const demo_events *ev);
+
+/**
+ * @function demo_events_range
+ *
+ * @input ev    The index.
+ *
+ * @input type  The message type.
+ *
+ * @input level The level, see event_ref.
+ *
+ * @input start Start of the time range, inclusive.
+ *
+ * @input end   End of the time range, exclusive.
+ *
+ * @input first Where to write a pointer to the first matching event.
+ *
+ * @input count Where to write the number of matching events.
+ *
+ * @return DEMO_OK upon success, DEMO_BAD_PARAMS for a type not indexed.
+ *
+ * @long The events of a type are sorted by level and time, ties in demo
+ *       order, so the matches are a slice found by binary search. The
+ *       slice stays valid until the next block is added. Times restart
+ *       with each level, which is why a range lies within one.
+ */
+extern int demo_events_range(demo_events *ev, uint32_t type, uint32_t level,
+                             float start, float end, const event_ref **first,
+                             size_t *count);
+
+/**
+ * @function demo_events_query
+ *
+ * @input ev     The index.
+ *
+ * @input types  The message types, NULL for all indexed ones.
+ *
+ * @input ntypes Number of entries in types.
+ *
+ * @input level  The level, or EVENT_ALL_LEVELS for the range in each.
+ *
+ * @input start  Start of the time range, inclusive.
+ *
+ * @input end    End of the time range, exclusive.
+ *
+ * @input cb     Called for every matching event, in level and time order,
+ *               ties in demo order.
+ *
+ * @input ctx    Passed on to the callback.
+ *
+ * @return DEMO_OK upon success, an error from demo_events_range(), or the
+ *         error the callback returned.
+ *
+ * @long Merges the ranges of several types, e.g. every DAMAGE and
+ *       KILLEDMONSTER message of a fight.
+ */
+extern int demo_events_query(demo_events *ev, const uint32_t *types,
+                             size_t ntypes, int32_t level, float start,
+                             float end, event_cb_t cb, void *ctx);
+
+/**
+ * @function demo_events_free
+ *
+ * @input ev The index.
+ *
+ * @return DEMO_OK.
+ */
+extern int demo_events_free(demo_events *ev);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DEMO_EVENTS_H
@@ -0,0 +1,171 @@
+#ifndef DEMO_HASH_H
+#define DEMO_HASH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include "demo.h"
+
+// DATA TYPES
+
+/* Streaming state of demo_hash64(). Input is consumed in 64 byte stripes by
+ * eight 64 bit lanes, which the SSE2 and AVX2 kernels process side by side.
+ * The result does not depend on the kernel or on how the input is split
+ * into updates.
+ */
+typedef struct _demo_hash_state {
+  uint64_t acc[8];
+  uint64_t seed;
+  uint64_t length;
+  uint32_t stripes;
+  uint32_t buffered;
+  uint8_t buffer[64];
+} demo_hash_state;
+
+/* Hashes of a demo's blocks, see demo_hashes_new(). blocks[i] is the hash
+ * of block i as it is stored in the file, length and angles included.
+ * Read only to the caller.
+ */
+typedef struct _demo_hashes {
+  int32_t track;
+  uint64_t block_count;
+  uint64_t *blocks;
+  size_t capacity;
+} demo_hashes;
+
+/*****************************************************************************
+ *                                                                           *
+ *                HASH FUNCTIONS                                             *
+ *                                                                           *
+ *****************************************************************************/
+
+/**
+ * @function demo_hash_init
+ *
+ * @input s    The state to reset.
+ *
+ * @input seed Seed, different seeds give unrelated hashes.
+ */
+extern void demo_hash_init(demo_hash_state *s, uint64_t seed);
+
+/**
+ * @function demo_hash_update
+ *
+ * @input s    The state.
+ *
+ * @input data The next bytes of input.
+ *
+ * @input len  Number of bytes.
+ */
+extern void demo_hash_update(demo_hash_state *s, const void *data,
+                             size_t len);
+
+/**
+ * @function demo_hash_final
+ *
+ * @input s The state, which is not changed, so more input may follow.
+ *
+ * @return The 64 bit hash of all input so far.
+ */
+extern uint64_t demo_hash_final(const demo_hash_state *s);
+
+/**
+ * @function demo_hash64
+ *
+ * @input data The input.
+ *
+ * @input len  Number of bytes.
+ *
+ * @input seed Seed.
+ *
+ * @return The hash, the same as from a state fed the input in pieces.
+ *
+ * @long Fast, not cryptographic. Kernels are picked by demo_simd_level().
+ */
+extern uint64_t demo_hash64(const void *data, size_t len, uint64_t seed);
+
+/**
+ * @function demo_hash_block
+ *
+ * @input b The block.
+ *
+ * @return The hash of the block's file representation.
+ *
+ * @long Hashes the bytes demo_write() would write for the block, without
+ *       writing them, so it matches a hash of the raw file data.
+ */
+extern uint64_t demo_hash_block(const block *b);
+
+/*****************************************************************************
+ *                                                                           *
+ *                DEMO HASHES                                                *
+ *                                                                           *
+ *****************************************************************************/
+
+/**
+ * @function demo_hashes_new
+ *
+ * @input h Where to write a pointer to the new, empty hash list.
+ *
+ * @return DEMO_OK upon success, DEMO_NO_MEMORY otherwise.
+ *
+ * @long Fill the list by passing it to demo_read() or demo_scan() with
+ *       READFLAG_HASHES, which hashes every block as it is parsed, or from
+ *       a demo already read with demo_hashes_build().
+ */
+extern int demo_hashes_new(demo_hashes **h);
+
+/**
+ * @function demo_hashes_add
+ *
+ * @input h     The hash list.
+ *
+ * @input track The demo's cd track.
+ *
+ * @input b     The next block of the demo.
+ *
+ * @return DEMO_OK upon success, DEMO_NO_MEMORY otherwise.
+ */
+extern int demo_hashes_add(demo_hashes *h, int32_t track, const block *b);
+
+/**
+ * @function demo_hashes_build
+ *
+ * @input h The hash list, which should be empty.
+ *
+ * @input d The demo.
+ *
+ * @return DEMO_OK upon success, DEMO_NO_MEMORY otherwise.
+ */
+extern int demo_hashes_build(demo_hashes *h, demo *d);
+
+/**
+ * @function demo_hashes_fingerprint
+ *
+ * @input h The hash list.
+ *
+ * @return Fingerprint of the whole demo.
+ *
+ * @long Hashes the cd track number and the block hashes, so demos with the
+ *       same contents have the same fingerprint however their cd track line
+ *       is formatted, and whatever their file is called.
+ */
+extern uint64_t demo_hashes_fingerprint(const demo_hashes *h);
+
+/**
+ * @function demo_hashes_free
+ *
+ * @input h The hash list.
+ *
+ * @return DEMO_OK.
+ */
+extern int demo_hashes_free(demo_hashes *h);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DEMO_HASH_H
@@ -0,0 +1,62 @@
+#ifndef DEMO_PIPELINE_H
+#define DEMO_PIPELINE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include "demo.h"
+
+// DATA TYPES
+
+/* Pipeline callback function type. Receives the header demo as it was when
+ * the block was read, the block, and its sequence number in the file
+ * (starting at 0). Setting *b to NULL takes ownership of the block.
+ */
+typedef int (*pipeline_cb_t)(void *ctx, demo *header, block **b,
+                             uint64_t seq);
+
+/* Pipeline description. process() runs on the consumer threads, in any
+ * order. commit(), if set, runs after process() in strict block order, one
+ * block at a time, for consumers that must write output in order.
+ */
+typedef struct _demo_pipeline {
+  int consumers;       // consumer threads, 0 for one per cpu
+  size_t queue_size;   // blocks in flight, 0 for the default
+  pipeline_cb_t process;
+  pipeline_cb_t commit;
+  void *ctx;
+} demo_pipeline;
+
+/*****************************************************************************
+ *                                                                           *
+ *                API                                                        *
+ *                                                                           *
+ *****************************************************************************/
+
+/**
+ * @function demo_pipeline_run
+ *
+ * @input flags    Tag - value array describing the demo to read,
+ *                 constructed out of READFLAG* tags.
+ *
+ * @input pipeline The pipeline to run.
+ *
+ * @return DEMO_OK upon success. Upon failure, the first error returned
+ *         by the reader or by a callback. Blocks still in flight are
+ *         freed without being processed.
+ *
+ * @long The calling thread reads the demo with demo_scan() and pushes
+ *       each block onto a bounded lock-free queue, from which the consumer
+ *       threads take blocks as they arrive. Blocks are freed after
+ *       commit(), or after process() if there is no commit().
+ */
+extern int demo_pipeline_run(flagfield *flags, const demo_pipeline *pipeline);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DEMO_PIPELINE_H
@@ -0,0 +1,133 @@
+#ifndef DEMO_SIMD_H
+#define DEMO_SIMD_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include "demo.h"
+
+/*****************************************************************************
+ *                                                                           *
+ *                SIMD LEVELS                                                *
+ *                                                                           *
+ *****************************************************************************/
+
+#define DEMO_SIMD_AUTO           -1
+#define DEMO_SIMD_SCALAR         0
+#define DEMO_SIMD_SSE2           1
+#define DEMO_SIMD_AVX2           2
+
+/**
+ * @function demo_simd_level
+ *
+ * @return The kernel level (DEMO_SIMD_*) used by the vectorized functions.
+ *
+ * @long The level is detected from the running CPU on first use, unless
+ *       it has been pinned with demo_simd_select().
+ */
+extern int demo_simd_level(void);
+
+/**
+ * @function demo_simd_select
+ *
+ * @input level DEMO_SIMD_* level to use, or DEMO_SIMD_AUTO to go back to
+ *              runtime detection.
+ *
+ * @return The level actually selected. Asking for a level the CPU does
+ *         not support selects the best supported one below it.
+ *
+ * @long Pins the kernel level, e.g. to compare the vector kernels against
+ *       the scalar reference. Calls already running finish with the
+ *       kernels they started with.
+ */
+extern int demo_simd_select(int level);
+
+/*****************************************************************************
+ *                                                                           *
+ *                DEQUANTIZATION KERNELS                                     *
+ *                                                                           *
+ *****************************************************************************/
+
+/**
+ * @function demo_dequant_coords
+ *
+ * @input src Packed little endian 16 bit fixed point coords (2 * n bytes).
+ * @input dst Where to write n floats.
+ * @input n   Number of coords.
+ *
+ * @long Wire coords are 1/8 units, as read by MSG_ReadCoord().
+ */
+extern void demo_dequant_coords(const uint8_t *src, float *dst, size_t n);
+
+/**
+ * @function demo_dequant_angles
+ *
+ * @input src Packed signed byte angles (n bytes).
+ * @input dst Where to write n floats, in degrees.
+ * @input n   Number of angles.
+ *
+ * @long Wire angles are 360/256 degree steps, as read by MSG_ReadAngle().
+ */
+extern void demo_dequant_angles(const uint8_t *src, float *dst, size_t n);
+
+/*****************************************************************************
+ *                                                                           *
+ *                BATCH DECODING                                             *
+ *                                                                           *
+ *****************************************************************************/
+
+/**
+ * @function demo_decode_entity_updates
+ *
+ * @input protocol Demo protocol the messages were read with.
+ * @input msgs     Array of n entity update messages (type >= 128).
+ * @input n        Number of messages.
+ * @input entities Where to write n entity numbers, or NULL.
+ * @input bits     Where to write n U_* update masks, or NULL.
+ * @input origins  Where to write n * 3 origin floats, or NULL.
+ * @input angles   Where to write n * 3 angle floats (degrees), or NULL.
+ *
+ * @return DEMO_OK upon success, DEMO_BAD_PARAMS if a message is not an
+ *         entity update or the protocol is a registered one, see
+ *         demo_register_protocol(), DEMO_CORRUPT_DEMO if a payload is too
+ *         short.
+ *
+ * @long Components not present in an update (see bits) are written as 0,
+ *       the engine takes them from the entity baseline.
+ */
+extern int demo_decode_entity_updates(uint32_t protocol, message *const *msgs,
+                                      size_t n, uint16_t *entities,
+                                      uint32_t *bits, float *origins,
+                                      float *angles);
+
+/**
+ * @function demo_decode_clientdata
+ *
+ * @input protocol Demo protocol the messages were read with.
+ * @input msgs     Array of n CLIENTDATA messages.
+ * @input n        Number of messages.
+ * @input bits     Where to write n SU_* masks, or NULL.
+ * @input view     Where to write n * 2 floats (viewheight, idealpitch),
+ *                 or NULL.
+ * @input punch    Where to write n * 3 punch angle floats, or NULL.
+ * @input velocity Where to write n * 3 velocity floats, or NULL.
+ *
+ * @return DEMO_OK upon success, DEMO_BAD_PARAMS if a message is not a
+ *         CLIENTDATA message or the protocol is a registered one,
+ *         DEMO_CORRUPT_DEMO if a payload is too short.
+ *
+ * @long Fields not present in a message get the defaults the engine uses
+ *       (viewheight 22, everything else 0).
+ */
+extern int demo_decode_clientdata(uint32_t protocol, message *const *msgs,
+                                  size_t n, uint32_t *bits, float *view,
+                                  float *punch, float *velocity);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DEMO_SIMD_H
@@ -0,0 +1,204 @@
+#ifndef DEMO_STREAM_H
+#define DEMO_STREAM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include "demo.h"
+
+// DATA TYPES
+
+/* A streaming transform stage. Blocks are handed to process() one at a
+ * time, in file order. A stage may edit the block in place, replace it, or
+ * drop it by freeing it and setting *b to NULL. At the end of the input,
+ * flush() (if set) may hand out one final block through *b. destroy() (if
+ * set) releases ctx when the stage is freed.
+ */
+typedef struct _demo_stage {
+  int (*process)(void *ctx, demo *header, block **b);
+  int (*flush)(void *ctx, demo *header, block **b);
+  void (*destroy)(void *ctx);
+  void *ctx;
+} demo_stage;
+
+/* Filter callback function type, called for messages whose filter action
+ * is FILTER_REWRITE. The message may be edited in place (data must stay
+ * malloc()ed); the return value is the action to apply afterwards,
+ * FILTER_KEEP, FILTER_DROP or FILTER_BLANK.
+ */
+typedef int (*filter_cb_t)(void *ctx, demo *header, message *m);
+
+/* Per message type filter actions. Entity updates have one type per mask,
+ * 128 to 255.
+ */
+typedef struct _demo_filter {
+  uint8_t action[256];
+  filter_cb_t rewrite;
+  void *ctx;
+} demo_filter;
+
+/*****************************************************************************
+ *                                                                           *
+ *                API                                                        *
+ *                                                                           *
+ *****************************************************************************/
+
+/**
+ * @function demo_transform
+ *
+ * @input rflags  Tag - value array describing the demo to read,
+ *                constructed out of READFLAG* tags.
+ *
+ * @input wflags  Tag - value array describing the demo to write,
+ *                constructed out of WRITEFLAG* tags.
+ *
+ * @input stages  Array of nstages stages to run each block through.
+ *
+ * @input nstages Number of stages.
+ *
+ * @return DEMO_OK upon success. Upon failure, an error code will be
+ *         returned, and the possibly partly written file might be
+ *         unplayable.
+ *
+ * @long Reads a demo with demo_scan(), runs each block through the stages
+ *       and writes the result with a demo_writer, one block at a time.
+ *       Block lengths are recomputed from the messages before writing, so
+ *       stages never have to maintain them.
+ */
+extern int demo_transform(flagfield *rflags, flagfield *wflags,
+                          demo_stage **stages, int nstages);
+
+/**
+ * @function demo_stage_free
+ *
+ * @input stage The stage to free.
+ *
+ * @return DEMO_OK.
+ *
+ * @long Frees a stage created by one of the *_stage() constructors.
+ */
+extern int demo_stage_free(demo_stage *stage);
+
+/**
+ * @function demo_filter_init
+ *
+ * @input filter The filter to initialize.
+ *
+ * @return DEMO_OK.
+ *
+ * @long Sets every action to FILTER_KEEP, and clears the callback.
+ */
+extern int demo_filter_init(demo_filter *filter);
+
+/**
+ * @function demo_filter_stage
+ *
+ * @input filter The filter to apply. It is copied.
+ *
+ * @input stage  Where to write a pointer to the new stage.
+ *
+ * @return DEMO_OK upon success, DEMO_NO_MEMORY upon failure.
+ *
+ * @long Creates a stage dropping, blanking or rewriting messages by type.
+ *       Blanking empties the text of string messages (PRINT, STUFFTEXT,
+ *       CENTERPRINT, FINALE, CUTSCENE, LIGHTSTYLE, UPDATENAME) and drops
+ *       any other message. Blocks left without messages are dropped.
+ */
+extern int demo_filter_stage(const demo_filter *filter, demo_stage **stage);
+
+/**
+ * @function demo_filter_file
+ *
+ * @input rflags READFLAG* tags describing the demo to read.
+ * @input wflags WRITEFLAG* tags describing the demo to write.
+ * @input filter The filter to apply.
+ *
+ * @return As demo_transform().
+ *
+ * @long Shorthand for demo_transform() with a single filter stage.
+ */
+extern int demo_filter_file(flagfield *rflags, flagfield *wflags,
+                            const demo_filter *filter);
+
+/**
+ * @function demo_downsample_stage
+ *
+ * @input fps   Target rate, in blocks per second of server time.
+ *
+ * @input stage Where to write a pointer to the new stage.
+ *
+ * @return DEMO_OK upon success, DEMO_BAD_PARAMS for a rate that is not
+ *         positive, DEMO_NO_MEMORY upon failure.
+ *
+ * @long Creates a stage thinning gameplay blocks to the target rate.
+ *       Blocks without a TIME message (the signon) and blocks changing
+ *       persistent state (SERVERINFO, SIGNONUM, LIGHTSTYLE, baselines and
+ *       statics, prints, names, ...) are always kept. Events and stat
+ *       changes from dropped blocks are carried forward into the next kept
+ *       block; absolute state (CLIENTDATA, UPDATESTAT, ...) only in its
+ *       latest version. Entity updates are absolute against the baseline,
+ *       so those of the kept block stand for the ones dropped.
+ */
+extern int demo_downsample_stage(float fps, demo_stage **stage);
+
+/**
+ * @function demo_convert_stage
+ *
+ * @input protocol The protocol to convert to, PROTOCOL_NETQUAKE,
+ *                 PROTOCOL_FITZQUAKE or PROTOCOL_BJP3.
+ *
+ * @input stage    Where to write a pointer to the new stage.
+ *
+ * @return DEMO_OK upon success, DEMO_BAD_PARAMS for an unsupported
+ *         protocol, DEMO_NO_MEMORY upon failure.
+ *
+ * @long Creates a stage rewriting every message into the layout of the
+ *       target protocol: the protocol number of SERVERINFO and VERSION,
+ *       the mask extensions of CLIENTDATA and entity updates, the sizes
+ *       of SOUND and the spawn messages. Messages the target has no
+ *       equivalent for are translated where the engines do the same
+ *       (FQBF becomes the "bf" STUFFTEXT, fog between FitzQuake and BJP3)
+ *       and dropped otherwise, as are the purely visual extensions (alpha,
+ *       lerp finish). Processing fails with DEMO_CANNOT_CONVERT on a
+ *       number the target cannot carry, such as a model index above 255
+ *       for PROTOCOL_NETQUAKE, and on demos of a protocol registered with
+ *       demo_register_protocol(). Runs in constant memory, one block at a
+ *       time; later stages see the target protocol in the header.
+ */
+extern int demo_convert_stage(uint32_t protocol, demo_stage **stage);
+
+/**
+ * @function demo_convert_file
+ *
+ * @input rflags   Tag - value array describing the demo to read.
+ *
+ * @input wflags   Tag - value array describing the demo to write.
+ *
+ * @input protocol The protocol to convert to.
+ *
+ * @return As demo_transform(), or DEMO_BAD_PARAMS for an unsupported
+ *         protocol.
+ *
+ * @long Shorthand for demo_transform() with a single conversion stage.
+ */
+extern int demo_convert_file(flagfield *rflags, flagfield *wflags,
+                             uint32_t protocol);
+
+/*****************************************************************************
+ *                                                                           *
+ *                FILTER ACTIONS                                             *
+ *                                                                           *
+ *****************************************************************************/
+
+#define FILTER_KEEP              0
+#define FILTER_DROP              1
+#define FILTER_BLANK             2
+#define FILTER_REWRITE           3
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DEMO_STREAM_H
@@ -0,0 +1,192 @@
+#ifndef DEMO_TEXT_H
+#define DEMO_TEXT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include "demo.h"
+
+// DATA TYPES
+
+/* Full text index over the string bearing messages of one or more demos
+ * (documents). Opaque, see demo_text_new() and demo_text_load().
+ */
+typedef struct _text_index text_index;
+
+/* One string found in a demo. time is that of the latest TIME message
+ * seen in or before the message, 0 until the first one. text references
+ * the raw string, see demo_text_string().
+ */
+typedef struct _text_hit {
+  uint32_t doc;
+  uint32_t block;
+  float time;
+  uint32_t type;
+  uint64_t text;
+} text_hit;
+
+/* Search callback function type. Any value other than DEMO_OK ends the
+ * search, DEMO_SCAN_STOP without an error.
+ */
+typedef int (*text_cb_t)(void *ctx, const text_index *t, const text_hit *h);
+
+/* Match modes for demo_text_find()
+ */
+#define TEXT_MATCH_TOKENS        0
+#define TEXT_MATCH_SUBSTRING     1
+
+/*****************************************************************************
+ *                                                                           *
+ *                API                                                        *
+ *                                                                           *
+ *****************************************************************************/
+
+/**
+ * @function demo_text_new
+ *
+ * @input t Where to write a pointer to the new, empty index.
+ *
+ * @return DEMO_OK upon success, DEMO_NO_MEMORY otherwise.
+ */
+extern int demo_text_new(text_index **t);
+
+/**
+ * @function demo_text_add
+ *
+ * @input t    The index.
+ *
+ * @input name Name of the document, e.g. the demo's path.
+ *
+ * @input d    The demo.
+ *
+ * @input doc  Where to write the document number, or NULL.
+ *
+ * @return DEMO_OK upon success. DEMO_BAD_PARAMS for an index loaded with
+ *         demo_text_load(), which is read only. DEMO_NO_MEMORY if
+ *         allocation fails.
+ *
+ * @long Adds every PRINT, STUFFTEXT, CENTERPRINT, FINALE, CUTSCENE and
+ *       UPDATENAME string, and for BJP3 demos the lmp slot and file names,
+ *       with its block number and time. Identical strings are stored once.
+ */
+extern int demo_text_add(text_index *t, const char *name, demo *d,
+                         uint32_t *doc);
+
+/**
+ * @function demo_text_add_scan
+ *
+ * @input t     The index.
+ *
+ * @input name  Name of the document.
+ *
+ * @input flags Tag - value array describing the demo to read, constructed
+ *              out of READFLAG* tags.
+ *
+ * @input doc   Where to write the document number, or NULL.
+ *
+ * @return As for demo_text_add(), or any error from demo_scan(). Strings
+ *         read before a read error stay in the index.
+ *
+ * @long Same as demo_text_add(), but reads the demo through demo_scan()
+ *       without building it.
+ */
+extern int demo_text_add_scan(text_index *t, const char *name,
+                              flagfield *flags, uint32_t *doc);
+
+/**
+ * @function demo_text_find
+ *
+ * @input t     The index.
+ *
+ * @input query What to look for. Case, and the high bit of quake's colored
+ *              characters, are ignored.
+ *
+ * @input mode  TEXT_MATCH_TOKENS to find strings holding every word of the
+ *              query as a whole word, TEXT_MATCH_SUBSTRING to find strings
+ *              holding the query anywhere.
+ *
+ * @input cb    Called for every matching string, in document and block
+ *              order.
+ *
+ * @input ctx   Passed on to the callback.
+ *
+ * @return DEMO_OK upon success, DEMO_NO_MEMORY if the token index could
+ *         not be built, or the error the callback returned.
+ *
+ * @long Words are runs of letters and digits. Both modes look the query up
+ *       in the token dictionary first; substring matches are then checked
+ *       against the strings of the candidate hits only.
+ */
+extern int demo_text_find(text_index *t, const char *query, int mode,
+                          text_cb_t cb, void *ctx);
+
+/**
+ * @function demo_text_string
+ *
+ * @input t   The index.
+ *
+ * @input ref A string reference, e.g. text_hit.text.
+ *
+ * @return The string, or "" if the reference is out of range.
+ */
+extern const char *demo_text_string(const text_index *t, uint64_t ref);
+
+/**
+ * @function demo_text_doc
+ *
+ * @input t   The index.
+ *
+ * @input doc A document number.
+ *
+ * @return The name the document was added with, or "" if there is none.
+ */
+extern const char *demo_text_doc(const text_index *t, uint32_t doc);
+
+/**
+ * @function demo_text_save
+ *
+ * @input t        The index.
+ *
+ * @input filename Name of the file to write.
+ *
+ * @return DEMO_OK upon success, DEMO_CANNOT_WRITE or DEMO_NO_MEMORY upon
+ *         failure.
+ *
+ * @long Writes the index, tokens included, in a form demo_text_load() maps
+ *       without any rebuilding. The file is written under a temporary name
+ *       and renamed into place.
+ */
+extern int demo_text_save(text_index *t, const char *filename);
+
+/**
+ * @function demo_text_load
+ *
+ * @input filename Name of a file written by demo_text_save().
+ *
+ * @input t        Where to write a pointer to the read only index.
+ *
+ * @return DEMO_OK upon success. DEMO_CANNOT_OPEN_DEMO if the file cannot
+ *         be opened or mapped, DEMO_CORRUPT_DEMO if it is not a text index
+ *         of this version and byte order.
+ *
+ * @long Maps the index in constant time.
+ */
+extern int demo_text_load(const char *filename, text_index **t);
+
+/**
+ * @function demo_text_free
+ *
+ * @input t The index.
+ *
+ * @return DEMO_OK.
+ */
+extern int demo_text_free(text_index *t);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DEMO_TEXT_H
@@ -0,0 +1,404 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+#include "demo.h"
+#include "demo_simd.h"
+#include "demo_angles.h"
+#include "demo_aim.h"
+
+/*****************************************************************************
+ *                                                                           *
+ *                DEFINITIONS                                                *
+ *                                                                           *
+ *****************************************************************************/
+
+#define CHUNK 1024 // frames per kernel call
+
+#define NEAREST (_MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)
+#define TWO_POW_23 8388608.0f // from here on every float is an integer
+
+#define DEFAULT_VELOCITY_BIN      50.0f
+#define DEFAULT_ACCELERATION_BIN  2000.0f
+#define DEFAULT_SNAP_VELOCITY     1500.0f
+#define DEFAULT_SETTLE_VELOCITY   100.0f
+
+typedef void (*deltas_fn)(const float *t, const float *p, const float *y,
+                          size_t n, float *dp, float *dy, float *dt,
+                          float *vel);
+
+/* Running state of demo_aim_analyse() across chunks
+ */
+typedef struct {
+  const aim_params *params;
+  aim_stats *stats;
+  double velocity_sum;
+  float prev_velocity;
+  int snap_pending;
+} analysis;
+
+/*****************************************************************************
+ *                                                                           *
+ *                FORWARD REFERENCES                                         *
+ *                                                                           *
+ *****************************************************************************/
+
+static deltas_fn select_kernel(void);
+static void accumulate(analysis *a, const float *dt, const float *vel,
+                       size_t n);
+static uint32_t bin_of(float value, float width);
+
+static void deltas_scalar(const float *t, const float *p, const float *y,
+                          size_t n, float *dp, float *dy, float *dt,
+                          float *vel);
+#ifdef HAVE_X86_KERNELS
+static __m128 nearbyint_sse2(__m128 x);
+static void deltas_sse2(const float *t, const float *p, const float *y,
+                        size_t n, float *dp, float *dy, float *dt,
+                        float *vel);
+static void deltas_avx2(const float *t, const float *p, const float *y,
+                        size_t n, float *dp, float *dy, float *dt,
+                        float *vel);
+#endif
+
+/*****************************************************************************
+ *                                                                           *
+ *                API                                                        *
+ *                                                                           *
+ *****************************************************************************/
+
+int demo_aim_defaults(aim_params *params)
+{
+  params->velocity_bin = DEFAULT_VELOCITY_BIN;
+  params->acceleration_bin = DEFAULT_ACCELERATION_BIN;
+  params->snap_velocity = DEFAULT_SNAP_VELOCITY;
+  params->settle_velocity = DEFAULT_SETTLE_VELOCITY;
+
+  return DEMO_OK;
+}
+
+int demo_aim_deltas(const angle_series *series, float *dpitch, float *dyaw,
+                    float *velocity)
+{
+  float dp[CHUNK];
+  float dy[CHUNK];
+  float dt[CHUNK];
+  float vel[CHUNK];
+  deltas_fn kernel;
+  size_t i;
+  size_t n;
+
+  if (series == NULL) {
+    return DEMO_BAD_PARAMS;
+  }
+  if (series->count == 0) {
+    return DEMO_OK;
+  }
+
+  kernel = select_kernel();
+
+  if (dpitch != NULL) {
+    dpitch[0] = 0;
+  }
+  if (dyaw != NULL) {
+    dyaw[0] = 0;
+  }
+  if (velocity != NULL) {
+    velocity[0] = -1;
+  }
+
+  for (i = 1; i < series->count; i += n) {
+    n = series->count - i;
+    if (n > CHUNK) {
+      n = CHUNK;
+    }
+    kernel(series->time + i - 1, series->pitch + i - 1, series->yaw + i - 1,
+           n, dp, dy, dt, vel);
+    if (dpitch != NULL) {
+      memcpy(dpitch + i, dp, n * sizeof(float));
+    }
+    if (dyaw != NULL) {
+      memcpy(dyaw + i, dy, n * sizeof(float));
+    }
+    if (velocity != NULL) {
+      memcpy(velocity + i, vel, n * sizeof(float));
+    }
+  }
+
+  return DEMO_OK;
+}
+
+int demo_aim_analyse(const angle_series *series, const aim_params *params,
+                     aim_stats *stats)
+{
+  float dp[CHUNK];
+  float dy[CHUNK];
+  float dt[CHUNK];
+  float vel[CHUNK];
+  aim_params defaults;
+  analysis a;
+  deltas_fn kernel;
+  size_t i;
+  size_t n;
+
+  if (series == NULL || stats == NULL) {
+    return DEMO_BAD_PARAMS;
+  }
+  if (params == NULL) {
+    demo_aim_defaults(&defaults);
+    params = &defaults;
+  }
+  if (params->velocity_bin <= 0 || params->acceleration_bin <= 0) {
+    return DEMO_BAD_PARAMS;
+  }
+
+  memset(stats, 0, sizeof(aim_stats));
+  memset(&a, 0, sizeof(a));
+  a.params = params;
+  a.stats = stats;
+  a.prev_velocity = -1;
+
+  kernel = select_kernel();
+
+  for (i = 1; i < series->count; i += n) {
+    n = series->count - i;
+    if (n > CHUNK) {
+      n = CHUNK;
+    }
+    kernel(series->time + i - 1, series->pitch + i - 1, series->yaw + i - 1,
+           n, dp, dy, dt, vel);
+    accumulate(&a, dt, vel, n);
+  }
+
+  if (stats->frames != 0) {
+    stats->mean_velocity = (float) (a.velocity_sum / stats->frames);
+  }
+
+  return DEMO_OK;
+}
+
+int demo_aim_batch(const angle_series *series, size_t n,
+                   const aim_params *params, aim_stats *stats)
+{
+  size_t i;
+  int ret;
+
+  if (series == NULL || stats == NULL) {
+    return DEMO_BAD_PARAMS;
+  }
+
+  for (i = 0; i < n; i++) {
+    ret = demo_aim_analyse(&series[i], params, &stats[i]);
+    if (ret != DEMO_OK) {
+      return ret;
+    }
+  }
+
+  return DEMO_OK;
+}
+
+/*****************************************************************************
+ *                                                                           *
+ *                ANALYSIS FUNCTIONS                                         *
+ *                                                                           *
+ *****************************************************************************/
+
+static deltas_fn select_kernel(void)
+{
+  switch (demo_simd_level()) {
+#ifdef HAVE_X86_KERNELS
+  case DEMO_SIMD_AVX2:
+    return deltas_avx2;
+
+  case DEMO_SIMD_SSE2:
+    return deltas_sse2;
+#endif
+
+  default:
+    return deltas_scalar;
+  }
+}
+
+/* Folds a chunk of kernel output into the statistics. Histogram updates are
+ * scatters, so this part stays scalar.
+ */
+static void accumulate(analysis *a, const float *dt, const float *vel,
+                       size_t n)
+{
+  aim_stats *s = a->stats;
+  float acc;
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    if (vel[i] < 0) {
+      continue; // time did not advance
+    }
+
+    s->frames++;
+    a->velocity_sum += vel[i];
+    if (vel[i] > s->peak_velocity) {
+      s->peak_velocity = vel[i];
+    }
+    s->velocity_hist[bin_of(vel[i], a->params->velocity_bin)]++;
+
+    if (a->prev_velocity >= 0) {
+      acc = fabsf(vel[i] - a->prev_velocity) / dt[i];
+      if (acc > s->peak_acceleration) {
+        s->peak_acceleration = acc;
+      }
+      s->acceleration_hist[bin_of(acc, a->params->acceleration_bin)]++;
+    }
+
+    // a snap is a flick that comes to rest on the very next frame
+    if (a->snap_pending && vel[i] < a->params->settle_velocity) {
+      s->snaps++;
+    }
+    a->snap_pending = (vel[i] >= a->params->snap_velocity);
+    a->prev_velocity = vel[i];
+  }
+}
+
+static uint32_t bin_of(float value, float width)
+{
+  float bin = value / width;
+
+  if (!(bin < AIM_HISTOGRAM_BINS - 1)) {
+    return AIM_HISTOGRAM_BINS - 1;
+  }
+
+  return (uint32_t) bin;
+}
+
+/*****************************************************************************
+ *                                                                           *
+ *                KERNELS                                                    *
+ *                                                                           *
+ *****************************************************************************/
+
+/* Scalar reference kernel. The inputs start one entry before the first
+ * output, output k describes the step from input k to input k + 1. The
+ * vector kernels must produce bit identical results: all operations are
+ * correctly rounded, and rounding to nearest matches nearbyintf() under the
+ * default rounding mode.
+ */
+static void deltas_scalar(const float *t, const float *p, const float *y,
+                          size_t n, float *dp, float *dy, float *dt,
+                          float *vel)
+{
+  float d;
+  size_t k;
+
+  for (k = 0; k < n; k++) {
+    dt[k] = t[k + 1] - t[k];
+    dp[k] = p[k + 1] - p[k];
+    dp[k] = dp[k] - 360.0f * nearbyintf(dp[k] / 360.0f);
+    dy[k] = y[k + 1] - y[k];
+    dy[k] = dy[k] - 360.0f * nearbyintf(dy[k] / 360.0f);
+    d = sqrtf(dp[k] * dp[k] + dy[k] * dy[k]);
+    vel[k] = (dt[k] > 0) ? d / dt[k] : -1.0f;
+  }
+}
+
+#ifdef HAVE_X86_KERNELS
+
+/* nearbyintf() without SSE4.1. Adding and subtracting 2^23 rounds the
+ * magnitude to nearest even, the sign is put back so -0.4 gives -0.
+ * Magnitudes from 2^23 on, infinities and NaNs are kept as they are,
+ * which is what nearbyintf() returns for them; cvtps2dq would give
+ * INT_MIN instead.
+ */
+__attribute__((target("sse2")))
+static inline __m128 nearbyint_sse2(__m128 x)
+{
+  const __m128 sign = _mm_set1_ps(-0.0f);
+  const __m128 big = _mm_set1_ps(TWO_POW_23);
+  __m128 a = _mm_andnot_ps(sign, x);
+  __m128 r = _mm_sub_ps(_mm_add_ps(a, big), big);
+  __m128 small = _mm_cmplt_ps(a, big); // false for NaN
+
+  r = _mm_or_ps(r, _mm_and_ps(x, sign));
+  return _mm_or_ps(_mm_and_ps(small, r), _mm_andnot_ps(small, x));
+}
+
+__attribute__((target("sse2")))
+static void deltas_sse2(const float *t, const float *p, const float *y,
+                        size_t n, float *dp, float *dy, float *dt,
+                        float *vel)
+{
+  const __m128 full = _mm_set1_ps(360.0f);
+  const __m128 invalid = _mm_set1_ps(-1.0f);
+  const __m128 zero = _mm_setzero_ps();
+  size_t k;
+
+  for (k = 0; k + 4 <= n; k += 4) {
+    __m128 vdt = _mm_sub_ps(_mm_loadu_ps(t + k + 1), _mm_loadu_ps(t + k));
+    __m128 vdp = _mm_sub_ps(_mm_loadu_ps(p + k + 1), _mm_loadu_ps(p + k));
+    __m128 vdy = _mm_sub_ps(_mm_loadu_ps(y + k + 1), _mm_loadu_ps(y + k));
+    __m128 r;
+    __m128 v;
+    __m128 ok;
+
+    r = nearbyint_sse2(_mm_div_ps(vdp, full));
+    vdp = _mm_sub_ps(vdp, _mm_mul_ps(full, r));
+    r = nearbyint_sse2(_mm_div_ps(vdy, full));
+    vdy = _mm_sub_ps(vdy, _mm_mul_ps(full, r));
+
+    v = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(vdp, vdp), _mm_mul_ps(vdy, vdy)));
+    v = _mm_div_ps(v, vdt);
+    ok = _mm_cmpgt_ps(vdt, zero);
+    v = _mm_or_ps(_mm_and_ps(ok, v), _mm_andnot_ps(ok, invalid));
+
+    _mm_storeu_ps(dt + k, vdt);
+    _mm_storeu_ps(dp + k, vdp);
+    _mm_storeu_ps(dy + k, vdy);
+    _mm_storeu_ps(vel + k, v);
+  }
+  deltas_scalar(t + k, p + k, y + k, n - k, dp + k, dy + k, dt + k, vel + k);
+}
+
+__attribute__((target("avx2")))
+static void deltas_avx2(const float *t, const float *p, const float *y,
+                        size_t n, float *dp, float *dy, float *dt,
+                        float *vel)
+{
+  const __m256 full = _mm256_set1_ps(360.0f);
+  const __m256 invalid = _mm256_set1_ps(-1.0f);
+  const __m256 zero = _mm256_setzero_ps();
+  size_t k;
+
+  for (k = 0; k + 8 <= n; k += 8) {
+    __m256 vdt = _mm256_sub_ps(_mm256_loadu_ps(t + k + 1),
+                               _mm256_loadu_ps(t + k));
+    __m256 vdp = _mm256_sub_ps(_mm256_loadu_ps(p + k + 1),
+                               _mm256_loadu_ps(p + k));
+    __m256 vdy = _mm256_sub_ps(_mm256_loadu_ps(y + k + 1),
+                               _mm256_loadu_ps(y + k));
+    __m256 r;
+    __m256 v;
+
+    r = _mm256_round_ps(_mm256_div_ps(vdp, full), NEAREST);
+    vdp = _mm256_sub_ps(vdp, _mm256_mul_ps(full, r));
+    r = _mm256_round_ps(_mm256_div_ps(vdy, full), NEAREST);
+    vdy = _mm256_sub_ps(vdy, _mm256_mul_ps(full, r));
+
+    v = _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(vdp, vdp),
+                                     _mm256_mul_ps(vdy, vdy)));
+    v = _mm256_div_ps(v, vdt);
+    v = _mm256_blendv_ps(invalid, v, _mm256_cmp_ps(vdt, zero, _CMP_GT_OQ));
+
+    _mm256_storeu_ps(dt + k, vdt);
+    _mm256_storeu_ps(dp + k, vdp);
+    _mm256_storeu_ps(dy + k, vdy);
+    _mm256_storeu_ps(vel + k, v);
+  }
+  deltas_scalar(t + k, p + k, y + k, n - k, dp + k, dy + k, dt + k, vel + k);
+}
+
+#endif // HAVE_X86_KERNELS
@@ -0,0 +1,208 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "demo.h"
+#include "demo_angles.h"
+
+/*****************************************************************************
+ *                                                                           *
+ *                DEFINITIONS                                                *
+ *                                                                           *
+ *****************************************************************************/
+
+#define INITIAL_CAPACITY 4096
+
+/*****************************************************************************
+ *                                                                           *
+ *                DATA TYPES                                                 *
+ *                                                                           *
+ *****************************************************************************/
+
+/* State kept while collecting angles from a list or a scan
+ */
+typedef struct {
+  angle_series *series;
+  int allocate;
+  float time;
+  size_t needed;
+} collector;
+
+/*****************************************************************************
+ *                                                                           *
+ *                FORWARD REFERENCES                                         *
+ *                                                                           *
+ *****************************************************************************/
+
+static int collect_block(collector *c, block *b);
+static int collect_scan_cb(void *ctx, demo *hdr, block **b);
+static int collect_finish(collector *c);
+static int grow_series(angle_series *s, size_t capacity);
+
+/*****************************************************************************
+ *                                                                           *
+ *                API                                                        *
+ *                                                                           *
+ *****************************************************************************/
+
+int demo_extract_angles(demo *d, angle_series *series)
+{
+  collector c;
+  block *b;
+  size_t count = 0;
+  int ret;
+
+  if (d == NULL || series == NULL) {
+    return DEMO_BAD_PARAMS;
+  }
+
+  memset(&c, 0, sizeof(c));
+  c.series = series;
+  c.allocate = (series->capacity == 0);
+  series->count = 0;
+
+  // the block count is known up front, allocate exactly once
+  if (c.allocate) {
+    for (b = d->blocks; b != NULL; b = b->next) {
+      count++;
+    }
+    ret = grow_series(series, count);
+    if (ret != DEMO_OK) {
+      return ret;
+    }
+  }
+
+  for (b = d->blocks; b != NULL; b = b->next) {
+    ret = collect_block(&c, b);
+    if (ret != DEMO_OK) {
+      return ret;
+    }
+  }
+
+  return collect_finish(&c);
+}
+
+int demo_scan_angles(flagfield *flags, angle_series *series)
+{
+  collector c;
+  int ret;
+
+  if (series == NULL) {
+    return DEMO_BAD_PARAMS;
+  }
+
+  memset(&c, 0, sizeof(c));
+  c.series = series;
+  c.allocate = (series->capacity == 0);
+  series->count = 0;
+
+  ret = demo_scan(flags, collect_scan_cb, &c);
+  if (ret != DEMO_OK) {
+    if (c.allocate) {
+      demo_angles_free(series);
+    }
+    return ret;
+  }
+
+  return collect_finish(&c);
+}
+
+int demo_angles_free(angle_series *series)
+{
+  if (series != NULL) {
+    // all four arrays live in the allocation starting at time
+    free(series->time);
+    memset(series, 0, sizeof(angle_series));
+  }
+
+  return DEMO_OK;
+}
+
+/*****************************************************************************
+ *                                                                           *
+ *                COLLECT FUNCTIONS                                          *
+ *                                                                           *
+ *****************************************************************************/
+
+static int collect_block(collector *c, block *b)
+{
+  angle_series *s = c->series;
+  message *m;
+  size_t n;
+  int ret;
+
+  // server time, TIME carries a little endian float
+  for (m = b->messages; m != NULL; m = m->next) {
+    if (m->type == TIME && m->size == 4) {
+      memcpy(&c->time, m->data, sizeof(float));
+    }
+  }
+
+  if (s->count == s->capacity) {
+    if (!c->allocate) {
+      c->needed++;
+      return DEMO_OK;
+    }
+    ret = grow_series(s, s->capacity ? s->capacity * 2 : INITIAL_CAPACITY);
+    if (ret != DEMO_OK) {
+      return ret;
+    }
+  }
+
+  n = s->count++;
+  s->time[n] = c->time;
+  s->pitch[n] = b->angles[0];
+  s->yaw[n] = b->angles[1];
+  s->roll[n] = b->angles[2];
+
+  return DEMO_OK;
+}
+
+static int collect_scan_cb(void *ctx, demo *hdr, block **b)
+{
+  return collect_block((collector *) ctx, *b);
+}
+
+static int collect_finish(collector *c)
+{
+  if (c->needed != 0) {
+    c->series->count += c->needed;
+    return DEMO_BAD_PARAMS;
+  }
+
+  return DEMO_OK;
+}
+
+/* The four arrays share a single allocation, laid out one after another,
+ * so growing moves each of them to its new offset.
+ */
+static int grow_series(angle_series *s, size_t capacity)
+{
+  float *buf;
+
+  if (capacity == 0) {
+    capacity = 1;
+  }
+
+  buf = malloc(capacity * 4 * sizeof(float));
+  if (buf == NULL) {
+    return DEMO_NO_MEMORY;
+  }
+
+  if (s->time != NULL) {
+    memcpy(buf, s->time, s->count * sizeof(float));
+    memcpy(buf + capacity, s->pitch, s->count * sizeof(float));
+    memcpy(buf + capacity * 2, s->yaw, s->count * sizeof(float));
+    memcpy(buf + capacity * 3, s->roll, s->count * sizeof(float));
+    free(s->time);
+  }
+
+  s->time = buf;
+  s->pitch = buf + capacity;
+  s->yaw = buf + capacity * 2;
+  s->roll = buf + capacity * 3;
+  s->capacity = capacity;
+
+  return DEMO_OK;
+}
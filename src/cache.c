@@ -0,0 +1,391 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "demo.h"
+#include "demo_cache.h"
+
+/*****************************************************************************
+ *                                                                           *
+ *                DEFINITIONS                                                *
+ *                                                                           *
+ *****************************************************************************/
+
+#define TMP_SUFFIX ".tmp"
+
+/*****************************************************************************
+ *                                                                           *
+ *                FORWARD REFERENCES                                         *
+ *                                                                           *
+ *****************************************************************************/
+
+static int count_demo(demo *d, ldc_header *h);
+static int write_tables(FILE *fp, demo *d, const ldc_header *h);
+static int table_fits(uint64_t offset, uint64_t count, size_t size,
+                      uint64_t total);
+static int copy_block(const demo_cache *c, const ldc_block *lb, block **br);
+
+/*****************************************************************************
+ *                                                                           *
+ *                API                                                        *
+ *                                                                           *
+ *****************************************************************************/
+
+int demo_save_cache(const char *filename, demo *d)
+{
+  ldc_header h;
+  char *tmpname;
+  FILE *fp;
+  int ret;
+
+  if (filename == NULL || d == NULL) {
+    return DEMO_BAD_PARAMS;
+  }
+
+  ret = count_demo(d, &h);
+  if (ret != DEMO_OK) {
+    return ret;
+  }
+
+  tmpname = malloc(strlen(filename) + sizeof(TMP_SUFFIX));
+  if (tmpname == NULL) {
+    return DEMO_NO_MEMORY;
+  }
+  strcpy(tmpname, filename);
+  strcat(tmpname, TMP_SUFFIX);
+
+  fp = fopen(tmpname, "wb");
+  if (fp == NULL) {
+    free(tmpname);
+    return DEMO_CANNOT_OPEN_DEMO;
+  }
+
+  ret = write_tables(fp, d, &h);
+  if (fclose(fp) != 0 && ret == DEMO_OK) {
+    ret = DEMO_CANNOT_WRITE;
+  }
+
+  // only a complete cache replaces the old one
+  if (ret == DEMO_OK && rename(tmpname, filename) != 0) {
+    ret = DEMO_CANNOT_WRITE;
+  }
+  if (ret != DEMO_OK) {
+    remove(tmpname);
+  }
+
+  free(tmpname);
+  return ret;
+}
+
+int demo_load_cache(const char *filename, demo_cache **c)
+{
+  demo_cache *cache;
+  const ldc_header *h;
+  struct stat st;
+  void *map;
+  int fd;
+
+  if (filename == NULL || c == NULL) {
+    return DEMO_BAD_PARAMS;
+  }
+
+  fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    return DEMO_CANNOT_OPEN_DEMO;
+  }
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return DEMO_CANNOT_OPEN_DEMO;
+  }
+  if ((uint64_t) st.st_size < sizeof(ldc_header)) {
+    close(fd);
+    return DEMO_CORRUPT_DEMO;
+  }
+
+  // the mapping stays valid after the descriptor is closed
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return DEMO_CANNOT_OPEN_DEMO;
+  }
+
+  // only the header is checked, the table entries are checked on use
+  h = (const ldc_header *) map;
+  if (memcmp(h->magic, LDC_MAGIC, sizeof(h->magic)) != 0 ||
+      h->version != LDC_VERSION || h->byte_order != LDC_BYTE_ORDER ||
+      !table_fits(h->block_offset, h->block_count, sizeof(ldc_block),
+                  st.st_size) ||
+      !table_fits(h->message_offset, h->message_count, sizeof(ldc_message),
+                  st.st_size) ||
+      !table_fits(h->payload_offset, h->payload_size, 1, st.st_size) ||
+      h->block_offset % 8 != 0 || h->message_offset % 8 != 0) {
+    munmap(map, st.st_size);
+    return DEMO_CORRUPT_DEMO;
+  }
+
+  cache = calloc(1, sizeof(demo_cache));
+  if (cache == NULL) {
+    munmap(map, st.st_size);
+    return DEMO_NO_MEMORY;
+  }
+
+  cache->protocol = h->protocol;
+  cache->track = h->track;
+  cache->block_count = h->block_count;
+  cache->message_count = h->message_count;
+  cache->payload_size = h->payload_size;
+  cache->blocks = (const ldc_block *) ((const uint8_t *) map + h->block_offset);
+  cache->messages =
+    (const ldc_message *) ((const uint8_t *) map + h->message_offset);
+  cache->payload = (const uint8_t *) map + h->payload_offset;
+  cache->map = map;
+  cache->map_size = st.st_size;
+
+  *c = cache;
+  return DEMO_OK;
+}
+
+const ldc_message *demo_cache_messages(const demo_cache *c,
+                                       const ldc_block *b)
+{
+  if (b->first_message > c->message_count ||
+      b->message_count > c->message_count - b->first_message) {
+    return NULL;
+  }
+
+  return c->messages + b->first_message;
+}
+
+const uint8_t *demo_cache_data(const demo_cache *c, const ldc_message *m)
+{
+  if (m->offset > c->payload_size || m->size > c->payload_size - m->offset) {
+    return NULL;
+  }
+
+  return c->payload + m->offset;
+}
+
+int demo_cache_demo(const demo_cache *c, demo **dem)
+{
+  demo *d;
+  block *b;
+  block *tail = NULL;
+  uint64_t i;
+  int ret;
+
+  if (c == NULL || dem == NULL) {
+    return DEMO_BAD_PARAMS;
+  }
+
+  d = calloc(1, sizeof(demo));
+  if (d == NULL) {
+    return DEMO_NO_MEMORY;
+  }
+  d->protocol = c->protocol;
+  d->track = c->track;
+
+  for (i = 0; i < c->block_count; i++) {
+    ret = copy_block(c, &c->blocks[i], &b);
+    if (ret != DEMO_OK) {
+      demo_free(d);
+      return ret;
+    }
+
+    if (tail == NULL) {
+      d->blocks = b;
+    }
+    else {
+      tail->next = b;
+      b->prev = tail;
+    }
+    tail = b;
+  }
+
+  *dem = d;
+  return DEMO_OK;
+}
+
+int demo_cache_free(demo_cache *c)
+{
+  if (c != NULL) {
+    munmap(c->map, c->map_size);
+    free(c);
+  }
+
+  return DEMO_OK;
+}
+
+/*****************************************************************************
+ *                                                                           *
+ *                HELPER FUNCTIONS                                           *
+ *                                                                           *
+ *****************************************************************************/
+
+/* Fills in the header for the demo, checking the block lengths on the way
+ * like write_messages() does.
+ */
+static int count_demo(demo *d, ldc_header *h)
+{
+  block *b;
+  message *m;
+  uint64_t length;
+
+  memset(h, 0, sizeof(*h));
+  memcpy(h->magic, LDC_MAGIC, sizeof(h->magic));
+  h->version = LDC_VERSION;
+  h->byte_order = LDC_BYTE_ORDER;
+  h->protocol = d->protocol;
+  h->track = d->track;
+
+  for (b = d->blocks; b != NULL; b = b->next) {
+    length = 0;
+    for (m = b->messages; m != NULL; m = m->next) {
+      length += m->size + 1;
+      h->message_count++;
+      h->payload_size += m->size;
+    }
+    if (length != b->length) {
+      return DEMO_CORRUPT_DEMO;
+    }
+    h->block_count++;
+  }
+
+  h->block_offset = sizeof(ldc_header);
+  h->message_offset = h->block_offset + h->block_count * sizeof(ldc_block);
+  h->payload_offset =
+    h->message_offset + h->message_count * sizeof(ldc_message);
+
+  return DEMO_OK;
+}
+
+/* Writes the header and the three tables one after another, each in a
+ * single pass over the demo.
+ */
+static int write_tables(FILE *fp, demo *d, const ldc_header *h)
+{
+  ldc_block lb;
+  ldc_message lm;
+  block *b;
+  message *m;
+  uint64_t index = 0;
+  uint64_t offset = 0;
+
+  if (fwrite(h, sizeof(*h), 1, fp) != 1) {
+    return DEMO_CANNOT_WRITE;
+  }
+
+  memset(&lb, 0, sizeof(lb));
+  for (b = d->blocks; b != NULL; b = b->next) {
+    lb.length = b->length;
+    memcpy(lb.angles, b->angles, sizeof(lb.angles));
+    lb.first_message = index;
+    lb.message_count = 0;
+    for (m = b->messages; m != NULL; m = m->next) {
+      lb.message_count++;
+    }
+    index += lb.message_count;
+
+    if (fwrite(&lb, sizeof(lb), 1, fp) != 1) {
+      return DEMO_CANNOT_WRITE;
+    }
+  }
+
+  for (b = d->blocks; b != NULL; b = b->next) {
+    for (m = b->messages; m != NULL; m = m->next) {
+      lm.type = m->type;
+      lm.size = m->size;
+      lm.offset = offset;
+      offset += m->size;
+
+      if (fwrite(&lm, sizeof(lm), 1, fp) != 1) {
+        return DEMO_CANNOT_WRITE;
+      }
+    }
+  }
+
+  for (b = d->blocks; b != NULL; b = b->next) {
+    for (m = b->messages; m != NULL; m = m->next) {
+      if (m->size != 0 && fwrite(m->data, m->size, 1, fp) != 1) {
+        return DEMO_CANNOT_WRITE;
+      }
+    }
+  }
+
+  return DEMO_OK;
+}
+
+/* Whether count entries of size bytes at offset lie within total bytes.
+ */
+static int table_fits(uint64_t offset, uint64_t count, size_t size,
+                      uint64_t total)
+{
+  if (offset > total) {
+    return 0;
+  }
+
+  return count <= (total - offset) / size;
+}
+
+static int copy_block(const demo_cache *c, const ldc_block *lb, block **br)
+{
+  const ldc_message *lm;
+  const uint8_t *data;
+  block *b;
+  message *m;
+  message *tail = NULL;
+  uint32_t i;
+
+  lm = demo_cache_messages(c, lb);
+  if (lm == NULL) {
+    return DEMO_CORRUPT_DEMO;
+  }
+
+  b = calloc(1, sizeof(block));
+  if (b == NULL) {
+    return DEMO_NO_MEMORY;
+  }
+  b->length = lb->length;
+  memcpy(b->angles, lb->angles, sizeof(b->angles));
+
+  for (i = 0; i < lb->message_count; i++, lm++) {
+    data = demo_cache_data(c, lm);
+    if (data == NULL) {
+      demo_free_block(b);
+      return DEMO_CORRUPT_DEMO;
+    }
+
+    m = calloc(1, sizeof(message));
+    if (m == NULL) {
+      demo_free_block(b);
+      return DEMO_NO_MEMORY;
+    }
+    m->type = lm->type;
+    m->size = lm->size;
+    if (lm->size != 0) {
+      m->data = malloc(lm->size);
+      if (m->data == NULL) {
+        free(m);
+        demo_free_block(b);
+        return DEMO_NO_MEMORY;
+      }
+      memcpy(m->data, data, lm->size);
+    }
+
+    if (tail == NULL) {
+      b->messages = m;
+    }
+    else {
+      tail->next = m;
+      m->prev = tail;
+    }
+    tail = m;
+  }
+
+  *br = b;
+  return DEMO_OK;
+}
@@ -0,0 +1,801 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "demo.h"
+#include "demo_context.h"
+#include "demo_hash.h"
+
+/*****************************************************************************
+ *                                                                           *
+ *                DEFINITIONS                                                *
+ *                                                                           *
+ *****************************************************************************/
+
+#define STRING_CHUNK_SIZE (64 * 1024) // string storage is allocated in chunks
+#define STRING_PAGE_SIZE 4096 // ids per page of the id table
+#define STRING_PAGES 16384 // pages, so at most 64M strings
+#define INITIAL_TABLE_SIZE 1024
+#define INITIAL_PAYLOAD_BUCKETS 256
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+/*****************************************************************************
+ *                                                                           *
+ *                DATA TYPES                                                 *
+ *                                                                           *
+ *****************************************************************************/
+
+/* Strings never move once stored, so pointers to them can be handed out
+ */
+typedef struct _string_chunk {
+  struct _string_chunk *next;
+  size_t used;
+  size_t size;
+  char data[];
+} string_chunk;
+
+/* A precache and its id lists, models first, in one allocation
+ */
+typedef struct _precache_entry {
+  demo_precache p;
+  uint64_t hash;
+  uint32_t ids[];
+} precache_entry;
+
+/* Shared message data. A payload in a store is found by content through
+ * its bucket chain until its last reference is gone, after which nothing
+ * may take a new one.
+ */
+struct _demo_payload {
+  atomic_uint_least32_t refs;
+  uint32_t size;
+  uint64_t hash;
+  uint8_t *data;
+  demo_context *store;
+  struct _demo_payload *next;
+};
+
+/* Strings are found by content through an open addressing table of ids,
+ * and by id through a two level table whose pages never move. Readers of
+ * the id table only need string_count, which is published after the page
+ * entry is written, so demo_context_string() takes no lock.
+ */
+struct _demo_context {
+  pthread_mutex_t lock;
+  string_chunk *chunks;
+  const char **pages[STRING_PAGES];
+  atomic_uint_least32_t string_count;
+  uint32_t *slots;
+  size_t slot_count;
+  precache_entry **precaches;
+  size_t precache_count;
+  size_t precache_slots;
+  pthread_mutex_t payload_lock;
+  demo_payload **payloads;
+  size_t payload_count;
+  size_t payload_buckets;
+};
+
+/*****************************************************************************
+ *                                                                           *
+ *                FORWARD REFERENCES                                         *
+ *                                                                           *
+ *****************************************************************************/
+
+static int intern_string(demo_context *c, const char *s, size_t len,
+                         uint32_t *id);
+static int store_string(demo_context *c, const char *s, size_t len,
+                        uint32_t id);
+static int grow_strings(demo_context *c);
+static int parse_serverinfo(demo_context *c, const message *m,
+                            uint32_t **ids, uint32_t *model_count,
+                            uint32_t *sound_count, uint32_t *title);
+static int next_string(const message *m, size_t *pos, const char **s,
+                       size_t *len);
+static int find_precache(demo_context *c, const uint32_t *ids,
+                         uint32_t model_count, uint32_t sound_count,
+                         uint32_t title, const demo_precache **p);
+static int grow_precaches(demo_context *c);
+static int find_payload(demo_context *c, const message *m, uint64_t hash,
+                        demo_payload **p);
+static int grow_payloads(demo_context *c);
+static int shared_type(uint32_t type);
+static uint64_t hash_ids(const uint32_t *ids, size_t count, uint32_t split);
+static uint64_t fnv1a(const void *data, size_t len, uint64_t hash);
+
+/*****************************************************************************
+ *                                                                           *
+ *                API                                                        *
+ *                                                                           *
+ *****************************************************************************/
+
+int demo_context_new(demo_context **c)
+{
+  demo_context *ctx;
+
+  if (c == NULL) {
+    return DEMO_BAD_PARAMS;
+  }
+
+  ctx = calloc(1, sizeof(demo_context));
+  if (ctx == NULL) {
+    return DEMO_NO_MEMORY;
+  }
+
+  // id 0 is the empty string, and marks free slots of the table
+  ctx->pages[0] = calloc(STRING_PAGE_SIZE, sizeof(const char *));
+  if (ctx->pages[0] == NULL) {
+    free(ctx);
+    return DEMO_NO_MEMORY;
+  }
+  ctx->pages[0][0] = "";
+  atomic_init(&ctx->string_count, 1);
+  pthread_mutex_init(&ctx->lock, NULL);
+  pthread_mutex_init(&ctx->payload_lock, NULL);
+
+  *c = ctx;
+  return DEMO_OK;
+}
+
+int demo_context_intern(demo_context *c, const char *s, uint32_t *id)
+{
+  int ret;
+
+  if (c == NULL || s == NULL || id == NULL) {
+    return DEMO_BAD_PARAMS;
+  }
+
+  pthread_mutex_lock(&c->lock);
+  ret = intern_string(c, s, strlen(s), id);
+  pthread_mutex_unlock(&c->lock);
+
+  return ret;
+}
+
+const char *demo_context_string(const demo_context *c, uint32_t id)
+{
+  uint32_t count;
+
+  count = atomic_load_explicit(&((demo_context *) c)->string_count,
+                               memory_order_acquire);
+  if (id >= count) {
+    return "";
+  }
+
+  return c->pages[id / STRING_PAGE_SIZE][id % STRING_PAGE_SIZE];
+}
+
+int demo_context_precache(demo_context *c, const message *serverinfo,
+                          const demo_precache **p)
+{
+  uint32_t *ids = NULL;
+  uint32_t model_count = 0;
+  uint32_t sound_count;
+  uint32_t title;
+  const demo_precache *found;
+  int ret;
+
+  if (c == NULL || serverinfo == NULL || serverinfo->type != SERVERINFO) {
+    return DEMO_BAD_PARAMS;
+  }
+
+  pthread_mutex_lock(&c->lock);
+
+  ret = parse_serverinfo(c, serverinfo, &ids, &model_count, &sound_count,
+                         &title);
+  if (ret == DEMO_OK) {
+    ret = find_precache(c, ids, model_count, sound_count, title, &found);
+  }
+
+  pthread_mutex_unlock(&c->lock);
+
+  free(ids);
+  if (ret == DEMO_OK && p != NULL) {
+    *p = found;
+  }
+  return ret;
+}
+
+const char *demo_precache_model(const demo_context *c,
+                                const demo_precache *p, uint32_t index)
+{
+  if (index == 0 || index >= p->model_count) {
+    return NULL;
+  }
+
+  return demo_context_string(c, p->models[index]);
+}
+
+const char *demo_precache_sound(const demo_context *c,
+                                const demo_precache *p, uint32_t index)
+{
+  if (index == 0 || index >= p->sound_count) {
+    return NULL;
+  }
+
+  return demo_context_string(c, p->sounds[index]);
+}
+
+int demo_context_share(demo_context *c, message *m)
+{
+  demo_payload *p;
+  uint64_t hash;
+  int ret;
+
+  if (m == NULL) {
+    return DEMO_BAD_PARAMS;
+  }
+
+  if (m->payload != NULL || m->data == NULL) {
+    return DEMO_OK;
+  }
+
+  hash = demo_hash64(m->data, m->size, 0);
+
+  if (c == NULL) {
+    p = malloc(sizeof(demo_payload));
+    if (p == NULL) {
+      return DEMO_NO_MEMORY;
+    }
+    atomic_init(&p->refs, 1);
+    p->size = m->size;
+    p->hash = hash;
+    p->data = m->data;
+    p->store = NULL;
+    p->next = NULL;
+  }
+  else {
+    pthread_mutex_lock(&c->payload_lock);
+    ret = find_payload(c, m, hash, &p);
+    pthread_mutex_unlock(&c->payload_lock);
+    if (ret != DEMO_OK) {
+      return ret;
+    }
+
+    // an existing copy makes this one redundant
+    if (p->data != m->data) {
+      free(m->data);
+    }
+  }
+
+  m->data = p->data;
+  m->payload = p;
+  return DEMO_OK;
+}
+
+int demo_context_share_block(demo_context *c, block *b)
+{
+  message *m;
+  int ret;
+
+  if (b == NULL) {
+    return DEMO_BAD_PARAMS;
+  }
+
+  for (m = b->messages; m != NULL; m = m->next) {
+    if (shared_type(m->type)) {
+      ret = demo_context_share(c, m);
+      if (ret != DEMO_OK) {
+        return ret;
+      }
+    }
+  }
+
+  return DEMO_OK;
+}
+
+void demo_payload_retain(demo_payload *p)
+{
+  atomic_fetch_add_explicit(&p->refs, 1, memory_order_relaxed);
+}
+
+void demo_payload_release(demo_payload *p)
+{
+  demo_payload **link;
+  demo_context *c;
+
+  if (atomic_fetch_sub_explicit(&p->refs, 1, memory_order_acq_rel) != 1) {
+    return;
+  }
+
+  c = p->store;
+  if (c != NULL) {
+    pthread_mutex_lock(&c->payload_lock);
+    link = &c->payloads[p->hash & (c->payload_buckets - 1)];
+    while (*link != p) {
+      link = &(*link)->next;
+    }
+    *link = p->next;
+    c->payload_count--;
+    pthread_mutex_unlock(&c->payload_lock);
+  }
+
+  free(p->data);
+  free(p);
+}
+
+int demo_context_free(demo_context *c)
+{
+  string_chunk *chunk;
+  demo_payload *p;
+  size_t i;
+
+  if (c == NULL) {
+    return DEMO_OK;
+  }
+
+  while (c->chunks != NULL) {
+    chunk = c->chunks;
+    c->chunks = chunk->next;
+    free(chunk);
+  }
+  for (i = 0; i < STRING_PAGES && c->pages[i] != NULL; i++) {
+    free(c->pages[i]);
+  }
+  for (i = 0; i < c->precache_slots; i++) {
+    free(c->precaches[i]);
+  }
+  free(c->precaches);
+  free(c->slots);
+
+  // the payloads belong to their messages, they just leave the store
+  for (i = 0; i < c->payload_buckets; i++) {
+    for (p = c->payloads[i]; p != NULL; p = p->next) {
+      p->store = NULL;
+    }
+  }
+  free(c->payloads);
+
+  pthread_mutex_destroy(&c->payload_lock);
+  pthread_mutex_destroy(&c->lock);
+  free(c);
+
+  return DEMO_OK;
+}
+
+/*****************************************************************************
+ *                                                                           *
+ *                STRING FUNCTIONS                                           *
+ *                                                                           *
+ *****************************************************************************/
+
+/* Returns the id of the len bytes at s, adding them if they are new. Called
+ * with the lock held.
+ */
+static int intern_string(demo_context *c, const char *s, size_t len,
+                         uint32_t *id)
+{
+  uint32_t count;
+  size_t mask;
+  size_t i;
+  const char *p;
+  int ret;
+
+  if (len == 0) {
+    *id = 0;
+    return DEMO_OK;
+  }
+
+  count = atomic_load_explicit(&c->string_count, memory_order_relaxed);
+  if (count * 2 >= c->slot_count) {
+    ret = grow_strings(c);
+    if (ret != DEMO_OK) {
+      return ret;
+    }
+  }
+
+  mask = c->slot_count - 1;
+  i = fnv1a(s, len, FNV_OFFSET) & mask;
+  while (c->slots[i] != 0) {
+    p = demo_context_string(c, c->slots[i]);
+    if (strncmp(p, s, len) == 0 && p[len] == '\0') {
+      *id = c->slots[i];
+      return DEMO_OK;
+    }
+    i = (i + 1) & mask;
+  }
+
+  if (count == (uint32_t) STRING_PAGES * STRING_PAGE_SIZE) {
+    return DEMO_NO_MEMORY;
+  }
+
+  ret = store_string(c, s, len, count);
+  if (ret != DEMO_OK) {
+    return ret;
+  }
+
+  c->slots[i] = count;
+  *id = count;
+  return DEMO_OK;
+}
+
+/* Copies the string into the chunks and publishes it under id
+ */
+static int store_string(demo_context *c, const char *s, size_t len,
+                        uint32_t id)
+{
+  string_chunk *chunk = c->chunks;
+  const char **page;
+  size_t size;
+  char *copy;
+
+  if (chunk == NULL || chunk->size - chunk->used < len + 1) {
+    size = (len + 1 > STRING_CHUNK_SIZE) ? len + 1 : STRING_CHUNK_SIZE;
+    chunk = malloc(sizeof(string_chunk) + size);
+    if (chunk == NULL) {
+      return DEMO_NO_MEMORY;
+    }
+    chunk->used = 0;
+    chunk->size = size;
+    chunk->next = c->chunks;
+    c->chunks = chunk;
+  }
+
+  page = c->pages[id / STRING_PAGE_SIZE];
+  if (page == NULL) {
+    page = calloc(STRING_PAGE_SIZE, sizeof(const char *));
+    if (page == NULL) {
+      return DEMO_NO_MEMORY;
+    }
+    c->pages[id / STRING_PAGE_SIZE] = page;
+  }
+
+  copy = chunk->data + chunk->used;
+  memcpy(copy, s, len);
+  copy[len] = '\0';
+  chunk->used += len + 1;
+
+  page[id % STRING_PAGE_SIZE] = copy;
+  atomic_store_explicit(&c->string_count, id + 1, memory_order_release);
+  return DEMO_OK;
+}
+
+static int grow_strings(demo_context *c)
+{
+  uint32_t *slots;
+  size_t size;
+  size_t mask;
+  size_t i;
+  size_t j;
+  const char *p;
+
+  size = (c->slot_count == 0) ? INITIAL_TABLE_SIZE : c->slot_count * 2;
+  slots = calloc(size, sizeof(uint32_t));
+  if (slots == NULL) {
+    return DEMO_NO_MEMORY;
+  }
+
+  mask = size - 1;
+  for (i = 0; i < c->slot_count; i++) {
+    if (c->slots[i] != 0) {
+      p = demo_context_string(c, c->slots[i]);
+      j = fnv1a(p, strlen(p), FNV_OFFSET) & mask;
+      while (slots[j] != 0) {
+        j = (j + 1) & mask;
+      }
+      slots[j] = c->slots[i];
+    }
+  }
+
+  free(c->slots);
+  c->slots = slots;
+  c->slot_count = size;
+  return DEMO_OK;
+}
+
+/*****************************************************************************
+ *                                                                           *
+ *                PRECACHE FUNCTIONS                                         *
+ *                                                                           *
+ *****************************************************************************/
+
+/* Interns the title and the names of a SERVERINFO message, as laid out by
+ * read_message(): a header, see demo_serverinfo_header(), the title, then
+ * the model and the sound names, each list ended by an empty string. ids
+ * receives a 0 for the unused index of each list, the models and then the
+ * sounds.
+ */
+static int parse_serverinfo(demo_context *c, const message *m,
+                            uint32_t **ids, uint32_t *model_count,
+                            uint32_t *sound_count, uint32_t *title)
+{
+  const char *s;
+  uint32_t *list;
+  uint32_t count = 0;
+  size_t pos = demo_serverinfo_header(m);
+  size_t len;
+  int list_no;
+  int ret;
+
+  if (pos == 0) {
+    return DEMO_CORRUPT_DEMO;
+  }
+
+  // every name takes at least two bytes, which bounds the count
+  list = malloc((m->size / 2 + 2) * sizeof(uint32_t));
+  if (list == NULL) {
+    return DEMO_NO_MEMORY;
+  }
+
+  ret = next_string(m, &pos, &s, &len);
+  if (ret == DEMO_OK) {
+    ret = intern_string(c, s, len, title);
+  }
+
+  for (list_no = 0; list_no < 2 && ret == DEMO_OK; list_no++) {
+    list[count++] = 0;
+    while ((ret = next_string(m, &pos, &s, &len)) == DEMO_OK && len > 0) {
+      ret = intern_string(c, s, len, &list[count]);
+      if (ret != DEMO_OK) {
+        break;
+      }
+      count++;
+    }
+    if (list_no == 0) {
+      *model_count = count;
+    }
+  }
+
+  if (ret != DEMO_OK) {
+    free(list);
+    return ret;
+  }
+
+  *sound_count = count - *model_count;
+  *ids = list;
+  return DEMO_OK;
+}
+
+static int next_string(const message *m, size_t *pos, const char **s,
+                       size_t *len)
+{
+  const uint8_t *end;
+
+  if (*pos >= m->size) {
+    return DEMO_CORRUPT_DEMO;
+  }
+
+  end = memchr(m->data + *pos, '\0', m->size - *pos);
+  if (end == NULL) {
+    return DEMO_CORRUPT_DEMO;
+  }
+
+  *s = (const char *) m->data + *pos;
+  *len = end - (m->data + *pos);
+  *pos += *len + 1;
+  return DEMO_OK;
+}
+
+/* Returns the precache with these ids, adding it if it is new. Called with
+ * the lock held.
+ */
+static int find_precache(demo_context *c, const uint32_t *ids,
+                         uint32_t model_count, uint32_t sound_count,
+                         uint32_t title, const demo_precache **p)
+{
+  precache_entry *e;
+  size_t count = model_count + sound_count;
+  uint64_t hash;
+  size_t mask;
+  size_t i;
+  int ret;
+
+  if (c->precache_count * 2 >= c->precache_slots) {
+    ret = grow_precaches(c);
+    if (ret != DEMO_OK) {
+      return ret;
+    }
+  }
+
+  hash = hash_ids(ids, count, model_count);
+  hash = fnv1a(&title, sizeof(title), hash);
+
+  mask = c->precache_slots - 1;
+  for (i = hash & mask; c->precaches[i] != NULL; i = (i + 1) & mask) {
+    e = c->precaches[i];
+    if (e->hash == hash && e->p.title == title &&
+        e->p.model_count == model_count && e->p.sound_count == sound_count &&
+        memcmp(e->ids, ids, count * sizeof(uint32_t)) == 0) {
+      *p = &e->p;
+      return DEMO_OK;
+    }
+  }
+
+  e = malloc(sizeof(precache_entry) + count * sizeof(uint32_t));
+  if (e == NULL) {
+    return DEMO_NO_MEMORY;
+  }
+  memcpy(e->ids, ids, count * sizeof(uint32_t));
+  e->hash = hash;
+  e->p.title = title;
+  e->p.model_count = model_count;
+  e->p.sound_count = sound_count;
+  e->p.models = e->ids;
+  e->p.sounds = e->ids + model_count;
+
+  c->precaches[i] = e;
+  c->precache_count++;
+
+  *p = &e->p;
+  return DEMO_OK;
+}
+
+static int grow_precaches(demo_context *c)
+{
+  precache_entry **slots;
+  size_t size;
+  size_t mask;
+  size_t i;
+  size_t j;
+
+  size = (c->precache_slots == 0) ? 64 : c->precache_slots * 2;
+  slots = calloc(size, sizeof(precache_entry *));
+  if (slots == NULL) {
+    return DEMO_NO_MEMORY;
+  }
+
+  mask = size - 1;
+  for (i = 0; i < c->precache_slots; i++) {
+    if (c->precaches[i] != NULL) {
+      j = c->precaches[i]->hash & mask;
+      while (slots[j] != NULL) {
+        j = (j + 1) & mask;
+      }
+      slots[j] = c->precaches[i];
+    }
+  }
+
+  free(c->precaches);
+  c->precaches = slots;
+  c->precache_slots = size;
+  return DEMO_OK;
+}
+
+/*****************************************************************************
+ *                                                                           *
+ *                PAYLOAD FUNCTIONS                                          *
+ *                                                                           *
+ *****************************************************************************/
+
+/* Returns a new reference to the payload with the message's data, adding
+ * one that takes over the data if there is none. Called with the payload
+ * lock held.
+ */
+static int find_payload(demo_context *c, const message *m, uint64_t hash,
+                        demo_payload **p)
+{
+  demo_payload *e;
+  uint_least32_t refs;
+  size_t i;
+  int ret;
+
+  if (c->payload_count >= c->payload_buckets) {
+    ret = grow_payloads(c);
+    if (ret != DEMO_OK) {
+      return ret;
+    }
+  }
+
+  i = hash & (c->payload_buckets - 1);
+  for (e = c->payloads[i]; e != NULL; e = e->next) {
+    if (e->hash != hash || e->size != m->size ||
+        memcmp(e->data, m->data, m->size) != 0) {
+      continue;
+    }
+
+    // one whose last reference is being dropped is as good as gone
+    refs = atomic_load_explicit(&e->refs, memory_order_relaxed);
+    while (refs != 0 &&
+           !atomic_compare_exchange_weak_explicit(&e->refs, &refs, refs + 1,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed))
+      ;
+    if (refs != 0) {
+      *p = e;
+      return DEMO_OK;
+    }
+  }
+
+  e = malloc(sizeof(demo_payload));
+  if (e == NULL) {
+    return DEMO_NO_MEMORY;
+  }
+  atomic_init(&e->refs, 1);
+  e->size = m->size;
+  e->hash = hash;
+  e->data = m->data;
+  e->store = c;
+  e->next = c->payloads[i];
+  c->payloads[i] = e;
+  c->payload_count++;
+
+  *p = e;
+  return DEMO_OK;
+}
+
+static int grow_payloads(demo_context *c)
+{
+  demo_payload **buckets;
+  demo_payload *e;
+  demo_payload *next;
+  size_t size;
+  size_t mask;
+  size_t i;
+
+  size = (c->payload_buckets == 0) ? INITIAL_PAYLOAD_BUCKETS :
+    c->payload_buckets * 2;
+  buckets = calloc(size, sizeof(demo_payload *));
+  if (buckets == NULL) {
+    return DEMO_NO_MEMORY;
+  }
+
+  mask = size - 1;
+  for (i = 0; i < c->payload_buckets; i++) {
+    for (e = c->payloads[i]; e != NULL; e = next) {
+      next = e->next;
+      e->next = buckets[e->hash & mask];
+      buckets[e->hash & mask] = e;
+    }
+  }
+
+  free(c->payloads);
+  c->payloads = buckets;
+  c->payload_buckets = size;
+  return DEMO_OK;
+}
+
+/* Message types that carry level data, which repeats across the demos of
+ * a map, rather than the state of a moment
+ */
+static int shared_type(uint32_t type)
+{
+  switch (type) {
+  case SERVERINFO:
+  case LIGHTSTYLE:
+  case SPAWNSTATIC:
+  case SPAWNBASELINE:
+  case SPAWNSTATICSOUND:
+  case STUFFTEXT:
+  case CDTRACK:
+  case FQSKYBOX:
+  case FQFOG:
+  case FQSPAWNBASELINE2:
+  case FQSPAWNSTATIC2:
+  case FQSPAWNSTATICSOUND2:
+  case BJP3FOG:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+/*****************************************************************************
+ *                                                                           *
+ *                HELPER FUNCTIONS                                           *
+ *                                                                           *
+ *****************************************************************************/
+
+static uint64_t hash_ids(const uint32_t *ids, size_t count, uint32_t split)
+{
+  uint64_t hash = FNV_OFFSET;
+
+  hash = fnv1a(&split, sizeof(split), hash);
+  return fnv1a(ids, count * sizeof(uint32_t), hash);
+}
+
+static uint64_t fnv1a(const void *data, size_t len, uint64_t hash)
+{
+  const uint8_t *p = (const uint8_t *) data;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    hash ^= p[i];
+    hash *= FNV_PRIME;
+  }
+
+  return hash;
+}
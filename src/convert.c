@@ -0,0 +1,1017 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "demo.h"
+#include "demo_stream.h"
+
+/*****************************************************************************
+ *                                                                           *
+ *                DEFINITIONS                                                *
+ *                                                                           *
+ *****************************************************************************/
+
+// the largest message built here, a FitzQuake CLIENTDATA with every
+// extension comes to 37 bytes
+#define MAX_CONVERTED 64
+
+// entity update mask bits, see read_message()
+#define U_MOREBITS      0x00000001
+#define U_ORIGINS       0x0000000E // a coord each
+#define U_FRAME         0x00000040
+#define U_ANGLES        0x00000310 // a byte each
+#define U_MODEL         0x00000400
+#define U_LOOKS         0x00003800 // colormap, skin, effects, a byte each
+#define U_LONGENTITY    0x00004000
+#define U_EXTEND1       0x00008000
+#define U_ALPHA         0x00010000
+#define U_FRAME2        0x00020000
+#define U_MODEL2        0x00040000
+#define U_LERPFINISH    0x00080000
+#define U_EXTEND2       0x00800000
+#define U_PORTABLE      0x00003F7E // the same in all protocols
+
+// CLIENTDATA mask bits
+#define SU_VIEW         0x000000FF // view height, pitch, punch, velocity
+#define SU_WEAPONFRAME  0x00001000
+#define SU_ARMOR        0x00002000
+#define SU_WEAPON       0x00004000
+#define SU_EXTEND1      0x00008000
+#define SU_WEAPON2      0x00010000
+#define SU_ARMOR2       0x00020000
+#define SU_AMMO2        0x00040000
+#define SU_SHELLS2      0x00080000
+#define SU_NAILS2       0x00100000
+#define SU_ROCKETS2     0x00200000
+#define SU_CELLS2       0x00400000
+#define SU_EXTEND2      0x00800000
+#define SU_WEAPONFRAME2 0x01000000
+#define SU_WEAPONALPHA  0x02000000
+#define SU_PORTABLE     0x00007FFF
+
+// SOUND mask bits
+#define SND_PORTABLE    0x07 // volume, attenuation
+#define SND_LARGEENTITY 0x08
+#define SND_LARGESOUND  0x10
+
+// FQSPAWNBASELINE2 and FQSPAWNSTATIC2 flags
+#define B_LARGEMODEL    0x01
+#define B_LARGEFRAME    0x02
+#define B_ALPHA         0x04
+
+// CLIENTDATA values FitzQuake may extend by a high byte, in the order
+// the high bytes follow the message
+#define STAT_WEAPON      0
+#define STAT_ARMOR       1
+#define STAT_AMMO        2 // and shells, nails, rockets, cells
+#define STAT_WEAPONFRAME 7
+#define STAT_COUNT       8
+
+static const uint32_t stat_high[STAT_COUNT] = {
+  SU_WEAPON2, SU_ARMOR2, SU_AMMO2, SU_SHELLS2, SU_NAILS2, SU_ROCKETS2,
+  SU_CELLS2, SU_WEAPONFRAME2
+};
+
+/*****************************************************************************
+ *                                                                           *
+ *                DATA TYPES                                                 *
+ *                                                                           *
+ *****************************************************************************/
+
+/* Conversion stage state. The source protocol is tracked as the reader
+ * sees it: unknown, and read as PROTOCOL_NETQUAKE, until the first
+ * SERVERINFO or VERSION.
+ */
+typedef struct {
+  uint32_t to;
+  uint32_t from;
+} converter;
+
+/* Reads the data of a message, noting reads past its end
+ */
+typedef struct {
+  const uint8_t *data;
+  uint32_t size;
+  uint32_t pos;
+  int overrun;
+} cursor;
+
+/* A message rebuilt for the target protocol
+ */
+typedef struct {
+  uint32_t type;
+  uint32_t size;
+  uint8_t data[MAX_CONVERTED];
+} converted;
+
+/*****************************************************************************
+ *                                                                           *
+ *                FORWARD REFERENCES                                         *
+ *                                                                           *
+ *****************************************************************************/
+
+static int convert_process(void *ctx, demo *hdr, block **b);
+static void convert_destroy(void *ctx);
+
+static int convert_message(uint32_t from, uint32_t to, message *m,
+                           converted *out, int *action);
+static int convert_serverinfo(uint32_t to, message *m);
+static int convert_update(uint32_t from, uint32_t to, message *m,
+                          converted *out);
+static int convert_clientdata(uint32_t from, uint32_t to, message *m,
+                              converted *out);
+static int convert_sound(uint32_t from, uint32_t to, message *m,
+                         converted *out);
+static int convert_spawn(uint32_t from, uint32_t to, message *m,
+                         converted *out);
+static int convert_staticsound(uint32_t to, message *m, converted *out);
+static int convert_fog(uint32_t from, message *m, converted *out);
+static int replace_data(message *m, const converted *out);
+
+static void cursor_init(cursor *c, const message *m);
+static uint32_t get_byte(cursor *c);
+static uint32_t get_short(cursor *c);
+static void get_bytes(cursor *c, uint8_t *buf, uint32_t n);
+static void put_byte(converted *out, uint32_t v);
+static void put_short(converted *out, uint32_t v);
+static void put_bytes(converted *out, const uint8_t *buf, uint32_t n);
+static uint32_t count_bits(uint32_t mask);
+static uint32_t get_uint32(const uint8_t *p);
+
+/*****************************************************************************
+ *                                                                           *
+ *                API                                                        *
+ *                                                                           *
+ *****************************************************************************/
+
+int demo_convert_stage(uint32_t protocol, demo_stage **stage)
+{
+  demo_stage *s;
+  converter *cv;
+
+  if (stage == NULL ||
+      (protocol != PROTOCOL_NETQUAKE &&
+       protocol != PROTOCOL_FITZQUAKE &&
+       protocol != PROTOCOL_BJP3))
+  {
+    return DEMO_BAD_PARAMS;
+  }
+
+  s = calloc(1, sizeof(demo_stage));
+  cv = calloc(1, sizeof(converter));
+  if (s == NULL || cv == NULL) {
+    free(s);
+    free(cv);
+    return DEMO_NO_MEMORY;
+  }
+
+  cv->to = protocol;
+  cv->from = PROTOCOL_UNKNOWN;
+  s->process = convert_process;
+  s->destroy = convert_destroy;
+  s->ctx = cv;
+
+  *stage = s;
+  return DEMO_OK;
+}
+
+int demo_convert_file(flagfield *rflags, flagfield *wflags, uint32_t protocol)
+{
+  demo_stage *stage;
+  int ret;
+
+  ret = demo_convert_stage(protocol, &stage);
+  if (ret != DEMO_OK) {
+    return ret;
+  }
+
+  ret = demo_transform(rflags, wflags, &stage, 1);
+  demo_stage_free(stage);
+
+  return ret;
+}
+
+/*****************************************************************************
+ *                                                                           *
+ *                STAGE FUNCTIONS                                            *
+ *                                                                           *
+ *****************************************************************************/
+
+static int convert_process(void *ctx, demo *hdr, block **b)
+{
+  converter *cv = (converter *) ctx;
+  converted out;
+  message *m;
+  message *mnext;
+  uint32_t from;
+  int action;
+  int ret;
+
+  ret = demo_block_unshare(*b);
+  if (ret != DEMO_OK) {
+    return ret;
+  }
+
+  for (m = (*b)->messages; m != NULL; m = mnext) {
+    mnext = m->next;
+
+    // the reader settles on the protocol of the first one of these
+    if (cv->from == PROTOCOL_UNKNOWN &&
+        (m->type == SERVERINFO || m->type == VERSION) && m->size >= 4)
+    {
+      cv->from = get_uint32(m->data);
+    }
+
+    from = cv->from;
+    if (from == PROTOCOL_UNKNOWN) {
+      from = PROTOCOL_NETQUAKE;
+    }
+    else if (from != PROTOCOL_NETQUAKE && from != PROTOCOL_FITZQUAKE &&
+             from != PROTOCOL_BJP3)
+    {
+      return DEMO_CANNOT_CONVERT; // registered, its layout is unknown here
+    }
+    if (from == cv->to) {
+      continue;
+    }
+
+    ret = convert_message(from, cv->to, m, &out, &action);
+    if (ret != DEMO_OK) {
+      return ret;
+    }
+
+    if (action == FILTER_REWRITE) {
+      ret = replace_data(m, &out);
+      if (ret != DEMO_OK) {
+        return ret;
+      }
+    }
+    else if (action == FILTER_DROP) {
+      if (m->prev != NULL) {
+        m->prev->next = m->next;
+      }
+      else {
+        (*b)->messages = m->next;
+      }
+      if (m->next != NULL) {
+        m->next->prev = m->prev;
+      }
+      demo_free_message(m);
+    }
+  }
+
+  // later stages read the messages as the target protocol
+  hdr->protocol = cv->to;
+
+  if ((*b)->messages == NULL) {
+    demo_free_block(*b);
+    *b = NULL;
+  }
+
+  return DEMO_OK;
+}
+
+static void convert_destroy(void *ctx)
+{
+  free(ctx);
+}
+
+/*****************************************************************************
+ *                                                                           *
+ *                CONVERT FUNCTIONS                                          *
+ *                                                                           *
+ *****************************************************************************/
+
+/* Rebuilds a message of protocol from for protocol to, which differ. The
+ * action says whether to keep the message as it is, drop it, or replace it
+ * with out (FILTER_KEEP, FILTER_DROP, FILTER_REWRITE).
+ */
+static int convert_message(uint32_t from, uint32_t to, message *m,
+                           converted *out, int *action)
+{
+  out->type = m->type;
+  out->size = 0;
+  *action = FILTER_REWRITE;
+
+  if (m->type & 0x80) {
+    return convert_update(from, to, m, out);
+  }
+
+  switch (m->type) {
+  case SERVERINFO:
+  case VERSION:
+    *action = FILTER_KEEP;
+    return convert_serverinfo(to, m);
+
+  case CLIENTDATA:
+    return convert_clientdata(from, to, m, out);
+
+  case SOUND:
+    return convert_sound(from, to, m, out);
+
+  case SPAWNBASELINE:
+  case SPAWNSTATIC:
+    return convert_spawn(from, to, m, out);
+
+  case SPAWNSTATICSOUND:
+    return convert_staticsound(to, m, out);
+
+  default:
+    break;
+  }
+
+  // the rest only exists in one of the protocols, or is the same in all
+  if (from == PROTOCOL_FITZQUAKE) {
+    switch (m->type) {
+    case FQSPAWNBASELINE2:
+    case FQSPAWNSTATIC2:
+      return convert_spawn(from, to, m, out);
+
+    case FQSPAWNSTATICSOUND2:
+      return convert_staticsound(to, m, out);
+
+    case FQBF:
+      // what the engines sent before there was a message for it
+      out->type = STUFFTEXT;
+      put_bytes(out, (const uint8_t *) "bf\n", 4);
+      return DEMO_OK;
+
+    case FQFOG:
+      if (to == PROTOCOL_BJP3) {
+        return convert_fog(from, m, out);
+      }
+      *action = FILTER_DROP;
+      return DEMO_OK;
+
+    case FQSKYBOX: // BJP3SKYBOX
+      *action = to == PROTOCOL_BJP3 ? FILTER_KEEP : FILTER_DROP;
+      return DEMO_OK;
+    }
+  }
+  else if (from == PROTOCOL_BJP3) {
+    switch (m->type) {
+    case BJP3FOG:
+      if (to == PROTOCOL_FITZQUAKE) {
+        return convert_fog(from, m, out);
+      }
+      *action = FILTER_DROP;
+      return DEMO_OK;
+
+    case BJP3SKYBOX: // FQSKYBOX
+      *action = to == PROTOCOL_FITZQUAKE ? FILTER_KEEP : FILTER_DROP;
+      return DEMO_OK;
+
+    case BJP3SHOWLMP:
+    case BJP3HIDELMP:
+      *action = FILTER_DROP;
+      return DEMO_OK;
+    }
+  }
+
+  *action = FILTER_KEEP;
+  return DEMO_OK;
+}
+
+/* The layout of SERVERINFO and VERSION is the same in all three protocols,
+ * only the number changes.
+ */
+static int convert_serverinfo(uint32_t to, message *m)
+{
+  uint8_t *data;
+  uint32_t size;
+
+  if (m->size < 4) {
+    return DEMO_CORRUPT_DEMO;
+  }
+
+  size = m->size;
+  data = malloc(size);
+  if (data == NULL) {
+    return DEMO_NO_MEMORY;
+  }
+  memcpy(data, m->data, size);
+  data[0] = to & 0xFF;
+  data[1] = (to >> 8) & 0xFF;
+  data[2] = (to >> 16) & 0xFF;
+  data[3] = (to >> 24) & 0xFF;
+
+  demo_free_message_data(m);
+  m->data = data;
+  m->size = size;
+
+  return DEMO_OK;
+}
+
+/* Entity updates: FitzQuake adds two more mask bytes and high bytes for
+ * model and frame, BJP3 a short model.
+ */
+static int convert_update(uint32_t from, uint32_t to, message *m,
+                          converted *out)
+{
+  cursor c;
+  uint8_t fields[12];
+  uint32_t nfields;
+  uint32_t mask;
+  uint32_t entity;
+  uint32_t model = 0;
+  uint32_t frame = 0;
+
+  cursor_init(&c, m);
+  mask = m->type & 0x7F;
+  if (mask & U_MOREBITS) {
+    mask |= get_byte(&c) << 8;
+  }
+  if (from == PROTOCOL_FITZQUAKE) {
+    if (mask & U_EXTEND1) {
+      mask |= get_byte(&c) << 16;
+    }
+    if (mask & U_EXTEND2) {
+      mask |= get_byte(&c) << 24;
+    }
+  }
+
+  entity = (mask & U_LONGENTITY) ? get_short(&c) : get_byte(&c);
+  if (mask & U_MODEL) {
+    model = from == PROTOCOL_BJP3 ? get_short(&c) : get_byte(&c);
+  }
+  if (mask & U_FRAME) {
+    frame = get_byte(&c);
+  }
+  nfields = count_bits(mask & U_LOOKS) + (count_bits(mask & U_ORIGINS) << 1) +
+    count_bits(mask & U_ANGLES);
+  get_bytes(&c, fields, nfields);
+
+  if (from == PROTOCOL_FITZQUAKE) {
+    if (mask & U_ALPHA) {
+      get_byte(&c);
+    }
+    if (mask & U_FRAME2) {
+      frame |= get_byte(&c) << 8;
+    }
+    if (mask & U_MODEL2) {
+      model |= get_byte(&c) << 8;
+    }
+    if (mask & U_LERPFINISH) {
+      get_byte(&c);
+    }
+  }
+  if (c.overrun) {
+    return DEMO_CORRUPT_DEMO;
+  }
+
+  // a high byte alone extends the baseline's low byte, unknown here
+  if (((mask & U_MODEL2) && !(mask & U_MODEL)) ||
+      ((mask & U_FRAME2) && !(mask & U_FRAME)))
+  {
+    return DEMO_CANNOT_CONVERT;
+  }
+
+  mask &= U_PORTABLE;
+  if (entity > 0xFF) {
+    mask |= U_LONGENTITY;
+  }
+  if (to == PROTOCOL_FITZQUAKE) {
+    if (model > 0xFF) {
+      mask |= U_MODEL2;
+    }
+    if (frame > 0xFF) {
+      mask |= U_FRAME2;
+    }
+  }
+  else if (frame > 0xFF || (to == PROTOCOL_NETQUAKE && model > 0xFF)) {
+    return DEMO_CANNOT_CONVERT;
+  }
+  if (mask & 0x00FF0000) {
+    mask |= U_EXTEND1;
+  }
+  if (mask & 0x0000FF00) {
+    mask |= U_MOREBITS;
+  }
+
+  out->type = 0x80 | (mask & 0x7F);
+  if (mask & U_MOREBITS) {
+    put_byte(out, mask >> 8);
+  }
+  if (mask & U_EXTEND1) {
+    put_byte(out, mask >> 16);
+  }
+  if (mask & U_LONGENTITY) {
+    put_short(out, entity);
+  }
+  else {
+    put_byte(out, entity);
+  }
+  if (mask & U_MODEL) {
+    if (to == PROTOCOL_BJP3) {
+      put_short(out, model);
+    }
+    else {
+      put_byte(out, model);
+    }
+  }
+  if (mask & U_FRAME) {
+    put_byte(out, frame);
+  }
+  put_bytes(out, fields, nfields);
+  if (mask & U_FRAME2) {
+    put_byte(out, frame >> 8);
+  }
+  if (mask & U_MODEL2) {
+    put_byte(out, model >> 8);
+  }
+
+  return DEMO_OK;
+}
+
+/* CLIENTDATA: FitzQuake adds two more mask bytes and high bytes for the
+ * stats at the end, BJP3 a short weapon model.
+ */
+static int convert_clientdata(uint32_t from, uint32_t to, message *m,
+                              converted *out)
+{
+  cursor c;
+  uint8_t view[8];
+  uint8_t items[4];
+  uint8_t health[2];
+  uint32_t stat[STAT_COUNT];
+  uint32_t activeweapon;
+  uint32_t nview;
+  uint32_t mask;
+  int i;
+
+  cursor_init(&c, m);
+  mask = get_short(&c);
+  if (from == PROTOCOL_FITZQUAKE) {
+    if (mask & SU_EXTEND1) {
+      mask |= get_byte(&c) << 16;
+    }
+    if (mask & SU_EXTEND2) {
+      mask |= get_byte(&c) << 24;
+    }
+  }
+
+  // absent stats are 0 to the client
+  nview = count_bits(mask & SU_VIEW);
+  get_bytes(&c, view, nview);
+  get_bytes(&c, items, 4);
+  stat[STAT_WEAPONFRAME] = (mask & SU_WEAPONFRAME) ? get_byte(&c) : 0;
+  stat[STAT_ARMOR] = (mask & SU_ARMOR) ? get_byte(&c) : 0;
+  stat[STAT_WEAPON] = 0;
+  if (mask & SU_WEAPON) {
+    stat[STAT_WEAPON] = from == PROTOCOL_BJP3 ? get_short(&c) : get_byte(&c);
+  }
+  get_bytes(&c, health, 2);
+  for (i = STAT_AMMO; i < STAT_AMMO + 5; i++) {
+    stat[i] = get_byte(&c);
+  }
+  activeweapon = get_byte(&c);
+
+  if (from == PROTOCOL_FITZQUAKE) {
+    for (i = 0; i < STAT_COUNT; i++) {
+      if (mask & stat_high[i]) {
+        stat[i] |= get_byte(&c) << 8;
+      }
+    }
+    if (mask & SU_WEAPONALPHA) {
+      get_byte(&c);
+    }
+  }
+  if (c.overrun) {
+    return DEMO_CORRUPT_DEMO;
+  }
+
+  mask &= SU_PORTABLE;
+  for (i = 0; i < STAT_COUNT; i++) {
+    if (stat[i] <= 0xFF || (i == STAT_WEAPON && to == PROTOCOL_BJP3)) {
+      continue;
+    }
+    if (to != PROTOCOL_FITZQUAKE) {
+      return DEMO_CANNOT_CONVERT;
+    }
+    mask |= stat_high[i];
+  }
+  // a high byte can come without its low byte
+  if (stat[STAT_WEAPONFRAME] != 0) {
+    mask |= SU_WEAPONFRAME;
+  }
+  if (stat[STAT_ARMOR] != 0) {
+    mask |= SU_ARMOR;
+  }
+  if (stat[STAT_WEAPON] != 0) {
+    mask |= SU_WEAPON;
+  }
+  if (mask & 0xFF000000) {
+    mask |= SU_EXTEND2;
+  }
+  if (mask & 0x00FF0000) {
+    mask |= SU_EXTEND1;
+  }
+
+  put_short(out, mask);
+  if (mask & SU_EXTEND1) {
+    put_byte(out, mask >> 16);
+  }
+  if (mask & SU_EXTEND2) {
+    put_byte(out, mask >> 24);
+  }
+  put_bytes(out, view, nview);
+  put_bytes(out, items, 4);
+  if (mask & SU_WEAPONFRAME) {
+    put_byte(out, stat[STAT_WEAPONFRAME]);
+  }
+  if (mask & SU_ARMOR) {
+    put_byte(out, stat[STAT_ARMOR]);
+  }
+  if (mask & SU_WEAPON) {
+    if (to == PROTOCOL_BJP3) {
+      put_short(out, stat[STAT_WEAPON]);
+    }
+    else {
+      put_byte(out, stat[STAT_WEAPON]);
+    }
+  }
+  put_bytes(out, health, 2);
+  for (i = STAT_AMMO; i < STAT_AMMO + 5; i++) {
+    put_byte(out, stat[i]);
+  }
+  put_byte(out, activeweapon);
+  for (i = 0; i < STAT_COUNT; i++) {
+    if (mask & stat_high[i]) {
+      put_byte(out, stat[i] >> 8);
+    }
+  }
+
+  return DEMO_OK;
+}
+
+/* SOUND: FitzQuake has flags for a separate channel byte and a short sound
+ * number, BJP3 always sends a short sound number.
+ */
+static int convert_sound(uint32_t from, uint32_t to, message *m,
+                         converted *out)
+{
+  cursor c;
+  uint8_t levels[2];
+  uint8_t origin[6];
+  uint32_t nlevels;
+  uint32_t mask;
+  uint32_t entity;
+  uint32_t channel;
+  uint32_t sound;
+
+  cursor_init(&c, m);
+  mask = get_byte(&c);
+  nlevels = count_bits(mask & 0x03);
+  get_bytes(&c, levels, nlevels);
+
+  if (from == PROTOCOL_FITZQUAKE && (mask & SND_LARGEENTITY)) {
+    entity = get_short(&c);
+    channel = get_byte(&c);
+  }
+  else {
+    channel = get_short(&c);
+    entity = channel >> 3;
+    channel &= 0x07;
+  }
+  if (from == PROTOCOL_BJP3 ||
+      (from == PROTOCOL_FITZQUAKE && (mask & SND_LARGESOUND)))
+  {
+    sound = get_short(&c);
+  }
+  else {
+    sound = get_byte(&c);
+  }
+  get_bytes(&c, origin, 6);
+  if (c.overrun) {
+    return DEMO_CORRUPT_DEMO;
+  }
+
+  mask &= SND_PORTABLE;
+  if (entity > 0x1FFF || channel > 0x07) {
+    if (to != PROTOCOL_FITZQUAKE) {
+      return DEMO_CANNOT_CONVERT;
+    }
+    mask |= SND_LARGEENTITY;
+  }
+  if (sound > 0xFF && to != PROTOCOL_BJP3) {
+    if (to != PROTOCOL_FITZQUAKE) {
+      return DEMO_CANNOT_CONVERT;
+    }
+    mask |= SND_LARGESOUND;
+  }
+
+  put_byte(out, mask);
+  put_bytes(out, levels, nlevels);
+  if (mask & SND_LARGEENTITY) {
+    put_short(out, entity);
+    put_byte(out, channel);
+  }
+  else {
+    put_short(out, (entity << 3) | channel);
+  }
+  if (to == PROTOCOL_BJP3 || (mask & SND_LARGESOUND)) {
+    put_short(out, sound);
+  }
+  else {
+    put_byte(out, sound);
+  }
+  put_bytes(out, origin, 6);
+
+  return DEMO_OK;
+}
+
+/* Baselines and static entities: BJP3 has a short model, FitzQuake its
+ * own messages with flags for a short model and frame and for alpha.
+ * FitzQuake servers only use those when they have to, and so does this.
+ */
+static int convert_spawn(uint32_t from, uint32_t to, message *m,
+                         converted *out)
+{
+  cursor c;
+  uint8_t fields[11]; // colormap, skin, origin and angles
+  uint32_t entity = 0;
+  uint32_t flags = 0;
+  uint32_t model;
+  uint32_t frame;
+  int baseline;
+  int fitz;
+
+  baseline = m->type == SPAWNBASELINE || m->type == FQSPAWNBASELINE2;
+  fitz = m->type == FQSPAWNBASELINE2 || m->type == FQSPAWNSTATIC2;
+
+  cursor_init(&c, m);
+  if (baseline) {
+    entity = get_short(&c);
+  }
+  if (fitz) {
+    flags = get_byte(&c);
+  }
+  if ((flags & B_LARGEMODEL) || (from == PROTOCOL_BJP3 && !fitz)) {
+    model = get_short(&c);
+  }
+  else {
+    model = get_byte(&c);
+  }
+  frame = (flags & B_LARGEFRAME) ? get_short(&c) : get_byte(&c);
+  get_bytes(&c, fields, 11);
+  if (flags & B_ALPHA) {
+    get_byte(&c);
+  }
+  if (c.overrun) {
+    return DEMO_CORRUPT_DEMO;
+  }
+
+  flags = 0;
+  if (to == PROTOCOL_FITZQUAKE) {
+    if (model > 0xFF) {
+      flags |= B_LARGEMODEL;
+    }
+    if (frame > 0xFF) {
+      flags |= B_LARGEFRAME;
+    }
+  }
+  else if (frame > 0xFF || (to == PROTOCOL_NETQUAKE && model > 0xFF)) {
+    return DEMO_CANNOT_CONVERT;
+  }
+
+  if (flags != 0) {
+    out->type = baseline ? FQSPAWNBASELINE2 : FQSPAWNSTATIC2;
+  }
+  else {
+    out->type = baseline ? SPAWNBASELINE : SPAWNSTATIC;
+  }
+  if (baseline) {
+    put_short(out, entity);
+  }
+  if (flags != 0) {
+    put_byte(out, flags);
+  }
+  if ((flags & B_LARGEMODEL) || to == PROTOCOL_BJP3) {
+    put_short(out, model);
+  }
+  else {
+    put_byte(out, model);
+  }
+  if (flags & B_LARGEFRAME) {
+    put_short(out, frame);
+  }
+  else {
+    put_byte(out, frame);
+  }
+  put_bytes(out, fields, 11);
+
+  return DEMO_OK;
+}
+
+/* Static sounds are the same in BJP3 and NetQuake, FitzQuake has its own
+ * message for a short sound number.
+ */
+static int convert_staticsound(uint32_t to, message *m, converted *out)
+{
+  cursor c;
+  uint8_t origin[6];
+  uint8_t levels[2];
+  uint32_t sound;
+
+  cursor_init(&c, m);
+  get_bytes(&c, origin, 6);
+  if (m->type == FQSPAWNSTATICSOUND2) {
+    sound = get_short(&c);
+  }
+  else {
+    sound = get_byte(&c);
+  }
+  get_bytes(&c, levels, 2);
+  if (c.overrun) {
+    return DEMO_CORRUPT_DEMO;
+  }
+
+  if (sound > 0xFF && to != PROTOCOL_FITZQUAKE) {
+    return DEMO_CANNOT_CONVERT;
+  }
+
+  put_bytes(out, origin, 6);
+  if (sound > 0xFF) {
+    out->type = FQSPAWNSTATICSOUND2;
+    put_short(out, sound);
+  }
+  else {
+    out->type = SPAWNSTATICSOUND;
+    put_byte(out, sound);
+  }
+  put_bytes(out, levels, 2);
+
+  return DEMO_OK;
+}
+
+/* FitzQuake fog is density, red, green, blue as bytes and a fade time, BJP3
+ * fog an enable byte followed by a float density and the color bytes.
+ */
+static int convert_fog(uint32_t from, message *m, converted *out)
+{
+  cursor c;
+  uint8_t color[3];
+  uint32_t density;
+  uint32_t u;
+  float f;
+
+  cursor_init(&c, m);
+  if (from == PROTOCOL_FITZQUAKE) {
+    density = get_byte(&c);
+    get_bytes(&c, color, 3);
+    get_short(&c);
+    if (c.overrun) {
+      return DEMO_CORRUPT_DEMO;
+    }
+
+    out->type = BJP3FOG;
+    put_byte(out, density != 0);
+    if (density != 0) {
+      f = density / 255.0f;
+      memcpy(&u, &f, sizeof(u));
+      put_byte(out, u);
+      put_byte(out, u >> 8);
+      put_byte(out, u >> 16);
+      put_byte(out, u >> 24);
+      put_bytes(out, color, 3);
+    }
+    return DEMO_OK;
+  }
+
+  density = 0;
+  memset(color, 0, sizeof(color));
+  if (get_byte(&c) != 0) {
+    u = get_byte(&c);
+    u |= get_byte(&c) << 8;
+    u |= get_byte(&c) << 16;
+    u |= get_byte(&c) << 24;
+    memcpy(&f, &u, sizeof(f));
+    get_bytes(&c, color, 3);
+    if (f > 1.0f) {
+      density = 0xFF;
+    }
+    else if (f > 0.0f) {
+      density = (uint32_t) (f * 255.0f + 0.5f);
+    }
+  }
+  if (c.overrun) {
+    return DEMO_CORRUPT_DEMO;
+  }
+
+  out->type = FQFOG;
+  put_byte(out, density);
+  put_bytes(out, color, 3);
+  put_short(out, 0); // no fade
+  return DEMO_OK;
+}
+
+/* Gives the message the data of out, unless that is what it has already,
+ * which keeps shared data shared.
+ */
+static int replace_data(message *m, const converted *out)
+{
+  uint8_t *data;
+
+  if (out->type == m->type && out->size == m->size &&
+      memcmp(out->data, m->data, out->size) == 0)
+  {
+    return DEMO_OK;
+  }
+
+  data = malloc(out->size > 0 ? out->size : 1);
+  if (data == NULL) {
+    return DEMO_NO_MEMORY;
+  }
+  memcpy(data, out->data, out->size);
+
+  demo_free_message_data(m);
+  m->type = out->type;
+  m->data = data;
+  m->size = out->size;
+
+  return DEMO_OK;
+}
+
+/*****************************************************************************
+ *                                                                           *
+ *                HELPER FUNCTIONS                                           *
+ *                                                                           *
+ *****************************************************************************/
+
+static void cursor_init(cursor *c, const message *m)
+{
+  c->data = m->data;
+  c->size = m->size;
+  c->pos = 0;
+  c->overrun = 0;
+}
+
+static uint32_t get_byte(cursor *c)
+{
+  if (c->pos >= c->size) {
+    c->overrun = 1;
+    return 0;
+  }
+
+  return c->data[c->pos++];
+}
+
+static uint32_t get_short(cursor *c)
+{
+  uint32_t v;
+
+  v = get_byte(c);
+  v |= get_byte(c) << 8;
+  return v;
+}
+
+static void get_bytes(cursor *c, uint8_t *buf, uint32_t n)
+{
+  if (n > c->size - c->pos) {
+    c->overrun = 1;
+    memset(buf, 0, n);
+    return;
+  }
+
+  memcpy(buf, c->data + c->pos, n);
+  c->pos += n;
+}
+
+static void put_byte(converted *out, uint32_t v)
+{
+  if (out->size < MAX_CONVERTED) {
+    out->data[out->size++] = v & 0xFF;
+  }
+}
+
+static void put_short(converted *out, uint32_t v)
+{
+  put_byte(out, v);
+  put_byte(out, v >> 8);
+}
+
+static void put_bytes(converted *out, const uint8_t *buf, uint32_t n)
+{
+  uint32_t i;
+
+  for (i = 0; i < n; i++) {
+    put_byte(out, buf[i]);
+  }
+}
+
+static uint32_t count_bits(uint32_t mask)
+{
+  uint32_t count;
+
+  for (count = 0; mask; count++) {
+    mask &= mask - 1;
+  }
+  return count;
+}
+
+static uint32_t get_uint32(const uint8_t *p)
+{
+  return (uint32_t) p[0] | ((uint32_t) p[1] << 8) |
+    ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
@@ -0,0 +1,1013 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "demo.h"
+#include "demo_corpus.h"
+#include "demo_hash.h"
+
+/*****************************************************************************
+ *                                                                           *
+ *                DEFINITIONS                                                *
+ *                                                                           *
+ *****************************************************************************/
+
+#define TMP_SUFFIX ".tmp"
+#define READ_CHUNK_SIZE (64 * 1024) // demo file read size while scanning
+#define MAX_MAP_NAME 64
+
+/*****************************************************************************
+ *                                                                           *
+ *                DATA TYPES                                                 *
+ *                                                                           *
+ *****************************************************************************/
+
+/* The tables of an index being built, written out as they are
+ */
+typedef struct {
+  corpus_entry *entries;
+  size_t entry_count;
+  size_t entry_capacity;
+  corpus_level *levels;
+  size_t level_count;
+  size_t level_capacity;
+  uint64_t *names;
+  size_t name_count;
+  size_t name_capacity;
+  char *strings;
+  size_t string_size;
+  size_t string_capacity;
+} builder;
+
+/* Demo files found in the directory
+ */
+typedef struct {
+  char **paths;
+  size_t count;
+  size_t capacity;
+} path_list;
+
+/* State kept while scanning one demo into the entry at index entry
+ */
+typedef struct {
+  builder *bld;
+  size_t entry;
+  uint32_t protocol;
+  int32_t track;
+  int in_level;
+  int have_time;
+  uint64_t block;
+  uint64_t offset;
+  demo_hashes *hashes;
+} scanner;
+
+/*****************************************************************************
+ *                                                                           *
+ *                FORWARD REFERENCES                                         *
+ *                                                                           *
+ *****************************************************************************/
+
+static int walk_dir(const char *dir, path_list *list);
+static char *join_path(const char *dir, const char *name);
+static int has_dem_suffix(const char *name);
+static int compare_paths(const void *a, const void *b);
+static const corpus_entry *find_entry(const demo_corpus *c, const char *path);
+static int modified_since(const corpus_entry *e, const struct timespec *t);
+static int copy_entry(builder *bld, const demo_corpus *old,
+                      const corpus_entry *oe, size_t index);
+static int scan_demo(builder *bld, const char *path, size_t index);
+static int scan_block(void *ctx, demo *hdr, block **b);
+static int add_level(scanner *sc, message *m);
+static int add_name(scanner *sc, const char *name);
+static int add_string(builder *bld, const char *s, uint64_t *ref);
+static int grow_array(void **array, size_t *capacity, size_t count,
+                      size_t size);
+static int write_corpus(const char *filename, builder *bld);
+static int table_fits(uint64_t offset, uint64_t count, size_t size,
+                      uint64_t total);
+static int match_map(const demo_corpus *c, const corpus_entry *e,
+                     const char *map);
+static int match_player(const demo_corpus *c, const corpus_entry *e,
+                        const char *player);
+
+/*****************************************************************************
+ *                                                                           *
+ *                API                                                        *
+ *                                                                           *
+ *****************************************************************************/
+
+int demo_corpus_update(const char *filename, const char *dir,
+                       corpus_stats *stats)
+{
+  demo_corpus *old = NULL;
+  const corpus_entry *oe;
+  corpus_entry *e;
+  corpus_stats cs;
+  builder bld;
+  path_list list;
+  struct stat st;
+  struct timespec written = { 0, 0 };
+  uint64_t matched = 0;
+  uint64_t ref;
+  size_t i;
+  int ret;
+
+  if (filename == NULL || dir == NULL) {
+    return DEMO_BAD_PARAMS;
+  }
+
+  memset(&cs, 0, sizeof(cs));
+  memset(&bld, 0, sizeof(bld));
+  memset(&list, 0, sizeof(list));
+
+  ret = walk_dir(dir, &list);
+  if (ret != DEMO_OK) {
+    goto demo_corpus_update_failure;
+  }
+  qsort(list.paths, list.count, sizeof(char *), compare_paths);
+
+  // a missing, damaged or outdated index is rebuilt from scratch
+  if (demo_corpus_open(filename, &old) != DEMO_OK) {
+    old = NULL;
+  }
+  else if (stat(filename, &st) == 0) {
+    written = st.st_mtim;
+  }
+
+  // reference 0 is the empty string
+  ret = add_string(&bld, "", &ref);
+  if (ret != DEMO_OK) {
+    goto demo_corpus_update_failure;
+  }
+
+  for (i = 0; i < list.count; i++) {
+    if (stat(list.paths[i], &st) != 0) {
+      continue; // gone since the walk
+    }
+
+    ret = grow_array((void **) &bld.entries, &bld.entry_capacity,
+                     bld.entry_count + 1, sizeof(corpus_entry));
+    if (ret != DEMO_OK) {
+      goto demo_corpus_update_failure;
+    }
+    e = &bld.entries[bld.entry_count];
+    memset(e, 0, sizeof(*e));
+    ret = add_string(&bld, list.paths[i], &e->path);
+    if (ret != DEMO_OK) {
+      goto demo_corpus_update_failure;
+    }
+    e->size = st.st_size;
+    e->mtime = st.st_mtim.tv_sec;
+    e->mtime_nsec = (uint32_t) st.st_mtim.tv_nsec;
+
+    oe = (old != NULL) ? find_entry(old, list.paths[i]) : NULL;
+    if (oe != NULL) {
+      matched++;
+    }
+
+    ret = DEMO_CORRUPT_DEMO;
+    if (oe != NULL && oe->size == e->size && oe->mtime == e->mtime &&
+        oe->mtime_nsec == e->mtime_nsec && !modified_since(e, &written))
+    {
+      ret = copy_entry(&bld, old, oe, bld.entry_count);
+      if (ret == DEMO_OK) {
+        cs.reused++;
+      }
+    }
+
+    // new, changed, or not usable from the old index
+    if (ret == DEMO_CORRUPT_DEMO) {
+      ret = scan_demo(&bld, list.paths[i], bld.entry_count);
+      if (ret == DEMO_OK) {
+        cs.scanned++;
+        if (bld.entries[bld.entry_count].status != DEMO_OK) {
+          cs.failed++;
+        }
+      }
+    }
+    if (ret != DEMO_OK) {
+      goto demo_corpus_update_failure;
+    }
+
+    bld.entry_count++;
+  }
+
+  if (old != NULL) {
+    cs.removed = old->entry_count - matched;
+  }
+
+  ret = write_corpus(filename, &bld);
+  if (ret == DEMO_OK && stats != NULL) {
+    *stats = cs;
+  }
+
+ demo_corpus_update_failure:
+  demo_corpus_close(old);
+  for (i = 0; i < list.count; i++) {
+    free(list.paths[i]);
+  }
+  free(list.paths);
+  free(bld.entries);
+  free(bld.levels);
+  free(bld.names);
+  free(bld.strings);
+  return ret;
+}
+
+int demo_corpus_open(const char *filename, demo_corpus **c)
+{
+  demo_corpus *corpus;
+  const corpus_header *h;
+  struct stat st;
+  void *map;
+  int fd;
+
+  if (filename == NULL || c == NULL) {
+    return DEMO_BAD_PARAMS;
+  }
+
+  fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    return DEMO_CANNOT_OPEN_DEMO;
+  }
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return DEMO_CANNOT_OPEN_DEMO;
+  }
+  if ((uint64_t) st.st_size < sizeof(corpus_header)) {
+    close(fd);
+    return DEMO_CORRUPT_DEMO;
+  }
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return DEMO_CANNOT_OPEN_DEMO;
+  }
+
+  // a pool ending in a NUL makes every in range reference a valid string
+  h = (const corpus_header *) map;
+  if (memcmp(h->magic, CORPUS_MAGIC, sizeof(h->magic)) != 0 ||
+      h->version != CORPUS_VERSION || h->byte_order != CORPUS_BYTE_ORDER ||
+      !table_fits(h->entry_offset, h->entry_count, sizeof(corpus_entry),
+                  st.st_size) ||
+      !table_fits(h->level_offset, h->level_count, sizeof(corpus_level),
+                  st.st_size) ||
+      !table_fits(h->name_offset, h->name_count, sizeof(uint64_t),
+                  st.st_size) ||
+      !table_fits(h->string_offset, h->string_size, 1, st.st_size) ||
+      h->entry_offset % 8 != 0 || h->level_offset % 8 != 0 ||
+      h->name_offset % 8 != 0 || h->string_size == 0 ||
+      ((const char *) map)[h->string_offset + h->string_size - 1] != '\0') {
+    munmap(map, st.st_size);
+    return DEMO_CORRUPT_DEMO;
+  }
+
+  corpus = calloc(1, sizeof(demo_corpus));
+  if (corpus == NULL) {
+    munmap(map, st.st_size);
+    return DEMO_NO_MEMORY;
+  }
+
+  corpus->entry_count = h->entry_count;
+  corpus->level_count = h->level_count;
+  corpus->name_count = h->name_count;
+  corpus->string_size = h->string_size;
+  corpus->entries =
+    (const corpus_entry *) ((const uint8_t *) map + h->entry_offset);
+  corpus->levels =
+    (const corpus_level *) ((const uint8_t *) map + h->level_offset);
+  corpus->names = (const uint64_t *) ((const uint8_t *) map + h->name_offset);
+  corpus->strings = (const char *) map + h->string_offset;
+  corpus->map = map;
+  corpus->map_size = st.st_size;
+
+  *c = corpus;
+  return DEMO_OK;
+}
+
+const char *demo_corpus_string(const demo_corpus *c, uint64_t ref)
+{
+  if (ref >= c->string_size) {
+    return "";
+  }
+
+  return c->strings + ref;
+}
+
+const corpus_level *demo_corpus_levels(const demo_corpus *c,
+                                       const corpus_entry *e)
+{
+  if (e->first_level > c->level_count ||
+      e->level_count > c->level_count - e->first_level) {
+    return NULL;
+  }
+
+  return c->levels + e->first_level;
+}
+
+const uint64_t *demo_corpus_names(const demo_corpus *c,
+                                  const corpus_entry *e)
+{
+  if (e->first_name > c->name_count ||
+      e->name_count > c->name_count - e->first_name) {
+    return NULL;
+  }
+
+  return c->names + e->first_name;
+}
+
+void demo_corpus_query_init(corpus_query *q)
+{
+  q->protocol = PROTOCOL_UNKNOWN;
+  q->map = NULL;
+  q->player = NULL;
+  q->min_duration = 0.0f;
+  q->max_duration = -1.0f;
+}
+
+int demo_corpus_query(const demo_corpus *c, const corpus_query *q,
+                      corpus_cb_t cb, void *ctx)
+{
+  const corpus_entry *e;
+  uint64_t i;
+  int ret;
+
+  if (c == NULL || q == NULL || cb == NULL) {
+    return DEMO_BAD_PARAMS;
+  }
+
+  // cheapest tests first, the string ones walk the levels and names
+  for (i = 0; i < c->entry_count; i++) {
+    e = &c->entries[i];
+
+    if (q->protocol != PROTOCOL_UNKNOWN && e->protocol != q->protocol) {
+      continue;
+    }
+    if (e->duration < q->min_duration) {
+      continue;
+    }
+    if (q->max_duration >= 0.0f && e->duration >= q->max_duration) {
+      continue;
+    }
+    if (q->map != NULL && !match_map(c, e, q->map)) {
+      continue;
+    }
+    if (q->player != NULL && !match_player(c, e, q->player)) {
+      continue;
+    }
+
+    ret = cb(ctx, c, e);
+    if (ret == DEMO_SCAN_STOP) {
+      break;
+    }
+    if (ret != DEMO_OK) {
+      return ret;
+    }
+  }
+
+  return DEMO_OK;
+}
+
+int demo_corpus_close(demo_corpus *c)
+{
+  if (c != NULL) {
+    munmap(c->map, c->map_size);
+    free(c);
+  }
+
+  return DEMO_OK;
+}
+
+/*****************************************************************************
+ *                                                                           *
+ *                BUILD FUNCTIONS                                            *
+ *                                                                           *
+ *****************************************************************************/
+
+/* Collects the .dem files below dir. Subdirectories that cannot be read
+ * are skipped, only dir itself has to be readable.
+ */
+static int walk_dir(const char *dir, path_list *list)
+{
+  DIR *d;
+  struct dirent *de;
+  struct stat st;
+  char *path;
+  int ret = DEMO_OK;
+
+  d = opendir(dir);
+  if (d == NULL) {
+    return DEMO_CANNOT_OPEN_DEMO;
+  }
+
+  while ((de = readdir(d)) != NULL) {
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+      continue;
+    }
+
+    path = join_path(dir, de->d_name);
+    if (path == NULL) {
+      ret = DEMO_NO_MEMORY;
+      break;
+    }
+
+    // lstat, so linked directories cannot loop
+    if (lstat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+      ret = walk_dir(path, list);
+      free(path);
+      if (ret == DEMO_CANNOT_OPEN_DEMO) {
+        ret = DEMO_OK;
+      }
+      if (ret != DEMO_OK) {
+        break;
+      }
+      continue;
+    }
+
+    if (!has_dem_suffix(de->d_name) || stat(path, &st) != 0 ||
+        !S_ISREG(st.st_mode)) {
+      free(path);
+      continue;
+    }
+
+    ret = grow_array((void **) &list->paths, &list->capacity,
+                     list->count + 1, sizeof(char *));
+    if (ret != DEMO_OK) {
+      free(path);
+      break;
+    }
+    list->paths[list->count++] = path;
+  }
+
+  closedir(d);
+  return ret;
+}
+
+static char *join_path(const char *dir, const char *name)
+{
+  size_t len = strlen(dir);
+  char *path;
+
+  while (len > 1 && dir[len - 1] == '/') {
+    len--;
+  }
+
+  path = malloc(len + strlen(name) + 2);
+  if (path != NULL) {
+    memcpy(path, dir, len);
+    path[len] = '/';
+    strcpy(path + len + 1, name);
+  }
+
+  return path;
+}
+
+static int has_dem_suffix(const char *name)
+{
+  size_t len = strlen(name);
+
+  return len > 4 && strcasecmp(name + len - 4, ".dem") == 0;
+}
+
+static int compare_paths(const void *a, const void *b)
+{
+  return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/* Binary search of the old index, whose entries are sorted by path.
+ */
+static const corpus_entry *find_entry(const demo_corpus *c, const char *path)
+{
+  uint64_t lo = 0;
+  uint64_t hi = c->entry_count;
+  uint64_t mid;
+  int cmp;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    cmp = strcmp(demo_corpus_string(c, c->entries[mid].path), path);
+    if (cmp == 0) {
+      return &c->entries[mid];
+    }
+    if (cmp < 0) {
+      lo = mid + 1;
+    }
+    else {
+      hi = mid;
+    }
+  }
+
+  return NULL;
+}
+
+/* Whether the file of an entry was modified no earlier than t. A write in
+ * the same tick of a coarse file system clock as the one seen leaves the
+ * modification time as it was, so such files cannot be trusted unchanged.
+ */
+static int modified_since(const corpus_entry *e, const struct timespec *t)
+{
+  if (e->mtime != t->tv_sec) {
+    return e->mtime > t->tv_sec;
+  }
+
+  return e->mtime_nsec >= t->tv_nsec;
+}
+
+/* Takes an unchanged demo over from the old index. Returns
+ * DEMO_CORRUPT_DEMO if the old entry is unusable, so it is scanned anew.
+ */
+static int copy_entry(builder *bld, const demo_corpus *old,
+                      const corpus_entry *oe, size_t index)
+{
+  const corpus_level *ol;
+  const uint64_t *on;
+  corpus_entry *e = &bld->entries[index];
+  corpus_level *l;
+  uint32_t i;
+  int ret;
+
+  ol = demo_corpus_levels(old, oe);
+  on = demo_corpus_names(old, oe);
+  if (ol == NULL || on == NULL) {
+    return DEMO_CORRUPT_DEMO;
+  }
+
+  e->fingerprint = oe->fingerprint;
+  e->protocol = oe->protocol;
+  e->track = oe->track;
+  e->duration = oe->duration;
+  e->status = oe->status;
+
+  e->first_level = bld->level_count;
+  for (i = 0; i < oe->level_count; i++) {
+    ret = grow_array((void **) &bld->levels, &bld->level_capacity,
+                     bld->level_count + 1, sizeof(corpus_level));
+    if (ret != DEMO_OK) {
+      return ret;
+    }
+    l = &bld->levels[bld->level_count];
+    *l = ol[i];
+    ret = add_string(bld, demo_corpus_string(old, ol[i].map), &l->map);
+    if (ret != DEMO_OK) {
+      return ret;
+    }
+    ret = add_string(bld, demo_corpus_string(old, ol[i].title), &l->title);
+    if (ret != DEMO_OK) {
+      return ret;
+    }
+    bld->level_count++;
+  }
+  e->level_count = oe->level_count;
+
+  e->first_name = bld->name_count;
+  for (i = 0; i < oe->name_count; i++) {
+    ret = grow_array((void **) &bld->names, &bld->name_capacity,
+                     bld->name_count + 1, sizeof(uint64_t));
+    if (ret != DEMO_OK) {
+      return ret;
+    }
+    ret = add_string(bld, demo_corpus_string(old, on[i]),
+                     &bld->names[bld->name_count]);
+    if (ret != DEMO_OK) {
+      return ret;
+    }
+    bld->name_count++;
+  }
+  e->name_count = oe->name_count;
+
+  return DEMO_OK;
+}
+
+/* Reads a demo into the entry at index, through the push parser, so the
+ * file is read once for both the fingerprint and the contents. A demo that
+ * fails to parse is not an error here, it is recorded in the entry.
+ */
+static int scan_demo(builder *bld, const char *path, size_t index)
+{
+  demo_parser *p = NULL;
+  corpus_entry *e;
+  corpus_level *l;
+  scanner sc;
+  FILE *fp;
+  uint8_t *buf;
+  uint8_t *nl;
+  demo_hash_state raw;
+  uint64_t fingerprint;
+  uint64_t fed = 0;
+  size_t n;
+  int header = 0;
+  int status = DEMO_OK;
+  int ret;
+  uint32_t i;
+
+  e = &bld->entries[index];
+  e->first_level = bld->level_count;
+  e->first_name = bld->name_count;
+
+  memset(&sc, 0, sizeof(sc));
+  sc.bld = bld;
+  sc.entry = index;
+
+  fp = fopen(path, "rb");
+  if (fp == NULL) {
+    e->status = DEMO_CANNOT_OPEN_DEMO;
+    return DEMO_OK;
+  }
+
+  buf = malloc(READ_CHUNK_SIZE);
+  ret = demo_parser_new(&p);
+  if (ret == DEMO_OK) {
+    ret = demo_hashes_new(&sc.hashes);
+  }
+  if (buf == NULL || ret != DEMO_OK) {
+    fclose(fp);
+    free(buf);
+    demo_parser_close(p);
+    demo_hashes_free(sc.hashes);
+    return DEMO_NO_MEMORY;
+  }
+
+  // a demo that fails to parse is fingerprinted by its raw bytes
+  demo_hash_init(&raw, 0);
+  while ((n = fread(buf, 1, READ_CHUNK_SIZE, fp)) > 0) {
+    demo_hash_update(&raw, buf, n);
+
+    // blocks start after the cd track line
+    if (!header) {
+      nl = memchr(buf, '\n', n);
+      if (nl != NULL) {
+        sc.offset = fed + (nl - buf) + 1;
+        header = 1;
+      }
+    }
+    fed += n;
+
+    if (status == DEMO_OK) {
+      status = demo_parser_feed(p, buf, n, scan_block, &sc);
+    }
+  }
+  if (ferror(fp) && status == DEMO_OK) {
+    status = DEMO_CANNOT_OPEN_DEMO;
+  }
+  ret = demo_parser_close(p);
+  if (status == DEMO_OK) {
+    status = ret;
+  }
+  fclose(fp);
+  free(buf);
+
+  fingerprint = (status == DEMO_OK) ? demo_hashes_fingerprint(sc.hashes)
+    : demo_hash_final(&raw);
+  demo_hashes_free(sc.hashes);
+
+  if (status == DEMO_NO_MEMORY) {
+    return DEMO_NO_MEMORY;
+  }
+
+  e = &bld->entries[index];
+  e->fingerprint = fingerprint;
+  e->status = status;
+  e->protocol = sc.protocol;
+  e->track = sc.track;
+  e->level_count = bld->level_count - e->first_level;
+  e->name_count = bld->name_count - e->first_name;
+
+  e->duration = 0.0f;
+  for (i = 0; i < e->level_count; i++) {
+    l = &bld->levels[e->first_level + i];
+    if (l->end_time > l->start_time) {
+      e->duration += l->end_time - l->start_time;
+    }
+  }
+
+  return DEMO_OK;
+}
+
+static int scan_block(void *ctx, demo *hdr, block **b)
+{
+  scanner *sc = (scanner *) ctx;
+  builder *bld = sc->bld;
+  corpus_level *l;
+  message *m;
+  float t;
+  int ret;
+
+  sc->protocol = hdr->protocol;
+  sc->track = hdr->track;
+
+  ret = demo_hashes_add(sc->hashes, hdr->track, *b);
+  if (ret != DEMO_OK) {
+    return ret;
+  }
+
+  for (m = (*b)->messages; m != NULL; m = m->next) {
+    switch (m->type) {
+    case SERVERINFO:
+      ret = add_level(sc, m);
+      if (ret != DEMO_OK) {
+        return ret;
+      }
+      break;
+
+    case TIME:
+      if (sc->in_level && m->size == 4) {
+        memcpy(&t, m->data, 4);
+        l = &bld->levels[bld->level_count - 1];
+        if (!sc->have_time) {
+          l->start_time = t;
+          sc->have_time = 1;
+        }
+        l->end_time = t;
+      }
+      break;
+
+    case UPDATENAME:
+      // slot, then the name, empty when a player leaves
+      if (m->size > 2 && m->data[m->size - 1] == '\0') {
+        ret = add_name(sc, (const char *) m->data + 1);
+        if (ret != DEMO_OK) {
+          return ret;
+        }
+      }
+      break;
+    }
+  }
+
+  if (sc->in_level) {
+    l = &bld->levels[bld->level_count - 1];
+    l->block_count = sc->block - l->first_block + 1;
+  }
+
+  sc->offset += 16 + (*b)->length;
+  sc->block++;
+  return DEMO_OK;
+}
+
+/* Starts a level at the block holding m. SERVERINFO holds the protocol,
+ * its flags if it has any, maxclients and gametype, then the level title,
+ * then the model names, the first of which is the world model
+ * "maps/<map>.bsp".
+ */
+static int add_level(scanner *sc, message *m)
+{
+  builder *bld = sc->bld;
+  corpus_level *l;
+  const char *title = "";
+  const char *model = "";
+  const char *base;
+  const char *dot;
+  const uint8_t *end;
+  const uint8_t *stop = m->data + m->size;
+  size_t header = demo_serverinfo_header(m);
+  char map[MAX_MAP_NAME];
+  uint64_t map_ref;
+  uint64_t title_ref;
+  size_t len;
+  int ret;
+
+  if (header > 0 && m->size > header) {
+    end = memchr(m->data + header, '\0', m->size - header);
+    if (end != NULL) {
+      title = (const char *) m->data + header;
+      if (end + 1 < stop && memchr(end + 1, '\0', stop - end - 1) != NULL) {
+        model = (const char *) end + 1;
+      }
+    }
+  }
+
+  base = strrchr(model, '/');
+  base = (base != NULL) ? base + 1 : model;
+  dot = strrchr(base, '.');
+  len = (dot != NULL) ? (size_t) (dot - base) : strlen(base);
+  if (len >= sizeof(map)) {
+    len = sizeof(map) - 1;
+  }
+  memcpy(map, base, len);
+  map[len] = '\0';
+
+  ret = add_string(bld, map, &map_ref);
+  if (ret != DEMO_OK) {
+    return ret;
+  }
+  ret = add_string(bld, title, &title_ref);
+  if (ret != DEMO_OK) {
+    return ret;
+  }
+
+  ret = grow_array((void **) &bld->levels, &bld->level_capacity,
+                   bld->level_count + 1, sizeof(corpus_level));
+  if (ret != DEMO_OK) {
+    return ret;
+  }
+  l = &bld->levels[bld->level_count++];
+  memset(l, 0, sizeof(*l));
+  l->map = map_ref;
+  l->title = title_ref;
+  l->offset = sc->offset;
+  l->first_block = sc->block;
+  l->block_count = 1;
+
+  sc->in_level = 1;
+  sc->have_time = 0;
+  return DEMO_OK;
+}
+
+/* Adds a player name to the entry being scanned, unless it is there.
+ */
+static int add_name(scanner *sc, const char *name)
+{
+  builder *bld = sc->bld;
+  size_t i;
+  int ret;
+
+  for (i = bld->entries[sc->entry].first_name; i < bld->name_count; i++) {
+    if (strcmp(bld->strings + bld->names[i], name) == 0) {
+      return DEMO_OK;
+    }
+  }
+
+  ret = grow_array((void **) &bld->names, &bld->name_capacity,
+                   bld->name_count + 1, sizeof(uint64_t));
+  if (ret != DEMO_OK) {
+    return ret;
+  }
+  ret = add_string(bld, name, &bld->names[bld->name_count]);
+  if (ret != DEMO_OK) {
+    return ret;
+  }
+  bld->name_count++;
+
+  return DEMO_OK;
+}
+
+static int add_string(builder *bld, const char *s, uint64_t *ref)
+{
+  size_t len = strlen(s) + 1;
+  int ret;
+
+  ret = grow_array((void **) &bld->strings, &bld->string_capacity,
+                   bld->string_size + len, 1);
+  if (ret != DEMO_OK) {
+    return ret;
+  }
+
+  memcpy(bld->strings + bld->string_size, s, len);
+  *ref = bld->string_size;
+  bld->string_size += len;
+
+  return DEMO_OK;
+}
+
+/* Makes room for count elements of size bytes, doubling the capacity.
+ */
+static int grow_array(void **array, size_t *capacity, size_t count,
+                      size_t size)
+{
+  size_t n = *capacity;
+  void *p;
+
+  if (count <= n) {
+    return DEMO_OK;
+  }
+
+  if (n == 0) {
+    n = 64;
+  }
+  while (n < count) {
+    n *= 2;
+  }
+
+  p = realloc(*array, n * size);
+  if (p == NULL) {
+    return DEMO_NO_MEMORY;
+  }
+
+  *array = p;
+  *capacity = n;
+  return DEMO_OK;
+}
+
+/* Writes the index under a temporary name and renames it into place, so
+ * readers see either the old or the new index, never a partial one.
+ */
+static int write_corpus(const char *filename, builder *bld)
+{
+  corpus_header h;
+  char *tmpname;
+  FILE *fp;
+  int ret = DEMO_OK;
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, CORPUS_MAGIC, sizeof(h.magic));
+  h.version = CORPUS_VERSION;
+  h.byte_order = CORPUS_BYTE_ORDER;
+  h.entry_count = bld->entry_count;
+  h.level_count = bld->level_count;
+  h.name_count = bld->name_count;
+  h.string_size = bld->string_size;
+  h.entry_offset = sizeof(corpus_header);
+  h.level_offset = h.entry_offset + h.entry_count * sizeof(corpus_entry);
+  h.name_offset = h.level_offset + h.level_count * sizeof(corpus_level);
+  h.string_offset = h.name_offset + h.name_count * sizeof(uint64_t);
+
+  tmpname = malloc(strlen(filename) + sizeof(TMP_SUFFIX));
+  if (tmpname == NULL) {
+    return DEMO_NO_MEMORY;
+  }
+  strcpy(tmpname, filename);
+  strcat(tmpname, TMP_SUFFIX);
+
+  fp = fopen(tmpname, "wb");
+  if (fp == NULL) {
+    free(tmpname);
+    return DEMO_CANNOT_WRITE;
+  }
+
+  if (fwrite(&h, sizeof(h), 1, fp) != 1 ||
+      fwrite(bld->entries, sizeof(corpus_entry), bld->entry_count, fp) !=
+      bld->entry_count ||
+      fwrite(bld->levels, sizeof(corpus_level), bld->level_count, fp) !=
+      bld->level_count ||
+      fwrite(bld->names, sizeof(uint64_t), bld->name_count, fp) !=
+      bld->name_count ||
+      fwrite(bld->strings, 1, bld->string_size, fp) != bld->string_size) {
+    ret = DEMO_CANNOT_WRITE;
+  }
+  if (fclose(fp) != 0) {
+    ret = DEMO_CANNOT_WRITE;
+  }
+
+  if (ret == DEMO_OK && rename(tmpname, filename) != 0) {
+    ret = DEMO_CANNOT_WRITE;
+  }
+  if (ret != DEMO_OK) {
+    remove(tmpname);
+  }
+
+  free(tmpname);
+  return ret;
+}
+
+/*****************************************************************************
+ *                                                                           *
+ *                HELPER FUNCTIONS                                           *
+ *                                                                           *
+ *****************************************************************************/
+
+/* Whether count entries of size bytes at offset lie within total bytes.
+ */
+static int table_fits(uint64_t offset, uint64_t count, size_t size,
+                      uint64_t total)
+{
+  if (offset > total) {
+    return 0;
+  }
+
+  return count <= (total - offset) / size;
+}
+
+static int match_map(const demo_corpus *c, const corpus_entry *e,
+                     const char *map)
+{
+  const corpus_level *l = demo_corpus_levels(c, e);
+  uint32_t i;
+
+  if (l == NULL) {
+    return 0;
+  }
+
+  for (i = 0; i < e->level_count; i++) {
+    if (strcasecmp(demo_corpus_string(c, l[i].map), map) == 0) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static int match_player(const demo_corpus *c, const corpus_entry *e,
+                        const char *player)
+{
+  const uint64_t *n = demo_corpus_names(c, e);
+  uint32_t i;
+
+  if (n == NULL) {
+    return 0;
+  }
+
+  for (i = 0; i < e->name_count; i++) {
+    if (strcasecmp(demo_corpus_string(c, n[i]), player) == 0) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,795 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "demo.h"
+#include "demo_cut.h"
+
+/*****************************************************************************
+ *                                                                           *
+ *                DEFINITIONS                                                *
+ *                                                                           *
+ *****************************************************************************/
+
+#define MAX_BLOCK_LENGTH 65536 // from lmpc
+#define BLOCK_HEADER 16 // length and angles
+#define PEEK_LENGTH 5 // type and value of a leading TIME message
+#define CDTRACK_MAX_LENGTH 16 // cd track line, newline included
+#define MAX_SPLIT_THREADS 64
+#define SPLIT_NAME_LENGTH 4096
+#define COPY_CHUNK_SIZE (1024 * 1024) // level copy size per read
+
+/*****************************************************************************
+ *                                                                           *
+ *                DATA TYPES                                                 *
+ *                                                                           *
+ *****************************************************************************/
+
+/* Raw block reader. data holds the current block from its header on, of
+ * which the first have bytes have been read. Blocks that are not parsed
+ * are never given to the parser, which only needs the protocol from the
+ * SERVERINFO blocks it does see.
+ */
+typedef struct {
+  FILE *fp;
+  FILE *local_fp;
+  demo_parser *parser;
+  int32_t track;
+  int seekable;
+  off_t offset; // file offset of the current block
+  off_t next; // file offset of the next block
+  uint32_t length;
+  uint8_t *data;
+  size_t have;
+} reader;
+
+/* What a block holds, as far as cutting is concerned
+ */
+typedef struct {
+  int serverinfo;
+  int has_time;
+  float time;
+} block_info;
+
+/* A level of the demo being split, blocks start to end - 1
+ */
+typedef struct {
+  off_t start;
+  off_t end;
+} level;
+
+/* Split state shared by the writer threads, which take levels in order
+ */
+typedef struct {
+  int fd;
+  int32_t track; // cd track line of the source, written to every level
+  const demo_split_params *params;
+  level *levels;
+  size_t level_count;
+  atomic_size_t next;
+  atomic_int ret;
+} split_job;
+
+typedef struct {
+  uint8_t *data;
+  size_t size;
+  size_t capacity;
+} byte_buffer;
+
+/*****************************************************************************
+ *                                                                           *
+ *                FORWARD REFERENCES                                         *
+ *                                                                           *
+ *****************************************************************************/
+
+static int cut_clip(reader *r, demo_writer *w, float start, float end);
+static int open_reader(flagfield *flags, reader *r);
+static void close_reader(reader *r);
+static int read_cdtrack(reader *r);
+static int next_block(reader *r);
+static int load_block(reader *r);
+static int skip_block(reader *r);
+static int seek_block(reader *r, off_t offset);
+static int copy_block(reader *r, demo_writer *w);
+static int keep_block(reader *r, byte_buffer *buf);
+static int inspect_block(reader *r, block_info *info);
+static int find_levels(reader *r, level **levels, size_t *count);
+static void *split_thread(void *arg);
+static int write_level(split_job *job, size_t index, uint8_t *buf);
+static int inspect_cb(void *ctx, demo *hdr, block **b);
+static int append(byte_buffer *buf, const uint8_t *data, size_t len);
+static uint32_t get_uint32(const uint8_t *p);
+static float get_float(const uint8_t *p);
+
+/*****************************************************************************
+ *                                                                           *
+ *                API                                                        *
+ *                                                                           *
+ *****************************************************************************/
+
+int demo_cut(flagfield *rflags, float start, float end, flagfield *wflags)
+{
+  demo_clip clip;
+
+  clip.flags = rflags;
+  clip.start = start;
+  clip.end = end;
+
+  return demo_splice(&clip, 1, wflags);
+}
+
+int demo_splice(const demo_clip *clips, size_t count, flagfield *wflags)
+{
+  demo_writer *w = NULL;
+  reader r;
+  size_t i;
+  int ret = DEMO_OK;
+  int ret2;
+
+  if (clips == NULL || count == 0 || wflags == NULL) {
+    return DEMO_BAD_PARAMS;
+  }
+
+  for (i = 0; i < count; i++) {
+    if (clips[i].flags == NULL || !(clips[i].end >= clips[i].start)) {
+      return DEMO_BAD_PARAMS;
+    }
+  }
+
+  for (i = 0; i < count && ret == DEMO_OK; i++) {
+    ret = open_reader(clips[i].flags, &r);
+    if (ret != DEMO_OK) {
+      break;
+    }
+
+    // the first demo decides the cd track
+    if (w == NULL) {
+      ret = demo_writer_open(wflags, r.track, &w);
+    }
+    if (ret == DEMO_OK) {
+      ret = cut_clip(&r, w, clips[i].start, clips[i].end);
+    }
+
+    close_reader(&r);
+  }
+
+  if (w != NULL) {
+    ret2 = demo_writer_close(w);
+    if (ret == DEMO_OK) {
+      ret = ret2;
+    }
+  }
+
+  return ret;
+}
+
+int demo_split(flagfield *rflags, const demo_split_params *params,
+               uint32_t *levels)
+{
+  pthread_t threads[MAX_SPLIT_THREADS];
+  split_job job;
+  reader r;
+  int thread_count;
+  int started;
+  int ret;
+  int i;
+
+  if (rflags == NULL || params == NULL || params->prefix == NULL) {
+    return DEMO_BAD_PARAMS;
+  }
+
+  ret = open_reader(rflags, &r);
+  if (ret != DEMO_OK) {
+    return ret;
+  }
+
+  memset(&job, 0, sizeof(job));
+  job.params = params;
+  job.fd = fileno(r.fp);
+  job.track = r.track;
+  atomic_init(&job.next, 0);
+  atomic_init(&job.ret, DEMO_OK);
+
+  // the threads read with pread(), which needs a seekable file
+  ret = r.seekable ? find_levels(&r, &job.levels, &job.level_count)
+                   : DEMO_BAD_PARAMS;
+  if (ret != DEMO_OK) {
+    goto demo_split_failure;
+  }
+
+  thread_count = params->threads;
+  if (thread_count <= 0) {
+    thread_count = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (thread_count <= 0) {
+    thread_count = 1;
+  }
+  if (thread_count > MAX_SPLIT_THREADS) {
+    thread_count = MAX_SPLIT_THREADS;
+  }
+  if ((size_t) thread_count > job.level_count) {
+    thread_count = (int) job.level_count;
+  }
+
+  for (started = 0; started < thread_count; started++) {
+    if (pthread_create(&threads[started], NULL, split_thread, &job) != 0) {
+      break;
+    }
+  }
+  if (started == 0 && thread_count > 0) {
+    split_thread(&job); // no threads, do it here
+  }
+  for (i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  ret = atomic_load(&job.ret);
+  if (ret == DEMO_OK && levels != NULL) {
+    *levels = (uint32_t) job.level_count;
+  }
+
+ demo_split_failure:
+  free(job.levels);
+  close_reader(&r);
+  return ret;
+}
+
+/*****************************************************************************
+ *                                                                           *
+ *                CUT FUNCTIONS                                              *
+ *                                                                           *
+ *****************************************************************************/
+
+/* Copies one range. The latest frame not after start might hold it, which
+ * only the next frame tells, so it is remembered: by offset if the file
+ * can seek back to it, otherwise by copy.
+ */
+static int cut_clip(reader *r, demo_writer *w, float start, float end)
+{
+  byte_buffer signon = { NULL, 0, 0 };
+  byte_buffer held = { NULL, 0, 0 };
+  block_info info;
+  off_t held_offset = -1;
+  int in_signon = 0;
+  int copying = 0;
+  int ret;
+
+  while ((ret = next_block(r)) == DEMO_OK) {
+    ret = inspect_block(r, &info);
+    if (ret != DEMO_OK) {
+      break;
+    }
+
+    if (info.serverinfo) {
+      if (copying) {
+        break; // the level is over
+      }
+      signon.size = 0;
+      held.size = 0;
+      held_offset = -1;
+      in_signon = 1;
+    }
+
+    if (!info.has_time) {
+      if (in_signon) {
+        ret = keep_block(r, &signon);
+      }
+      else if (copying) {
+        ret = copy_block(r, w);
+      }
+      else {
+        ret = skip_block(r);
+      }
+      if (ret != DEMO_OK) {
+        break;
+      }
+      continue;
+    }
+    in_signon = 0;
+
+    if (copying) {
+      if (info.time > end) {
+        break;
+      }
+      ret = copy_block(r, w);
+      if (ret != DEMO_OK) {
+        break;
+      }
+      continue;
+    }
+
+    if (info.time <= start) {
+      if (r->seekable) {
+        held_offset = r->offset;
+        ret = skip_block(r);
+      }
+      else {
+        held.size = 0;
+        ret = keep_block(r, &held);
+      }
+      if (ret != DEMO_OK) {
+        break;
+      }
+      continue;
+    }
+
+    // the first frame after start
+    copying = 1;
+    ret = demo_writer_raw(w, signon.data, signon.size);
+    if (ret != DEMO_OK) {
+      break;
+    }
+
+    if (held_offset >= 0) {
+      // go through the held frame and this one again, now copying
+      ret = seek_block(r, held_offset);
+      if (ret != DEMO_OK) {
+        break;
+      }
+      continue;
+    }
+
+    if (held.size > 0) {
+      ret = demo_writer_raw(w, held.data, held.size);
+      if (ret != DEMO_OK || info.time > end) {
+        break;
+      }
+    }
+
+    ret = copy_block(r, w);
+    if (ret != DEMO_OK) {
+      break;
+    }
+  }
+
+  // the demo ended, the frame holding start may be its last
+  if (ret == DEMO_SCAN_STOP) {
+    ret = DEMO_OK;
+    if (!copying && (held_offset >= 0 || held.size > 0)) {
+      ret = demo_writer_raw(w, signon.data, signon.size);
+      if (ret == DEMO_OK && held_offset >= 0) {
+        ret = seek_block(r, held_offset);
+        if (ret == DEMO_OK) {
+          ret = next_block(r);
+        }
+        if (ret == DEMO_OK) {
+          ret = copy_block(r, w);
+        }
+      }
+      else if (ret == DEMO_OK) {
+        ret = demo_writer_raw(w, held.data, held.size);
+      }
+    }
+  }
+
+  free(signon.data);
+  free(held.data);
+  return ret;
+}
+
+/*****************************************************************************
+ *                                                                           *
+ *                SPLIT FUNCTIONS                                            *
+ *                                                                           *
+ *****************************************************************************/
+
+/* Skip scans the demo for its levels
+ */
+static int find_levels(reader *r, level **levels, size_t *count)
+{
+  level *list = NULL;
+  level *grown;
+  size_t capacity = 0;
+  size_t n = 0;
+  block_info info;
+  int seen = 0;
+  int ret;
+
+  while ((ret = next_block(r)) == DEMO_OK) {
+    ret = inspect_block(r, &info);
+    if (ret != DEMO_OK) {
+      break;
+    }
+
+    // blocks before the first SERVERINFO are part of the first level
+    if (n == 0 || (info.serverinfo && seen)) {
+      if (n == capacity) {
+        capacity = (capacity == 0) ? 16 : capacity * 2;
+        grown = realloc(list, capacity * sizeof(level));
+        if (grown == NULL) {
+          ret = DEMO_NO_MEMORY;
+          break;
+        }
+        list = grown;
+      }
+      if (n > 0) {
+        list[n - 1].end = r->offset;
+      }
+      list[n].start = r->offset;
+      n++;
+    }
+    seen |= info.serverinfo;
+
+    ret = skip_block(r);
+    if (ret != DEMO_OK) {
+      break;
+    }
+  }
+
+  if (ret != DEMO_SCAN_STOP) {
+    free(list);
+    return ret;
+  }
+
+  if (n > 0) {
+    list[n - 1].end = r->next;
+  }
+
+  *levels = list;
+  *count = n;
+  return DEMO_OK;
+}
+
+static void *split_thread(void *arg)
+{
+  split_job *job = (split_job *) arg;
+  uint8_t *buf;
+  size_t i;
+  int expected;
+  int ret;
+
+  buf = malloc(COPY_CHUNK_SIZE);
+  if (buf == NULL) {
+    expected = DEMO_OK;
+    atomic_compare_exchange_strong(&job->ret, &expected, DEMO_NO_MEMORY);
+    return NULL;
+  }
+
+  // levels are taken until they run out or a thread fails
+  while (atomic_load(&job->ret) == DEMO_OK) {
+    i = atomic_fetch_add(&job->next, 1);
+    if (i >= job->level_count) {
+      break;
+    }
+
+    ret = write_level(job, i, buf);
+    if (ret != DEMO_OK) {
+      expected = DEMO_OK;
+      atomic_compare_exchange_strong(&job->ret, &expected, ret);
+    }
+  }
+
+  free(buf);
+  return NULL;
+}
+
+static int write_level(split_job *job, size_t index, uint8_t *buf)
+{
+  const level *l = &job->levels[index];
+  char name[SPLIT_NAME_LENGTH];
+  flagfield wflags[3];
+  demo_writer *w;
+  off_t offset;
+  size_t n;
+  ssize_t got;
+  int ret;
+  int ret2;
+
+  if (snprintf(name, sizeof(name), "%s%03u.dem", job->params->prefix,
+               (unsigned int) index + 1) >= (int) sizeof(name)) {
+    return DEMO_BAD_PARAMS;
+  }
+
+  wflags[0].flag = WRITEFLAG_FILENAME;
+  wflags[0].value = name;
+  wflags[1].flag = job->params->replace ? WRITEFLAG_REPLACE : WRITEFLAG_END;
+  wflags[1].value = NULL;
+  wflags[2].flag = WRITEFLAG_END;
+  wflags[2].value = NULL;
+
+  ret = demo_writer_open(wflags, job->track, &w);
+  if (ret != DEMO_OK) {
+    return ret;
+  }
+
+  for (offset = l->start; offset < l->end && ret == DEMO_OK; offset += got) {
+    n = (l->end - offset < COPY_CHUNK_SIZE) ? (size_t) (l->end - offset)
+                                            : COPY_CHUNK_SIZE;
+    got = pread(job->fd, buf, n, offset);
+    if (got <= 0) {
+      ret = DEMO_UNEXPECTED_EOF;
+      break;
+    }
+    ret = demo_writer_raw(w, buf, got);
+  }
+
+  ret2 = demo_writer_close(w);
+  return (ret == DEMO_OK) ? ret2 : ret;
+}
+
+/*****************************************************************************
+ *                                                                           *
+ *                READER FUNCTIONS                                           *
+ *                                                                           *
+ *****************************************************************************/
+
+static int open_reader(flagfield *flags, reader *r)
+{
+  char *filename = NULL;
+  int ret;
+
+  memset(r, 0, sizeof(*r));
+
+  for (; flags->flag != READFLAG_END; flags++) {
+    switch ((size_t) flags->flag) {
+    case (size_t) READFLAG_FILENAME:
+      filename = (char *) flags->value;
+      break;
+
+    case (size_t) READFLAG_FP:
+      r->fp = (FILE *) flags->value;
+      break;
+
+    default:
+      break;
+    }
+  }
+
+  if ((r->fp == NULL) == (filename == NULL)) {
+    return DEMO_BAD_PARAMS;
+  }
+
+  if (filename != NULL) {
+    r->local_fp = fopen(filename, "rb");
+    if (r->local_fp == NULL) {
+      return DEMO_CANNOT_OPEN_DEMO;
+    }
+    r->fp = r->local_fp;
+  }
+
+  r->data = malloc(BLOCK_HEADER + MAX_BLOCK_LENGTH);
+  ret = (r->data == NULL) ? DEMO_NO_MEMORY : demo_parser_new(&r->parser);
+  if (ret == DEMO_OK) {
+    ret = read_cdtrack(r);
+  }
+  if (ret != DEMO_OK) {
+    close_reader(r);
+    return ret;
+  }
+
+  // pipes are read through instead of seeking
+  r->next = ftello(r->fp);
+  r->seekable = (r->next >= 0 && fseeko(r->fp, r->next, SEEK_SET) == 0);
+  if (!r->seekable) {
+    r->next = 0;
+  }
+
+  return DEMO_OK;
+}
+
+static void close_reader(reader *r)
+{
+  if (r->parser != NULL) {
+    demo_parser_close(r->parser);
+  }
+  if (r->local_fp != NULL) {
+    fclose(r->local_fp);
+  }
+  free(r->data);
+}
+
+/* Reads the cd track line, and hands it to the parser as well
+ */
+static int read_cdtrack(reader *r)
+{
+  size_t len = 0;
+  int c;
+
+  do {
+    c = fgetc(r->fp);
+    if (c == EOF) {
+      return DEMO_UNEXPECTED_EOF;
+    }
+    r->data[len++] = (uint8_t) c;
+  } while (c != '\n' && len < CDTRACK_MAX_LENGTH);
+
+  if (c != '\n') {
+    return DEMO_CORRUPT_DEMO;
+  }
+
+  r->data[len] = '\0';
+  r->track = (int32_t) strtol((const char *) r->data, NULL, 10);
+
+  return demo_parser_feed(r->parser, r->data, len, inspect_cb, NULL);
+}
+
+/* Reads the header of the next block, and the start of its messages.
+ * Returns DEMO_SCAN_STOP at the end of the demo.
+ */
+static int next_block(reader *r)
+{
+  size_t peek;
+  size_t n;
+
+  r->offset = r->next;
+
+  n = fread(r->data, 1, BLOCK_HEADER, r->fp);
+  if (n == 0 && feof(r->fp)) {
+    return DEMO_SCAN_STOP;
+  }
+  if (n != BLOCK_HEADER) {
+    return DEMO_UNEXPECTED_EOF;
+  }
+
+  r->length = get_uint32(r->data);
+  if (r->length > MAX_BLOCK_LENGTH) {
+    return DEMO_CORRUPT_DEMO;
+  }
+  r->next = r->offset + BLOCK_HEADER + r->length;
+
+  peek = (r->length < PEEK_LENGTH) ? r->length : PEEK_LENGTH;
+  if (fread(r->data + BLOCK_HEADER, 1, peek, r->fp) != peek) {
+    return DEMO_UNEXPECTED_EOF;
+  }
+  r->have = BLOCK_HEADER + peek;
+
+  return DEMO_OK;
+}
+
+/* Reads the rest of the current block
+ */
+static int load_block(reader *r)
+{
+  size_t left = BLOCK_HEADER + r->length - r->have;
+
+  if (left > 0 && fread(r->data + r->have, 1, left, r->fp) != left) {
+    return DEMO_UNEXPECTED_EOF;
+  }
+  r->have += left;
+
+  return DEMO_OK;
+}
+
+static int skip_block(reader *r)
+{
+  if (!r->seekable) {
+    return load_block(r);
+  }
+
+  if (fseeko(r->fp, r->next, SEEK_SET) != 0) {
+    return DEMO_CORRUPT_DEMO;
+  }
+  r->have = BLOCK_HEADER + r->length;
+
+  return DEMO_OK;
+}
+
+/* Goes back to a block read before, which is read next
+ */
+static int seek_block(reader *r, off_t offset)
+{
+  if (fseeko(r->fp, offset, SEEK_SET) != 0) {
+    return DEMO_CORRUPT_DEMO;
+  }
+  r->next = offset;
+
+  return DEMO_OK;
+}
+
+static int copy_block(reader *r, demo_writer *w)
+{
+  int ret;
+
+  ret = load_block(r);
+  if (ret != DEMO_OK) {
+    return ret;
+  }
+
+  return demo_writer_raw(w, r->data, r->have);
+}
+
+static int keep_block(reader *r, byte_buffer *buf)
+{
+  int ret;
+
+  ret = load_block(r);
+  if (ret != DEMO_OK) {
+    return ret;
+  }
+
+  return append(buf, r->data, r->have);
+}
+
+/* Frames start with a TIME message, which is read straight from the
+ * block. Any other block is parsed.
+ */
+static int inspect_block(reader *r, block_info *info)
+{
+  int ret;
+
+  memset(info, 0, sizeof(*info));
+
+  if (r->length >= PEEK_LENGTH && r->data[BLOCK_HEADER] == TIME) {
+    info->has_time = 1;
+    info->time = get_float(r->data + BLOCK_HEADER + 1);
+    return DEMO_OK;
+  }
+
+  ret = load_block(r);
+  if (ret != DEMO_OK) {
+    return ret;
+  }
+
+  return demo_parser_feed(r->parser, r->data, r->have, inspect_cb, info);
+}
+
+static int inspect_cb(void *ctx, demo *hdr, block **b)
+{
+  block_info *info = (block_info *) ctx;
+  message *m;
+
+  if (info == NULL) {
+    return DEMO_OK;
+  }
+
+  for (m = (*b)->messages; m != NULL; m = m->next) {
+    if (m->type == SERVERINFO) {
+      info->serverinfo = 1;
+    }
+    else if (m->type == TIME && m->size == 4 && !info->has_time) {
+      info->has_time = 1;
+      info->time = get_float(m->data);
+    }
+  }
+
+  return DEMO_OK;
+}
+
+/*****************************************************************************
+ *                                                                           *
+ *                HELPER FUNCTIONS                                           *
+ *                                                                           *
+ *****************************************************************************/
+
+static int append(byte_buffer *buf, const uint8_t *data, size_t len)
+{
+  uint8_t *grown;
+  size_t capacity;
+
+  if (buf->size + len > buf->capacity) {
+    capacity = (buf->capacity == 0) ? 4096 : buf->capacity;
+    while (capacity < buf->size + len) {
+      capacity *= 2;
+    }
+    grown = realloc(buf->data, capacity);
+    if (grown == NULL) {
+      return DEMO_NO_MEMORY;
+    }
+    buf->data = grown;
+    buf->capacity = capacity;
+  }
+
+  memcpy(buf->data + buf->size, data, len);
+  buf->size += len;
+  return DEMO_OK;
+}
+
+static uint32_t get_uint32(const uint8_t *p)
+{
+  return (uint32_t) p[0] | ((uint32_t) p[1] << 8) |
+    ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static float get_float(const uint8_t *p)
+{
+  uint32_t u = get_uint32(p);
+  float f;
+
+  memcpy(&f, &u, sizeof(f));
+  return f;
+}
@@ -4,8 +4,19 @@
 #include <stdint.h>
 #include <limits.h>
 #include <setjmp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #include "demo.h"
+#include "demo_events.h"
+#include "demo_context.h"
+#include "demo_hash.h"
 
 /*****************************************************************************
  *                                                                           *
@@ -15,9 +26,24 @@
 
 #define MAX_BLOCK_LENGTH 65536 // from lmpc
 #define CB_BLOCKS (72*30) // make callbacks every n blocks
+#define PROGRESS_MS 250 // default interval of timed progress callbacks
+#define INPUT_BUFFER_SIZE (2 * MAX_BLOCK_LENGTH) // local read buffer
+#define READAHEAD_CHUNKS 3 // triple buffered
+#define READAHEAD_CHUNK_SIZE (1024 * 1024) // default read ahead chunk
+#define WRITE_CHUNK_SIZE (256 * 1024) // async write buffer
+#define FOLLOW_POLL_MS 50 // how often a followed file is checked for growth
+#define CDTRACK_MAX_LENGTH 8 // cd track line, newline included
 
 #define DEMO_PROTOCOL_NOT_PRESENT DEMO_INTERNAL_1
 
+#define SIZE_READ -1 // message type without a fixed size
+#define PROTOCOL_COUNT (sizeof(registry) / sizeof(registry[0]))
+
+// message layouts the shared readers are specialized for
+#define LAYOUT_NETQUAKE  0
+#define LAYOUT_FITZQUAKE 1
+#define LAYOUT_BJP3      2
+
 #define GET_MEMORY(ptr, size, ret, label) do {  \
   ptr = calloc(1, (size));                      \
   if (ptr == NULL) {                            \
@@ -32,25 +58,178 @@
  *                                                                           *
  *****************************************************************************/
 
+/* Shared by the blocks of cloned demos, which point to the same messages
+ */
+struct _demo_block_share {
+  atomic_uint_least32_t refs;
+};
+
+/* Read ahead state. A background thread fills the chunks of a ring, while
+ * the parser consumes them in order. The chunk at head is in use by the
+ * parser from the moment it has been handed out until the next refill.
+ */
+typedef struct {
+  FILE *fp;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  uint8_t *chunks[READAHEAD_CHUNKS];
+  size_t lengths[READAHEAD_CHUNKS];
+  size_t chunk_size;
+  int head;
+  int count;
+  int holding;
+  int eof;
+  int stop;
+} readahead;
+
+typedef struct _protocol_impl protocol_impl;
+
 /* Metadata structure used during demo opening
  */
 typedef struct {
   FILE *fp;
   uint32_t protocol;
+  const protocol_impl *proto; // tables of the protocol, see PROTOCOL FUNCTIONS
+  int reselect; // proto depends on the flags of each SERVERINFO
   progress_cb_t pcb;
+  progress64_cb_t pcb64;
+  demo_progress_cb_t progress;
+  void *progress_ctx;
+  uint64_t progress_ns; // interval
+  uint64_t progress_next; // time of the next report
+  uint64_t start_ns;
+  uint64_t total; // file size, 0 if unknown
+  uint64_t blocks;
   jmp_buf jumpbuf;
   uint8_t buffer[MAX_BLOCK_LENGTH];
   uint8_t buffer2[2048];
+
+  // input, the unread bytes are in[in_pos] to in[in_len - 1]
+  uint8_t *in;
+  size_t in_pos;
+  size_t in_len;
+  uint64_t offset; // file offset of in[0]
+  int seekable; // fp is put back where parsing stopped, see close_input()
+  size_t readahead_size;
+  readahead *ra;
+  uint8_t inbuf[INPUT_BUFFER_SIZE];
+  demo_events *events;
+  demo_context *context;
+  demo_hashes *hashes;
 } deminfo;
 
+/* How a protocol lays out its messages. Message types with a size of
+ * SIZE_READ are read by their read function, or are not part of the
+ * protocol if there is none.
+ */
+typedef int (*read_fn_t)(deminfo *di, message *m);
+
+struct _protocol_impl {
+  uint32_t number;
+  uint32_t coord_size; // bytes per coord and angle, see build_protocol()
+  uint32_t angle_size;
+  int32_t size[256];
+  read_fn_t read[256];
+};
+
+/* A protocol added with demo_register_protocol(), and the tables built for
+ * it, one for each set of protocol flags demos have used. They are kept
+ * until the process ends.
+ */
+typedef struct _built_protocol {
+  struct _built_protocol *next;
+  uint32_t flags;
+  protocol_impl impl;
+} built_protocol;
+
+typedef struct {
+  demo_protocol_def def;
+  built_protocol *built;
+} registered_protocol;
+
+/* Incremental parse state, shared by the push parser and the follower. The
+ * parser state lives on in di between calls, only complete blocks are ever
+ * handed to read_block().
+ */
+struct _demo_parser {
+  deminfo *di;
+  int32_t track;
+  int started;
+  int cb_c;
+};
+
+/* Live follow state. Input is read straight from the file descriptor, so
+ * a pipe or socket never blocks on more than has arrived.
+ */
+struct _demo_follower {
+  demo_parser p;
+  FILE *local_fp;
+  int fd;
+  int pollable; // a pipe or socket, waited on with poll()
+  int hangup; // the writer of a pipe or socket is gone
+};
+
+/* Serialized data waiting for the async writer thread
+ */
+typedef struct _write_chunk {
+  struct _write_chunk *next;
+  size_t length;
+  uint8_t data[WRITE_CHUNK_SIZE];
+} write_chunk;
+
+/* Async write state. The caller serializes the demo into chunks and queues
+ * them, the writer thread writes them out in order. ret holds the first
+ * error from either side.
+ */
+struct _demo_write_handle {
+  FILE *fp;
+  FILE *local_fp;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  write_chunk *head;
+  write_chunk *tail;
+  int done;
+  int finished;
+  int ret;
+};
+
+/* Streaming writer state. With async set, output goes to the current chunk
+ * instead of fp. ret holds the error of the last failed out_write().
+ */
+struct _demo_writer {
+  FILE *fp;
+  FILE *local_fp;
+  demo_write_handle *async;
+  write_chunk *chunk;
+  int ret;
+};
+
 /*****************************************************************************
  *                                                                           *
  *                FORWARD REFERENCES                                         *
  *                                                                           *
  *****************************************************************************/
 
+static int read_readflags(flagfield *flags, deminfo *di, FILE **local_fp);
+static int open_input(deminfo *di);
+static void close_input(deminfo *di);
+static void stop_readahead(readahead *ra);
+static size_t fill_input(deminfo *di);
+static int input_eof(deminfo *di);
+static void *readahead_thread(void *arg);
+static int parse_buffered(demo_parser *p, block **b, size_t *need);
+static size_t push_input(deminfo *di, const uint8_t *buf, size_t len);
+static void compact_input(deminfo *di);
+static int follow_block(demo_follower *f, block **b);
+static int follow_fill(demo_follower *f, size_t need);
+static void follow_wait(demo_follower *f, int ms);
 static int read_demo_data(deminfo *di, demo **dem);
-static int read_blocks(deminfo *di, block **b);
+static int scan_demo_data(deminfo *di, scan_cb_t cb, void *ctx);
+static int read_blocks(deminfo *di, demo *hdr, scan_cb_t cb, void *ctx);
+static int append_block(void *ctx, demo *hdr, block **b);
+static int index_block(deminfo *di, int32_t track, block *b);
 static int read_block(deminfo *di, block **br);
 static int read_messages(deminfo *di, message **m, uint32_t length);
 static int read_message(deminfo *di, message **mr);
@@ -62,13 +241,53 @@ static uint16_t read_uint16_t(deminfo *di);
 static uint8_t read_uint8_t(deminfo *di);
 static void read_n_uint8_t(deminfo *di, int n, uint8_t *buf);
 
-static int write_demo_data(FILE *fp, demo *demo);
-static int write_blocks(FILE *fp, block *bp);
-static int write_block(FILE *fp, block *b);
-static int write_messages(FILE *fp, message *m, uint32_t length);
-static int write_message(FILE *fp, message *m, size_t *written);
-static size_t write_uint32_t(FILE *fp, uint32_t du32);
-static size_t write_float(FILE *fp, float df32);
+static void init_protocols(void);
+static void reset_protocol(deminfo *di);
+static const protocol_impl *find_builtin(uint32_t number);
+static registered_protocol *find_registered(uint32_t number);
+static int build_protocol(registered_protocol *r, uint32_t flags,
+                          const protocol_impl **p);
+static size_t serverinfo_header(const uint8_t *data);
+static int register_protocol(const demo_protocol_def *def);
+static void netquake_init(protocol_impl *p);
+static void fitzquake_init(protocol_impl *p);
+static void bjp3_init(protocol_impl *p);
+static int read_text(deminfo *di, message *m);
+static int read_indexed_text(deminfo *di, message *m);
+static int read_serverinfo(deminfo *di, message *m);
+static int read_temp_entity(deminfo *di, message *m);
+static int read_sound(deminfo *di, message *m);
+static int read_sound_fitz(deminfo *di, message *m);
+static int read_sound_bjp3(deminfo *di, message *m);
+static int read_clientdata(deminfo *di, message *m);
+static int read_clientdata_fitz(deminfo *di, message *m);
+static int read_clientdata_bjp3(deminfo *di, message *m);
+static int read_update(deminfo *di, message *m);
+static int read_update_fitz(deminfo *di, message *m);
+static int read_update_bjp3(deminfo *di, message *m);
+static int read_baseline2(deminfo *di, message *m);
+static int read_static2(deminfo *di, message *m);
+static int read_showlmp(deminfo *di, message *m);
+static int read_fog(deminfo *di, message *m);
+
+static int open_writeflags(flagfield *flags, FILE **fp, FILE **local_fp,
+                           demo_write_handle ***async);
+static int start_async(demo_writer *w);
+static void finish_async(demo_writer *w, int ret);
+static int queue_chunk(demo_write_handle *h, write_chunk *c);
+static void *write_thread(void *arg);
+static size_t out_write(const void *ptr, size_t size, size_t nmemb,
+                        demo_writer *w);
+static int write_demo_data(demo_writer *w, demo *demo);
+static int write_cdtrack(demo_writer *w, int32_t track);
+static int write_blocks(demo_writer *w, block *bp);
+static int write_block(demo_writer *w, block *b);
+static int write_messages(demo_writer *w, message *m, uint32_t length);
+static int write_message(demo_writer *w, message *m, size_t *written);
+static size_t write_uint32_t(demo_writer *w, uint32_t du32);
+static size_t write_float(demo_writer *w, float df32);
+
+static int copy_messages(message *m, message **copy);
 
 static int free_blocks(block *b);
 static int free_block(block *b);
@@ -76,8 +295,11 @@ static int free_messages(message *m);
 static int free_message(message *m);
 
 static char *msg_name(deminfo *di, int type);
-static int fpeek(FILE *fp);
-static int find_protocol(message *m, uint32_t *p);
+static uint32_t get_uint32(const uint8_t *data);
+static int find_protocol(deminfo *di, message *m, const protocol_impl **p);
+static void report_progress(deminfo *di);
+static int check_progress(deminfo *di);
+static uint64_t now_ns(void);
 static int count_setbits(uint32_t mask);
 
 /*****************************************************************************
@@ -88,8 +310,6 @@ static int count_setbits(uint32_t mask);
 
 char *demo_error(int errcode)
 {
-  printf("demo_error was called with errcode %d", &errcode);
-
   switch (errcode) {
   case DEMO_OK:
     return "no error";
@@ -118,6 +338,21 @@ char *demo_error(int errcode)
   case DEMO_NO_MEMORY:
     return "memory allocation failed";
 
+  case DEMO_SCAN_STOP:
+    return "scan stopped by callback";
+
+  case DEMO_PENDING:
+    return "operation still in progress";
+
+  case DEMO_CANNOT_CONVERT:
+    return "demo does not fit the target protocol";
+
+  case DEMO_CANCELLED:
+    return "cancelled by progress callback";
+
+  case DEMO_END_OF_STREAM:
+    return "stream closed by its writer";
+
   default:
     return "unknown demo error";
   }
@@ -153,38 +388,109 @@ int demo_read(flagfield *flags, demo **dem)
   FILE *local_fp = NULL;
 
   GET_MEMORY(di, sizeof(deminfo), ret, demo_read_failure);
-  di->protocol = PROTOCOL_UNKNOWN;
+  reset_protocol(di);
 
-  // The flags, of type flagfield, 
-  if (flags == NULL) {
-    ret = DEMO_BAD_PARAMS;
+  ret = read_readflags(flags, di, &local_fp);
+  if (ret != DEMO_OK) {
+    goto demo_read_failure;
+  }
+
+  ret = open_input(di);
+  if (ret != DEMO_OK) {
     goto demo_read_failure;
   }
 
+  // Read the demo. di now contains a file pointer, a protocol (UNKNOWN, currently), 
+  // all the other variables the struct contains by default.
+  ret = read_demo_data(di, dem);
+
+ demo_read_failure:
+  if (di != NULL) {
+    close_input(di);
+  }
+  if (local_fp != NULL) {
+    fclose(local_fp);
+  }
+  if (di != NULL) {
+    free(di);
+  }
+  return ret;
+}
+
+/* Scans a quake demo file block by block, without building the full demo.
+ * Each block is handed to the callback together with a header demo (protocol
+ * and track, no blocks), and freed when the callback returns, unless the
+ * callback has taken ownership by setting *b to NULL.
+ */
+int demo_scan(flagfield *flags, scan_cb_t cb, void *ctx)
+{
+  deminfo *di;
+  int ret;
+  FILE *local_fp = NULL;
+
+  GET_MEMORY(di, sizeof(deminfo), ret, demo_scan_failure);
+  reset_protocol(di);
+
+  if (cb == NULL) {
+    ret = DEMO_BAD_PARAMS;
+    goto demo_scan_failure;
+  }
+
+  ret = read_readflags(flags, di, &local_fp);
+  if (ret != DEMO_OK) {
+    goto demo_scan_failure;
+  }
+
+  ret = open_input(di);
+  if (ret != DEMO_OK) {
+    goto demo_scan_failure;
+  }
+
+  ret = scan_demo_data(di, cb, ctx);
+
+ demo_scan_failure:
+  if (di != NULL) {
+    close_input(di);
+  }
+  if (local_fp != NULL) {
+    fclose(local_fp);
+  }
+  if (di != NULL) {
+    free(di);
+  }
+  return ret;
+}
+
+/* Parses the read flags into the deminfo struct. A file opened on behalf of
+ * the caller is returned through local_fp, and must be closed by the caller.
+ */
+static int read_readflags(flagfield *flags, deminfo *di, FILE **local_fp)
+{
+  if (flags == NULL) {
+    return DEMO_BAD_PARAMS;
+  }
+
   // Parse the readflags the user supplied to the function until we reach th end
 
   while (flags->flag != READFLAG_END) {
     switch ((size_t) flags->flag) {
     case (size_t) READFLAG_FILENAME:
       if (di->fp != NULL) {
-        ret = DEMO_BAD_PARAMS;
-        goto demo_read_failure;
+        return DEMO_BAD_PARAMS;
       }
 
-      local_fp = fopen((char *) flags->value, "rb");
+      *local_fp = fopen((char *) flags->value, "rb");
 	
       // If local_fp is still NULL after that fopen(), something is wrong
-      if (local_fp == NULL) {
-        ret = DEMO_BAD_PARAMS;
-        goto demo_read_failure;
+      if (*local_fp == NULL) {
+        return DEMO_BAD_PARAMS;
       }
-      di->fp = local_fp;
+      di->fp = *local_fp;
       break;
 
     case (size_t) READFLAG_FP:
       if (di->fp != NULL) {
-        ret = DEMO_BAD_PARAMS;
-        goto demo_read_failure;
+        return DEMO_BAD_PARAMS;
       }
       di->fp = (FILE *) flags->value;
       break;
@@ -193,1012 +499,2559 @@ int demo_read(flagfield *flags, demo **dem)
       di->pcb = (progress_cb_t) flags->value;
       break;
 
+    case (size_t) READFLAG_PROGRESS64_CB:
+      di->pcb64 = (progress64_cb_t) flags->value;
+      break;
+
+    case (size_t) READFLAG_PROGRESS_FN:
+      di->progress = (demo_progress_cb_t) flags->value;
+      break;
+
+    case (size_t) READFLAG_PROGRESS_CTX:
+      di->progress_ctx = flags->value;
+      break;
+
+    case (size_t) READFLAG_PROGRESS_MS:
+      di->progress_ns = (uint64_t) (size_t) flags->value * 1000000;
+      break;
+
+    case (size_t) READFLAG_EVENTS:
+      di->events = (demo_events *) flags->value;
+      break;
+
+    case (size_t) READFLAG_CONTEXT:
+      di->context = (demo_context *) flags->value;
+      break;
+
+    case (size_t) READFLAG_HASHES:
+      di->hashes = (demo_hashes *) flags->value;
+      break;
+
+    case (size_t) READFLAG_READAHEAD:
+      di->readahead_size = (size_t) flags->value;
+      if (di->readahead_size == 0) {
+        di->readahead_size = READAHEAD_CHUNK_SIZE;
+      }
+      break;
+
     default:
-      ret = DEMO_BAD_PARAMS;
-      goto demo_read_failure;
+      return DEMO_BAD_PARAMS;
     }
     flags++;
   }
 
   if (di->fp == NULL) {
-    ret = DEMO_CANNOT_OPEN_DEMO;
-    goto demo_read_failure;
+    return DEMO_CANNOT_OPEN_DEMO;
   }
 
-  // Read the demo. di now contains a file pointer, a protocol (UNKNOWN, currently), 
-  // all the other variables the struct contains by default.
-  ret = read_demo_data(di, dem);
-
- demo_read_failure:
-  if (local_fp != NULL) {
-    fclose(local_fp);
-  }
-  if (di != NULL) {
-    free(di);
-  }
-  return ret;
+  return DEMO_OK;
 }
 
 /*****************************************************************************
- *                WRITE API                                                  *
+ *                PARSER API                                                 *
  *****************************************************************************/
 
-int demo_write(flagfield *flags, demo *demo)
+int demo_parser_new(demo_parser **p)
 {
-  char *filename = NULL;
-  FILE *fp = NULL;
-  FILE *local_fp = NULL;
+  demo_parser *parser;
   int ret;
-  int replace = 0;
 
-  if (flags == NULL) {
-    ret = DEMO_BAD_PARAMS;
-    goto demo_write_failure;
-  }
+  GET_MEMORY(parser, sizeof(demo_parser), ret, demo_parser_new_failure);
+  GET_MEMORY(parser->di, sizeof(deminfo), ret, demo_parser_new_failure);
+  reset_protocol(parser->di);
+  parser->di->in = parser->di->inbuf;
 
-  while (flags->flag != WRITEFLAG_END) {
-    switch ((size_t) flags->flag) {
-    case (size_t) WRITEFLAG_FILENAME:
-      if (fp != NULL || filename != NULL) {
-        ret = DEMO_BAD_PARAMS;
-        goto demo_write_failure;
-      }
-      filename = (char *) flags->value;
-      break;
+  *p = parser;
+  return DEMO_OK;
 
-    case (size_t) WRITEFLAG_FP:
-      if (fp != NULL || filename != NULL) {
-        ret = DEMO_BAD_PARAMS;
-        goto demo_write_failure;
-      }
-      fp = (FILE *) flags->value;
-      break;
+ demo_parser_new_failure:
+  if (parser != NULL) {
+    free(parser);
+  }
+  return ret;
+}
 
-    case (size_t) WRITEFLAG_REPLACE:
-      replace = 1;
-      break;
+/* Appends a chunk of input, handing every block it completes to the
+ * callback. Whatever is left of an incomplete block stays buffered for the
+ * next call.
+ */
+int demo_parser_feed(demo_parser *p, const void *buf, size_t len,
+                     scan_cb_t cb, void *ctx)
+{
+  const uint8_t *src = (const uint8_t *) buf;
+  demo hdr;
+  block *b;
+  size_t need;
+  size_t count;
+  int ret;
 
-    default:
-      ret = DEMO_BAD_PARAMS;
-      goto demo_write_failure;
-    }
-    flags++;
+  if (p == NULL || cb == NULL || (buf == NULL && len > 0)) {
+    return DEMO_BAD_PARAMS;
   }
 
-  // we need either a file name or fp
-  if (fp == NULL && filename == NULL) {
-      ret = DEMO_BAD_PARAMS;
-      goto demo_write_failure;
-  }
+  memset(&hdr, 0, sizeof(hdr));
 
-  // open file locally?
-  if (filename != NULL) {
-    if (replace == 0) {
-      local_fp = fopen(filename, "r");
-      if (local_fp != NULL) {
-        fclose(local_fp);
-        ret = DEMO_FILE_EXISTS;
-        goto demo_write_failure;
+  while (len > 0) {
+    count = push_input(p->di, src, len);
+    src += count;
+    len -= count;
+
+    while ((ret = parse_buffered(p, &b, &need)) == DEMO_OK) {
+      hdr.protocol = p->di->protocol;
+      hdr.track = p->track;
+      ret = cb(ctx, &hdr, &b);
+      if (b != NULL) {
+        free_block(b);
+      }
+      if (ret != DEMO_OK) {
+        return ret;
       }
     }
-    local_fp = fopen (filename, "wb");
-    if (local_fp == NULL) {
-      ret = DEMO_CANNOT_OPEN_DEMO;
-      goto demo_write_failure;
+    if (ret != DEMO_PENDING) {
+      return ret;
     }
-    fp = local_fp;
-  }
-
-  // write the demo
-  ret = write_demo_data(fp, demo);
-
- demo_write_failure:
-  if (local_fp != NULL) {
-    fclose(local_fp);
-  }
-  return ret;
-}
-
-/*****************************************************************************
- *                FREE API                                                   *
- *****************************************************************************/
-
-int demo_free(demo *d)
-{
-  if (d != NULL) {
-    free_blocks(d->blocks);
-    free(d);
   }
 
   return DEMO_OK;
 }
 
-int demo_free_data(demo *d)
+int demo_parser_close(demo_parser *p)
 {
-  if (d) {
-    free_blocks(d->blocks);
-    d->blocks = NULL;
+  int ret = DEMO_OK;
+
+  if (p != NULL) {
+    // the input has to end between two blocks
+    if (!p->started || p->di->in_pos < p->di->in_len) {
+      ret = DEMO_UNEXPECTED_EOF;
+    }
+    free(p->di);
+    free(p);
   }
 
-  return DEMO_OK;
+  return ret;
 }
 
 /*****************************************************************************
- *                                                                           *
- *                READ FUNCTIONS                                             *
- *                                                                           *
+ *                FOLLOW API                                                 *
  *****************************************************************************/
 
-/* Reads the data within a demo, using meta information about it determined by demo_read()
- * and stored in *di. 
+/* Opens a demo that may still be recording. Nothing is read yet, so this
+ * succeeds on an empty file.
  */
-static int read_demo_data(deminfo *di, demo **dem)
+int demo_follow_open(flagfield *flags, demo_follower **f)
 {
-
-  demo *d;
-  block *b;
+  demo_follower *follower;
+  struct stat st;
   int ret;
-  int32_t cdtrack = 0;
 
-  // alloc demo
-  GET_MEMORY(d, sizeof(demo), ret, read_demo_data_failure);
+  GET_MEMORY(follower, sizeof(demo_follower), ret, demo_follow_open_failure);
+  GET_MEMORY(follower->p.di, sizeof(deminfo), ret, demo_follow_open_failure);
+  reset_protocol(follower->p.di);
 
-  // read cd track
-  ret = read_cdtrack(di, &cdtrack);
+  ret = read_readflags(flags, follower->p.di, &follower->local_fp);
   if (ret != DEMO_OK) {
-    goto read_demo_data_failure;
+    goto demo_follow_open_failure;
   }
-  d->track = cdtrack;
-  
-  // read all the blocks, into b
-  ret = read_blocks(di, &b);
+
+  // read ahead gives up at the end of the file, the follower does not
+  if (follower->p.di->readahead_size != 0) {
+    ret = DEMO_BAD_PARAMS;
+    goto demo_follow_open_failure;
+  }
+
+  ret = open_input(follower->p.di);
   if (ret != DEMO_OK) {
-    goto read_demo_data_failure;
+    goto demo_follow_open_failure;
   }
 
-  d->blocks = b;
-  d->protocol = di->protocol;
+  // reading bypasses stdio, so start the descriptor where the stream is
+  follower->fd = fileno(follower->p.di->fp);
+  if (fstat(follower->fd, &st) != 0) {
+    ret = DEMO_BAD_PARAMS;
+    goto demo_follow_open_failure;
+  }
+  follower->pollable = !S_ISREG(st.st_mode);
+  if (follower->p.di->seekable) {
+    lseek(follower->fd, (off_t) follower->p.di->offset, SEEK_SET);
+  }
 
-  // return demo
-  *dem = d;
+  *f = follower;
   return DEMO_OK;
 
- read_demo_data_failure:
-  demo_free(d);
+ demo_follow_open_failure:
+  demo_follow_close(follower);
   return ret;
 }
 
-/* Demo files are made up of blocks of data, which stored in a linked list, as the blocks
- * are sequentially describing the events of a gameplay recording. This method, given a deminfo struct
- * containing meta-information about a demo, and a place to store the block, iterates over all of the blocks
- * in a demo file, with the heavy lifting of parsing each individual block being sent off to read_block()
+/* Returns the next complete block, waiting up to timeout_ms for the file
+ * to grow. A negative timeout waits forever, 0 does not wait at all.
  */
-static int read_blocks(deminfo *di, block **b)
+int demo_follow_next(demo_follower *f, int timeout_ms, demo *header,
+                     block **b)
 {
-  block *head = NULL;
-  block *lastblock;
-  block *newblock = NULL;
+  uint64_t deadline = 0;
+  uint64_t now;
+  int wait;
   int ret;
-  int cb_c = 0;
 
-  // Iterate until EOF of the demo file pointer
-  while (!feof(di->fp)) {
-    if (fpeek(di->fp) == EOF) {
-      break;
-    }
+  if (f == NULL || b == NULL) {
+    return DEMO_BAD_PARAMS;
+  }
 
-    // read a block
-    ret = read_block(di, &newblock);
-    if (ret != DEMO_OK) {
-      goto read_blocks_failure;
-    }
+  if (timeout_ms > 0) {
+    deadline = now_ns() + (uint64_t) timeout_ms * 1000000;
+  }
 
-    // insert into linked list
-    if (head == NULL) {
-      head = newblock;
-      newblock->prev = NULL;
-    }
-    else {
-      lastblock->next = newblock;
-      newblock->prev = lastblock;
+  while ((ret = follow_block(f, b)) == DEMO_PENDING) {
+    if (timeout_ms == 0) {
+      break;
     }
-    lastblock = newblock;
-
-    // progress callback?
-    if (di->pcb != NULL) {
-      if (cb_c++ > CB_BLOCKS) {
-        cb_c = 0;
-        di->pcb(ftell(di->fp));
+    wait = FOLLOW_POLL_MS;
+    if (timeout_ms > 0) {
+      now = now_ns();
+      if (now >= deadline) {
+        break;
+      }
+      if (deadline - now < (uint64_t) wait * 1000000) {
+        wait = (int) ((deadline - now + 999999) / 1000000);
       }
     }
+    follow_wait(f, wait);
   }
 
-  *b = head;
-  return DEMO_OK;
+  if (header != NULL) {
+    header->protocol = f->p.di->protocol;
+    header->track = f->p.track;
+    header->blocks = NULL;
+  }
 
- read_blocks_failure:
-  free_blocks(head);
   return ret;
 }
 
-/* Each block is made of a size value, a 3D vector (x,y,z) describing the camera viewing direction, and the remaining bytes
- * make up one or more 'messages'. Given a single block and a deminfo struct, this function gets the block size, vector, and the
- * messages 
- */
-static int read_block(deminfo *di, block **br)
+int demo_follow_close(demo_follower *f)
 {
-  block *b;
-  message *m;
-  uint32_t length;
+  if (f != NULL) {
+    if (f->local_fp != NULL) {
+      fclose(f->local_fp);
+    }
+    free(f->p.di);
+    free(f);
+  }
+
+  return DEMO_OK;
+}
+
+/*****************************************************************************
+ *                WRITE API                                                  *
+ *****************************************************************************/
+
+int demo_write(flagfield *flags, demo *demo)
+{
+  demo_writer writer;
+  demo_write_handle **async = NULL;
   int ret;
- 
-  // This is again likely some kind of error handling
-  ret = setjmp(di->jumpbuf);
-  if (ret != 0) {
-    goto read_block_failure;
+
+  memset(&writer, 0, sizeof(writer));
+
+  ret = open_writeflags(flags, &writer.fp, &writer.local_fp, &async);
+  if (ret != DEMO_OK) {
+    goto demo_write_failure;
   }
 
-  // The size value makes up the first 32bits of the block.
-  length = read_uint32_t(di);
-  if (length > MAX_BLOCK_LENGTH) {
-    return bp(DEMO_CORRUPT_DEMO);
+  if (async != NULL) {
+    ret = start_async(&writer);
+    if (ret != DEMO_OK) {
+      goto demo_write_failure;
+    }
+
+    // from here on errors are reported through the handle
+    *async = writer.async;
+    finish_async(&writer, write_demo_data(&writer, demo));
+    return DEMO_OK;
   }
 
-  // alloc the needed memory
-  GET_MEMORY(b, sizeof(block), ret, read_block_failure);
-  b->length = length;
+  // write the demo
+  ret = write_demo_data(&writer, demo);
 
-  // Next in the binary block are three 32bit floating point numbers that make up the 
-  // 3D vector representing the camera view direction
-  // printf("(%2.f,%2.f,%2.f)\n", b->angles[0], b->angles[1], b->angles[2]);
+ demo_write_failure:
+  if (writer.local_fp != NULL) {
+    fclose(writer.local_fp);
+  }
+  return ret;
+}
 
-  b->angles[0] = read_float(di);
-  b->angles[1] = read_float(di);
-  b->angles[2] = read_float(di);
+/* Waits for an async write to finish and frees the handle.
+ */
+int demo_write_wait(demo_write_handle *h)
+{
+  int ret;
 
+  if (h == NULL) {
+    return DEMO_BAD_PARAMS;
+  }
 
-  // Any remaining data in the block are one or more messages.
-  ret = read_messages(di, &m, length);
-  if (ret != DEMO_OK) {
-    goto read_block_failure;
+  pthread_join(h->thread, NULL);
+  ret = h->ret;
+
+  pthread_cond_destroy(&h->cond);
+  pthread_mutex_destroy(&h->lock);
+  free(h);
+
+  return ret;
+}
+
+int demo_write_poll(demo_write_handle *h)
+{
+  int ret;
+
+  if (h == NULL) {
+    return DEMO_BAD_PARAMS;
   }
-  b->messages = m;
 
-  // return demo
-  *br = b;
-  return DEMO_OK;
+  pthread_mutex_lock(&h->lock);
+  ret = h->finished ? h->ret : DEMO_PENDING;
+  pthread_mutex_unlock(&h->lock);
 
- read_block_failure:
-  bp(0);
-  free_block(b);
   return ret;
 }
 
-/* At the end of a block are one or more messages. Their size is variable depending on the type and contents
- * of the message.
+/* Opens a streaming writer and writes the cd track. Blocks are then written
+ * one at a time with demo_writer_block(), so the demo never has to be held in
+ * memory as a whole.
  */
-static int read_messages(deminfo *di, message **m, uint32_t length)
+int demo_writer_open(flagfield *flags, int32_t track, demo_writer **w)
 {
-  uint32_t protocol;
-  uint32_t messagelen = 0;
-  message *head = NULL;
-  message *lastmessage;
-  message *newmessage;
+  demo_writer *writer;
   int ret;
 
-  do {
-    ret = read_message(di, &newmessage);
-    if (ret != DEMO_OK) {
-      goto read_messages_failure;
+  GET_MEMORY(writer, sizeof(demo_writer), ret, demo_writer_open_failure);
+
+  // the streaming writer takes no WRITEFLAG_ASYNC
+  ret = open_writeflags(flags, &writer->fp, &writer->local_fp, NULL);
+  if (ret != DEMO_OK) {
+    goto demo_writer_open_failure;
+  }
+
+  ret = write_cdtrack(writer, track);
+  if (ret != DEMO_OK) {
+    goto demo_writer_open_failure;
+  }
+
+  *w = writer;
+  return DEMO_OK;
+
+ demo_writer_open_failure:
+  if (writer != NULL) {
+    if (writer->local_fp != NULL) {
+      fclose(writer->local_fp);
     }
-    messagelen += newmessage->size + 1; // +1 because of type byte
+    free(writer);
+  }
+  return ret;
+}
 
-    if (head == NULL) {
-      head = newmessage;
-      newmessage->prev = NULL;
+int demo_writer_block(demo_writer *w, block *b)
+{
+  if (w == NULL || b == NULL) {
+    return DEMO_BAD_PARAMS;
+  }
+
+  // same as write_blocks(), empty blocks are not written
+  if (b->length == 0) {
+    return DEMO_OK;
+  }
+
+  return write_block(w, b);
+}
+
+int demo_writer_raw(demo_writer *w, const void *data, size_t len)
+{
+  if (w == NULL || (data == NULL && len > 0)) {
+    return DEMO_BAD_PARAMS;
+  }
+
+  if (len == 0) {
+    return DEMO_OK;
+  }
+
+  return (out_write(data, len, 1, w) == 1) ? DEMO_OK : w->ret;
+}
+
+int demo_writer_close(demo_writer *w)
+{
+  int ret = DEMO_OK;
+
+  if (w != NULL) {
+    if (w->local_fp != NULL) {
+      if (fclose(w->local_fp) != 0) {
+        ret = DEMO_CANNOT_WRITE;
+      }
     }
-    else {
-      lastmessage->next = newmessage;
-      newmessage->prev = lastmessage;
+    else if (fflush(w->fp) != 0) {
+      ret = DEMO_CANNOT_WRITE;
     }
-    lastmessage = newmessage;
+    free(w);
+  }
 
-    // find demo protocol
-    if (di->protocol == PROTOCOL_UNKNOWN) {
-      ret = find_protocol(newmessage, &protocol);
-      switch (ret) {
-      case DEMO_OK:
-        di->protocol = protocol;
-        break;
+  return ret;
+}
 
-      case DEMO_UNKNOWN_PROTOCOL:
-        goto read_messages_failure;
-        break;
+/* Parses the write flags, opening the file if a file name was given. The
+ * file to write to is returned through fp, and if it was opened here, also
+ * through local_fp, in which case it must be closed by the caller. Where an
+ * async handle is wanted is returned through async, callers passing NULL
+ * do not support WRITEFLAG_ASYNC.
+ */
+static int open_writeflags(flagfield *flags, FILE **fp, FILE **local_fp,
+                           demo_write_handle ***async)
+{
+  char *filename = NULL;
+  FILE *f;
+  int replace = 0;
 
-      default:
-        break;
+  *fp = NULL;
+  *local_fp = NULL;
+
+  if (flags == NULL) {
+    return DEMO_BAD_PARAMS;
+  }
+
+  while (flags->flag != WRITEFLAG_END) {
+    switch ((size_t) flags->flag) {
+    case (size_t) WRITEFLAG_FILENAME:
+      if (*fp != NULL || filename != NULL) {
+        return DEMO_BAD_PARAMS;
+      }
+      filename = (char *) flags->value;
+      break;
+
+    case (size_t) WRITEFLAG_FP:
+      if (*fp != NULL || filename != NULL) {
+        return DEMO_BAD_PARAMS;
+      }
+      *fp = (FILE *) flags->value;
+      break;
+
+    case (size_t) WRITEFLAG_REPLACE:
+      replace = 1;
+      break;
+
+    case (size_t) WRITEFLAG_ASYNC:
+      if (async == NULL || flags->value == NULL) {
+        return DEMO_BAD_PARAMS;
       }
+      *async = (demo_write_handle **) flags->value;
+      break;
+
+    default:
+      return DEMO_BAD_PARAMS;
     }
-  } while (messagelen < length);
+    flags++;
+  }
 
-  // error check, we expect an exact amount of data
-  if (messagelen != length) {
-    ret = bp(DEMO_CORRUPT_DEMO);
-    goto read_messages_failure;
+  // we need either a file name or fp
+  if (*fp == NULL && filename == NULL) {
+    return DEMO_BAD_PARAMS;
+  }
+
+  // open file locally?
+  if (filename != NULL) {
+    if (replace == 0) {
+      f = fopen(filename, "r");
+      if (f != NULL) {
+        fclose(f);
+        return DEMO_FILE_EXISTS;
+      }
+    }
+    f = fopen(filename, "wb");
+    if (f == NULL) {
+      return DEMO_CANNOT_OPEN_DEMO;
+    }
+    *fp = f;
+    *local_fp = f;
   }
 
-  // return messages
-  *m = head;
   return DEMO_OK;
+}
 
- read_messages_failure:
-  bp(0);
-  free_messages(head);
+/*****************************************************************************
+ *                CLONE API                                                  *
+ *****************************************************************************/
+
+int demo_clone(demo *src, demo **dst)
+{
+  demo *d = NULL;
+  block *b;
+  block *nb;
+  block *tail = NULL;
+  int ret;
+
+  if (src == NULL || dst == NULL) {
+    return DEMO_BAD_PARAMS;
+  }
+
+  GET_MEMORY(d, sizeof(demo), ret, demo_clone_failure);
+  d->protocol = src->protocol;
+  d->track = src->track;
+
+  for (b = src->blocks; b != NULL; b = b->next) {
+    if (b->share == NULL) {
+      GET_MEMORY(b->share, sizeof(demo_block_share), ret, demo_clone_failure);
+      atomic_init(&b->share->refs, 1);
+    }
+
+    GET_MEMORY(nb, sizeof(block), ret, demo_clone_failure);
+    nb->length = b->length;
+    memcpy(nb->angles, b->angles, sizeof(nb->angles));
+    nb->messages = b->messages;
+    nb->share = b->share;
+    atomic_fetch_add_explicit(&b->share->refs, 1, memory_order_relaxed);
+
+    if (tail == NULL) {
+      d->blocks = nb;
+    }
+    else {
+      tail->next = nb;
+      nb->prev = tail;
+    }
+    tail = nb;
+  }
+
+  *dst = d;
+  return DEMO_OK;
+
+ demo_clone_failure:
+  demo_free(d);
   return ret;
 }
 
-/** Read an invidual message.
- *
- */ 
-static int read_message(deminfo *di, message **mr)
+int demo_block_unshare(block *b)
 {
-  int process = 0;
-  message *m;
-  uint32_t mask;
-  int i;
+  message *copy;
   int ret;
 
-  // Weird error handling
-  ret = setjmp(di->jumpbuf);
-  if (ret != 0) {
-    goto read_message_failure;
+  if (b == NULL) {
+    return DEMO_BAD_PARAMS;
   }
 
-  GET_MEMORY(m, sizeof(message), ret, read_message_failure);
+  if (b->share == NULL) {
+    return DEMO_OK;
+  }
 
-  // The first 8 bits of the message describes its type, of which there are many.
-  // Knowing the type will help determine the size of the following message contents
-  // we are to read.
-  m->type = read_uint8_t(di);
+  // the last holder keeps the messages
+  if (atomic_load_explicit(&b->share->refs, memory_order_acquire) == 1) {
+    free(b->share);
+    b->share = NULL;
+    return DEMO_OK;
+  }
 
-  // These are all defined as hex values in the header file. This switch statement 
-  // lays out for us what the expected message size yieled by each type will be.
-  switch (m->type) {
-  case BAD:
-  case NOP:
-  case DISCONNECT:
-  case SPAWNBINARY:
-  case KILLEDMONSTER:
-  case FOUNDSECRET:
-  case INTERMISSION:
-  case SELLSCREEN:
-    m->size = 0;
-    break;
-  case SETPAUSE:
-  case SIGNONUM:
-    m->size = 1;
-    break;
-  case SETVIEW:
-  case STOPSOUND:
-  case UPDATECOLORS:
-  case CDTRACK:
-    m->size = 2;
-    break;
-  case SETANGLE:
-  case UPDATEFRAGS:
-    m->size = 3;
-    break;
-  case VERSION:
-  case TIME:
-    m->size = 4;
-    break;
-  case UPDATESTAT:
-    m->size = 5;
-    break;
-  case DAMAGE:
-    m->size = 8;
-    break;
-  case SPAWNSTATICSOUND:
-    m->size = 9;
-    break;
-  case PARTICLE:
-    m->size = 11;
-    break;
-  case SPAWNSTATIC:
-    m->size = 13;
-    break;
-  case SPAWNBASELINE:
-    m->size = 15;
-    break;
+  ret = copy_messages(b->messages, &copy);
+  if (ret != DEMO_OK) {
+    return ret;
+  }
 
-  default: // variable size messages or non standard protocol
-    process = 1;
+  // the others may have let go meanwhile
+  if (atomic_fetch_sub_explicit(&b->share->refs, 1,
+                                memory_order_acq_rel) == 1) {
+    free_messages(b->messages);
+    free(b->share);
   }
 
-  // This appears to be something specific to Fitzquake engines using something called the
-  // FitzQuake protocol. It seems to implement extra message types on top of the pre-existing ones.
-  // Cool!
+  b->messages = copy;
+  b->share = NULL;
+  return DEMO_OK;
+}
 
-  if (di->protocol == PROTOCOL_FITZQUAKE && process == 1) {
-    switch (m->type) {
-    case FQBF:
-      process = 0;
-      m->size = 0;
-      break;
+int demo_message_unshare(message *m)
+{
+  uint8_t *data;
 
-    case FQFOG:
-      process = 0;
-      m->size = 6;
-      break;
+  if (m == NULL) {
+    return DEMO_BAD_PARAMS;
+  }
 
-    case FQSPAWNSTATICSOUND2:
-      process = 0;
-      m->size = 10;
-      break;
+  if (m->payload == NULL) {
+    return DEMO_OK;
+  }
 
-    case FQSKYBOX:
-    case FQSPAWNBASELINE2:
-    case FQSPAWNSTATIC2:
-      break;
-    }
+  data = malloc(m->size);
+  if (data == NULL) {
+    return DEMO_NO_MEMORY;
   }
-	
-  // I think this is the Nehahra BJP3 protocol? That's what google says anyway. Similar deal to Fitzquake.
-  // Actually the quake wiki indicates that there are tons of additional protocols that are supersets of the
-  // original.  
-  if (di->protocol == PROTOCOL_BJP3) {
-    switch (m->type) {
-    case SPAWNBASELINE:
-    case SPAWNSTATIC:
-      m->size += 1;
-      break;
+  memcpy(data, m->data, m->size);
 
-    case SPAWNSTATICSOUND:
-      // size change nulled by Compatibility flag
-      break;
+  demo_payload_release(m->payload);
+  m->payload = NULL;
+  m->data = data;
+  return DEMO_OK;
+}
+
+/*****************************************************************************
+ *                ALLOCATION API                                             *
+ *****************************************************************************/
+
+int demo_message_new(uint32_t type, uint32_t size, message **m)
+{
+  message *msg;
+  int ret;
+
+  if (m == NULL) {
+    return DEMO_BAD_PARAMS;
+  }
+
+  GET_MEMORY(msg, sizeof(message), ret, demo_message_new_failure);
+  if (size > 0) {
+    GET_MEMORY(msg->data, size, ret, demo_message_new_failure);
+  }
+  msg->type = type;
+  msg->size = size;
+
+  *m = msg;
+  return DEMO_OK;
+
+ demo_message_new_failure:
+  free(msg);
+  return ret;
+}
+
+int demo_block_new(block **b)
+{
+  block *blk;
+  int ret;
+
+  if (b == NULL) {
+    return DEMO_BAD_PARAMS;
+  }
+
+  GET_MEMORY(blk, sizeof(block), ret, demo_block_new_failure);
+
+  *b = blk;
+  return DEMO_OK;
+
+ demo_block_new_failure:
+  return ret;
+}
+
+/*****************************************************************************
+ *                FREE API                                                   *
+ *****************************************************************************/
+
+int demo_free(demo *d)
+{
+  if (d != NULL) {
+    free_blocks(d->blocks);
+    free(d);
+  }
+
+  return DEMO_OK;
+}
+
+int demo_free_data(demo *d)
+{
+  if (d) {
+    free_blocks(d->blocks);
+    d->blocks = NULL;
+  }
+
+  return DEMO_OK;
+}
+
+int demo_free_block(block *b)
+{
+  return free_block(b);
+}
+
+int demo_free_message(message *m)
+{
+  return free_message(m);
+}
+
+int demo_free_message_data(message *m)
+{
+  if (m) {
+    if (m->payload) {
+      demo_payload_release(m->payload);
+    }
+    else if (m->data) {
+      free(m->data);
+    }
+    m->payload = NULL;
+    m->data = NULL;
+    m->size = 0;
+  }
+
+  return DEMO_OK;
+}
+
+/*****************************************************************************
+ *                PROTOCOL API                                               *
+ *****************************************************************************/
+
+int demo_register_protocol(const demo_protocol_def *def)
+{
+  return register_protocol(def);
+}
+
+size_t demo_serverinfo_header(const message *m)
+{
+  size_t size;
+
+  if (m == NULL || m->type != SERVERINFO || m->data == NULL || m->size < 4) {
+    return 0;
+  }
+
+  size = serverinfo_header(m->data);
+  return size <= m->size ? size : 0;
+}
+
+/*****************************************************************************
+ *                                                                           *
+ *                READ FUNCTIONS                                             *
+ *                                                                           *
+ *****************************************************************************/
+
+/* Reads the data within a demo, using meta information about it determined by demo_read()
+ * and stored in *di. 
+ */
+static int read_demo_data(deminfo *di, demo **dem)
+{
+
+  demo *d;
+  block *tail = NULL;
+  int ret;
+  int32_t cdtrack = 0;
+
+  // alloc demo
+  GET_MEMORY(d, sizeof(demo), ret, read_demo_data_failure);
+
+  // read cd track
+  ret = read_cdtrack(di, &cdtrack);
+  if (ret != DEMO_OK) {
+    goto read_demo_data_failure;
+  }
+  d->track = cdtrack;
+  
+  // read all the blocks, appending them to d
+  ret = read_blocks(di, d, append_block, &tail);
+  if (ret != DEMO_OK) {
+    goto read_demo_data_failure;
+  }
+
+  d->protocol = di->protocol;
+
+  // return demo
+  *dem = d;
+  return DEMO_OK;
+
+ read_demo_data_failure:
+  demo_free(d);
+  return ret;
+}
+
+/* Same as read_demo_data(), but hands the blocks to a scan callback one at a
+ * time instead of collecting them, so only one block is held in memory.
+ */
+static int scan_demo_data(deminfo *di, scan_cb_t cb, void *ctx)
+{
+  demo hdr;
+  int ret;
+  int32_t cdtrack = 0;
+
+  memset(&hdr, 0, sizeof(hdr));
+
+  ret = read_cdtrack(di, &cdtrack);
+  if (ret != DEMO_OK) {
+    return ret;
+  }
+  hdr.track = cdtrack;
+
+  ret = read_blocks(di, &hdr, cb, ctx);
+  if (ret == DEMO_SCAN_STOP) {
+    ret = DEMO_OK;
+  }
+
+  return ret;
+}
+
+/* Demo files are made up of blocks of data, which stored in a linked list, as the blocks
+ * are sequentially describing the events of a gameplay recording. This method, given a deminfo struct
+ * containing meta-information about a demo, iterates over all of the blocks in a demo file, with the
+ * heavy lifting of parsing each individual block being sent off to read_block(). Each block is
+ * passed on to the callback, which either takes ownership of it or leaves it to be freed here.
+ */
+static int read_blocks(deminfo *di, demo *hdr, scan_cb_t cb, void *ctx)
+{
+  block *newblock = NULL;
+  int ret;
+  int cb_c = 0;
+
+  // Iterate until EOF of the demo file pointer
+  while (!input_eof(di)) {
+
+    // read a block
+    ret = read_block(di, &newblock);
+    if (ret != DEMO_OK) {
+      return ret;
+    }
+
+    // index it while the caller may still give it away
+    ret = index_block(di, hdr->track, newblock);
+    if (ret != DEMO_OK) {
+      free_block(newblock);
+      return ret;
+    }
+
+    // hand it over
+    hdr->protocol = di->protocol;
+    ret = cb(ctx, hdr, &newblock);
+    if (newblock != NULL) {
+      free_block(newblock);
+    }
+    if (ret != DEMO_OK) {
+      return ret;
+    }
+
+    // progress callback?
+    if (di->pcb != NULL || di->pcb64 != NULL) {
+      if (cb_c++ > CB_BLOCKS) {
+        cb_c = 0;
+        report_progress(di);
+      }
+    }
+    ret = check_progress(di);
+    if (ret != DEMO_OK) {
+      return ret;
+    }
+  }
+
+  return DEMO_OK;
+}
+
+/* Scan callback used by read_demo_data(), inserting each block at the end of
+ * the demo's linked list. ctx points to the current last block.
+ */
+static int append_block(void *ctx, demo *hdr, block **b)
+{
+  block **tail = (block **) ctx;
+  block *newblock = *b;
+
+  if (*tail == NULL) {
+    hdr->blocks = newblock;
+    newblock->prev = NULL;
+  }
+  else {
+    (*tail)->next = newblock;
+    newblock->prev = *tail;
+  }
+  *tail = newblock;
+
+  *b = NULL;
+  return DEMO_OK;
+}
+
+/* Adds a block just read to the indexes asked for with read flags
+ */
+static int index_block(deminfo *di, int32_t track, block *b)
+{
+  int ret;
+
+  if (di->events != NULL) {
+    ret = demo_events_add(di->events, b);
+    if (ret != DEMO_OK) {
+      return ret;
+    }
+  }
+
+  if (di->hashes != NULL) {
+    ret = demo_hashes_add(di->hashes, track, b);
+    if (ret != DEMO_OK) {
+      return ret;
+    }
+  }
+
+  if (di->context != NULL) {
+    ret = demo_context_share_block(di->context, b);
+    if (ret != DEMO_OK) {
+      return ret;
+    }
+  }
+
+  return DEMO_OK;
+}
+
+/* Each block is made of a size value, a 3D vector (x,y,z) describing the camera viewing direction, and the remaining bytes
+ * make up one or more 'messages'. Given a single block and a deminfo struct, this function gets the block size, vector, and the
+ * messages 
+ */
+static int read_block(deminfo *di, block **br)
+{
+  block *b;
+  message *m;
+  uint32_t length;
+  int ret;
+ 
+  // This is again likely some kind of error handling
+  ret = setjmp(di->jumpbuf);
+  if (ret != 0) {
+    goto read_block_failure;
+  }
+
+  // The size value makes up the first 32bits of the block.
+  length = read_uint32_t(di);
+  if (length > MAX_BLOCK_LENGTH) {
+    return bp(DEMO_CORRUPT_DEMO);
+  }
+
+  // alloc the needed memory
+  GET_MEMORY(b, sizeof(block), ret, read_block_failure);
+  b->length = length;
+
+  // Next in the binary block are three 32bit floating point numbers that make up the 
+  // 3D vector representing the camera view direction
+  // printf("(%2.f,%2.f,%2.f)\n", b->angles[0], b->angles[1], b->angles[2]);
+
+  b->angles[0] = read_float(di);
+  b->angles[1] = read_float(di);
+  b->angles[2] = read_float(di);
+
+
+  // Any remaining data in the block are one or more messages.
+  ret = read_messages(di, &m, length);
+  if (ret != DEMO_OK) {
+    goto read_block_failure;
+  }
+  b->messages = m;
+
+  // return demo
+  *br = b;
+  return DEMO_OK;
+
+ read_block_failure:
+  bp(0);
+  free_block(b);
+  return ret;
+}
+
+/* At the end of a block are one or more messages. Their size is variable depending on the type and contents
+ * of the message.
+ */
+static int read_messages(deminfo *di, message **m, uint32_t length)
+{
+  const protocol_impl *protocol;
+  uint32_t messagelen = 0;
+  message *head = NULL;
+  message *lastmessage;
+  message *newmessage;
+  int ret;
+
+  do {
+    ret = read_message(di, &newmessage);
+    if (ret != DEMO_OK) {
+      goto read_messages_failure;
+    }
+    messagelen += newmessage->size + 1; // +1 because of type byte
+
+    if (head == NULL) {
+      head = newmessage;
+      newmessage->prev = NULL;
+    }
+    else {
+      lastmessage->next = newmessage;
+      newmessage->prev = lastmessage;
+    }
+    lastmessage = newmessage;
+
+    // find demo protocol, the flags of a registered one may change with
+    // every level
+    if (di->protocol == PROTOCOL_UNKNOWN ||
+        (di->reselect && newmessage->type == SERVERINFO))
+    {
+      ret = find_protocol(di, newmessage, &protocol);
+      switch (ret) {
+      case DEMO_OK:
+        di->protocol = protocol->number;
+        di->proto = protocol;
+        break;
+
+      case DEMO_PROTOCOL_NOT_PRESENT:
+        break;
+
+      default:
+        goto read_messages_failure;
+        break;
+      }
+    }
+  } while (messagelen < length);
+
+  // error check, we expect an exact amount of data
+  if (messagelen != length) {
+    ret = bp(DEMO_CORRUPT_DEMO);
+    goto read_messages_failure;
+  }
+
+  // return messages
+  *m = head;
+  return DEMO_OK;
+
+ read_messages_failure:
+  bp(0);
+  free_messages(head);
+  return ret;
+}
+
+/** Read an invidual message.
+ *
+ * The size of the message, or how to read it, comes from the tables of the
+ * demo's protocol, see PROTOCOL FUNCTIONS.
+ */ 
+static int read_message(deminfo *di, message **mr)
+{
+  const protocol_impl *p = di->proto;
+  message *m;
+  int ret;
+
+  // Weird error handling
+  ret = setjmp(di->jumpbuf);
+  if (ret != 0) {
+    goto read_message_failure;
+  }
+
+  GET_MEMORY(m, sizeof(message), ret, read_message_failure);
+
+  // The first 8 bits of the message describes its type, of which there are many.
+  // Knowing the type will help determine the size of the following message contents
+  // we are to read.
+  m->type = read_uint8_t(di);
+
+  if (p->size[m->type] >= 0) {
+    // deal with messages with known length
+    m->size = p->size[m->type];
+    GET_MEMORY(m->data, m->size, ret, read_message_failure);
+
+    // Read n (m->size) integers, 8bits in size, from deminfo into the m->data buffer.
+    read_n_uint8_t(di, m->size, m->data);
+  }
+  else if (p->read[m->type] != NULL) {
+    // deal with messages with unknown length
+    ret = p->read[m->type](di, m);
+    if (ret != DEMO_OK) {
+      goto read_message_failure;
+    }
+  }
+  else {
+    // not a message of this protocol
+    ret = bp(DEMO_CORRUPT_DEMO);
+    goto read_message_failure;
+  }
+
+  *mr = m;
+  return DEMO_OK;
+
+ read_message_failure:
+  bp(0);
+  free_message(m);
+  return ret;
+}
+
+/* Read the next 8bit integer from the deminfo file stream.
+ *
+ */
+static uint8_t read_uint8_t(deminfo *di)
+{
+  if (di->in_pos == di->in_len) {
+    if (fill_input(di) == 0) {
+      longjmp(di->jumpbuf, DEMO_UNEXPECTED_EOF);
+    }
+  }
+
+  return di->in[di->in_pos++];
+}
+
+/* Read an arbitrary (n) amount of unsigned 8bit integers from deminfo into the buffer, buf. 
+ * This is basically a wrapper for fread() which operates in a very similar mindset. 
+ */
+static void read_n_uint8_t(deminfo *di, int n, uint8_t *buf)
+{
+  size_t count;
+
+  // Copy out of the input buffer, refilling it as often as needed.
+  while (n > 0) {
+    if (di->in_pos == di->in_len) {
+      if (fill_input(di) == 0) {
+        longjmp(di->jumpbuf, DEMO_UNEXPECTED_EOF);
+      }
+    }
+
+    count = di->in_len - di->in_pos;
+    if (count > (size_t) n) {
+      count = n;
+    }
+    memcpy(buf, di->in + di->in_pos, count);
+    di->in_pos += count;
+    buf += count;
+    n -= count;
+  }
+}
+
+static uint16_t read_uint16_t(deminfo *di)
+{
+  uint16_t i;
+
+  read_n_uint8_t(di, 2, (uint8_t *)&i);
+  return i;
+}
+
+static uint32_t read_uint32_t(deminfo *di)
+{
+  uint32_t i;
+
+  read_n_uint8_t(di, 4, (uint8_t *)&i);
+  return i;
+}
+
+static float read_float(deminfo *di)
+{
+  uint32_t i = read_uint32_t(di);
+  return *(float *)&i;
+}
+
+static int read_string(deminfo *di, char *target)
+{
+  char *string_pointer;
+  int i;
+
+  string_pointer = target;
+  for (i = 0; i < 0x7FF; i++, string_pointer++) {
+    if (!(*string_pointer = read_uint8_t(di))) {
+      break;
+    }
+  }
+  *string_pointer = '\0';
+  return i + 1;
+}
+
+/* Parses the demo file to determine what CD track
+ * (from the Quake soundtrack) is set to be played
+ */
+static int read_cdtrack(deminfo *di, int32_t *track)
+{
+
+  int32_t cdtrack = 0;
+  int number = 0;
+  int sign = 0;
+  int readcount = 0;
+  int ret;
+  
+  // Remove strang jump error handling in Rust rewrite.
+  ret = setjmp(di->jumpbuf);
+  if (ret != 0) {
+    return ret;
+  }
+
+  // Sequentially read unsigned 8bit ints from deminfo struct until newline
+  while ((number = read_uint8_t(di)) != '\n') {
+    // This has something to do with comparing signed to unsigned integers, I think..
+    if (number == '-') {
+      sign = 1;
+    }
+    else if (number == ' ' || number == '\t' || number == '\r') {
+      // padding and dos line ends are formatting, not part of the number
+    }
+    else {
+      number -= '0'; // Surely the point of this is related to the above ^ 
+      if (number > 9) {
+        return bp(DEMO_CORRUPT_DEMO);
+      }
+      cdtrack = cdtrack * 10 + number;
+    }
+    if (++readcount > 6) {
+      // don't expect more than 6 chars to select a cd track
+      // ^ tbh expect the unexpected
+      return bp(DEMO_CORRUPT_DEMO);
+    }
+  }
+  if (sign) {
+    cdtrack = -cdtrack;
+  }
+
+  // Throughout my findings, the CD track will be -1 if there was no music on during the demo recording. 
+  // Likely because the actual CD tracklisting starts at 0.
+  *track = cdtrack;
+  return DEMO_OK;
+}
+
+/*****************************************************************************
+ *                                                                           *
+ *                PROTOCOL FUNCTIONS                                         *
+ *                                                                           *
+ *****************************************************************************/
+
+/* The protocol registry. Each entry fills the tables read_message() uses
+ * for its protocol, they are built once and a demo picks its entry when
+ * find_protocol() sees the number, so reading never asks which protocol it
+ * is. The first entry reads demos until then.
+ *
+ * Protocols extending these are added with demo_register_protocol(), e.g.
+ * RMQ (999), which sends flags after the number in SERVERINFO that select
+ * its coord and angle sizes. Their tables are copies of those of their base
+ * with the sizes of the layout chosen for the flags, see build_protocol(),
+ * and the readers of coords and angles take their sizes from the tables.
+ * A protocol with message types of its own needs read functions here, and
+ * the modules decoding message contents, dequant.c and convert.c, still
+ * only know the three below.
+ */
+static const struct {
+  uint32_t number;
+  void (*init)(protocol_impl *p);
+} registry[] = {
+  { PROTOCOL_NETQUAKE, netquake_init },
+  { PROTOCOL_FITZQUAKE, fitzquake_init },
+  { PROTOCOL_BJP3, bjp3_init },
+};
+
+static protocol_impl protocols[PROTOCOL_COUNT];
+static pthread_once_t protocols_once = PTHREAD_ONCE_INIT;
+
+static registered_protocol registered[DEMO_MAX_PROTOCOLS];
+static atomic_size_t registered_count;
+static pthread_mutex_t registered_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Fixed size messages holding coords and angles, with how many of each,
+ * whose sizes follow those of a registered protocol
+ */
+static const struct {
+  uint8_t type;
+  uint8_t coords;
+  uint8_t angles;
+} scaled_sizes[] = {
+  { SETANGLE, 0, 3 },
+  { DAMAGE, 3, 0 },
+  { SPAWNSTATICSOUND, 3, 0 },
+  { PARTICLE, 3, 0 },
+  { SPAWNSTATIC, 3, 3 },
+  { SPAWNBASELINE, 3, 3 },
+  { FQSPAWNSTATICSOUND2, 3, 0 },
+};
+
+static void init_protocols(void)
+{
+  size_t i;
+
+  for (i = 0; i < PROTOCOL_COUNT; i++) {
+    protocols[i].number = registry[i].number;
+    registry[i].init(&protocols[i]);
+  }
+}
+
+/* Puts a new reader into the state before the protocol is known
+ */
+static void reset_protocol(deminfo *di)
+{
+  pthread_once(&protocols_once, init_protocols);
+  di->protocol = PROTOCOL_UNKNOWN;
+  di->proto = &protocols[0];
+  di->reselect = 0;
+}
+
+static const protocol_impl *find_builtin(uint32_t number)
+{
+  size_t i;
+
+  for (i = 0; i < PROTOCOL_COUNT; i++) {
+    if (protocols[i].number == number) {
+      return &protocols[i];
+    }
+  }
+
+  return NULL;
+}
+
+static registered_protocol *find_registered(uint32_t number)
+{
+  size_t count;
+  size_t i;
+
+  count = atomic_load_explicit(&registered_count, memory_order_acquire);
+  for (i = 0; i < count; i++) {
+    if (registered[i].def.number == number) {
+      return &registered[i];
+    }
+  }
+
+  return NULL;
+}
+
+/* Registered protocols are only ever appended. An entry is complete before
+ * the count covering it is published, so readers look them up without the
+ * lock, which guards registering and the tables built for them.
+ */
+static int register_protocol(const demo_protocol_def *def)
+{
+  size_t count;
+  int ret;
+
+  pthread_once(&protocols_once, init_protocols);
+  if (def == NULL || def->number == PROTOCOL_UNKNOWN ||
+      find_builtin(def->number) != NULL || find_builtin(def->base) == NULL)
+  {
+    return DEMO_BAD_PARAMS;
+  }
+
+  pthread_mutex_lock(&registered_lock);
+  count = atomic_load_explicit(&registered_count, memory_order_relaxed);
+  if (find_registered(def->number) != NULL) {
+    ret = DEMO_BAD_PARAMS;
+  }
+  else if (count == DEMO_MAX_PROTOCOLS) {
+    ret = DEMO_NO_MEMORY;
+  }
+  else {
+    registered[count].def = *def;
+    registered[count].built = NULL;
+    atomic_store_explicit(&registered_count, count + 1, memory_order_release);
+    ret = DEMO_OK;
+  }
+  pthread_mutex_unlock(&registered_lock);
+
+  return ret;
+}
+
+/* Finds or builds the tables of a registered protocol for a set of flags.
+ * The layout starts as that of the base and is handed to select(), then
+ * the sizes of the fixed size messages holding coords and angles are
+ * scaled to it and its own sizes applied.
+ */
+static int build_protocol(registered_protocol *r, uint32_t flags,
+                          const protocol_impl **p)
+{
+  demo_protocol_layout layout;
+  built_protocol *b;
+  int32_t *size;
+  size_t i;
+  int ret;
+
+  pthread_mutex_lock(&registered_lock);
+  for (b = r->built; b != NULL; b = b->next) {
+    if (b->flags == flags) {
+      *p = &b->impl;
+      pthread_mutex_unlock(&registered_lock);
+      return DEMO_OK;
+    }
+  }
+
+  layout.coord_size = 2;
+  layout.angle_size = 1;
+  for (i = 0; i < 256; i++) {
+    layout.size[i] = DEMO_SIZE_BASE;
+  }
+  if (r->def.select != NULL) {
+    ret = r->def.select(r->def.ctx, flags, &layout);
+    if (ret != DEMO_OK) {
+      goto build_protocol_failure;
+    }
+  }
+
+  // SERVERINFO carries the protocol, it is always read
+  ret = DEMO_BAD_PARAMS;
+  if (layout.coord_size < 2 || layout.coord_size > 4 ||
+      layout.angle_size < 1 || layout.angle_size > 4 ||
+      layout.size[SERVERINFO] != DEMO_SIZE_BASE)
+  {
+    goto build_protocol_failure;
+  }
+  for (i = 0; i < 256; i++) {
+    if (layout.size[i] < DEMO_SIZE_BASE ||
+        layout.size[i] >= MAX_BLOCK_LENGTH)
+    {
+      goto build_protocol_failure;
+    }
+  }
+
+  GET_MEMORY(b, sizeof(built_protocol), ret, build_protocol_failure);
+  b->impl = *find_builtin(r->def.base);
+  b->impl.number = r->def.number;
+  b->impl.coord_size = layout.coord_size;
+  b->impl.angle_size = layout.angle_size;
+
+  size = b->impl.size;
+  for (i = 0; i < sizeof(scaled_sizes) / sizeof(scaled_sizes[0]); i++) {
+    if (size[scaled_sizes[i].type] >= 0) {
+      size[scaled_sizes[i].type] +=
+        scaled_sizes[i].coords * (layout.coord_size - 2) +
+        scaled_sizes[i].angles * (layout.angle_size - 1);
+    }
+  }
+  for (i = 0; i < 256; i++) {
+    if (layout.size[i] != DEMO_SIZE_BASE) {
+      size[i] = layout.size[i];
+    }
+  }
+
+  b->flags = flags;
+  b->next = r->built;
+  r->built = b;
+  pthread_mutex_unlock(&registered_lock);
+
+  *p = &b->impl;
+  return DEMO_OK;
+
+ build_protocol_failure:
+  pthread_mutex_unlock(&registered_lock);
+  return ret;
+}
+
+static void netquake_init(protocol_impl *p)
+{
+  int i;
+
+  for (i = 0; i < 256; i++) {
+    p->size[i] = SIZE_READ;
+    p->read[i] = NULL;
+  }
+  p->coord_size = 2;
+  p->angle_size = 1;
+
+  // These are all defined as hex values in the header file. The sizes lay
+  // out for us what the expected message size yielded by each type will be.
+  p->size[BAD] = 0;
+  p->size[NOP] = 0;
+  p->size[DISCONNECT] = 0;
+  p->size[SPAWNBINARY] = 0;
+  p->size[KILLEDMONSTER] = 0;
+  p->size[FOUNDSECRET] = 0;
+  p->size[INTERMISSION] = 0;
+  p->size[SELLSCREEN] = 0;
+  p->size[SETPAUSE] = 1;
+  p->size[SIGNONUM] = 1;
+  p->size[SETVIEW] = 2;
+  p->size[STOPSOUND] = 2;
+  p->size[UPDATECOLORS] = 2;
+  p->size[CDTRACK] = 2;
+  p->size[SETANGLE] = 3;
+  p->size[UPDATEFRAGS] = 3;
+  p->size[VERSION] = 4;
+  p->size[TIME] = 4;
+  p->size[UPDATESTAT] = 5;
+  p->size[DAMAGE] = 8;
+  p->size[SPAWNSTATICSOUND] = 9;
+  p->size[PARTICLE] = 11;
+  p->size[SPAWNSTATIC] = 13;
+  p->size[SPAWNBASELINE] = 15;
+
+  p->read[PRINT] = read_text;
+  p->read[STUFFTEXT] = read_text;
+  p->read[CENTERPRINT] = read_text;
+  p->read[FINALE] = read_text;
+  p->read[CUTSCENE] = read_text;
+  p->read[SERVERINFO] = read_serverinfo;
+  p->read[LIGHTSTYLE] = read_indexed_text;
+  p->read[UPDATENAME] = read_indexed_text;
+  p->read[TEMP_ENTITY] = read_temp_entity;
+  p->read[SOUND] = read_sound;
+  p->read[CLIENTDATA] = read_clientdata;
+
+  // an entity update
+  for (i = 128; i < 256; i++) {
+    p->read[i] = read_update;
+  }
+}
+
+/* This appears to be something specific to Fitzquake engines using something called the
+ * FitzQuake protocol. It seems to implement extra message types on top of the pre-existing ones.
+ * Cool!
+ */
+static void fitzquake_init(protocol_impl *p)
+{
+  int i;
+
+  netquake_init(p);
+
+  p->size[FQBF] = 0;
+  p->size[FQFOG] = 6;
+  p->size[FQSPAWNSTATICSOUND2] = 10;
+
+  p->read[FQSKYBOX] = read_text;
+  p->read[FQSPAWNBASELINE2] = read_baseline2;
+  p->read[FQSPAWNSTATIC2] = read_static2;
+  p->read[SOUND] = read_sound_fitz;
+  p->read[CLIENTDATA] = read_clientdata_fitz;
+
+  for (i = 128; i < 256; i++) {
+    p->read[i] = read_update_fitz;
+  }
+}
+
+/* I think this is the Nehahra BJP3 protocol? That's what google says anyway. Similar deal to Fitzquake.
+ * Actually the quake wiki indicates that there are tons of additional protocols that are supersets of the
+ * original.
+ */
+static void bjp3_init(protocol_impl *p)
+{
+  int i;
+
+  netquake_init(p);
+
+  p->size[SPAWNBASELINE] += 1; // short model
+  p->size[SPAWNSTATIC] += 1;
+  // SPAWNSTATICSOUND size change nulled by Compatibility flag
+
+  p->read[BJP3SKYBOX] = read_text;
+  p->read[BJP3SHOWLMP] = read_showlmp;
+  p->read[BJP3HIDELMP] = read_text;
+  p->read[BJP3FOG] = read_fog;
+  p->read[SOUND] = read_sound_bjp3;
+  p->read[CLIENTDATA] = read_clientdata_bjp3;
+
+  for (i = 128; i < 256; i++) {
+    p->read[i] = read_update_bjp3;
+  }
+}
+
+/* it's a string
+ */
+static int read_text(deminfo *di, message *m)
+{
+  int ret;
+
+  m->size = read_string(di, di->buffer);
+  GET_MEMORY(m->data, m->size, ret, read_text_failure);
+  memcpy(m->data, di->buffer, m->size);
+
+  return DEMO_OK;
+
+ read_text_failure:
+  return ret;
+}
+
+/* An index byte followed by a string
+ */
+static int read_indexed_text(deminfo *di, message *m)
+{
+  int ret;
+  int i;
+
+  i = read_uint8_t(di);
+  m->size = read_string(di, di->buffer) + 1;
+  GET_MEMORY(m->data, m->size, ret, read_indexed_text_failure);
+  m->data[0] = (uint8_t) i;
+  memcpy(m->data + 1, di->buffer, m->size - 1);
+
+  return DEMO_OK;
+
+ read_indexed_text_failure:
+  return ret;
+}
+
+static int read_serverinfo(deminfo *di, message *m)
+{
+  int size;
+  int ret;
+
+  // protocol, its flags if it has any, max clients, game type
+  read_n_uint8_t(di, 4, di->buffer);
+  m->size = serverinfo_header(di->buffer);
+  read_n_uint8_t(di, m->size - 4, di->buffer + 4);
+
+  // force read map title (there may be none)
+  size = read_string(di, di->buffer2);
+  memcpy(di->buffer + m->size, di->buffer2, size);
+  m->size += size;
+
+  // read mapname and models
+  do {
+    size = read_string(di, di->buffer2);
+    memcpy(di->buffer + m->size, di->buffer2, size);
+    m->size += size;
+  } while (size > 1);
+
+  // read sounds
+  do {
+    size = read_string(di, di->buffer2);
+    memcpy(di->buffer + m->size, di->buffer2, size);
+    m->size += size;
+  } while (size > 1);
+
+  // copy to exact sized buffer
+  GET_MEMORY(m->data, m->size, ret, read_serverinfo_failure);
+  memcpy(m->data, di->buffer, m->size);
+
+  // intern the names now, later lookups find them
+  if (di->context != NULL) {
+    ret = demo_context_precache(di->context, m, NULL);
+    if (ret != DEMO_OK) {
+      goto read_serverinfo_failure;
+    }
+  }
+
+  return DEMO_OK;
+
+ read_serverinfo_failure:
+  return ret;
+}
+
+static int read_temp_entity(deminfo *di, message *m)
+{
+  uint32_t coords = 0;
+  uint8_t type;
+  int ret;
+
+  type = read_uint8_t(di);
+  switch (type) {
+  case 0: case 1: case 2: case 3: case 4:
+  case 7: case 8: case 10: case 11:
+    m->size = 1;
+    coords = 3;
+    break;
+
+  case 5: case 6: case 9: case 13:
+    m->size = 3; // entity
+    coords = 6;
+    break;
+
+  case 12:
+    m->size = 3; // color start and length
+    coords = 3;
+    break;
+  }
+  m->size += coords * di->proto->coord_size;
+  GET_MEMORY(m->data, m->size, ret, read_temp_entity_failure);
+  m->data[0] = type;
+  read_n_uint8_t(di, m->size - 1, m->data + 1);
+
+  return DEMO_OK;
+
+ read_temp_entity_failure:
+  return ret;
+}
+
+/* The readers below are specialized from one body per message with a
+ * constant layout, which the compiler folds.
+ */
+static inline int read_sound_layout(deminfo *di, message *m, int layout)
+{
+  uint32_t mask;
+  int ret;
+
+  mask = read_uint8_t(di); // the flag byte
+  m->size = 4 + 3 * di->proto->coord_size;
+  if (layout == LAYOUT_BJP3) {
+    m->size += 1; // sound_num short rather than byte
+  }
+  if (mask & 0x01) {
+    m->size += 1;
+  }
+  if (mask & 0x02) {
+    m->size += 1;
+  }
+  if (layout == LAYOUT_FITZQUAKE) {
+    if (mask & 0x08) {
+      m->size += 1;
+    }
+    if (mask & 0x10) {
+      m->size += 1;
+    }
+  }
+  GET_MEMORY(m->data, m->size, ret, read_sound_failure);
+  m->data[0] = (uint8_t) mask;
+  read_n_uint8_t(di, m->size - 1, m->data + 1);
+
+  return DEMO_OK;
+
+ read_sound_failure:
+  return ret;
+}
+
+static int read_sound(deminfo *di, message *m)
+{
+  return read_sound_layout(di, m, LAYOUT_NETQUAKE);
+}
+
+static int read_sound_fitz(deminfo *di, message *m)
+{
+  return read_sound_layout(di, m, LAYOUT_FITZQUAKE);
+}
+
+static int read_sound_bjp3(deminfo *di, message *m)
+{
+  return read_sound_layout(di, m, LAYOUT_BJP3);
+}
+
+static inline int read_clientdata_layout(deminfo *di, message *m, int layout)
+{
+  uint16_t mask16;
+  uint32_t mask;
+  uint8_t du8;
+  uint8_t extramask1 = 0;
+  uint8_t extramask2 = 0;
+  int i;
+  int ret;
+
+  m->size = 14; // 14 bytes minimum
+
+  mask16 = read_uint16_t(di);
+  mask = mask16;
+  if (layout == LAYOUT_FITZQUAKE) {
+    if (mask & 0x8000) {
+      m->size += 1;
+      extramask1 = read_uint8_t(di);
+      mask |= (extramask1 << 16);
+      if (mask & 0x00800000) {
+        m->size += 1;
+        extramask2 = read_uint8_t(di);
+        mask |= (extramask2 << 24);
+      }
+    }
+  }
+
+  // each of these bits cost an additional 1 byte
+  if (layout == LAYOUT_FITZQUAKE) {
+    m->size += count_setbits(mask & 0x37F70FF);
+  }
+  else {
+    m->size += count_setbits(mask & 0x70FF);
+  }
+  if (layout == LAYOUT_BJP3) {
+    if (mask & (0x4000)) {
+      m->size += 1; // SU_WEAPON short rather than byte
+    }
+  }
+
+  if (mask & 0x80000000) {
+    return bp(DEMO_CORRUPT_DEMO); // unsupported
+  }
+
+  i = 0;
+  GET_MEMORY(m->data, m->size, ret, read_clientdata_failure);
+  du8 = (mask16 & 0x00FF);
+  m->data[i++] = du8;
+  du8 = (mask16 & 0xFF00) >> 8;
+  m->data[i++] = du8;
+
+  if (layout == LAYOUT_FITZQUAKE) {
+    if (mask & 0x8000) {
+      m->data[i++] = extramask1;
+    }
+    if (mask & 0x00800000) {
+      m->data[i++] = extramask2;
+    }
+  }
+  read_n_uint8_t(di, m->size - i, m->data + i);
+
+  return DEMO_OK;
+
+ read_clientdata_failure:
+  return ret;
+}
+
+static int read_clientdata(deminfo *di, message *m)
+{
+  return read_clientdata_layout(di, m, LAYOUT_NETQUAKE);
+}
+
+static int read_clientdata_fitz(deminfo *di, message *m)
+{
+  return read_clientdata_layout(di, m, LAYOUT_FITZQUAKE);
+}
+
+static int read_clientdata_bjp3(deminfo *di, message *m)
+{
+  return read_clientdata_layout(di, m, LAYOUT_BJP3);
+}
+
+static inline int read_update_layout(deminfo *di, message *m, int layout)
+{
+  uint8_t extramask1 = 0;
+  uint8_t extramask2 = 0;
+  uint8_t extramask3 = 0;
+  uint32_t mask;
+  int i;
+  int ret;
+
+  mask = m->type & 0x7F;
+
+  m->size = 1;
+  if (mask & 0x01) {
+    m->size += 1;
+    extramask1 = read_uint8_t(di);
+    mask |= (extramask1 << 8);
+  }
+
+  if (layout == LAYOUT_FITZQUAKE) {
+    if (mask & 0x8000) {
+      m->size += 1;
+      extramask2 = read_uint8_t(di);
+      mask |= (extramask2 << 16);
+    }
+    if (mask & 0x800000) {
+      m->size += 1;
+      extramask3 = read_uint8_t(di);
+      mask |= (extramask3 << 24);
+    }
+  }
+
+  // each of these bits cost an additional 1 byte
+  if (layout == LAYOUT_FITZQUAKE) {
+    m->size += count_setbits(mask & 0xF7F50);
+  }
+  else {
+    m->size += count_setbits(mask & 0x7F50);
+  }
+
+  // these bits cost a coord, and the angle bits among the ones above
+  // whatever an angle takes beyond a byte
+  m->size += count_setbits(mask & 0xE) * di->proto->coord_size;
+  m->size += count_setbits(mask & 0x310) * (di->proto->angle_size - 1);
+
+  // this bit may cost an additional byte
+  if (layout == LAYOUT_BJP3) {
+    if (mask & (0x0400)) {
+      m->size += 1; // U_MODEL short rather than byte
+    }
+  }
+
+  GET_MEMORY(m->data, m->size, ret, read_update_failure);
+
+  i = 0;
+  if (mask & 0x01) {
+    m->data[i++] = extramask1;
+  }
+  if (layout == LAYOUT_FITZQUAKE) {
+    if (mask & 0x8000) {
+      m->data[i++] = extramask2;
+    }
+    if (mask & 0x800000) {
+      m->data[i++] = extramask3;
+    }
+  }
+  read_n_uint8_t(di, m->size - i, m->data + i);
+
+  return DEMO_OK;
+
+ read_update_failure:
+  return ret;
+}
+
+static int read_update(deminfo *di, message *m)
+{
+  return read_update_layout(di, m, LAYOUT_NETQUAKE);
+}
+
+static int read_update_fitz(deminfo *di, message *m)
+{
+  return read_update_layout(di, m, LAYOUT_FITZQUAKE);
+}
+
+static int read_update_bjp3(deminfo *di, message *m)
+{
+  return read_update_layout(di, m, LAYOUT_BJP3);
+}
+
+static int read_baseline2(deminfo *di, message *m)
+{
+  uint8_t entnum1;
+  uint8_t entnum2;
+  uint32_t mask;
+  int ret;
+
+  // +1 for flag byte
+  m->size = 6 + 1 + 3 * (di->proto->coord_size + di->proto->angle_size);
+
+  entnum1 = read_uint8_t(di); // entnum precedes the mask
+  entnum2 = read_uint8_t(di);
+  mask = read_uint8_t(di); // the flag byte
+  if (mask & 0x01) {
+    m->size += 1;
+  }
+  if (mask & 0x02) {
+    m->size += 1;
+  }
+  if (mask & 0x04) {
+    m->size += 1;
+  }
+  GET_MEMORY(m->data, m->size, ret, read_baseline2_failure);
+  m->data[0] = entnum1;
+  m->data[1] = entnum2;
+  m->data[2] = (uint8_t) mask;
+  read_n_uint8_t(di, m->size - 3, m->data + 3);
+
+  return DEMO_OK;
+
+ read_baseline2_failure:
+  return ret;
+}
+
+static int read_static2(deminfo *di, message *m)
+{
+  uint32_t mask;
+  int ret;
+
+  // +1 for flag byte
+  m->size = 4 + 1 + 3 * (di->proto->coord_size + di->proto->angle_size);
+
+  mask = read_uint8_t(di); // the flag byte
+  if (mask & 0x01) {
+    m->size += 1;
+  }
+  if (mask & 0x02) {
+    m->size += 1;
+  }
+  if (mask & 0x04) {
+    m->size += 1;
+  }
+  GET_MEMORY(m->data, m->size, ret, read_static2_failure);
+  m->data[0] = (uint8_t) mask;
+  read_n_uint8_t(di, m->size - 1, m->data + 1);
+
+  return DEMO_OK;
+
+ read_static2_failure:
+  return ret;
+}
+
+static int read_showlmp(deminfo *di, message *m)
+{
+  char slotname[2048];
+  size_t slotname_l;
+  char lmpfilename[2048];
+  size_t lmpfilename_l;
+  int ret;
+
+  // [string] slotname [string] lmpfilename [coord] x [coord] y
+  slotname_l = read_string(di, slotname);
+  lmpfilename_l = read_string(di, lmpfilename);
+  m->size = slotname_l + lmpfilename_l + 2;
+  GET_MEMORY(m->data, m->size, ret, read_showlmp_failure);
+  memcpy(m->data, slotname, slotname_l);
+  memcpy(m->data + slotname_l, lmpfilename, lmpfilename_l);
+  m->data[m->size - 2] = read_uint8_t(di);
+  m->data[m->size - 1] = read_uint8_t(di);
+
+  return DEMO_OK;
+
+ read_showlmp_failure:
+  return ret;
+}
+
+static int read_fog(deminfo *di, message *m)
+{
+  uint8_t enable;
+  int ret;
+
+  // [byte] enable
+  // <optional past this point, only included if enable is true>
+  // [float] density [byte] red [byte] green [byte] blue
+  m->size = 1;
+  enable = read_uint8_t(di);
+  if (enable) {
+    m->size += 7;
+  }
+  GET_MEMORY(m->data, m->size, ret, read_fog_failure);
+  m->data[0] = enable;
+  if (enable) {
+    read_n_uint8_t(di, 7, m->data + 1);
+  }
+
+  return DEMO_OK;
+
+ read_fog_failure:
+  return ret;
+}
+
+/*****************************************************************************
+ *                                                                           *
+ *                INPUT FUNCTIONS                                            *
+ *                                                                           *
+ *****************************************************************************/
+
+/* Sets up the input buffer, and starts the read ahead thread if asked to.
+ */
+static int open_input(deminfo *di)
+{
+  readahead *ra;
+  struct stat st;
+  off_t pos;
+  int i;
+
+  pos = ftello(di->fp);
+  di->offset = (pos < 0) ? 0 : (uint64_t) pos; // 0 for a pipe
+  di->seekable = (pos >= 0);
+  if (fstat(fileno(di->fp), &st) == 0 && S_ISREG(st.st_mode)) {
+    di->total = (uint64_t) st.st_size;
+  }
+  di->start_ns = now_ns();
+  if (di->progress_ns == 0) {
+    di->progress_ns = (uint64_t) PROGRESS_MS * 1000000;
+  }
+  di->progress_next = di->start_ns + di->progress_ns;
+  di->in = di->inbuf;
+
+  if (di->readahead_size == 0) {
+    return DEMO_OK;
+  }
+
+  ra = calloc(1, sizeof(readahead));
+  if (ra == NULL) {
+    return DEMO_NO_MEMORY;
+  }
+  ra->fp = di->fp;
+  ra->chunk_size = di->readahead_size;
+  for (i = 0; i < READAHEAD_CHUNKS; i++) {
+    ra->chunks[i] = malloc(ra->chunk_size);
+    if (ra->chunks[i] == NULL) {
+      goto open_input_failure;
+    }
+  }
+
+  pthread_mutex_init(&ra->lock, NULL);
+  pthread_cond_init(&ra->cond, NULL);
+  if (pthread_create(&ra->thread, NULL, readahead_thread, ra) != 0) {
+    pthread_cond_destroy(&ra->cond);
+    pthread_mutex_destroy(&ra->lock);
+    goto open_input_failure;
+  }
+
+  di->ra = ra;
+  return DEMO_OK;
+
+ open_input_failure:
+  for (i = 0; i < READAHEAD_CHUNKS; i++) {
+    free(ra->chunks[i]);
+  }
+  free(ra);
+  return DEMO_NO_MEMORY;
+}
+
+/* Stops the read ahead thread, if any. Input is read ahead in whole
+ * buffers either way, so a seekable file is then put back right after the
+ * last byte parsed, where a supplied file pointer is expected to be.
+ */
+static void close_input(deminfo *di)
+{
+  readahead *ra = di->ra;
+
+  if (ra != NULL) {
+    stop_readahead(ra);
+    di->ra = NULL;
+  }
+
+  if (di->fp != NULL && di->seekable) {
+    fseeko(di->fp, (off_t) (di->offset + di->in_pos), SEEK_SET);
+  }
+}
+
+static void stop_readahead(readahead *ra)
+{
+  int i;
+
+  pthread_mutex_lock(&ra->lock);
+  ra->stop = 1;
+  pthread_cond_broadcast(&ra->cond);
+  pthread_mutex_unlock(&ra->lock);
+  pthread_join(ra->thread, NULL);
+
+  pthread_cond_destroy(&ra->cond);
+  pthread_mutex_destroy(&ra->lock);
+  for (i = 0; i < READAHEAD_CHUNKS; i++) {
+    free(ra->chunks[i]);
+  }
+  free(ra);
+}
+
+/* Replaces the consumed input buffer with the next piece of the file.
+ * Returns the number of bytes now available, 0 at the end of the file.
+ */
+static size_t fill_input(deminfo *di)
+{
+  readahead *ra = di->ra;
+
+  // the push parser has no file, its input ends with the buffer
+  if (di->fp == NULL) {
+    return 0;
+  }
+
+  di->offset += di->in_len;
+  di->in_pos = 0;
+  di->in_len = 0;
+
+  if (ra == NULL) {
+    di->in_len = fread(di->inbuf, 1, INPUT_BUFFER_SIZE, di->fp);
+    return di->in_len;
+  }
+
+  pthread_mutex_lock(&ra->lock);
+
+  // hand the consumed chunk back to the reader thread
+  if (ra->holding) {
+    ra->holding = 0;
+    ra->head = (ra->head + 1) % READAHEAD_CHUNKS;
+    ra->count--;
+    pthread_cond_broadcast(&ra->cond);
+  }
+
+  while (ra->count == 0 && !ra->eof) {
+    pthread_cond_wait(&ra->cond, &ra->lock);
+  }
+
+  if (ra->count > 0) {
+    ra->holding = 1;
+    di->in = ra->chunks[ra->head];
+    di->in_len = ra->lengths[ra->head];
+  }
+
+  pthread_mutex_unlock(&ra->lock);
+  return di->in_len;
+}
+
+static int input_eof(deminfo *di)
+{
+  if (di->in_pos < di->in_len) {
+    return 0;
+  }
+
+  return fill_input(di) == 0;
+}
+
+/* Reads the file into the free chunks of the ring, ahead of the parser,
+ * until the end of the file or until asked to stop.
+ */
+static void *readahead_thread(void *arg)
+{
+  readahead *ra = (readahead *) arg;
+  size_t length;
+  int slot;
+
+  pthread_mutex_lock(&ra->lock);
+  while (!ra->stop) {
+    if (ra->count == READAHEAD_CHUNKS) {
+      pthread_cond_wait(&ra->cond, &ra->lock);
+      continue;
+    }
+    slot = (ra->head + ra->count) % READAHEAD_CHUNKS;
+
+    // the free slot belongs to this thread until it is counted
+    pthread_mutex_unlock(&ra->lock);
+    length = fread(ra->chunks[slot], 1, ra->chunk_size, ra->fp);
+    pthread_mutex_lock(&ra->lock);
+
+    if (length > 0) {
+      ra->lengths[slot] = length;
+      ra->count++;
+    }
+    if (length < ra->chunk_size) {
+      ra->eof = 1;
+    }
+    pthread_cond_broadcast(&ra->cond);
+    if (ra->eof) {
+      break;
+    }
+  }
+  pthread_mutex_unlock(&ra->lock);
+
+  return NULL;
+}
+
+/* Reads one block out of the input buffer, but only once all of it is
+ * there, so the parser never runs into the end of the input. Until then
+ * DEMO_PENDING is returned, without consuming anything, and need is set to
+ * the number of unread bytes it takes to get any further.
+ */
+static int parse_buffered(demo_parser *p, block **b, size_t *need)
+{
+  deminfo *di = p->di;
+  size_t avail = di->in_len - di->in_pos;
+  uint32_t length;
+  int ret;
+
+  if (!p->started) {
+    if (memchr(di->in + di->in_pos, '\n', avail) == NULL &&
+        avail < CDTRACK_MAX_LENGTH) {
+      *need = avail + 1;
+      return DEMO_PENDING;
+    }
+
+    ret = read_cdtrack(di, &p->track);
+    if (ret != DEMO_OK) {
+      return ret;
+    }
+    p->started = 1;
+    avail = di->in_len - di->in_pos;
+  }
+
+  if (avail < 4) {
+    *need = 4;
+    return DEMO_PENDING;
+  }
+  memcpy(&length, di->in + di->in_pos, 4);
+
+  // a bad length is left to read_block() to report
+  if (length <= MAX_BLOCK_LENGTH && avail < 16 + length) {
+    *need = 16 + length;
+    return DEMO_PENDING;
+  }
+
+  ret = read_block(di, b);
+  if (ret == DEMO_UNEXPECTED_EOF) {
+    // all of the block was there, so its messages overran its length
+    ret = bp(DEMO_CORRUPT_DEMO);
+  }
+  if (ret != DEMO_OK) {
+    return ret;
+  }
+
+  ret = index_block(di, p->track, *b);
+  if (ret != DEMO_OK) {
+    free_block(*b);
+    return ret;
+  }
+
+  // progress callback?
+  if (di->pcb != NULL || di->pcb64 != NULL) {
+    if (p->cb_c++ > CB_BLOCKS) {
+      p->cb_c = 0;
+      report_progress(di);
+    }
+  }
+  ret = check_progress(di);
+  if (ret != DEMO_OK) {
+    free_block(*b);
+    *b = NULL;
+    return ret;
+  }
+
+  return DEMO_OK;
+}
+
+/* Copies as much of buf into the input buffer as fits, making room first
+ * if needed. Returns the number of bytes taken.
+ */
+static size_t push_input(deminfo *di, const uint8_t *buf, size_t len)
+{
+  size_t count;
+
+  if (INPUT_BUFFER_SIZE - di->in_len < len) {
+    compact_input(di);
+  }
+
+  count = INPUT_BUFFER_SIZE - di->in_len;
+  if (count > len) {
+    count = len;
+  }
+  memcpy(di->inbuf + di->in_len, buf, count);
+  di->in_len += count;
+
+  return count;
+}
+
+/* Moves the unread bytes to the start of the input buffer.
+ */
+static void compact_input(deminfo *di)
+{
+  size_t avail = di->in_len - di->in_pos;
+
+  memmove(di->inbuf, di->inbuf + di->in_pos, avail);
+  di->offset += di->in_pos;
+  di->in_pos = 0;
+  di->in_len = avail;
+}
+
+/* Reads one block for demo_follow_next(), reading more of the file for as
+ * long as the parser asks for more. Once the writer of a pipe or socket is
+ * gone, what is left can never complete.
+ */
+static int follow_block(demo_follower *f, block **b)
+{
+  deminfo *di = f->p.di;
+  size_t need;
+  int ret;
 
-    default:
-      break;
+  while ((ret = parse_buffered(&f->p, b, &need)) == DEMO_PENDING) {
+    if (!follow_fill(f, need)) {
+      if (f->hangup) {
+        return (di->in_pos < di->in_len) ? DEMO_UNEXPECTED_EOF
+                                         : DEMO_END_OF_STREAM;
+      }
+      return DEMO_PENDING;
     }
   }
 
-  if (!process) {
-    // deal with messages with known length
-    GET_MEMORY(m->data, m->size, ret, read_message_failure);
+  return ret;
+}
 
-    // Read n (m->size) integers, 8bits in size, from deminfo into the m->data buffer.
-    read_n_uint8_t(di, m->size, m->data);
-  }
-  else {
-    // deal with messages with unknown length
-    switch (m->type) {
-    case PRINT:
-    case STUFFTEXT:
-    case CENTERPRINT:
-    case FINALE:
-    case CUTSCENE:
-      {
-        // it's a string
-        m->size = read_string(di, di->buffer);
-        GET_MEMORY(m->data, m->size, ret, read_message_failure);
-        memcpy(m->data, di->buffer, m->size);
-      }
-      break;
+/* Makes at least need unread bytes available in the input buffer, keeping
+ * the unread ones, and reading whatever the file has grown by. Only bytes
+ * that have arrived are read, a pipe or socket is checked with poll()
+ * before each read(). Returns 0 if the file is still too short.
+ */
+static int follow_fill(demo_follower *f, size_t need)
+{
+  deminfo *di = f->p.di;
+  struct pollfd pfd;
+  ssize_t got;
 
-    case FQSKYBOX:
-  //case BJP3SKYBOX:
-      if (di->protocol == PROTOCOL_FITZQUAKE ||
-          di->protocol == PROTOCOL_BJP3)
-      {
-        // it's a string
-        m->size = read_string(di, di->buffer);
-        GET_MEMORY(m->data, m->size, ret, read_message_failure);
-        memcpy(m->data, di->buffer, m->size);
-      }
-      else {
-        ret = bp(DEMO_CORRUPT_DEMO);
-        goto read_message_failure;
-      }
-      break;
+  compact_input(di);
 
-    case FQSPAWNBASELINE2:
-      if (di->protocol == PROTOCOL_FITZQUAKE) {
-        uint8_t entnum1;
-        uint8_t entnum2;
-
-        m->size = 15 + 1; // +1 for flag byte
-
-        entnum1 = read_uint8_t(di); // entnum precedes the mask
-        entnum2 = read_uint8_t(di);
-        mask = read_uint8_t(di); // the flag byte
-        if (mask & 0x01) {
-          m->size += 1;
-        }
-        if (mask & 0x02) {
-          m->size += 1;
-        }
-        if (mask & 0x04) {
-          m->size += 1;
-        }
-        GET_MEMORY(m->data, m->size, ret, read_message_failure);
-        m->data[0] = entnum1;
-        m->data[1] = entnum2;
-        m->data[2] = (uint8_t) mask;
-        read_n_uint8_t(di, m->size - 3, m->data + 3);
-      }
-      else {
-        ret = bp(DEMO_CORRUPT_DEMO);
-        goto read_message_failure;
-      }
+  pfd.fd = f->fd;
+  pfd.events = POLLIN;
+  while (di->in_len < need && di->in_len < INPUT_BUFFER_SIZE) {
+    if (f->pollable && poll(&pfd, 1, 0) <= 0) {
       break;
+    }
 
-    case FQSPAWNSTATIC2:
-      if (di->protocol == PROTOCOL_FITZQUAKE) {
-        m->size = 13 + 1; // +1 for flag byte
-
-        mask = read_uint8_t(di); // the flag byte
-        if (mask & 0x01) {
-          m->size += 1;
-        }
-        if (mask & 0x02) {
-          m->size += 1;
-        }
-        if (mask & 0x04) {
-          m->size += 1;
-        }
-        GET_MEMORY(m->data, m->size, ret, read_message_failure);
-        m->data[0] = (uint8_t) mask;
-        read_n_uint8_t(di, m->size - 1, m->data + 1);
-      }
-      else {
-        ret = bp(DEMO_CORRUPT_DEMO);
-        goto read_message_failure;
+    got = read(f->fd, di->inbuf + di->in_len, INPUT_BUFFER_SIZE - di->in_len);
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got <= 0) {
+      // a regular file grows again, a pipe that has hung up does not
+      if (got == 0 && f->pollable) {
+        f->hangup = 1;
       }
       break;
+    }
+    di->in_len += got;
+  }
 
-    case SOUND:
-      {
-        mask = read_uint8_t(di); // the flag byte
-        m->size = 10;
-        if (di->protocol == PROTOCOL_BJP3) {
-          m->size += 1; // sound_num short rather than byte
-        }
-        if (mask & 0x01) {
-          m->size += 1;
-        }
-        if (mask & 0x02) {
-          m->size += 1;
-        }
-        if (di->protocol == PROTOCOL_FITZQUAKE) {
-          if (mask & 0x08) {
-            m->size += 1;
-          }
-          if (mask & 0x10) {
-            m->size += 1;
-          }
-        }
-        GET_MEMORY(m->data, m->size, ret, read_message_failure);
-        m->data[0] = (uint8_t) mask;
-        read_n_uint8_t(di, m->size - 1, m->data + 1);
-      }
-      break;
+  return di->in_len >= need;
+}
 
-    case SERVERINFO:
-      {
-        int size;
-        m->size = 6;
-        read_n_uint8_t(di, 6, di->buffer);
-
-        // force read map title (there may be none)
-        size = read_string(di, di->buffer2);
-        memcpy(di->buffer + m->size, di->buffer2, size);
-        m->size += size;
-
-        // read mapname and models
-        do {
-          size = read_string(di, di->buffer2);
-          memcpy(di->buffer + m->size, di->buffer2, size);
-          m->size += size;
-        } while (size > 1);
-
-        // read sounds
-        do {
-          size = read_string(di, di->buffer2);
-          memcpy(di->buffer + m->size, di->buffer2, size);
-          m->size += size;
-        } while (size > 1);
-
-        // copy to exact sized buffer
-        GET_MEMORY(m->data, m->size, ret, read_message_failure);
-        memcpy(m->data, di->buffer, m->size);
-      }
-      break;
+/* Waits up to ms milliseconds for more input. A pipe or socket wakes the
+ * wait as soon as data arrives, a regular file is just checked again.
+ */
+static void follow_wait(demo_follower *f, int ms)
+{
+  struct pollfd pfd;
+  struct timespec ts;
 
-    case LIGHTSTYLE:
-    case UPDATENAME:
-      {
-        i = read_uint8_t(di);
-        m->size = read_string(di, di->buffer) + 1;
-        GET_MEMORY(m->data, m->size, ret, read_message_failure);
-        m->data[0] = (uint8_t) i;
-        memcpy(m->data + 1, di->buffer, m->size - 1);
-      }
-      break;
+  if (f->pollable && !f->hangup) {
+    pfd.fd = f->fd;
+    pfd.events = POLLIN;
+    poll(&pfd, 1, ms);
+    return;
+  }
 
-    case CLIENTDATA:
-      {
-        uint16_t mask16;
-        uint8_t du8;
-        uint8_t extramask1;
-        uint8_t extramask2;
-        uint32_t bytemask;
-        m->size = 14; // 14 bytes minimum
-
-        mask16 = read_uint16_t(di);
-        mask = mask16;
-        if (di->protocol == PROTOCOL_FITZQUAKE) {
-          if (mask & 0x8000) {
-            m->size += 1;
-            extramask1 = read_uint8_t(di);
-            mask |= (extramask1 << 16);
-            if (mask & 0x00800000) {
-              m->size += 1;
-              extramask2 = read_uint8_t(di);
-              mask |= (extramask2 << 24);
-            }
-          }
-        }
-
-        // each of these bits cost an additional 1 byte
-        if (di->protocol == PROTOCOL_FITZQUAKE) {
-          bytemask = 0x37F70FF;
-        }
-        else {
-          bytemask = 0x70FF;
-        }
-        m->size += count_setbits(mask & bytemask);
-        if (di->protocol == PROTOCOL_BJP3) {
-          if (mask & (0x4000)) {
-            m->size += 1; // SU_WEAPON short rather than byte
-          }
-        }
-
-        if (mask & 0x80000000) {
-          ret = bp(DEMO_CORRUPT_DEMO);
-          goto read_message_failure; // unsupported
-        }
-
-        i = 0;
-        GET_MEMORY(m->data, m->size, ret, read_message_failure);
-        du8 = (mask16 & 0x00FF);
-        m->data[i++] = du8;
-        du8 = (mask16 & 0xFF00) >> 8;
-        m->data[i++] = du8;
-
-        if (di->protocol == PROTOCOL_FITZQUAKE) {
-          if (mask & 0x8000) {
-            m->data[i++] = extramask1;
-          }
-          if (mask & 0x00800000) {
-            m->data[i++] = extramask2;
-          }
-        }
-        read_n_uint8_t(di, m->size - i, m->data + i);
-      }
-      break;
+  ts.tv_sec = ms / 1000;
+  ts.tv_nsec = (ms % 1000) * 1000000L;
+  nanosleep(&ts, NULL);
+}
 
-    case TEMP_ENTITY:
-      {
-        uint8_t type;
-        type = read_uint8_t(di);
-        switch (type) {
-        case 0: case 1: case 2: case 3: case 4:
-        case 7: case 8: case 10: case 11:
-          m->size = 7;
-          break;
-
-        case 5: case 6: case 9: case 13:
-          m->size = 15;
-          break;
-
-        case 12:
-          m->size = 9;
-          break;
-        }
-        GET_MEMORY(m->data, m->size, ret, read_message_failure);
-        m->data[0] = type;
-        read_n_uint8_t(di, m->size - 1, m->data + 1);
-      }
-      break;
+/*****************************************************************************
+ *                                                                           *
+ *                WRITE FUNCTIONS                                            *
+ *                                                                           *
+ *****************************************************************************/
 
-    case BJP3SHOWLMP:
-      if (di->protocol == PROTOCOL_BJP3) {
-        char slotname[2048];
-        size_t slotname_l;
-        char lmpfilename[2048];
-        size_t lmpfilename_l;
-
-        // [string] slotname [string] lmpfilename [coord] x [coord] y
-        slotname_l = read_string(di, slotname);
-        lmpfilename_l = read_string(di, lmpfilename);
-        m->size = slotname_l + lmpfilename_l + 2;
-        GET_MEMORY(m->data, m->size, ret, read_message_failure);
-        memcpy(m->data, slotname, slotname_l);
-        memcpy(m->data + slotname_l, lmpfilename, lmpfilename_l);
-        m->data[m->size - 2] = read_uint8_t(di);
-        m->data[m->size - 1] = read_uint8_t(di);
-      }
-      else {
-        ret = bp(DEMO_CORRUPT_DEMO);
-        goto read_message_failure;
-      }
-      break;
+/* Starts the writer thread. The file, and the duty to close it, move to
+ * the handle.
+ */
+static int start_async(demo_writer *w)
+{
+  demo_write_handle *h;
+  int ret;
 
-    case BJP3HIDELMP:
-      if (di->protocol == PROTOCOL_BJP3) {
-        // [string] slotname
-        m->size = read_string(di, di->buffer);
-        GET_MEMORY(m->data, m->size, ret, read_message_failure);
-        memcpy(m->data, di->buffer, m->size);
-      }
-      else {
-        ret = bp(DEMO_CORRUPT_DEMO);
-        goto read_message_failure;
-      }
-      break;
+  GET_MEMORY(h, sizeof(demo_write_handle), ret, start_async_failure);
 
-    case BJP3FOG:
-      if (di->protocol == PROTOCOL_BJP3) {
-        uint8_t enable;
-
-        // [byte] enable
-        // <optional past this point, only included if enable is true>
-        // [float] density [byte] red [byte] green [byte] blue
-        m->size = 1;
-        enable = read_uint8_t(di);
-        if (enable) {
-          m->size += 7;
-        }
-        GET_MEMORY(m->data, m->size, ret, read_message_failure);
-        m->data[0] = enable;
-        if (enable) {
-          read_n_uint8_t(di, 7, m->data + 1);
-        }
-      }
-      else {
-        ret = bp(DEMO_CORRUPT_DEMO);
-        goto read_message_failure;
-      }
-      break;
+  h->fp = w->fp;
+  h->local_fp = w->local_fp;
+  h->ret = DEMO_OK;
+  pthread_mutex_init(&h->lock, NULL);
+  pthread_cond_init(&h->cond, NULL);
 
-    default:
-      // an entity update
-      if ((m->type & 128) == 0) {
-        ret = bp(DEMO_CORRUPT_DEMO);
-        goto read_message_failure;
-      }
-      else {
-        uint8_t extramask1;
-        uint8_t extramask2;
-        uint8_t extramask3;
-        uint32_t bytemask;
-
-        mask = m->type & 0x7F;
-
-        m->size = 1;
-        if (mask & 0x01) {
-          m->size += 1;
-          extramask1 = read_uint8_t(di);
-          mask |= (extramask1 << 8);
-        }
-
-        if (di->protocol == PROTOCOL_FITZQUAKE) {
-          if (mask & 0x8000) {
-            m->size += 1;
-            extramask2 = read_uint8_t(di);
-            mask |= (extramask2 << 16);
-          }
-          if (mask & 0x800000) {
-            m->size += 1;
-            extramask3 = read_uint8_t(di);
-            mask |= (extramask3 << 24);
-          }
-        }
-
-        // each of these bits cost an additional 1 byte
-        if (di->protocol == PROTOCOL_FITZQUAKE) {
-          bytemask = 0xF7F50;
-        }
-        else {
-          bytemask = 0x7F50;
-        }
-        m->size += count_setbits(mask & bytemask);
-
-        // these bits cost an additional 2 bytes
-        m->size += count_setbits(mask & 0xE) << 1;
-
-        // this bit may cost an additional byte
-        if (di->protocol == PROTOCOL_BJP3) {
-          if (mask & (0x0400)) {
-            m->size += 1; // U_MODEL short rather than byte
-          }
-        }
-
-        GET_MEMORY(m->data, m->size, ret, read_message_failure);
-
-        i = 0;
-        if (mask & 0x01) {
-          m->data[i++] = extramask1;
-        }
-        if (di->protocol == PROTOCOL_FITZQUAKE) {
-          if (mask & 0x8000) {
-            m->data[i++] = extramask2;
-          }
-          if (mask & 0x800000) {
-            m->data[i++] = extramask3;
-          }
-        }
-        read_n_uint8_t(di, m->size - i, m->data + i);
-      }
-      break;
-    }
+  if (pthread_create(&h->thread, NULL, write_thread, h) != 0) {
+    pthread_cond_destroy(&h->cond);
+    pthread_mutex_destroy(&h->lock);
+    free(h);
+    return DEMO_NO_MEMORY;
   }
-  //printf("ok the type of the message is %x i think with size %x\n", m->type, m->size);
 
-  *mr = m;
+  w->async = h;
+  w->local_fp = NULL;
   return DEMO_OK;
 
- read_message_failure:
-  bp(0);
-  free_message(m);
+ start_async_failure:
   return ret;
 }
 
-/* Read the next 8bit integer from the deminfo file stream.
- *
+/* Queues the last partial chunk and tells the writer thread no more data
+ * is coming. A serialization error is recorded unless an earlier one was.
  */
-static uint8_t read_uint8_t(deminfo *di)
+static void finish_async(demo_writer *w, int ret)
 {
-  int n;
-  int n2;
-  n = getc(di->fp);
-  
-  if (n == EOF) {
-    longjmp(di->jumpbuf, DEMO_UNEXPECTED_EOF);
+  demo_write_handle *h = w->async;
+
+  if (w->chunk != NULL) {
+    queue_chunk(h, w->chunk);
+    w->chunk = NULL;
   }
-  // I'm not totally sure what this bitwise AND accomplishes. n is an unsigned int, and we 
-  // bitwise AND it with a hexadecimal value (255). 
-  return (uint8_t) (n & 0x000000FF);
+
+  pthread_mutex_lock(&h->lock);
+  if (h->ret == DEMO_OK) {
+    h->ret = ret;
+  }
+  h->done = 1;
+  pthread_cond_signal(&h->cond);
+  pthread_mutex_unlock(&h->lock);
 }
 
-/* Read an arbitrary (n) amount of unsigned 8bit integers from deminfo into the buffer, buf. 
- * This is basically a wrapper for fread() which operates in a very similar mindset. 
+/* Hands a chunk to the writer thread. The queue is not bounded, the caller
+ * must never wait for the disk. Returns the error state of the handle.
  */
-static void read_n_uint8_t(deminfo *di, int n, uint8_t *buf)
+static int queue_chunk(demo_write_handle *h, write_chunk *c)
 {
-  size_t count;
+  int ret;
 
-  if (n == 0) {
-    return;
+  c->next = NULL;
+
+  pthread_mutex_lock(&h->lock);
+  if (h->tail != NULL) {
+    h->tail->next = c;
   }
-  
-  // Read one element, n bytes in size, from the stream di->fp, into the buffer at buf 
-  // buf. fread() autoincrements the seek position.
-  count = fread(buf, n, 1, di->fp);
-  
-  // Weird error handling again.
-  if (count != 1) {
-    longjmp(di->jumpbuf, DEMO_UNEXPECTED_EOF);
+  else {
+    h->head = c;
   }
-}
-
-static uint16_t read_uint16_t(deminfo *di)
-{
-  uint16_t i;
+  h->tail = c;
+  ret = h->ret;
+  pthread_cond_signal(&h->cond);
+  pthread_mutex_unlock(&h->lock);
 
-  read_n_uint8_t(di, 2, (uint8_t *)&i);
-  return i;
+  return ret;
 }
 
-static uint32_t read_uint32_t(deminfo *di)
+static void *write_thread(void *arg)
 {
-  uint32_t i;
+  demo_write_handle *h = (demo_write_handle *) arg;
+  write_chunk *c;
+  int ret = DEMO_OK;
+
+  pthread_mutex_lock(&h->lock);
+  for (;;) {
+    while (h->head == NULL && !h->done) {
+      pthread_cond_wait(&h->cond, &h->lock);
+    }
 
-  read_n_uint8_t(di, 4, (uint8_t *)&i);
-  return i;
-}
+    c = h->head;
+    if (c == NULL) {
+      break;
+    }
+    h->head = c->next;
+    if (h->head == NULL) {
+      h->tail = NULL;
+    }
+    ret = h->ret;
+    pthread_mutex_unlock(&h->lock);
 
-static float read_float(deminfo *di)
-{
-  uint32_t i = read_uint32_t(di);
-  return *(float *)&i;
-}
+    // after an error the rest is only freed
+    if (ret == DEMO_OK && fwrite(c->data, c->length, 1, h->fp) != 1) {
+      ret = DEMO_CANNOT_WRITE;
+    }
+    free(c);
 
-static int read_string(deminfo *di, char *target)
-{
-  char *string_pointer;
-  int i;
+    pthread_mutex_lock(&h->lock);
+    if (h->ret == DEMO_OK) {
+      h->ret = ret;
+    }
+  }
+  pthread_mutex_unlock(&h->lock);
 
-  string_pointer = target;
-  for (i = 0; i < 0x7FF; i++, string_pointer++) {
-    if (!(*string_pointer = read_uint8_t(di))) {
-      break;
+  if (h->local_fp != NULL) {
+    if (fclose(h->local_fp) != 0) {
+      ret = DEMO_CANNOT_WRITE;
     }
   }
-  *string_pointer = '\0';
-  return i + 1;
+  else if (fflush(h->fp) != 0) {
+    ret = DEMO_CANNOT_WRITE;
+  }
+
+  pthread_mutex_lock(&h->lock);
+  if (h->ret == DEMO_OK) {
+    h->ret = ret;
+  }
+  h->finished = 1;
+  pthread_mutex_unlock(&h->lock);
+
+  return NULL;
 }
 
-/* Parses the demo file to determine what CD track
- * (from the Quake soundtrack) is set to be played
+/* fwrite() replacement for the write functions. In async mode the data is
+ * copied into chunks, which are queued as they fill up. Upon failure the
+ * error is left in w->ret.
  */
-static int read_cdtrack(deminfo *di, int32_t *track)
+static size_t out_write(const void *ptr, size_t size, size_t nmemb,
+                        demo_writer *w)
 {
-
-  int32_t cdtrack = 0;
-  int number = 0;
-  int sign = 0;
-  int readcount = 0;
+  const uint8_t *p = (const uint8_t *) ptr;
+  size_t left = size * nmemb;
+  size_t n;
   int ret;
-  
-  // Remove strang jump error handling in Rust rewrite.
-  ret = setjmp(di->jumpbuf);
-  if (ret != 0) {
-    return ret;
+
+  if (w->async == NULL) {
+    n = fwrite(ptr, size, nmemb, w->fp);
+    if (n != nmemb) {
+      w->ret = DEMO_CANNOT_WRITE;
+    }
+    return n;
   }
 
-  // Sequentially read unsigned 8bit ints from deminfo struct until newline
-  while ((number = read_uint8_t(di)) != '\n') {
-    printf("Reading number from di, got: %d \t %x\n", number, number);
+  while (left > 0) {
+    if (w->chunk == NULL) {
+      w->chunk = malloc(sizeof(write_chunk));
+      if (w->chunk == NULL) {
+        w->ret = DEMO_NO_MEMORY;
+        return 0;
+      }
+      w->chunk->length = 0;
+    }
 
-    // This has something to do with comparing signed to unsigned integers, I think..
-    if (number == '-') {
-      printf("number == '-', so sign = 1\n");
-      sign = 1;
+    n = WRITE_CHUNK_SIZE - w->chunk->length;
+    if (n > left) {
+      n = left;
     }
-    else {
-      number -= '0'; // Surely the point of this is related to the above ^ 
-      if (number > 9) {
-        return bp(DEMO_CORRUPT_DEMO);
+    memcpy(w->chunk->data + w->chunk->length, p, n);
+    w->chunk->length += n;
+    p += n;
+    left -= n;
+
+    if (w->chunk->length == WRITE_CHUNK_SIZE) {
+      ret = queue_chunk(w->async, w->chunk);
+      w->chunk = NULL;
+      if (ret != DEMO_OK) {
+        w->ret = ret;
+        return 0;
       }
-      cdtrack = cdtrack * 10 + number;
-    }
-    if (++readcount > 6) {
-      // don't expect more than 6 chars to select a cd track
-      // ^ tbh expect the unexpected
-      return bp(DEMO_CORRUPT_DEMO);
     }
   }
-  if (sign) {
-    cdtrack = -cdtrack;
-  }
 
-  // Throughout my findings, the CD track will be -1 if there was no music on during the demo recording. 
-  // Likely because the actual CD tracklisting starts at 0.
-  *track = cdtrack;
-  return DEMO_OK;
+  return nmemb;
 }
 
-/*****************************************************************************
- *                                                                           *
- *                WRITE FUNCTIONS                                            *
- *                                                                           *
- *****************************************************************************/
+static int write_demo_data(demo_writer *w, demo *demo)
+{
+  int ret;
+
+  ret = write_cdtrack(w, demo->track);
+  if (ret != DEMO_OK) {
+    return ret;
+  }
+
+  return write_blocks(w, demo->blocks);
+}
 
-static int write_demo_data(FILE *fp, demo *demo)
+static int write_cdtrack(demo_writer *w, int32_t track)
 {
-  uint32_t writesize;
+  char buf[16];
+  int writesize;
 
-  // write cd track
-  writesize = fprintf(fp, "%d\n", demo->track);
+  writesize = snprintf(buf, sizeof(buf), "%d\n", track);
   if (writesize < 2) {
     return DEMO_CANNOT_WRITE;
   }
+  if (out_write(buf, writesize, 1, w) != 1) {
+    return w->ret;
+  }
 
-  return write_blocks(fp, demo->blocks);
+  return DEMO_OK;
 }
 
-static int write_blocks(FILE *fp, block *bp)
+static int write_blocks(demo_writer *w, block *bp)
 {
   block *b;
   int ret;
@@ -1207,7 +3060,7 @@ static int write_blocks(FILE *fp, block *bp)
     if (b->length == 0) {
       continue;
     }
-    ret = write_block(fp, b);
+    ret = write_block(w, b);
     if (ret != DEMO_OK) {
       return ret;
     }
@@ -1216,29 +3069,29 @@ static int write_blocks(FILE *fp, block *bp)
   return DEMO_OK;
 }
 
-static int write_block(FILE *fp, block *b)
+static int write_block(demo_writer *w, block *b)
 {
   size_t count;
   int i;
 
   // write length
-  count = write_uint32_t(fp, b->length);
+  count = write_uint32_t(w, b->length);
   if (count != 1) {
-    return DEMO_CANNOT_WRITE;
+    return w->ret;
   }
 
   // write angles
   for (i = 0; i < 3; i++) {
-    count = write_float(fp, b->angles[i]);
+    count = write_float(w, b->angles[i]);
     if (count != 1) {
-      return DEMO_CANNOT_WRITE;
+      return w->ret;
     }
   }
 
-  return write_messages(fp, b->messages, b->length);
+  return write_messages(w, b->messages, b->length);
 }
 
-static int write_messages(FILE *fp, message *m, uint32_t length)
+static int write_messages(demo_writer *w, message *m, uint32_t length)
 {
   int ret;
   size_t written;
@@ -1247,7 +3100,7 @@ static int write_messages(FILE *fp, message *m, uint32_t length)
   // write all block messages
   writesize = 0;
   for (; m != NULL; m = m->next) {
-    ret = write_message(fp, m, &written);
+    ret = write_message(w, m, &written);
     if (ret != DEMO_OK) {
       return ret;
     }
@@ -1266,10 +3119,10 @@ static int write_messages(FILE *fp, message *m, uint32_t length)
   return DEMO_OK;
 }
 
-static int write_message(FILE *fp, message *m, size_t *written)
+static int write_message(demo_writer *w, message *m, size_t *written)
 {
   uint8_t du8;
-  size_t w = 0;
+  size_t n = 0;
   int count;
 
   // write message id
@@ -1277,26 +3130,26 @@ static int write_message(FILE *fp, message *m, size_t *written)
     return bp(DEMO_CORRUPT_DEMO);
   }
   du8 = (uint8_t)m->type;
-  count = fwrite(&du8, sizeof(du8), 1, fp);
+  count = out_write(&du8, sizeof(du8), 1, w);
   if (count != 1) {
-    return DEMO_CANNOT_WRITE;
+    return w->ret;
   }
-  w += 1;
+  n += 1;
 
   // write message data
   if (m->size != 0) {
-    count = fwrite(m->data, m->size, 1, fp);
+    count = out_write(m->data, m->size, 1, w);
     if (count != 1) {
-      return DEMO_CANNOT_WRITE;
+      return w->ret;
     }
   }
-  w += m->size;
+  n += m->size;
 
-  *written = w;
+  *written = n;
   return DEMO_OK;
 }
 
-static size_t write_uint32_t(FILE *fp, uint32_t du32)
+static size_t write_uint32_t(demo_writer *w, uint32_t du32)
 {
   uint8_t du[4];
 
@@ -1304,13 +3157,67 @@ static size_t write_uint32_t(FILE *fp, uint32_t du32)
   du[1] = (du32 & 0x0000FF00) >> 8;
   du[2] = (du32 & 0x00FF0000) >> 16;
   du[3] = (du32 & 0xFF000000) >> 24;
-  return fwrite(du, sizeof(du), 1, fp);
+  return out_write(du, sizeof(du), 1, w);
 }
 
-static size_t write_float(FILE *fp, float df32)
+static size_t write_float(demo_writer *w, float df32)
 {
   uint32_t du32 = *(uint32_t *)&df32;
-  return write_uint32_t(fp, du32);
+  return write_uint32_t(w, du32);
+}
+
+/*****************************************************************************
+ *                                                                           *
+ *                CLONE FUNCTIONS                                            *
+ *                                                                           *
+ *****************************************************************************/
+
+/* Copies a message list. Shared payloads get another reference, other data
+ * is copied.
+ */
+static int copy_messages(message *m, message **copy)
+{
+  message *head = NULL;
+  message *tail = NULL;
+  message *nm;
+  int ret;
+
+  for (; m != NULL; m = m->next) {
+    GET_MEMORY(nm, sizeof(message), ret, copy_messages_failure);
+    nm->size = m->size;
+    nm->type = m->type;
+
+    if (m->payload != NULL) {
+      demo_payload_retain(m->payload);
+      nm->payload = m->payload;
+      nm->data = m->data;
+    }
+    else if (m->data != NULL) {
+      nm->data = malloc(m->size);
+      if (nm->data == NULL) {
+        free(nm);
+        ret = DEMO_NO_MEMORY;
+        goto copy_messages_failure;
+      }
+      memcpy(nm->data, m->data, m->size);
+    }
+
+    if (tail == NULL) {
+      head = nm;
+    }
+    else {
+      tail->next = nm;
+      nm->prev = tail;
+    }
+    tail = nm;
+  }
+
+  *copy = head;
+  return DEMO_OK;
+
+ copy_messages_failure:
+  free_messages(head);
+  return ret;
 }
 
 /*****************************************************************************
@@ -1334,7 +3241,14 @@ static int free_blocks(block *b)
 static int free_block(block *b)
 {
   if (b) {
-    free_messages(b->messages);
+    if (b->share == NULL) {
+      free_messages(b->messages);
+    }
+    else if (atomic_fetch_sub_explicit(&b->share->refs, 1,
+                                       memory_order_acq_rel) == 1) {
+      free_messages(b->messages);
+      free(b->share);
+    }
     free(b);
   }
 
@@ -1356,11 +3270,16 @@ static int free_messages(message *m)
 static int free_message(message *m)
 {
   if (m) {
-    if (m->data) {
+    if (m->payload) {
+      demo_payload_release(m->payload);
+    }
+    else if (m->data) {
       free(m->data);
     }
     free(m);
   }
+
+  return DEMO_OK;
 }
 
 /*****************************************************************************
@@ -1369,40 +3288,108 @@ static int free_message(message *m)
  *                                                                           *
  *****************************************************************************/
 
-static int fpeek(FILE *fp)
+static uint32_t get_uint32(const uint8_t *data)
 {
-  int c;
-
-  c = fgetc(fp);
-  ungetc(c, fp);
-  return c;
+  return data[0] | (data[1] << 8) | (data[2] << 16) |
+         ((uint32_t) data[3] << 24);
 }
 
-static int find_protocol(message *m, uint32_t *p)
+/* Picks the tables for the protocol of a SERVERINFO or VERSION message.
+ * Those of a registered protocol are chosen by the flags of SERVERINFO.
+ */
+static int find_protocol(deminfo *di, message *m, const protocol_impl **p)
 {
-  uint32_t protocol = PROTOCOL_UNKNOWN;
+  registered_protocol *r;
+  uint32_t protocol;
+  uint32_t flags = 0;
 
   if (m->type == SERVERINFO || m->type == VERSION) {
-    protocol  = m->data[0];
-    protocol |= m->data[1] << 8;
-    protocol |= m->data[2] << 16;
-    protocol |= m->data[3] << 24;
-
-    *p = protocol;
-    if (protocol != PROTOCOL_NETQUAKE &&
-        protocol != PROTOCOL_FITZQUAKE &&
-        protocol != PROTOCOL_BJP3)
-    {
+    protocol = get_uint32(m->data);
+
+    *p = find_builtin(protocol);
+    if (*p != NULL) {
+      return DEMO_OK;
+    }
+
+    r = find_registered(protocol);
+    if (r == NULL) {
       return DEMO_UNKNOWN_PROTOCOL;
     }
-    else {
-      return DEMO_OK;
+    if (r->def.has_flags) {
+      if (m->type == SERVERINFO) {
+        flags = get_uint32(m->data + 4);
+        di->reselect = 1;
+      }
     }
+    return build_protocol(r, flags, p);
   }
 
   return DEMO_PROTOCOL_NOT_PRESENT;
 }
 
+/* Size of the SERVERINFO header, from the protocol number at its start
+ */
+static size_t serverinfo_header(const uint8_t *data)
+{
+  registered_protocol *r;
+
+  r = find_registered(get_uint32(data));
+  return (r != NULL && r->def.has_flags) ? 10 : 6;
+}
+
+/* Hands the offset of the parser to the progress callbacks. The old one
+ * only takes 32 bits of it.
+ */
+static void report_progress(deminfo *di)
+{
+  uint64_t offset = di->offset + di->in_pos;
+
+  if (di->pcb != NULL) {
+    di->pcb((unsigned int) offset);
+  }
+  if (di->pcb64 != NULL) {
+    di->pcb64(offset);
+  }
+}
+
+/* Counts a block read, and calls the timed progress callback once its
+ * interval has passed. Returns DEMO_CANCELLED if the callback asks to stop.
+ */
+static int check_progress(deminfo *di)
+{
+  demo_progress p;
+  uint64_t now;
+
+  di->blocks++;
+  if (di->progress == NULL) {
+    return DEMO_OK;
+  }
+
+  now = now_ns();
+  if (now < di->progress_next) {
+    return DEMO_OK;
+  }
+  di->progress_next = now + di->progress_ns;
+
+  p.bytes = di->offset + di->in_pos;
+  p.total = di->total;
+  p.blocks = di->blocks;
+  p.elapsed = (now - di->start_ns) / 1e9;
+
+  if (di->progress(di->progress_ctx, &p) != 0) {
+    return DEMO_CANCELLED;
+  }
+  return DEMO_OK;
+}
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 static int count_setbits(uint32_t mask)
 {
   int count;
@@ -0,0 +1,557 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+#include "demo.h"
+#include "demo_simd.h"
+
+/*****************************************************************************
+ *                                                                           *
+ *                DEFINITIONS                                                *
+ *                                                                           *
+ *****************************************************************************/
+
+#define COORD_SCALE (1.0f / 8.0f)
+#define ANGLE_SCALE (360.0f / 256.0f)
+#define VELOCITY_SCALE 16.0f
+#define DEFAULT_VIEWHEIGHT 22.0f
+
+#define BATCH 256 // messages staged per kernel call
+
+// entity update bits
+#define U_MOREBITS   0x00000001
+#define U_ORIGIN1    0x00000002
+#define U_ORIGIN2    0x00000004
+#define U_ORIGIN3    0x00000008
+#define U_ANGLE2     0x00000010
+#define U_FRAME      0x00000040
+#define U_ANGLE1     0x00000100
+#define U_ANGLE3     0x00000200
+#define U_MODEL      0x00000400
+#define U_COLORMAP   0x00000800
+#define U_SKIN       0x00001000
+#define U_EFFECTS    0x00002000
+#define U_LONGENTITY 0x00004000
+#define U_EXTEND1    0x00008000
+#define U_EXTEND2    0x00800000
+
+// clientdata bits
+#define SU_VIEWHEIGHT 0x00000001
+#define SU_IDEALPITCH 0x00000002
+#define SU_PUNCH1     0x00000004
+#define SU_VELOCITY1  0x00000020
+#define SU_EXTEND1    0x00008000
+#define SU_EXTEND2    0x00800000
+
+typedef void (*dequant_fn)(const uint8_t *src, float *dst, size_t n,
+                           float scale);
+
+/* The kernels of one DEMO_SIMD_* level
+ */
+typedef struct {
+  dequant_fn s16;
+  dequant_fn s8;
+} kernel_set;
+
+/*****************************************************************************
+ *                                                                           *
+ *                FORWARD REFERENCES                                         *
+ *                                                                           *
+ *****************************************************************************/
+
+static int detect_level(void);
+static const kernel_set *get_kernels(void);
+static int known_protocol(uint32_t protocol);
+
+static void dequant_s16_scalar(const uint8_t *src, float *dst, size_t n,
+                               float scale);
+static void dequant_s8_scalar(const uint8_t *src, float *dst, size_t n,
+                              float scale);
+#ifdef HAVE_X86_KERNELS
+static void dequant_s16_sse2(const uint8_t *src, float *dst, size_t n,
+                             float scale);
+static void dequant_s8_sse2(const uint8_t *src, float *dst, size_t n,
+                            float scale);
+static void dequant_s16_avx2(const uint8_t *src, float *dst, size_t n,
+                             float scale);
+static void dequant_s8_avx2(const uint8_t *src, float *dst, size_t n,
+                            float scale);
+#endif
+
+static int stage_entity_update(uint32_t protocol, message *m,
+                               uint16_t *entity, uint32_t *bits,
+                               uint8_t *coords, uint8_t *angles);
+static int stage_clientdata(uint32_t protocol, message *m, uint32_t *bits,
+                            uint8_t *view, uint8_t *punch, uint8_t *velocity);
+
+/*****************************************************************************
+ *                                                                           *
+ *                KERNEL SELECTION                                           *
+ *                                                                           *
+ *****************************************************************************/
+
+/* Indexed by level. Only the level is shared between threads, each call
+ * looks its kernels up once, so a concurrent demo_simd_select() never
+ * mixes levels within a call.
+ */
+static const kernel_set kernels[] = {
+  {dequant_s16_scalar, dequant_s8_scalar},
+#ifdef HAVE_X86_KERNELS
+  {dequant_s16_sse2, dequant_s8_sse2},
+  {dequant_s16_avx2, dequant_s8_avx2},
+#endif
+};
+
+static atomic_int simd_level = DEMO_SIMD_AUTO;
+
+int demo_simd_level(void)
+{
+  int level = atomic_load_explicit(&simd_level, memory_order_relaxed);
+  int expected = DEMO_SIMD_AUTO;
+
+  if (level == DEMO_SIMD_AUTO) {
+    level = detect_level();
+    // a level pinned meanwhile by demo_simd_select() wins
+    if (!atomic_compare_exchange_strong_explicit(&simd_level, &expected,
+                                                 level, memory_order_relaxed,
+                                                 memory_order_relaxed)) {
+      level = expected;
+    }
+  }
+
+  return level;
+}
+
+int demo_simd_select(int level)
+{
+  int supported = detect_level();
+
+  if (level == DEMO_SIMD_AUTO || level > supported) {
+    level = supported;
+  }
+  if (level < DEMO_SIMD_SCALAR) {
+    level = DEMO_SIMD_SCALAR;
+  }
+  atomic_store_explicit(&simd_level, level, memory_order_relaxed);
+
+  return level;
+}
+
+static int detect_level(void)
+{
+#ifdef HAVE_X86_KERNELS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return DEMO_SIMD_AVX2;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return DEMO_SIMD_SSE2;
+  }
+#endif
+  return DEMO_SIMD_SCALAR;
+}
+
+static const kernel_set *get_kernels(void)
+{
+  return &kernels[demo_simd_level()];
+}
+
+/* The stagers know the layouts of the built in protocols, not those of
+ * protocols registered with demo_register_protocol()
+ */
+static int known_protocol(uint32_t protocol)
+{
+  return protocol == PROTOCOL_UNKNOWN || protocol == PROTOCOL_NETQUAKE ||
+         protocol == PROTOCOL_FITZQUAKE || protocol == PROTOCOL_BJP3;
+}
+
+/*****************************************************************************
+ *                                                                           *
+ *                API                                                        *
+ *                                                                           *
+ *****************************************************************************/
+
+void demo_dequant_coords(const uint8_t *src, float *dst, size_t n)
+{
+  get_kernels()->s16(src, dst, n, COORD_SCALE);
+}
+
+void demo_dequant_angles(const uint8_t *src, float *dst, size_t n)
+{
+  get_kernels()->s8(src, dst, n, ANGLE_SCALE);
+}
+
+/* Entity updates are staged into packed raw coord and angle arrays, one
+ * batch at a time, which are then dequantized by the kernels straight into
+ * the caller's float arrays.
+ */
+int demo_decode_entity_updates(uint32_t protocol, message *const *msgs,
+                               size_t n, uint16_t *entities, uint32_t *bits,
+                               float *origins, float *angles)
+{
+  uint8_t rawcoords[BATCH * 3 * 2];
+  uint8_t rawangles[BATCH * 3];
+  const kernel_set *k = get_kernels();
+  uint16_t entity;
+  uint32_t mask;
+  size_t done;
+  size_t count;
+  size_t i;
+  int ret;
+
+  if (!known_protocol(protocol)) {
+    return DEMO_BAD_PARAMS;
+  }
+
+  for (done = 0; done < n; done += count) {
+    count = n - done;
+    if (count > BATCH) {
+      count = BATCH;
+    }
+
+    for (i = 0; i < count; i++) {
+      ret = stage_entity_update(protocol, msgs[done + i], &entity, &mask,
+                                rawcoords + i * 6, rawangles + i * 3);
+      if (ret != DEMO_OK) {
+        return ret;
+      }
+      if (entities != NULL) {
+        entities[done + i] = entity;
+      }
+      if (bits != NULL) {
+        bits[done + i] = mask;
+      }
+    }
+
+    if (origins != NULL) {
+      k->s16(rawcoords, origins + done * 3, count * 3, COORD_SCALE);
+    }
+    if (angles != NULL) {
+      k->s8(rawangles, angles + done * 3, count * 3, ANGLE_SCALE);
+    }
+  }
+
+  return DEMO_OK;
+}
+
+int demo_decode_clientdata(uint32_t protocol, message *const *msgs, size_t n,
+                           uint32_t *bits, float *view, float *punch,
+                           float *velocity)
+{
+  uint8_t rawview[BATCH * 2];
+  uint8_t rawpunch[BATCH * 3];
+  uint8_t rawvelocity[BATCH * 3];
+  const kernel_set *k = get_kernels();
+  uint32_t mask;
+  size_t done;
+  size_t count;
+  size_t i;
+  int ret;
+
+  if (!known_protocol(protocol)) {
+    return DEMO_BAD_PARAMS;
+  }
+
+  for (done = 0; done < n; done += count) {
+    count = n - done;
+    if (count > BATCH) {
+      count = BATCH;
+    }
+
+    for (i = 0; i < count; i++) {
+      ret = stage_clientdata(protocol, msgs[done + i], &mask,
+                             rawview + i * 2, rawpunch + i * 3,
+                             rawvelocity + i * 3);
+      if (ret != DEMO_OK) {
+        return ret;
+      }
+      if (bits != NULL) {
+        bits[done + i] = mask;
+      }
+    }
+
+    if (view != NULL) {
+      k->s8(rawview, view + done * 2, count * 2, 1.0f);
+      for (i = 0; i < count; i++) {
+        if (!(msgs[done + i]->data[0] & SU_VIEWHEIGHT)) {
+          view[(done + i) * 2] = DEFAULT_VIEWHEIGHT;
+        }
+      }
+    }
+    if (punch != NULL) {
+      k->s8(rawpunch, punch + done * 3, count * 3, 1.0f);
+    }
+    if (velocity != NULL) {
+      k->s8(rawvelocity, velocity + done * 3, count * 3,
+                 VELOCITY_SCALE);
+    }
+  }
+
+  return DEMO_OK;
+}
+
+/*****************************************************************************
+ *                                                                           *
+ *                STAGING FUNCTIONS                                          *
+ *                                                                           *
+ *****************************************************************************/
+
+/* Walks the entity update payload as laid out by read_message(), copying
+ * the raw origin and angle fields into the staging arrays. Absent fields
+ * are staged as 0.
+ */
+static int stage_entity_update(uint32_t protocol, message *m,
+                               uint16_t *entity, uint32_t *bits,
+                               uint8_t *coords, uint8_t *angles)
+{
+  static const uint32_t origin_bits[3] = { U_ORIGIN1, U_ORIGIN2, U_ORIGIN3 };
+  static const uint32_t angle_bits[3] = { U_ANGLE1, U_ANGLE2, U_ANGLE3 };
+  uint32_t mask;
+  uint32_t i = 0;
+  uint32_t need;
+  int c;
+
+  if (m->type < 128 || m->type > 255) {
+    return DEMO_BAD_PARAMS;
+  }
+
+  mask = m->type & 0x7F;
+  if (mask & U_MOREBITS) {
+    if (i >= m->size) {
+      return DEMO_CORRUPT_DEMO;
+    }
+    mask |= m->data[i++] << 8;
+  }
+  if (protocol == PROTOCOL_FITZQUAKE) {
+    if (mask & U_EXTEND1) {
+      if (i >= m->size) {
+        return DEMO_CORRUPT_DEMO;
+      }
+      mask |= m->data[i++] << 16;
+    }
+    if (mask & U_EXTEND2) {
+      if (i >= m->size) {
+        return DEMO_CORRUPT_DEMO;
+      }
+      mask |= (uint32_t) m->data[i++] << 24;
+    }
+  }
+
+  // entity, model, frame, colormap, skin, effects, then 3 * (coord, angle)
+  need = i + 1;
+  if (mask & U_LONGENTITY) {
+    need += 1;
+  }
+  if (mask & U_MODEL) {
+    need += (protocol == PROTOCOL_BJP3) ? 2 : 1;
+  }
+  need += ((mask & U_FRAME) != 0) + ((mask & U_COLORMAP) != 0) +
+          ((mask & U_SKIN) != 0) + ((mask & U_EFFECTS) != 0);
+  need += ((mask & U_ORIGIN1) != 0) * 2 + ((mask & U_ANGLE1) != 0) +
+          ((mask & U_ORIGIN2) != 0) * 2 + ((mask & U_ANGLE2) != 0) +
+          ((mask & U_ORIGIN3) != 0) * 2 + ((mask & U_ANGLE3) != 0);
+  if (need > m->size) {
+    return DEMO_CORRUPT_DEMO;
+  }
+
+  if (mask & U_LONGENTITY) {
+    *entity = m->data[i] | (m->data[i + 1] << 8);
+    i += 2;
+  }
+  else {
+    *entity = m->data[i++];
+  }
+  if (mask & U_MODEL) {
+    i += (protocol == PROTOCOL_BJP3) ? 2 : 1;
+  }
+  i += ((mask & U_FRAME) != 0) + ((mask & U_COLORMAP) != 0) +
+       ((mask & U_SKIN) != 0) + ((mask & U_EFFECTS) != 0);
+
+  for (c = 0; c < 3; c++) {
+    if (mask & origin_bits[c]) {
+      coords[c * 2] = m->data[i++];
+      coords[c * 2 + 1] = m->data[i++];
+    }
+    else {
+      coords[c * 2] = 0;
+      coords[c * 2 + 1] = 0;
+    }
+    if (mask & angle_bits[c]) {
+      angles[c] = m->data[i++];
+    }
+    else {
+      angles[c] = 0;
+    }
+  }
+
+  *bits = mask;
+  return DEMO_OK;
+}
+
+/* Walks the CLIENTDATA payload as laid out by read_message(): the 16 bit
+ * mask, FitzQuake extension bytes, then viewheight, idealpitch and the
+ * interleaved punch/velocity chars.
+ */
+static int stage_clientdata(uint32_t protocol, message *m, uint32_t *bits,
+                            uint8_t *view, uint8_t *punch, uint8_t *velocity)
+{
+  uint32_t mask;
+  uint32_t i = 2;
+  uint32_t need;
+  int c;
+
+  if (m->type != CLIENTDATA || m->size < 2) {
+    return (m->type != CLIENTDATA) ? DEMO_BAD_PARAMS : DEMO_CORRUPT_DEMO;
+  }
+
+  mask = m->data[0] | (m->data[1] << 8);
+  if (protocol == PROTOCOL_FITZQUAKE) {
+    if (mask & SU_EXTEND1) {
+      if (i >= m->size) {
+        return DEMO_CORRUPT_DEMO;
+      }
+      mask |= m->data[i++] << 16;
+      if (mask & SU_EXTEND2) {
+        if (i >= m->size) {
+          return DEMO_CORRUPT_DEMO;
+        }
+        mask |= (uint32_t) m->data[i++] << 24;
+      }
+    }
+  }
+
+  need = i + __builtin_popcount(mask & 0xFF);
+  if (need > m->size) {
+    return DEMO_CORRUPT_DEMO;
+  }
+
+  view[0] = (mask & SU_VIEWHEIGHT) ? m->data[i++] : 0;
+  view[1] = (mask & SU_IDEALPITCH) ? m->data[i++] : 0;
+  for (c = 0; c < 3; c++) {
+    punch[c] = (mask & (SU_PUNCH1 << c)) ? m->data[i++] : 0;
+    velocity[c] = (mask & (SU_VELOCITY1 << c)) ? m->data[i++] : 0;
+  }
+
+  *bits = mask;
+  return DEMO_OK;
+}
+
+/*****************************************************************************
+ *                                                                           *
+ *                KERNELS                                                    *
+ *                                                                           *
+ *****************************************************************************/
+
+/* Scalar reference kernels. The vector kernels must produce bit identical
+ * results, which holds since every int16 is exact in a float and each
+ * output is a single multiplication.
+ */
+static void dequant_s16_scalar(const uint8_t *src, float *dst, size_t n,
+                               float scale)
+{
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    int16_t v = (int16_t) (src[i * 2] | (src[i * 2 + 1] << 8));
+    dst[i] = (float) v * scale;
+  }
+}
+
+static void dequant_s8_scalar(const uint8_t *src, float *dst, size_t n,
+                              float scale)
+{
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    dst[i] = (float) (int8_t) src[i] * scale;
+  }
+}
+
+#ifdef HAVE_X86_KERNELS
+
+__attribute__((target("sse2")))
+static void dequant_s16_sse2(const uint8_t *src, float *dst, size_t n,
+                             float scale)
+{
+  __m128 vscale = _mm_set1_ps(scale);
+  size_t i;
+
+  for (i = 0; i + 8 <= n; i += 8) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (src + i * 2));
+    __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+    __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+    _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), vscale));
+    _mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), vscale));
+  }
+  dequant_s16_scalar(src + i * 2, dst + i, n - i, scale);
+}
+
+__attribute__((target("sse2")))
+static void dequant_s8_sse2(const uint8_t *src, float *dst, size_t n,
+                            float scale)
+{
+  __m128 vscale = _mm_set1_ps(scale);
+  size_t i;
+  int k;
+
+  for (i = 0; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+    __m128i w[2];
+    w[0] = _mm_unpacklo_epi8(v, v);
+    w[1] = _mm_unpackhi_epi8(v, v);
+    for (k = 0; k < 2; k++) {
+      __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(w[k], w[k]), 24);
+      __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(w[k], w[k]), 24);
+      _mm_storeu_ps(dst + i + k * 8,
+                    _mm_mul_ps(_mm_cvtepi32_ps(lo), vscale));
+      _mm_storeu_ps(dst + i + k * 8 + 4,
+                    _mm_mul_ps(_mm_cvtepi32_ps(hi), vscale));
+    }
+  }
+  dequant_s8_scalar(src + i, dst + i, n - i, scale);
+}
+
+__attribute__((target("avx2")))
+static void dequant_s16_avx2(const uint8_t *src, float *dst, size_t n,
+                             float scale)
+{
+  __m256 vscale = _mm256_set1_ps(scale);
+  size_t i;
+
+  for (i = 0; i + 16 <= n; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *) (src + i * 2));
+    __m128i b = _mm_loadu_si128((const __m128i *) (src + i * 2 + 16));
+    __m256 fa = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(a));
+    __m256 fb = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(b));
+    _mm256_storeu_ps(dst + i, _mm256_mul_ps(fa, vscale));
+    _mm256_storeu_ps(dst + i + 8, _mm256_mul_ps(fb, vscale));
+  }
+  dequant_s16_scalar(src + i * 2, dst + i, n - i, scale);
+}
+
+__attribute__((target("avx2")))
+static void dequant_s8_avx2(const uint8_t *src, float *dst, size_t n,
+                            float scale)
+{
+  __m256 vscale = _mm256_set1_ps(scale);
+  size_t i;
+  int k;
+
+  for (i = 0; i + 32 <= n; i += 32) {
+    for (k = 0; k < 4; k++) {
+      __m128i v = _mm_loadl_epi64((const __m128i *) (src + i + k * 8));
+      __m256 f = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(v));
+      _mm256_storeu_ps(dst + i + k * 8, _mm256_mul_ps(f, vscale));
+    }
+  }
+  dequant_s8_scalar(src + i, dst + i, n - i, scale);
+}
+
+#endif // HAVE_X86_KERNELS
@@ -0,0 +1,591 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "demo.h"
+#include "demo_hash.h"
+#include "demo_diff.h"
+
+/*****************************************************************************
+ *                                                                           *
+ *                DEFINITIONS                                                *
+ *                                                                           *
+ *****************************************************************************/
+
+#define MYERS_MAX_EDITS 256 // beyond this a stretch is replaced as a whole
+
+/*****************************************************************************
+ *                                                                           *
+ *                DATA TYPES                                                 *
+ *                                                                           *
+ *****************************************************************************/
+
+/* Diff state. Runs of the same kind are collected in pending and handed to
+ * the callback once they end.
+ */
+typedef struct {
+  uint64_t *ha;
+  uint64_t *hb;
+  block **ba;
+  block **bb;
+  diff_cb_t cb;
+  void *ctx;
+  diff_op pending;
+  int have_pending;
+  int64_t *history; // Myers V arrays, one per edit count
+} differ;
+
+/* Occurrences of a block hash within the stretch being aligned
+ */
+typedef struct {
+  uint64_t hash;
+  uint32_t count_a;
+  uint32_t count_b;
+  uint64_t pos_b;
+} occurrence;
+
+/* A block occurring once in each demo, and the anchor before it in the
+ * longest increasing run
+ */
+typedef struct {
+  uint64_t a;
+  uint64_t b;
+  int64_t prev;
+} anchor;
+
+/*****************************************************************************
+ *                                                                           *
+ *                FORWARD REFERENCES                                         *
+ *                                                                           *
+ *****************************************************************************/
+
+static int collect_blocks(demo *d, block ***blocks, uint64_t **hashes,
+                          uint64_t *count);
+static int diff_range(differ *d, uint64_t a_lo, uint64_t a_hi,
+                      uint64_t b_lo, uint64_t b_hi);
+static int find_anchors(differ *d, uint64_t a_lo, uint64_t a_hi,
+                        uint64_t b_lo, uint64_t b_hi, anchor **anchors,
+                        size_t *count);
+static int myers(differ *d, uint64_t a_lo, uint64_t a_hi, uint64_t b_lo,
+                 uint64_t b_hi, int *done);
+static int replace(differ *d, uint64_t a_lo, uint64_t a_hi, uint64_t b_lo,
+                   uint64_t b_hi);
+static int emit(differ *d, int kind, uint64_t a, uint64_t b, uint64_t na,
+                uint64_t nb);
+static int emit_changed(differ *d, uint64_t a, uint64_t b);
+static int flush(differ *d);
+static int same_message(const message *a, const message *b);
+
+/*****************************************************************************
+ *                                                                           *
+ *                API                                                        *
+ *                                                                           *
+ *****************************************************************************/
+
+int demo_diff(demo *a, demo *b, diff_cb_t cb, void *ctx)
+{
+  differ d;
+  uint64_t na = 0;
+  uint64_t nb = 0;
+  int ret;
+
+  if (a == NULL || b == NULL || cb == NULL) {
+    return DEMO_BAD_PARAMS;
+  }
+
+  memset(&d, 0, sizeof(d));
+  d.cb = cb;
+  d.ctx = ctx;
+
+  ret = collect_blocks(a, &d.ba, &d.ha, &na);
+  if (ret == DEMO_OK) {
+    ret = collect_blocks(b, &d.bb, &d.hb, &nb);
+  }
+  if (ret == DEMO_OK) {
+    ret = diff_range(&d, 0, na, 0, nb);
+  }
+  if (ret == DEMO_OK) {
+    ret = flush(&d);
+  }
+
+  free(d.ha);
+  free(d.hb);
+  free(d.ba);
+  free(d.bb);
+  free(d.history);
+
+  return (ret == DEMO_SCAN_STOP) ? DEMO_OK : ret;
+}
+
+/*****************************************************************************
+ *                                                                           *
+ *                ALIGNMENT FUNCTIONS                                        *
+ *                                                                           *
+ *****************************************************************************/
+
+/* Numbers the blocks of a demo and hashes them
+ */
+static int collect_blocks(demo *d, block ***blocks, uint64_t **hashes,
+                          uint64_t *count)
+{
+  block *b;
+  uint64_t n = 0;
+
+  for (b = d->blocks; b != NULL; b = b->next) {
+    n++;
+  }
+
+  *blocks = malloc((n + 1) * sizeof(block *));
+  *hashes = malloc((n + 1) * sizeof(uint64_t));
+  if (*blocks == NULL || *hashes == NULL) {
+    return DEMO_NO_MEMORY;
+  }
+
+  for (n = 0, b = d->blocks; b != NULL; b = b->next, n++) {
+    (*blocks)[n] = b;
+    (*hashes)[n] = demo_hash_block(b);
+  }
+
+  *count = n;
+  return DEMO_OK;
+}
+
+/* Aligns blocks a_lo to a_hi - 1 of a with b_lo to b_hi - 1 of b
+ */
+static int diff_range(differ *d, uint64_t a_lo, uint64_t a_hi,
+                      uint64_t b_lo, uint64_t b_hi)
+{
+  anchor *anchors = NULL;
+  uint64_t prefix = 0;
+  uint64_t suffix = 0;
+  size_t count;
+  size_t i;
+  int done;
+  int ret;
+
+  while (a_lo + prefix < a_hi && b_lo + prefix < b_hi &&
+         d->ha[a_lo + prefix] == d->hb[b_lo + prefix]) {
+    prefix++;
+  }
+  ret = emit(d, DIFF_SAME, a_lo, b_lo, prefix, prefix);
+  if (ret != DEMO_OK) {
+    return ret;
+  }
+  a_lo += prefix;
+  b_lo += prefix;
+
+  while (a_hi - suffix > a_lo && b_hi - suffix > b_lo &&
+         d->ha[a_hi - suffix - 1] == d->hb[b_hi - suffix - 1]) {
+    suffix++;
+  }
+  a_hi -= suffix;
+  b_hi -= suffix;
+
+  if (a_lo == a_hi || b_lo == b_hi) {
+    ret = replace(d, a_lo, a_hi, b_lo, b_hi);
+  }
+  else {
+    ret = find_anchors(d, a_lo, a_hi, b_lo, b_hi, &anchors, &count);
+    if (ret == DEMO_OK && count > 0) {
+      // anchors come out in order, each splits off a smaller stretch
+      for (i = 0; i < count && ret == DEMO_OK; i++) {
+        ret = diff_range(d, a_lo, anchors[i].a, b_lo, anchors[i].b);
+        if (ret == DEMO_OK) {
+          ret = emit(d, DIFF_SAME, anchors[i].a, anchors[i].b, 1, 1);
+        }
+        a_lo = anchors[i].a + 1;
+        b_lo = anchors[i].b + 1;
+      }
+      if (ret == DEMO_OK) {
+        ret = diff_range(d, a_lo, a_hi, b_lo, b_hi);
+      }
+    }
+    else if (ret == DEMO_OK) {
+      ret = myers(d, a_lo, a_hi, b_lo, b_hi, &done);
+      if (ret == DEMO_OK && !done) {
+        ret = replace(d, a_lo, a_hi, b_lo, b_hi);
+      }
+    }
+    free(anchors);
+  }
+
+  if (ret == DEMO_OK) {
+    ret = emit(d, DIFF_SAME, a_hi, b_hi, suffix, suffix);
+  }
+  return ret;
+}
+
+/* Finds the blocks occurring exactly once in both stretches, and of those
+ * the longest run in the same order in both, by patience sorting.
+ */
+static int find_anchors(differ *d, uint64_t a_lo, uint64_t a_hi,
+                        uint64_t b_lo, uint64_t b_hi, anchor **anchors,
+                        size_t *count)
+{
+  occurrence *table;
+  occurrence *o;
+  anchor *cand;
+  size_t *tails;
+  size_t size = 16;
+  size_t mask;
+  size_t ncand = 0;
+  size_t ntails = 0;
+  size_t lo;
+  size_t hi;
+  size_t mid;
+  size_t i;
+  uint64_t j;
+  int64_t k;
+
+  while (size < 2 * ((a_hi - a_lo) + (b_hi - b_lo))) {
+    size *= 2;
+  }
+  mask = size - 1;
+
+  table = calloc(size, sizeof(occurrence));
+  cand = malloc((a_hi - a_lo) * sizeof(anchor));
+  tails = malloc((a_hi - a_lo) * sizeof(size_t));
+  if (table == NULL || cand == NULL || tails == NULL) {
+    free(table);
+    free(cand);
+    free(tails);
+    return DEMO_NO_MEMORY;
+  }
+
+  // the hashes are already well mixed, their low bits make a good index
+#define LOOKUP(h) \
+  for (i = (h) & mask; \
+       (table[i].count_a != 0 || table[i].count_b != 0) && \
+       table[i].hash != (h); i = (i + 1) & mask) \
+    ; \
+  o = &table[i]; \
+  o->hash = (h)
+
+  for (j = a_lo; j < a_hi; j++) {
+    LOOKUP(d->ha[j]);
+    o->count_a++;
+  }
+  for (j = b_lo; j < b_hi; j++) {
+    LOOKUP(d->hb[j]);
+    o->count_b++;
+    o->pos_b = j;
+  }
+
+  for (j = a_lo; j < a_hi; j++) {
+    LOOKUP(d->ha[j]);
+    if (o->count_a == 1 && o->count_b == 1) {
+      cand[ncand].a = j;
+      cand[ncand].b = o->pos_b;
+      ncand++;
+    }
+  }
+#undef LOOKUP
+
+  // longest run increasing in b, tails[n] ends the best run of length n + 1
+  for (i = 0; i < ncand; i++) {
+    lo = 0;
+    hi = ntails;
+    while (lo < hi) {
+      mid = lo + (hi - lo) / 2;
+      if (cand[tails[mid]].b < cand[i].b) {
+        lo = mid + 1;
+      }
+      else {
+        hi = mid;
+      }
+    }
+    cand[i].prev = (lo > 0) ? (int64_t) tails[lo - 1] : -1;
+    tails[lo] = i;
+    if (lo == ntails) {
+      ntails++;
+    }
+  }
+
+  // walk the run back, filling it in from the end
+  *count = ntails;
+  if (ntails > 0) {
+    k = tails[ntails - 1];
+    for (i = ntails; i > 0; i--) {
+      tails[i - 1] = k;
+      k = cand[k].prev;
+    }
+    for (i = 0; i < ntails; i++) {
+      cand[i] = cand[tails[i]];
+    }
+  }
+
+  free(table);
+  free(tails);
+  *anchors = cand;
+  return DEMO_OK;
+}
+
+/* Myers' greedy diff, giving up after MYERS_MAX_EDITS edits. The V array of
+ * every edit count is kept for the walk back.
+ */
+static int myers(differ *d, uint64_t a_lo, uint64_t a_hi, uint64_t b_lo,
+                 uint64_t b_hi, int *done)
+{
+  const int64_t width = 2 * MYERS_MAX_EDITS + 3;
+  const int64_t off = MYERS_MAX_EDITS + 1;
+  int64_t n = a_hi - a_lo;
+  int64_t m = b_hi - b_lo;
+  int64_t *v;
+  int64_t *prev;
+  int64_t dist;
+  int64_t k;
+  int64_t x;
+  int64_t y;
+  int64_t px;
+  int64_t py;
+  int64_t x0;
+  int64_t ra;
+  int64_t rb;
+  int64_t last = -1;
+  uint8_t *script;
+  int64_t len = 0;
+  int64_t i;
+  int ret = DEMO_OK;
+
+  *done = 0;
+  if (n + m > 0 && (n > INT32_MAX || m > INT32_MAX)) {
+    return DEMO_OK;
+  }
+
+  if (d->history == NULL) {
+    d->history = malloc((MYERS_MAX_EDITS + 1) * width * sizeof(int64_t));
+    if (d->history == NULL) {
+      return DEMO_NO_MEMORY;
+    }
+  }
+
+  for (dist = 0; dist <= MYERS_MAX_EDITS && last < 0; dist++) {
+    v = d->history + dist * width;
+    prev = (dist > 0) ? v - width : NULL;
+    for (k = -dist; k <= dist; k += 2) {
+      if (dist == 0) {
+        x = 0;
+      }
+      else if (k == -dist || (k != dist && prev[off + k - 1] <
+                              prev[off + k + 1])) {
+        x = prev[off + k + 1];
+      }
+      else {
+        x = prev[off + k - 1] + 1;
+      }
+      y = x - k;
+      while (x < n && y < m && d->ha[a_lo + x] == d->hb[b_lo + y]) {
+        x++;
+        y++;
+      }
+      v[off + k] = x;
+      if (x >= n && y >= m) {
+        last = dist;
+        break;
+      }
+    }
+  }
+  if (last < 0) {
+    return DEMO_OK;
+  }
+
+  // walk back, writing the script from the end: 0 same, 1 removed, 2 added
+  script = malloc(n + m + 1);
+  if (script == NULL) {
+    return DEMO_NO_MEMORY;
+  }
+  x = n;
+  y = m;
+  for (dist = last; dist > 0; dist--) {
+    prev = d->history + (dist - 1) * width;
+    k = x - y;
+    if (k == -dist || (k != dist && prev[off + k - 1] < prev[off + k + 1])) {
+      px = prev[off + k + 1];
+      py = px - k - 1;
+      x0 = px;
+    }
+    else {
+      px = prev[off + k - 1];
+      py = px - k + 1;
+      x0 = px + 1;
+    }
+    for (; x > x0; x--, y--) {
+      script[len++] = 0;
+    }
+    script[len++] = (x0 == px) ? 2 : 1;
+    x = px;
+    y = py;
+  }
+  for (; x > 0; x--) {
+    script[len++] = 0;
+  }
+
+  // removed and added blocks between two identical ones are a replacement
+  x = a_lo;
+  y = b_lo;
+  ra = 0;
+  rb = 0;
+  for (i = len - 1; i >= -1 && ret == DEMO_OK; i--) {
+    if (i >= 0 && script[i] == 1) {
+      ra++;
+    }
+    else if (i >= 0 && script[i] == 2) {
+      rb++;
+    }
+    else {
+      if (ra > 0 || rb > 0) {
+        ret = replace(d, x, x + ra, y, y + rb);
+        x += ra;
+        y += rb;
+        ra = 0;
+        rb = 0;
+      }
+      if (i >= 0 && ret == DEMO_OK) {
+        ret = emit(d, DIFF_SAME, x, y, 1, 1);
+        x++;
+        y++;
+      }
+    }
+  }
+
+  free(script);
+  *done = 1;
+  return ret;
+}
+
+/* Pairs the blocks of two stretches in order as changed, the rest of the
+ * longer one is removed or inserted
+ */
+static int replace(differ *d, uint64_t a_lo, uint64_t a_hi, uint64_t b_lo,
+                   uint64_t b_hi)
+{
+  int ret;
+
+  while (a_lo < a_hi && b_lo < b_hi) {
+    ret = emit_changed(d, a_lo++, b_lo++);
+    if (ret != DEMO_OK) {
+      return ret;
+    }
+  }
+
+  if (a_lo < a_hi) {
+    return emit(d, DIFF_REMOVED, a_lo, b_lo, a_hi - a_lo, 0);
+  }
+  if (b_lo < b_hi) {
+    return emit(d, DIFF_INSERTED, a_lo, b_lo, 0, b_hi - b_lo);
+  }
+  return DEMO_OK;
+}
+
+/*****************************************************************************
+ *                                                                           *
+ *                OUTPUT FUNCTIONS                                           *
+ *                                                                           *
+ *****************************************************************************/
+
+/* Queues a run, joining it to the pending one if it continues it
+ */
+static int emit(differ *d, int kind, uint64_t a, uint64_t b, uint64_t na,
+                uint64_t nb)
+{
+  diff_op *p = &d->pending;
+  int ret;
+
+  if (na == 0 && nb == 0) {
+    return DEMO_OK;
+  }
+
+  if (d->have_pending && p->kind == kind &&
+      p->a_first + p->a_count == a && p->b_first + p->b_count == b) {
+    p->a_count += na;
+    p->b_count += nb;
+    return DEMO_OK;
+  }
+
+  ret = flush(d);
+  if (ret != DEMO_OK) {
+    return ret;
+  }
+
+  memset(p, 0, sizeof(*p));
+  p->kind = kind;
+  p->a_first = a;
+  p->b_first = b;
+  p->a_count = na;
+  p->b_count = nb;
+  d->have_pending = 1;
+  return DEMO_OK;
+}
+
+/* Reports a changed block pair, with the messages that differ after the
+ * identical ones at either end are taken off
+ */
+static int emit_changed(differ *d, uint64_t a, uint64_t b)
+{
+  diff_op op;
+  message *ma = d->ba[a]->messages;
+  message *mb = d->bb[b]->messages;
+  message *ta;
+  message *tb;
+  uint32_t na = 0;
+  uint32_t nb = 0;
+  uint32_t prefix = 0;
+  uint32_t suffix = 0;
+  int ret;
+
+  ret = flush(d);
+  if (ret != DEMO_OK) {
+    return ret;
+  }
+
+  for (ta = ma; ta != NULL && ta->next != NULL; ta = ta->next) {
+    na++;
+  }
+  for (tb = mb; tb != NULL && tb->next != NULL; tb = tb->next) {
+    nb++;
+  }
+  na += (ma != NULL);
+  nb += (mb != NULL);
+
+  while (prefix < na && prefix < nb && same_message(ma, mb)) {
+    ma = ma->next;
+    mb = mb->next;
+    prefix++;
+  }
+  while (suffix < na - prefix && suffix < nb - prefix &&
+         same_message(ta, tb)) {
+    ta = ta->prev;
+    tb = tb->prev;
+    suffix++;
+  }
+
+  memset(&op, 0, sizeof(op));
+  op.kind = DIFF_CHANGED;
+  op.a_first = a;
+  op.b_first = b;
+  op.a_block = d->ba[a];
+  op.b_block = d->bb[b];
+  op.a_message = prefix;
+  op.b_message = prefix;
+  op.a_count = na - prefix - suffix;
+  op.b_count = nb - prefix - suffix;
+
+  return d->cb(d->ctx, &op);
+}
+
+static int flush(differ *d)
+{
+  if (!d->have_pending) {
+    return DEMO_OK;
+  }
+
+  d->have_pending = 0;
+  return d->cb(d->ctx, &d->pending);
+}
+
+static int same_message(const message *a, const message *b)
+{
+  return a->type == b->type && a->size == b->size &&
+    (a->size == 0 || memcmp(a->data, b->data, a->size) == 0);
+}
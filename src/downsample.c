@@ -0,0 +1,412 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "demo.h"
+#include "demo_stream.h"
+
+/*****************************************************************************
+ *                                                                           *
+ *                DEFINITIONS                                                *
+ *                                                                           *
+ *****************************************************************************/
+
+// carried over messages are flushed into the next block before they exceed
+// this, keeping merged blocks well within the engines' 8192 byte messages
+#define PENDING_LIMIT 1024
+
+#define TIME_EPSILON 0.0001f
+
+/*****************************************************************************
+ *                                                                           *
+ *                DATA TYPES                                                 *
+ *                                                                           *
+ *****************************************************************************/
+
+/* Downsampling stage state. The most recent dropped block is held back, so
+ * that it can still be written at the end of the demo.
+ */
+typedef struct {
+  float interval;
+  float next_time;
+  block *held;
+  message *pending;
+  message *pending_tail;
+  uint32_t pending_bytes;
+} downsampler;
+
+/*****************************************************************************
+ *                                                                           *
+ *                FORWARD REFERENCES                                         *
+ *                                                                           *
+ *****************************************************************************/
+
+static int downsample_process(void *ctx, demo *hdr, block **b);
+static int downsample_flush(void *ctx, demo *hdr, block **b);
+static void downsample_destroy(void *ctx);
+
+static int keep_block(block *b, float *time);
+static uint32_t carry_bytes(block *b);
+static void carry_block(downsampler *ds, block *b);
+static void merge_pending(downsampler *ds, block *b);
+static void remove_pending(downsampler *ds, int key);
+static int coalesce_key(message *m);
+static int carried(message *m);
+
+/*****************************************************************************
+ *                                                                           *
+ *                API                                                        *
+ *                                                                           *
+ *****************************************************************************/
+
+/* Creates a stage thinning gameplay blocks to at most fps per second of
+ * server time.
+ */
+int demo_downsample_stage(float fps, demo_stage **stage)
+{
+  demo_stage *s;
+  downsampler *ds;
+
+  if (stage == NULL || !(fps > 0)) {
+    return DEMO_BAD_PARAMS;
+  }
+
+  s = calloc(1, sizeof(demo_stage));
+  ds = calloc(1, sizeof(downsampler));
+  if (s == NULL || ds == NULL) {
+    free(s);
+    free(ds);
+    return DEMO_NO_MEMORY;
+  }
+
+  ds->interval = 1.0f / fps;
+  s->process = downsample_process;
+  s->flush = downsample_flush;
+  s->destroy = downsample_destroy;
+  s->ctx = ds;
+
+  *stage = s;
+  return DEMO_OK;
+}
+
+/*****************************************************************************
+ *                                                                           *
+ *                STAGE FUNCTIONS                                            *
+ *                                                                           *
+ *****************************************************************************/
+
+static int downsample_process(void *ctx, demo *hdr, block **b)
+{
+  downsampler *ds = (downsampler *) ctx;
+  float time = 0;
+  int keep;
+  int ret;
+
+  // messages are moved between blocks
+  ret = demo_block_unshare(*b);
+  if (ret != DEMO_OK) {
+    return ret;
+  }
+
+  keep = keep_block(*b, &time);
+  if (!keep && time >= ds->next_time - TIME_EPSILON) {
+    keep = 1; // due
+  }
+  if (!keep && time + ds->interval < ds->next_time) {
+    keep = 1; // time went back, a new level
+  }
+
+  // whatever was held back is older than this block
+  if (ds->held != NULL) {
+    carry_block(ds, ds->held);
+    demo_free_block(ds->held);
+    ds->held = NULL;
+  }
+
+  if (!keep && ds->pending_bytes + carry_bytes(*b) > PENDING_LIMIT) {
+    keep = 1;
+  }
+
+  if (keep) {
+    merge_pending(ds, *b);
+    if (time > 0) {
+      ds->next_time = time + ds->interval;
+    }
+    return DEMO_OK;
+  }
+
+  ds->held = *b;
+  *b = NULL;
+  return DEMO_OK;
+}
+
+/* The last dropped block is the end of the demo, so it is written after all,
+ * carrying whatever is still pending.
+ */
+static int downsample_flush(void *ctx, demo *hdr, block **b)
+{
+  downsampler *ds = (downsampler *) ctx;
+
+  if (ds->held != NULL) {
+    merge_pending(ds, ds->held);
+    *b = ds->held;
+    ds->held = NULL;
+  }
+
+  return DEMO_OK;
+}
+
+static void downsample_destroy(void *ctx)
+{
+  downsampler *ds = (downsampler *) ctx;
+  message *m;
+  message *mnext;
+
+  demo_free_block(ds->held);
+  for (m = ds->pending; m != NULL; m = mnext) {
+    mnext = m->next;
+    demo_free_message(m);
+  }
+  free(ds);
+}
+
+/*****************************************************************************
+ *                                                                           *
+ *                HELPER FUNCTIONS                                           *
+ *                                                                           *
+ *****************************************************************************/
+
+/* Returns 1 for blocks that must always be kept: those changing persistent
+ * client state, and those without a server time (the signon). The block
+ * time is returned through time.
+ */
+static int keep_block(block *b, float *time)
+{
+  message *m;
+  int keep = 0;
+  int timed = 0;
+
+  for (m = b->messages; m != NULL; m = m->next) {
+    switch (m->type) {
+    case TIME:
+      if (m->size == 4) {
+        memcpy(time, m->data, sizeof(float));
+        timed = 1;
+      }
+      break;
+
+    case DISCONNECT:
+    case VERSION:
+    case SETVIEW:
+    case PRINT:
+    case STUFFTEXT:
+    case SERVERINFO:
+    case LIGHTSTYLE:
+    case UPDATENAME:
+    case SPAWNSTATIC:
+    case SPAWNBINARY:
+    case SPAWNBASELINE:
+    case SETPAUSE:
+    case SIGNONUM:
+    case CENTERPRINT:
+    case SPAWNSTATICSOUND:
+    case INTERMISSION:
+    case FINALE:
+    case CDTRACK:
+    case SELLSCREEN:
+    case CUTSCENE:
+    case BJP3SHOWLMP:
+    case BJP3HIDELMP:
+    case FQSKYBOX:
+    case FQFOG:
+    case FQSPAWNBASELINE2:
+    case FQSPAWNSTATIC2:
+    case FQSPAWNSTATICSOUND2:
+    case BJP3FOG:
+      keep = 1;
+      break;
+
+    default:
+      break;
+    }
+  }
+
+  return keep || !timed;
+}
+
+static uint32_t carry_bytes(block *b)
+{
+  message *m;
+  uint32_t bytes = 0;
+
+  for (m = b->messages; m != NULL; m = m->next) {
+    if (carried(m)) {
+      bytes += m->size + 1;
+    }
+  }
+
+  return bytes;
+}
+
+/* Moves the messages of a dropped block that still matter onto the pending
+ * list, replacing older pending messages carrying the same state.
+ */
+static void carry_block(downsampler *ds, block *b)
+{
+  message *m;
+  message *mnext;
+
+  for (m = b->messages; m != NULL; m = mnext) {
+    mnext = m->next;
+    if (!carried(m)) {
+      continue;
+    }
+
+    // unlink from the block
+    if (m->prev != NULL) {
+      m->prev->next = m->next;
+    }
+    else {
+      b->messages = m->next;
+    }
+    if (m->next != NULL) {
+      m->next->prev = m->prev;
+    }
+
+    remove_pending(ds, coalesce_key(m));
+
+    // append to pending
+    m->next = NULL;
+    m->prev = ds->pending_tail;
+    if (ds->pending_tail != NULL) {
+      ds->pending_tail->next = m;
+    }
+    else {
+      ds->pending = m;
+    }
+    ds->pending_tail = m;
+    ds->pending_bytes += m->size + 1;
+  }
+}
+
+/* Inserts the pending messages into a kept block, right after its TIME
+ * message, so they take effect at the block's time. State the block sets
+ * itself supersedes the pending copy.
+ */
+static void merge_pending(downsampler *ds, block *b)
+{
+  message *m;
+  message *after = NULL;
+
+  for (m = b->messages; m != NULL && ds->pending != NULL; m = m->next) {
+    remove_pending(ds, coalesce_key(m));
+    if (m->type == TIME && after == NULL) {
+      after = m;
+    }
+  }
+  if (ds->pending == NULL) {
+    return;
+  }
+
+  for (m = b->messages; m != NULL && after == NULL; m = m->next) {
+    if (m->type == TIME) {
+      after = m;
+    }
+  }
+
+  if (after != NULL) {
+    ds->pending_tail->next = after->next;
+    if (after->next != NULL) {
+      after->next->prev = ds->pending_tail;
+    }
+    after->next = ds->pending;
+    ds->pending->prev = after;
+  }
+  else {
+    ds->pending_tail->next = b->messages;
+    if (b->messages != NULL) {
+      b->messages->prev = ds->pending_tail;
+    }
+    b->messages = ds->pending;
+    ds->pending->prev = NULL;
+  }
+
+  ds->pending = NULL;
+  ds->pending_tail = NULL;
+  ds->pending_bytes = 0;
+}
+
+static void remove_pending(downsampler *ds, int key)
+{
+  message *m;
+
+  if (key < 0) {
+    return;
+  }
+
+  for (m = ds->pending; m != NULL; m = m->next) {
+    if (coalesce_key(m) == key) {
+      break;
+    }
+  }
+  if (m == NULL) {
+    return;
+  }
+
+  if (m->prev != NULL) {
+    m->prev->next = m->next;
+  }
+  else {
+    ds->pending = m->next;
+  }
+  if (m->next != NULL) {
+    m->next->prev = m->prev;
+  }
+  else {
+    ds->pending_tail = m->prev;
+  }
+  ds->pending_bytes -= m->size + 1;
+  demo_free_message(m);
+}
+
+/* Messages setting absolute state, where only the latest one counts, get a
+ * key identifying the state they set. Others return -1.
+ */
+static int coalesce_key(message *m)
+{
+  switch (m->type) {
+  case UPDATESTAT:
+  case UPDATEFRAGS:
+  case UPDATECOLORS:
+    return (m->size > 0) ? (int) ((m->type << 8) | m->data[0]) : -1;
+
+  case CLIENTDATA:
+  case SETANGLE:
+    return m->type << 8;
+
+  default:
+    return -1;
+  }
+}
+
+/* Entity updates are absolute against the baseline, and each server message
+ * holds every visible entity, so the kept block's updates are the merged
+ * entity state already. The same goes for the time.
+ */
+static int carried(message *m)
+{
+  if (m->type & 0x80) {
+    return 0;
+  }
+
+  switch (m->type) {
+  case TIME:
+  case NOP:
+  case BAD:
+    return 0;
+
+  default:
+    return 1;
+  }
+}
@@ -0,0 +1,385 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "demo.h"
+#include "demo_events.h"
+
+/*****************************************************************************
+ *                                                                           *
+ *                DATA TYPES                                                 *
+ *                                                                           *
+ *****************************************************************************/
+
+/* The events of one message type, in demo order until they are first
+ * queried. Levels only grow and within a level times mostly do, so sorted
+ * stays set unless a time goes back and the list needs a sort.
+ */
+typedef struct {
+  event_ref *refs;
+  size_t count;
+  size_t capacity;
+  int indexed;
+  int sorted;
+} event_list;
+
+struct _demo_events {
+  event_list lists[EVENT_TYPES];
+  uint32_t block;
+  uint32_t level; // counted at each SERVERINFO after the first
+  uint32_t levels;
+  float time;
+};
+
+/* Merge cursor of demo_events_query()
+ */
+typedef struct {
+  uint32_t type;
+  const event_ref *next;
+  const event_ref *end;
+} event_cursor;
+
+/*****************************************************************************
+ *                                                                           *
+ *                FORWARD REFERENCES                                         *
+ *                                                                           *
+ *****************************************************************************/
+
+static int add_event(event_list *l, uint32_t level, uint32_t block,
+                     uint32_t message, float time);
+static int query_level(demo_events *ev, const uint32_t *types,
+                       size_t ntypes, uint32_t level, float start,
+                       float end, event_cb_t cb, void *ctx);
+static void sort_list(event_list *l);
+static size_t lower_bound(const event_list *l, uint32_t level, float time);
+static int event_before(const event_ref *a, const event_ref *b);
+static int compare_events(const void *a, const void *b);
+
+/*****************************************************************************
+ *                                                                           *
+ *                API                                                        *
+ *                                                                           *
+ *****************************************************************************/
+
+int demo_events_new(demo_events **ev, const uint32_t *types, size_t ntypes)
+{
+  demo_events *e;
+  size_t i;
+
+  if (ev == NULL) {
+    return DEMO_BAD_PARAMS;
+  }
+
+  e = calloc(1, sizeof(demo_events));
+  if (e == NULL) {
+    return DEMO_NO_MEMORY;
+  }
+
+  for (i = 0; i < EVENT_TYPES; i++) {
+    e->lists[i].indexed = (types == NULL);
+    e->lists[i].sorted = 1;
+  }
+  for (i = 0; types != NULL && i < ntypes; i++) {
+    if (types[i] >= EVENT_TYPES) {
+      free(e);
+      return DEMO_BAD_PARAMS;
+    }
+    e->lists[types[i]].indexed = 1;
+  }
+
+  *ev = e;
+  return DEMO_OK;
+}
+
+int demo_events_add(demo_events *ev, block *b)
+{
+  message *m;
+  uint32_t index = 0;
+  int ret;
+
+  for (m = b->messages; m != NULL; m = m->next, index++) {
+    if (m->type == TIME && m->size == 4) {
+      memcpy(&ev->time, m->data, 4);
+    }
+
+    // blocks before the first SERVERINFO belong to the first level
+    if (m->type == SERVERINFO) {
+      if (ev->levels > 0) {
+        ev->level++;
+        ev->time = 0;
+      }
+      ev->levels = ev->level + 1;
+    }
+
+    if (m->type < EVENT_TYPES && ev->lists[m->type].indexed) {
+      ret = add_event(&ev->lists[m->type], ev->level, ev->block, index,
+                      ev->time);
+      if (ret != DEMO_OK) {
+        return ret;
+      }
+    }
+  }
+
+  ev->block++;
+  return DEMO_OK;
+}
+
+int demo_events_build(demo_events *ev, demo *d)
+{
+  block *b;
+  int ret;
+
+  if (ev == NULL || d == NULL) {
+    return DEMO_BAD_PARAMS;
+  }
+
+  for (b = d->blocks; b != NULL; b = b->next) {
+    ret = demo_events_add(ev, b);
+    if (ret != DEMO_OK) {
+      return ret;
+    }
+  }
+
+  return DEMO_OK;
+}
+
+uint32_t demo_events_levels(const demo_events *ev)
+{
+  if (ev == NULL) {
+    return 0;
+  }
+
+  // a demo without SERVERINFO still has its events in level 0
+  return (ev->levels > 0) ? ev->levels : (ev->block > 0);
+}
+
+int demo_events_range(demo_events *ev, uint32_t type, uint32_t level,
+                      float start, float end, const event_ref **first,
+                      size_t *count)
+{
+  event_list *l;
+  size_t lo;
+  size_t hi;
+
+  if (ev == NULL || type >= EVENT_TYPES || !ev->lists[type].indexed ||
+      first == NULL || count == NULL) {
+    return DEMO_BAD_PARAMS;
+  }
+
+  l = &ev->lists[type];
+  sort_list(l);
+
+  lo = lower_bound(l, level, start);
+  hi = (end > start) ? lower_bound(l, level, end) : lo;
+
+  *first = l->refs + lo;
+  *count = hi - lo;
+  return DEMO_OK;
+}
+
+int demo_events_query(demo_events *ev, const uint32_t *types,
+                      size_t ntypes, int32_t level, float start, float end,
+                      event_cb_t cb, void *ctx)
+{
+  uint32_t first;
+  uint32_t last;
+  uint32_t l;
+  int ret;
+
+  if (ev == NULL || cb == NULL || level < EVENT_ALL_LEVELS) {
+    return DEMO_BAD_PARAMS;
+  }
+
+  if (level == EVENT_ALL_LEVELS) {
+    first = 0;
+    last = demo_events_levels(ev);
+    if (last == 0) {
+      last = 1; // nothing to find, but the types are still checked
+    }
+  }
+  else {
+    first = (uint32_t) level;
+    last = first + 1;
+  }
+
+  for (l = first; l < last; l++) {
+    ret = query_level(ev, types, ntypes, l, start, end, cb, ctx);
+    if (ret != DEMO_OK) {
+      return (ret == DEMO_SCAN_STOP) ? DEMO_OK : ret;
+    }
+  }
+
+  return DEMO_OK;
+}
+
+int demo_events_free(demo_events *ev)
+{
+  size_t i;
+
+  if (ev != NULL) {
+    for (i = 0; i < EVENT_TYPES; i++) {
+      free(ev->lists[i].refs);
+    }
+    free(ev);
+  }
+
+  return DEMO_OK;
+}
+
+/*****************************************************************************
+ *                                                                           *
+ *                HELPER FUNCTIONS                                           *
+ *                                                                           *
+ *****************************************************************************/
+
+static int add_event(event_list *l, uint32_t level, uint32_t block,
+                     uint32_t message, float time)
+{
+  event_ref *refs;
+  size_t capacity;
+
+  if (l->count == l->capacity) {
+    capacity = (l->capacity == 0) ? 64 : l->capacity * 2;
+    refs = realloc(l->refs, capacity * sizeof(event_ref));
+    if (refs == NULL) {
+      return DEMO_NO_MEMORY;
+    }
+    l->refs = refs;
+    l->capacity = capacity;
+  }
+
+  if (l->count > 0 && level == l->refs[l->count - 1].level &&
+      time < l->refs[l->count - 1].time) {
+    l->sorted = 0;
+  }
+
+  l->refs[l->count].level = level;
+  l->refs[l->count].block = block;
+  l->refs[l->count].message = message;
+  l->refs[l->count].time = time;
+  l->count++;
+
+  return DEMO_OK;
+}
+
+/* Merges the ranges of several types within one level. Returns the error
+ * of the callback as it is, DEMO_SCAN_STOP included.
+ */
+static int query_level(demo_events *ev, const uint32_t *types,
+                       size_t ntypes, uint32_t level, float start,
+                       float end, event_cb_t cb, void *ctx)
+{
+  event_cursor cursors[EVENT_TYPES];
+  uint8_t seen[EVENT_TYPES];
+  const event_ref *first;
+  size_t ncursors = 0;
+  size_t count;
+  size_t best;
+  size_t i;
+  uint32_t type;
+  int ret;
+
+  memset(seen, 0, sizeof(seen));
+  if (types == NULL) {
+    ntypes = EVENT_TYPES;
+  }
+  for (i = 0; i < ntypes; i++) {
+    type = (types == NULL) ? i : types[i];
+    if (types == NULL && !ev->lists[type].indexed) {
+      continue;
+    }
+
+    ret = demo_events_range(ev, type, level, start, end, &first, &count);
+    if (ret != DEMO_OK) {
+      return ret;
+    }
+    if (count == 0 || seen[type]) {
+      continue;
+    }
+    seen[type] = 1;
+
+    cursors[ncursors].type = type;
+    cursors[ncursors].next = first;
+    cursors[ncursors].end = first + count;
+    ncursors++;
+  }
+
+  // few types are queried at a time, a linear pick beats a heap
+  while (ncursors > 0) {
+    best = 0;
+    for (i = 1; i < ncursors; i++) {
+      if (event_before(cursors[i].next, cursors[best].next)) {
+        best = i;
+      }
+    }
+
+    ret = cb(ctx, cursors[best].type, cursors[best].next);
+    if (ret != DEMO_OK) {
+      return ret;
+    }
+
+    if (++cursors[best].next == cursors[best].end) {
+      cursors[best] = cursors[--ncursors];
+    }
+  }
+
+  return DEMO_OK;
+}
+
+/* Sorts the list by level and time. Blocks and messages break ties, so
+ * events of the same time stay in demo order.
+ */
+static void sort_list(event_list *l)
+{
+  if (!l->sorted) {
+    qsort(l->refs, l->count, sizeof(event_ref), compare_events);
+    l->sorted = 1;
+  }
+}
+
+/* Index of the first event at or after time in level, or in a later
+ * level, in a sorted list
+ */
+static size_t lower_bound(const event_list *l, uint32_t level, float time)
+{
+  const event_ref *r;
+  size_t lo = 0;
+  size_t hi = l->count;
+  size_t mid;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    r = &l->refs[mid];
+    if (r->level < level || (r->level == level && r->time < time)) {
+      lo = mid + 1;
+    }
+    else {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
+
+static int event_before(const event_ref *a, const event_ref *b)
+{
+  return compare_events(a, b) < 0;
+}
+
+static int compare_events(const void *a, const void *b)
+{
+  const event_ref *ea = (const event_ref *) a;
+  const event_ref *eb = (const event_ref *) b;
+
+  if (ea->level != eb->level) {
+    return (ea->level < eb->level) ? -1 : 1;
+  }
+  if (ea->time != eb->time) {
+    return (ea->time < eb->time) ? -1 : 1;
+  }
+  if (ea->block != eb->block) {
+    return (ea->block < eb->block) ? -1 : 1;
+  }
+  return (ea->message > eb->message) - (ea->message < eb->message);
+}
@@ -0,0 +1,468 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+#include "demo.h"
+#include "demo_simd.h"
+#include "demo_hash.h"
+
+/*****************************************************************************
+ *                                                                           *
+ *                DEFINITIONS                                                *
+ *                                                                           *
+ *****************************************************************************/
+
+#define STRIPE 64 // bytes per stripe, eight 64 bit lanes
+#define ROUND_STRIPES 16 // stripes between two scrambles of the lanes
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+#define PRIME32_1 0x9E3779B1U
+
+typedef void (*stripes_fn)(uint64_t *acc, const uint8_t *p, size_t n);
+
+/* Lane keys, mixed into the data before the multiply
+ */
+static const uint64_t keys[8] = {
+  0xBE4BA423396CFEB8ULL, 0x1CAD21F72C81017CULL,
+  0xDB979083E96DD4DEULL, 0x1F67B3B7A4A44072ULL,
+  0x78E5C0CC4EE679CBULL, 0x2172FFCC7DD05A82ULL,
+  0x8E2443F7744608B8ULL, 0x4C263A81E69035E0ULL
+};
+
+/*****************************************************************************
+ *                                                                           *
+ *                FORWARD REFERENCES                                         *
+ *                                                                           *
+ *****************************************************************************/
+
+static stripes_fn select_kernel(void);
+static void consume(demo_hash_state *s, const uint8_t *p, size_t n);
+static void scramble(uint64_t *acc);
+static void stripes_scalar(uint64_t *acc, const uint8_t *p, size_t n);
+#ifdef HAVE_X86_KERNELS
+static void stripes_sse2(uint64_t *acc, const uint8_t *p, size_t n);
+static void stripes_avx2(uint64_t *acc, const uint8_t *p, size_t n);
+#endif
+static uint64_t mix_round(uint64_t acc, uint64_t v);
+static uint64_t rotl64(uint64_t v, int r);
+static uint64_t read_le64(const uint8_t *p);
+static uint32_t read_le32(const uint8_t *p);
+static void put_le32(uint8_t *p, uint32_t v);
+static void put_le64(uint8_t *p, uint64_t v);
+
+/*****************************************************************************
+ *                                                                           *
+ *                HASH FUNCTIONS                                             *
+ *                                                                           *
+ *****************************************************************************/
+
+void demo_hash_init(demo_hash_state *s, uint64_t seed)
+{
+  int i;
+
+  memset(s, 0, sizeof(*s));
+  for (i = 0; i < 8; i++) {
+    s->acc[i] = keys[(i + 3) & 7] ^ (seed * PRIME64_5);
+  }
+  s->seed = seed;
+}
+
+/* Whole stripes go straight from the input to the kernel, only the bytes
+ * of a stripe split across updates pass through the buffer.
+ */
+void demo_hash_update(demo_hash_state *s, const void *data, size_t len)
+{
+  const uint8_t *p = (const uint8_t *) data;
+  size_t n;
+
+  s->length += len;
+
+  if (s->buffered > 0) {
+    n = STRIPE - s->buffered;
+    if (n > len) {
+      n = len;
+    }
+    memcpy(s->buffer + s->buffered, p, n);
+    s->buffered += n;
+    p += n;
+    len -= n;
+    if (s->buffered < STRIPE) {
+      return;
+    }
+    consume(s, s->buffer, 1);
+    s->buffered = 0;
+  }
+
+  n = len / STRIPE;
+  if (n > 0) {
+    consume(s, p, n);
+    p += n * STRIPE;
+    len -= n * STRIPE;
+  }
+
+  memcpy(s->buffer, p, len);
+  s->buffered = len;
+}
+
+uint64_t demo_hash_final(const demo_hash_state *s)
+{
+  const uint8_t *p = s->buffer;
+  size_t left = s->buffered;
+  uint64_t h;
+  int i;
+
+  h = s->seed + s->length * PRIME64_1;
+  for (i = 0; i < 8; i++) {
+    h ^= mix_round(0, s->acc[i]);
+    h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+  }
+
+  for (; left >= 8; p += 8, left -= 8) {
+    h ^= mix_round(0, read_le64(p));
+    h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+  }
+  if (left >= 4) {
+    h ^= (uint64_t) read_le32(p) * PRIME64_1;
+    h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+    p += 4;
+    left -= 4;
+  }
+  for (; left > 0; p++, left--) {
+    h ^= *p * PRIME64_5;
+    h = rotl64(h, 11) * PRIME64_1;
+  }
+
+  // avalanche
+  h ^= h >> 33;
+  h *= PRIME64_2;
+  h ^= h >> 29;
+  h *= PRIME64_3;
+  h ^= h >> 32;
+
+  return h;
+}
+
+uint64_t demo_hash64(const void *data, size_t len, uint64_t seed)
+{
+  demo_hash_state s;
+
+  demo_hash_init(&s, seed);
+  demo_hash_update(&s, data, len);
+  return demo_hash_final(&s);
+}
+
+uint64_t demo_hash_block(const block *b)
+{
+  demo_hash_state s;
+  uint8_t header[16];
+  uint32_t bits;
+  uint8_t type;
+  const message *m;
+  int i;
+
+  // as write_block() lays it out, little endian
+  put_le32(header, b->length);
+  for (i = 0; i < 3; i++) {
+    memcpy(&bits, &b->angles[i], 4);
+    put_le32(header + 4 + i * 4, bits);
+  }
+
+  demo_hash_init(&s, 0);
+  demo_hash_update(&s, header, sizeof(header));
+  for (m = b->messages; m != NULL; m = m->next) {
+    type = (uint8_t) m->type;
+    demo_hash_update(&s, &type, 1);
+    if (m->size != 0) {
+      demo_hash_update(&s, m->data, m->size);
+    }
+  }
+
+  return demo_hash_final(&s);
+}
+
+/*****************************************************************************
+ *                                                                           *
+ *                DEMO HASHES                                                *
+ *                                                                           *
+ *****************************************************************************/
+
+int demo_hashes_new(demo_hashes **h)
+{
+  if (h == NULL) {
+    return DEMO_BAD_PARAMS;
+  }
+
+  *h = calloc(1, sizeof(demo_hashes));
+  if (*h == NULL) {
+    return DEMO_NO_MEMORY;
+  }
+
+  return DEMO_OK;
+}
+
+int demo_hashes_add(demo_hashes *h, int32_t track, const block *b)
+{
+  uint64_t *blocks;
+  size_t capacity;
+
+  if (h->block_count == h->capacity) {
+    capacity = (h->capacity == 0) ? 1024 : h->capacity * 2;
+    blocks = realloc(h->blocks, capacity * sizeof(uint64_t));
+    if (blocks == NULL) {
+      return DEMO_NO_MEMORY;
+    }
+    h->blocks = blocks;
+    h->capacity = capacity;
+  }
+
+  h->track = track;
+  h->blocks[h->block_count++] = demo_hash_block(b);
+  return DEMO_OK;
+}
+
+int demo_hashes_build(demo_hashes *h, demo *d)
+{
+  block *b;
+  int ret;
+
+  if (h == NULL || d == NULL) {
+    return DEMO_BAD_PARAMS;
+  }
+
+  h->track = d->track;
+  for (b = d->blocks; b != NULL; b = b->next) {
+    ret = demo_hashes_add(h, d->track, b);
+    if (ret != DEMO_OK) {
+      return ret;
+    }
+  }
+
+  return DEMO_OK;
+}
+
+uint64_t demo_hashes_fingerprint(const demo_hashes *h)
+{
+  demo_hash_state s;
+  uint8_t buf[STRIPE];
+  uint64_t i;
+  size_t n = 0;
+
+  demo_hash_init(&s, (uint32_t) h->track);
+  for (i = 0; i < h->block_count; i++) {
+    put_le64(buf + n, h->blocks[i]);
+    n += 8;
+    if (n == sizeof(buf)) {
+      demo_hash_update(&s, buf, n);
+      n = 0;
+    }
+  }
+  demo_hash_update(&s, buf, n);
+
+  return demo_hash_final(&s);
+}
+
+int demo_hashes_free(demo_hashes *h)
+{
+  if (h != NULL) {
+    free(h->blocks);
+    free(h);
+  }
+
+  return DEMO_OK;
+}
+
+/*****************************************************************************
+ *                                                                           *
+ *                KERNELS                                                    *
+ *                                                                           *
+ *****************************************************************************/
+
+static stripes_fn select_kernel(void)
+{
+  switch (demo_simd_level()) {
+#ifdef HAVE_X86_KERNELS
+  case DEMO_SIMD_AVX2:
+    return stripes_avx2;
+
+  case DEMO_SIMD_SSE2:
+    return stripes_sse2;
+#endif
+
+  default:
+    return stripes_scalar;
+  }
+}
+
+/* Feeds n stripes to the kernel, scrambling the lanes every ROUND_STRIPES
+ * stripes of the whole input.
+ */
+static void consume(demo_hash_state *s, const uint8_t *p, size_t n)
+{
+  stripes_fn fn = select_kernel();
+  size_t k;
+
+  while (n > 0) {
+    k = ROUND_STRIPES - s->stripes;
+    if (k > n) {
+      k = n;
+    }
+
+    fn(s->acc, p, k);
+    p += k * STRIPE;
+    n -= k;
+
+    s->stripes += k;
+    if (s->stripes == ROUND_STRIPES) {
+      scramble(s->acc);
+      s->stripes = 0;
+    }
+  }
+}
+
+/* Spreads the high bits of each lane over the low ones, which are all the
+ * multiply of the next round sees.
+ */
+static void scramble(uint64_t *acc)
+{
+  int i;
+
+  for (i = 0; i < 8; i++) {
+    acc[i] ^= acc[i] >> 47;
+    acc[i] ^= keys[(i + 1) & 7];
+    acc[i] *= PRIME32_1;
+  }
+}
+
+/* Reference kernel. Each lane adds the product of the halves of its keyed
+ * data, and its neighbour's data as it is, so no input bit is lost to the
+ * multiply.
+ */
+static void stripes_scalar(uint64_t *acc, const uint8_t *p, size_t n)
+{
+  uint64_t d;
+  uint64_t dk;
+  size_t k;
+  int i;
+
+  for (k = 0; k < n; k++, p += STRIPE) {
+    for (i = 0; i < 8; i++) {
+      d = read_le64(p + i * 8);
+      dk = d ^ keys[i];
+      acc[i ^ 1] += d;
+      acc[i] += (dk & 0xFFFFFFFF) * (dk >> 32);
+    }
+  }
+}
+
+#ifdef HAVE_X86_KERNELS
+
+__attribute__((target("sse2")))
+static void stripes_sse2(uint64_t *acc, const uint8_t *p, size_t n)
+{
+  __m128i a[4];
+  __m128i k[4];
+  size_t s;
+  int i;
+
+  for (i = 0; i < 4; i++) {
+    a[i] = _mm_loadu_si128((const __m128i *) (acc + i * 2));
+    k[i] = _mm_loadu_si128((const __m128i *) (keys + i * 2));
+  }
+
+  for (s = 0; s < n; s++, p += STRIPE) {
+    for (i = 0; i < 4; i++) {
+      __m128i d = _mm_loadu_si128((const __m128i *) (p + i * 16));
+      __m128i dk = _mm_xor_si128(d, k[i]);
+      __m128i prod = _mm_mul_epu32(dk, _mm_srli_epi64(dk, 32));
+      __m128i swap = _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+      a[i] = _mm_add_epi64(a[i], _mm_add_epi64(prod, swap));
+    }
+  }
+
+  for (i = 0; i < 4; i++) {
+    _mm_storeu_si128((__m128i *) (acc + i * 2), a[i]);
+  }
+}
+
+__attribute__((target("avx2")))
+static void stripes_avx2(uint64_t *acc, const uint8_t *p, size_t n)
+{
+  __m256i a[2];
+  __m256i k[2];
+  size_t s;
+  int i;
+
+  for (i = 0; i < 2; i++) {
+    a[i] = _mm256_loadu_si256((const __m256i *) (acc + i * 4));
+    k[i] = _mm256_loadu_si256((const __m256i *) (keys + i * 4));
+  }
+
+  for (s = 0; s < n; s++, p += STRIPE) {
+    for (i = 0; i < 2; i++) {
+      __m256i d = _mm256_loadu_si256((const __m256i *) (p + i * 32));
+      __m256i dk = _mm256_xor_si256(d, k[i]);
+      __m256i prod = _mm256_mul_epu32(dk, _mm256_srli_epi64(dk, 32));
+      __m256i swap = _mm256_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+      a[i] = _mm256_add_epi64(a[i], _mm256_add_epi64(prod, swap));
+    }
+  }
+
+  for (i = 0; i < 2; i++) {
+    _mm256_storeu_si256((__m256i *) (acc + i * 4), a[i]);
+  }
+}
+
+#endif // HAVE_X86_KERNELS
+
+/*****************************************************************************
+ *                                                                           *
+ *                HELPER FUNCTIONS                                           *
+ *                                                                           *
+ *****************************************************************************/
+
+static uint64_t mix_round(uint64_t acc, uint64_t v)
+{
+  acc += v * PRIME64_2;
+  acc = rotl64(acc, 31);
+  return acc * PRIME64_1;
+}
+
+static uint64_t rotl64(uint64_t v, int r)
+{
+  return (v << r) | (v >> (64 - r));
+}
+
+static uint64_t read_le64(const uint8_t *p)
+{
+  return (uint64_t) read_le32(p) | ((uint64_t) read_le32(p + 4) << 32);
+}
+
+static uint32_t read_le32(const uint8_t *p)
+{
+  return (uint32_t) p[0] | ((uint32_t) p[1] << 8) |
+    ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+  p[0] = v & 0xFF;
+  p[1] = (v >> 8) & 0xFF;
+  p[2] = (v >> 16) & 0xFF;
+  p[3] = (v >> 24) & 0xFF;
+}
+
+static void put_le64(uint8_t *p, uint64_t v)
+{
+  put_le32(p, (uint32_t) v);
+  put_le32(p + 4, (uint32_t) (v >> 32));
+}
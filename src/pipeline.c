@@ -0,0 +1,383 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "demo.h"
+#include "demo_pipeline.h"
+
+/*****************************************************************************
+ *                                                                           *
+ *                DEFINITIONS                                                *
+ *                                                                           *
+ *****************************************************************************/
+
+#define DEFAULT_QUEUE_SIZE 1024
+#define MAX_CONSUMERS 256
+
+#define SPIN_LIMIT 64
+#define YIELD_LIMIT 128
+#define SLEEP_NS 50000
+
+/*****************************************************************************
+ *                                                                           *
+ *                DATA TYPES                                                 *
+ *                                                                           *
+ *****************************************************************************/
+
+/* A queued block. A NULL block tells a consumer to stop.
+ */
+typedef struct {
+  uint64_t seq;
+  demo header;
+  block *b;
+} item;
+
+/* Bounded multi producer, multi consumer queue (after Dmitry Vyukov). Each
+ * cell's sequence tells whether it is free for the producer at a position,
+ * or filled for the consumer at that position.
+ */
+typedef struct {
+  atomic_size_t seq;
+  item it;
+} cell;
+
+typedef struct {
+  cell *cells;
+  size_t mask;
+  atomic_size_t enqueue;
+  atomic_size_t dequeue;
+} queue;
+
+/* Shared state of a running pipeline
+ */
+typedef struct {
+  const demo_pipeline *p;
+  queue q;
+  uint64_t next_seq;           // reader only
+  atomic_uint_fast64_t commit; // next sequence to commit
+  atomic_int failed;           // first error, DEMO_OK while running
+} pipeline;
+
+/*****************************************************************************
+ *                                                                           *
+ *                FORWARD REFERENCES                                         *
+ *                                                                           *
+ *****************************************************************************/
+
+static int queue_init(queue *q, size_t size);
+static int queue_push(queue *q, item *it);
+static int queue_pop(queue *q, item *it);
+
+static int reader_cb(void *ctx, demo *hdr, block **b);
+static void push_item(pipeline *pl, item *it);
+static void *consumer_thread(void *arg);
+static int consume(pipeline *pl, item *it);
+static void fail(pipeline *pl, int ret);
+static void backoff(int *spins);
+
+/*****************************************************************************
+ *                                                                           *
+ *                API                                                        *
+ *                                                                           *
+ *****************************************************************************/
+
+int demo_pipeline_run(flagfield *flags, const demo_pipeline *pipeline_desc)
+{
+  pthread_t threads[MAX_CONSUMERS];
+  pipeline pl;
+  item it;
+  size_t size;
+  int consumers;
+  int started;
+  int ret;
+  int i;
+
+  if (pipeline_desc == NULL || pipeline_desc->process == NULL) {
+    return DEMO_BAD_PARAMS;
+  }
+
+  consumers = pipeline_desc->consumers;
+  if (consumers <= 0) {
+    consumers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (consumers <= 0) {
+    consumers = 1;
+  }
+  if (consumers > MAX_CONSUMERS) {
+    consumers = MAX_CONSUMERS;
+  }
+
+  // the queue needs a power of two, and room for the stop items
+  size = pipeline_desc->queue_size ? pipeline_desc->queue_size
+                                   : DEFAULT_QUEUE_SIZE;
+  if (size < (size_t) consumers) {
+    size = consumers;
+  }
+
+  memset(&pl, 0, sizeof(pl));
+  pl.p = pipeline_desc;
+  atomic_init(&pl.commit, 0);
+  atomic_init(&pl.failed, DEMO_OK);
+  ret = queue_init(&pl.q, size);
+  if (ret != DEMO_OK) {
+    return ret;
+  }
+
+  for (started = 0; started < consumers; started++) {
+    if (pthread_create(&threads[started], NULL, consumer_thread, &pl) != 0) {
+      fail(&pl, DEMO_NO_MEMORY);
+      break;
+    }
+  }
+
+  // this thread is the reader
+  if (started > 0) {
+    ret = demo_scan(flags, reader_cb, &pl);
+    if (ret != DEMO_OK) {
+      fail(&pl, ret);
+    }
+  }
+
+  memset(&it, 0, sizeof(it));
+  for (i = 0; i < started; i++) {
+    push_item(&pl, &it);
+  }
+  for (i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  // anything left behind after a failure
+  while (queue_pop(&pl.q, &it)) {
+    demo_free_block(it.b);
+  }
+  free(pl.q.cells);
+
+  return atomic_load(&pl.failed);
+}
+
+/*****************************************************************************
+ *                                                                           *
+ *                PIPELINE FUNCTIONS                                         *
+ *                                                                           *
+ *****************************************************************************/
+
+static int reader_cb(void *ctx, demo *hdr, block **b)
+{
+  pipeline *pl = (pipeline *) ctx;
+  item it;
+  int ret;
+
+  ret = atomic_load_explicit(&pl->failed, memory_order_relaxed);
+  if (ret != DEMO_OK) {
+    return ret;
+  }
+
+  it.seq = pl->next_seq++;
+  it.header = *hdr;
+  it.b = *b;
+  push_item(pl, &it);
+
+  *b = NULL;
+  return DEMO_OK;
+}
+
+/* Pushes an item, waiting for room. After a failure the consumers only
+ * drain the queue, so this always terminates.
+ */
+static void push_item(pipeline *pl, item *it)
+{
+  int spins = 0;
+
+  while (!queue_push(&pl->q, it)) {
+    backoff(&spins);
+  }
+}
+
+static void *consumer_thread(void *arg)
+{
+  pipeline *pl = (pipeline *) arg;
+  item it;
+  int spins = 0;
+  int ret;
+
+  for (;;) {
+    if (!queue_pop(&pl->q, &it)) {
+      backoff(&spins);
+      continue;
+    }
+    spins = 0;
+
+    if (it.b == NULL) {
+      break;
+    }
+
+    if (atomic_load_explicit(&pl->failed, memory_order_relaxed) != DEMO_OK) {
+      demo_free_block(it.b);
+      continue;
+    }
+
+    ret = consume(pl, &it);
+    if (ret != DEMO_OK) {
+      fail(pl, ret);
+    }
+    demo_free_block(it.b);
+  }
+
+  return NULL;
+}
+
+/* Processes one block, then waits for its turn to commit it. The oldest
+ * block in flight is always held by a running consumer, so the wait ends,
+ * unless the pipeline fails, which also ends it.
+ */
+static int consume(pipeline *pl, item *it)
+{
+  const demo_pipeline *p = pl->p;
+  int spins = 0;
+  int ret;
+
+  ret = p->process(p->ctx, &it->header, &it->b, it->seq);
+  if (ret != DEMO_OK || p->commit == NULL) {
+    return ret;
+  }
+
+  while (atomic_load_explicit(&pl->commit, memory_order_acquire) != it->seq) {
+    if (atomic_load_explicit(&pl->failed, memory_order_relaxed) != DEMO_OK) {
+      return DEMO_OK;
+    }
+    backoff(&spins);
+  }
+
+  ret = p->commit(p->ctx, &it->header, &it->b, it->seq);
+  atomic_store_explicit(&pl->commit, it->seq + 1, memory_order_release);
+
+  return ret;
+}
+
+static void fail(pipeline *pl, int ret)
+{
+  int expected = DEMO_OK;
+
+  atomic_compare_exchange_strong(&pl->failed, &expected, ret);
+}
+
+static void backoff(int *spins)
+{
+  struct timespec ts;
+
+  if (*spins < SPIN_LIMIT) {
+    (*spins)++;
+  }
+  else if (*spins < YIELD_LIMIT) {
+    (*spins)++;
+    sched_yield();
+  }
+  else {
+    ts.tv_sec = 0;
+    ts.tv_nsec = SLEEP_NS;
+    nanosleep(&ts, NULL);
+  }
+}
+
+/*****************************************************************************
+ *                                                                           *
+ *                QUEUE FUNCTIONS                                            *
+ *                                                                           *
+ *****************************************************************************/
+
+static int queue_init(queue *q, size_t size)
+{
+  size_t capacity = 2;
+  size_t i;
+
+  while (capacity < size) {
+    capacity <<= 1;
+  }
+
+  q->cells = malloc(capacity * sizeof(cell));
+  if (q->cells == NULL) {
+    return DEMO_NO_MEMORY;
+  }
+  for (i = 0; i < capacity; i++) {
+    atomic_init(&q->cells[i].seq, i);
+  }
+  q->mask = capacity - 1;
+  atomic_init(&q->enqueue, 0);
+  atomic_init(&q->dequeue, 0);
+
+  return DEMO_OK;
+}
+
+/* Returns 1 if the item was queued, 0 if the queue is full.
+ */
+static int queue_push(queue *q, item *it)
+{
+  cell *c;
+  size_t pos;
+  size_t seq;
+  intptr_t dif;
+
+  pos = atomic_load_explicit(&q->enqueue, memory_order_relaxed);
+  for (;;) {
+    c = &q->cells[pos & q->mask];
+    seq = atomic_load_explicit(&c->seq, memory_order_acquire);
+    dif = (intptr_t) seq - (intptr_t) pos;
+    if (dif == 0) {
+      if (atomic_compare_exchange_weak_explicit(&q->enqueue, &pos, pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        break;
+      }
+    }
+    else if (dif < 0) {
+      return 0;
+    }
+    else {
+      pos = atomic_load_explicit(&q->enqueue, memory_order_relaxed);
+    }
+  }
+
+  c->it = *it;
+  atomic_store_explicit(&c->seq, pos + 1, memory_order_release);
+  return 1;
+}
+
+/* Returns 1 if an item was taken, 0 if the queue is empty.
+ */
+static int queue_pop(queue *q, item *it)
+{
+  cell *c;
+  size_t pos;
+  size_t seq;
+  intptr_t dif;
+
+  pos = atomic_load_explicit(&q->dequeue, memory_order_relaxed);
+  for (;;) {
+    c = &q->cells[pos & q->mask];
+    seq = atomic_load_explicit(&c->seq, memory_order_acquire);
+    dif = (intptr_t) seq - (intptr_t) (pos + 1);
+    if (dif == 0) {
+      if (atomic_compare_exchange_weak_explicit(&q->dequeue, &pos, pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        break;
+      }
+    }
+    else if (dif < 0) {
+      return 0;
+    }
+    else {
+      pos = atomic_load_explicit(&q->dequeue, memory_order_relaxed);
+    }
+  }
+
+  *it = c->it;
+  atomic_store_explicit(&c->seq, pos + q->mask + 1, memory_order_release);
+  return 1;
+}
@@ -0,0 +1,337 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "demo.h"
+#include "demo_stream.h"
+
+/*****************************************************************************
+ *                                                                           *
+ *                DATA TYPES                                                 *
+ *                                                                           *
+ *****************************************************************************/
+
+/* State of a running demo_transform()
+ */
+typedef struct {
+  flagfield *wflags;
+  demo_writer *writer;
+  demo_stage **stages;
+  int nstages;
+  demo header;
+} transform;
+
+/*****************************************************************************
+ *                                                                           *
+ *                FORWARD REFERENCES                                         *
+ *                                                                           *
+ *****************************************************************************/
+
+static int transform_cb(void *ctx, demo *hdr, block **b);
+static int run_stages(transform *t, int first, block **b);
+static int open_output(transform *t);
+
+static int filter_process(void *ctx, demo *hdr, block **b);
+static void filter_destroy(void *ctx);
+static int blank_message(message *m);
+
+/*****************************************************************************
+ *                                                                           *
+ *                API                                                        *
+ *                                                                           *
+ *****************************************************************************/
+
+int demo_transform(flagfield *rflags, flagfield *wflags, demo_stage **stages,
+                   int nstages)
+{
+  transform t;
+  block *b;
+  int ret;
+  int i;
+
+  if (wflags == NULL || (stages == NULL && nstages != 0)) {
+    return DEMO_BAD_PARAMS;
+  }
+
+  memset(&t, 0, sizeof(t));
+  t.wflags = wflags;
+  t.stages = stages;
+  t.nstages = nstages;
+
+  ret = demo_scan(rflags, transform_cb, &t);
+  if (ret != DEMO_OK) {
+    goto demo_transform_failure;
+  }
+
+  // no blocks at all, still write a header
+  ret = open_output(&t);
+  if (ret != DEMO_OK) {
+    goto demo_transform_failure;
+  }
+
+  // let stages holding on to data hand it out
+  for (i = 0; i < nstages; i++) {
+    if (stages[i]->flush == NULL) {
+      continue;
+    }
+    b = NULL;
+    ret = stages[i]->flush(stages[i]->ctx, &t.header, &b);
+    if (ret == DEMO_OK && b != NULL) {
+      ret = run_stages(&t, i + 1, &b);
+    }
+    if (b != NULL) {
+      demo_free_block(b);
+    }
+    if (ret != DEMO_OK) {
+      goto demo_transform_failure;
+    }
+  }
+
+  return demo_writer_close(t.writer);
+
+ demo_transform_failure:
+  demo_writer_close(t.writer);
+  return ret;
+}
+
+int demo_stage_free(demo_stage *stage)
+{
+  if (stage != NULL) {
+    if (stage->destroy != NULL) {
+      stage->destroy(stage->ctx);
+    }
+    free(stage);
+  }
+
+  return DEMO_OK;
+}
+
+int demo_filter_init(demo_filter *filter)
+{
+  memset(filter, 0, sizeof(demo_filter));
+
+  return DEMO_OK;
+}
+
+int demo_filter_stage(const demo_filter *filter, demo_stage **stage)
+{
+  demo_stage *s;
+  demo_filter *f;
+
+  if (filter == NULL || stage == NULL) {
+    return DEMO_BAD_PARAMS;
+  }
+
+  s = calloc(1, sizeof(demo_stage));
+  f = malloc(sizeof(demo_filter));
+  if (s == NULL || f == NULL) {
+    free(s);
+    free(f);
+    return DEMO_NO_MEMORY;
+  }
+
+  memcpy(f, filter, sizeof(demo_filter));
+  s->process = filter_process;
+  s->destroy = filter_destroy;
+  s->ctx = f;
+
+  *stage = s;
+  return DEMO_OK;
+}
+
+int demo_filter_file(flagfield *rflags, flagfield *wflags,
+                     const demo_filter *filter)
+{
+  demo_stage *stage;
+  int ret;
+
+  ret = demo_filter_stage(filter, &stage);
+  if (ret != DEMO_OK) {
+    return ret;
+  }
+
+  ret = demo_transform(rflags, wflags, &stage, 1);
+  demo_stage_free(stage);
+
+  return ret;
+}
+
+/*****************************************************************************
+ *                                                                           *
+ *                TRANSFORM FUNCTIONS                                        *
+ *                                                                           *
+ *****************************************************************************/
+
+static int transform_cb(void *ctx, demo *hdr, block **b)
+{
+  transform *t = (transform *) ctx;
+  int ret;
+
+  t->header.protocol = hdr->protocol;
+  t->header.track = hdr->track;
+
+  // the track is only known once the scan has started
+  ret = open_output(t);
+  if (ret != DEMO_OK) {
+    return ret;
+  }
+
+  return run_stages(t, 0, b);
+}
+
+/* Runs a block through the stages starting at first, and writes whatever
+ * comes out of the last one. The block stays owned by the caller.
+ */
+static int run_stages(transform *t, int first, block **b)
+{
+  message *m;
+  uint32_t length;
+  int ret;
+  int i;
+
+  for (i = first; i < t->nstages && *b != NULL; i++) {
+    ret = t->stages[i]->process(t->stages[i]->ctx, &t->header, b);
+    if (ret != DEMO_OK) {
+      return ret;
+    }
+  }
+
+  if (*b == NULL) {
+    return DEMO_OK;
+  }
+
+  // fix up the block length, +1 for each type byte
+  length = 0;
+  for (m = (*b)->messages; m != NULL; m = m->next) {
+    length += m->size + 1;
+  }
+  (*b)->length = length;
+
+  return demo_writer_block(t->writer, *b);
+}
+
+static int open_output(transform *t)
+{
+  if (t->writer != NULL) {
+    return DEMO_OK;
+  }
+
+  return demo_writer_open(t->wflags, t->header.track, &t->writer);
+}
+
+/*****************************************************************************
+ *                                                                           *
+ *                FILTER FUNCTIONS                                           *
+ *                                                                           *
+ *****************************************************************************/
+
+static int filter_process(void *ctx, demo *hdr, block **b)
+{
+  demo_filter *f = (demo_filter *) ctx;
+  message *m;
+  message *mnext;
+  int action;
+  int ret;
+
+  ret = demo_block_unshare(*b);
+  if (ret != DEMO_OK) {
+    return ret;
+  }
+
+  for (m = (*b)->messages; m != NULL; m = mnext) {
+    mnext = m->next;
+
+    action = f->action[m->type & 0xFF];
+    if (action == FILTER_REWRITE && f->rewrite != NULL) {
+      ret = demo_message_unshare(m);
+      if (ret != DEMO_OK) {
+        return ret;
+      }
+      action = f->rewrite(f->ctx, hdr, m);
+    }
+    else if (action == FILTER_REWRITE) {
+      action = FILTER_KEEP;
+    }
+
+    if (action == FILTER_BLANK) {
+      ret = blank_message(m);
+      if (ret == DEMO_OK) {
+        continue;
+      }
+      if (ret != DEMO_BAD_PARAMS) {
+        return ret;
+      }
+      action = FILTER_DROP; // nothing to blank
+    }
+
+    if (action == FILTER_DROP) {
+      if (m->prev != NULL) {
+        m->prev->next = m->next;
+      }
+      else {
+        (*b)->messages = m->next;
+      }
+      if (m->next != NULL) {
+        m->next->prev = m->prev;
+      }
+      demo_free_message(m);
+    }
+  }
+
+  if ((*b)->messages == NULL) {
+    demo_free_block(*b);
+    *b = NULL;
+  }
+
+  return DEMO_OK;
+}
+
+static void filter_destroy(void *ctx)
+{
+  free(ctx);
+}
+
+/* Empties the text of a string message, keeping any leading index byte.
+ * Returns DEMO_BAD_PARAMS for messages that carry no text.
+ */
+static int blank_message(message *m)
+{
+  uint32_t keep;
+  uint8_t *data;
+
+  switch (m->type) {
+  case PRINT:
+  case STUFFTEXT:
+  case CENTERPRINT:
+  case FINALE:
+  case CUTSCENE:
+    keep = 0;
+    break;
+
+  case LIGHTSTYLE:
+  case UPDATENAME:
+    keep = 1;
+    break;
+
+  default:
+    return DEMO_BAD_PARAMS;
+  }
+
+  if (m->size < keep + 1) {
+    return DEMO_CORRUPT_DEMO;
+  }
+
+  data = malloc(keep + 1);
+  if (data == NULL) {
+    return DEMO_NO_MEMORY;
+  }
+  memcpy(data, m->data, keep);
+  data[keep] = '\0';
+
+  demo_free_message_data(m);
+  m->data = data;
+  m->size = keep + 1;
+
+  return DEMO_OK;
+}
@@ -0,0 +1,1159 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "demo.h"
+#include "demo_text.h"
+
+/*****************************************************************************
+ *                                                                           *
+ *                DEFINITIONS                                                *
+ *                                                                           *
+ *****************************************************************************/
+
+#define TEXT_MAGIC "LDT1"
+#define TEXT_VERSION 1
+#define TEXT_BYTE_ORDER 0x01020304
+#define TMP_SUFFIX ".tmp"
+#define MAX_STRING 2048 // longest string read_string() returns, NUL included
+#define INITIAL_TABLE_SIZE 1024
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+/*****************************************************************************
+ *                                                                           *
+ *                DATA TYPES                                                 *
+ *                                                                           *
+ *****************************************************************************/
+
+/* Open addressing hash set of strings in the pool, keyed by their content.
+ * A ref of 0 marks a free slot, the pool starts with an empty string so no
+ * real string has that reference.
+ */
+typedef struct {
+  uint64_t *refs;
+  uint32_t *ids;
+  size_t size;
+  size_t used;
+} string_table;
+
+/* Token dictionary entry. The hits holding the word are count consecutive
+ * entries of the posting array, starting at first, in ascending order.
+ */
+typedef struct {
+  uint64_t word;
+  uint64_t first;
+  uint32_t count;
+  uint32_t reserved;
+} text_token;
+
+/* On disk layout written by demo_text_save(). All offsets are from the
+ * start of the file and 8 byte aligned.
+ */
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t reserved;
+  uint64_t hit_count;
+  uint64_t token_count;
+  uint64_t posting_count;
+  uint64_t doc_count;
+  uint64_t string_size;
+  uint64_t hit_offset;
+  uint64_t token_offset;
+  uint64_t posting_offset;
+  uint64_t doc_offset;
+  uint64_t string_offset;
+} text_header;
+
+/* The index. Hits, documents and strings are added as demos come in, the
+ * tokens and postings are rebuilt from the hits when a search or save
+ * finds them out of date. A loaded index points into the mapping and has
+ * no hash tables.
+ */
+struct _text_index {
+  text_hit *hits;
+  uint64_t hit_count;
+  size_t hit_capacity;
+  text_token *tokens;
+  uint64_t token_count;
+  uint32_t *postings;
+  uint64_t posting_count;
+  uint64_t *docs;
+  uint64_t doc_count;
+  size_t doc_capacity;
+  char *strings;
+  uint64_t string_size;
+  size_t string_capacity;
+  string_table texts;
+  string_table words;
+  uint64_t *word_refs;
+  size_t word_count;
+  size_t word_capacity;
+  int dirty;
+  void *map;
+  size_t map_size;
+};
+
+/* State kept while adding one demo
+ */
+typedef struct {
+  text_index *t;
+  uint32_t doc;
+  uint32_t block;
+  float time;
+} collector;
+
+/* Dictionary sort key
+ */
+typedef struct {
+  const char *word;
+  uint32_t id;
+} word_key;
+
+/*****************************************************************************
+ *                                                                           *
+ *                FORWARD REFERENCES                                         *
+ *                                                                           *
+ *****************************************************************************/
+
+static int begin_doc(text_index *t, const char *name, collector *c);
+static int collect_block(collector *c, uint32_t protocol, block *b);
+static int collect_scan_cb(void *ctx, demo *hdr, block **b);
+static int add_hit(collector *c, uint32_t type, const uint8_t *s,
+                   size_t size);
+static int build_tokens(text_index *t);
+static int intern(text_index *t, string_table *st, const char *s,
+                  size_t len, uint64_t *ref, int *added);
+static int table_find(const string_table *st, const char *pool,
+                      const char *s, size_t len, size_t *slot);
+static int table_grow(string_table *st, const char *pool);
+static int grow_array(void **array, size_t *capacity, size_t count,
+                      size_t size);
+static const text_token *find_token(const text_index *t, const char *word);
+static int find_tokens(text_index *t, const char *query, text_cb_t cb,
+                       void *ctx);
+static int find_substring(text_index *t, const char *query, text_cb_t cb,
+                          void *ctx);
+static int emit(text_index *t, uint32_t hit, text_cb_t cb, void *ctx);
+static int table_fits(uint64_t offset, uint64_t count, size_t size,
+                      uint64_t total);
+static const char *next_word(const char *s, char *word, size_t *len);
+static int contains(const char *text, const char *query);
+static int norm_char(unsigned char c);
+static int is_word_char(int c);
+static int compare_keys(const void *a, const void *b);
+static int compare_counts(const void *a, const void *b);
+static uint64_t fnv1a(const char *s, size_t len);
+
+/*****************************************************************************
+ *                                                                           *
+ *                API                                                        *
+ *                                                                           *
+ *****************************************************************************/
+
+int demo_text_new(text_index **t)
+{
+  text_index *ti;
+
+  ti = calloc(1, sizeof(text_index));
+  if (ti == NULL) {
+    return DEMO_NO_MEMORY;
+  }
+
+  // reference 0 is the empty string, which also marks free table slots
+  if (grow_array((void **) &ti->strings, &ti->string_capacity, 1, 1) !=
+      DEMO_OK) {
+    free(ti);
+    return DEMO_NO_MEMORY;
+  }
+  ti->strings[0] = '\0';
+  ti->string_size = 1;
+
+  *t = ti;
+  return DEMO_OK;
+}
+
+int demo_text_add(text_index *t, const char *name, demo *d, uint32_t *doc)
+{
+  collector c;
+  block *b;
+  int ret;
+
+  if (t == NULL || d == NULL) {
+    return DEMO_BAD_PARAMS;
+  }
+
+  ret = begin_doc(t, name, &c);
+  if (ret != DEMO_OK) {
+    return ret;
+  }
+
+  for (b = d->blocks; b != NULL; b = b->next) {
+    ret = collect_block(&c, d->protocol, b);
+    if (ret != DEMO_OK) {
+      return ret;
+    }
+  }
+
+  if (doc != NULL) {
+    *doc = c.doc;
+  }
+  return DEMO_OK;
+}
+
+int demo_text_add_scan(text_index *t, const char *name, flagfield *flags,
+                       uint32_t *doc)
+{
+  collector c;
+  int ret;
+
+  if (t == NULL) {
+    return DEMO_BAD_PARAMS;
+  }
+
+  ret = begin_doc(t, name, &c);
+  if (ret != DEMO_OK) {
+    return ret;
+  }
+
+  if (doc != NULL) {
+    *doc = c.doc;
+  }
+  return demo_scan(flags, collect_scan_cb, &c);
+}
+
+int demo_text_find(text_index *t, const char *query, int mode,
+                   text_cb_t cb, void *ctx)
+{
+  int ret;
+
+  if (t == NULL || query == NULL || cb == NULL) {
+    return DEMO_BAD_PARAMS;
+  }
+
+  ret = build_tokens(t);
+  if (ret != DEMO_OK) {
+    return ret;
+  }
+
+  switch (mode) {
+  case TEXT_MATCH_TOKENS:
+    ret = find_tokens(t, query, cb, ctx);
+    break;
+
+  case TEXT_MATCH_SUBSTRING:
+    ret = find_substring(t, query, cb, ctx);
+    break;
+
+  default:
+    return DEMO_BAD_PARAMS;
+  }
+
+  return (ret == DEMO_SCAN_STOP) ? DEMO_OK : ret;
+}
+
+const char *demo_text_string(const text_index *t, uint64_t ref)
+{
+  if (ref >= t->string_size) {
+    return "";
+  }
+
+  return t->strings + ref;
+}
+
+const char *demo_text_doc(const text_index *t, uint32_t doc)
+{
+  if (doc >= t->doc_count) {
+    return "";
+  }
+
+  return demo_text_string(t, t->docs[doc]);
+}
+
+int demo_text_save(text_index *t, const char *filename)
+{
+  static const uint8_t pad[8];
+  text_header h;
+  char *tmpname;
+  FILE *fp;
+  size_t padding;
+  int ret;
+
+  if (t == NULL || filename == NULL) {
+    return DEMO_BAD_PARAMS;
+  }
+
+  ret = build_tokens(t);
+  if (ret != DEMO_OK) {
+    return ret;
+  }
+
+  // postings are 4 byte entries, the documents after them need padding
+  padding = (t->posting_count % 2) ? 4 : 0;
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, TEXT_MAGIC, sizeof(h.magic));
+  h.version = TEXT_VERSION;
+  h.byte_order = TEXT_BYTE_ORDER;
+  h.hit_count = t->hit_count;
+  h.token_count = t->token_count;
+  h.posting_count = t->posting_count;
+  h.doc_count = t->doc_count;
+  h.string_size = t->string_size;
+  h.hit_offset = sizeof(text_header);
+  h.token_offset = h.hit_offset + h.hit_count * sizeof(text_hit);
+  h.posting_offset = h.token_offset + h.token_count * sizeof(text_token);
+  h.doc_offset =
+    h.posting_offset + h.posting_count * sizeof(uint32_t) + padding;
+  h.string_offset = h.doc_offset + h.doc_count * sizeof(uint64_t);
+
+  tmpname = malloc(strlen(filename) + sizeof(TMP_SUFFIX));
+  if (tmpname == NULL) {
+    return DEMO_NO_MEMORY;
+  }
+  strcpy(tmpname, filename);
+  strcat(tmpname, TMP_SUFFIX);
+
+  fp = fopen(tmpname, "wb");
+  if (fp == NULL) {
+    free(tmpname);
+    return DEMO_CANNOT_WRITE;
+  }
+
+  if (fwrite(&h, sizeof(h), 1, fp) != 1 ||
+      fwrite(t->hits, sizeof(text_hit), t->hit_count, fp) != t->hit_count ||
+      fwrite(t->tokens, sizeof(text_token), t->token_count, fp) !=
+      t->token_count ||
+      fwrite(t->postings, sizeof(uint32_t), t->posting_count, fp) !=
+      t->posting_count ||
+      fwrite(pad, 1, padding, fp) != padding ||
+      fwrite(t->docs, sizeof(uint64_t), t->doc_count, fp) != t->doc_count ||
+      fwrite(t->strings, 1, t->string_size, fp) != t->string_size) {
+    ret = DEMO_CANNOT_WRITE;
+  }
+  if (fclose(fp) != 0) {
+    ret = DEMO_CANNOT_WRITE;
+  }
+
+  if (ret == DEMO_OK && rename(tmpname, filename) != 0) {
+    ret = DEMO_CANNOT_WRITE;
+  }
+  if (ret != DEMO_OK) {
+    remove(tmpname);
+  }
+
+  free(tmpname);
+  return ret;
+}
+
+int demo_text_load(const char *filename, text_index **t)
+{
+  text_index *ti;
+  const text_header *h;
+  const uint8_t *base;
+  struct stat st;
+  uint64_t size;
+  void *map;
+  int fd;
+
+  if (filename == NULL || t == NULL) {
+    return DEMO_BAD_PARAMS;
+  }
+
+  fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    return DEMO_CANNOT_OPEN_DEMO;
+  }
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return DEMO_CANNOT_OPEN_DEMO;
+  }
+  size = st.st_size;
+  if (size < sizeof(text_header)) {
+    close(fd);
+    return DEMO_CORRUPT_DEMO;
+  }
+
+  map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return DEMO_CANNOT_OPEN_DEMO;
+  }
+
+  // only the header is checked, the table entries are checked on use
+  h = (const text_header *) map;
+  base = (const uint8_t *) map;
+  if (memcmp(h->magic, TEXT_MAGIC, sizeof(h->magic)) != 0 ||
+      h->version != TEXT_VERSION || h->byte_order != TEXT_BYTE_ORDER ||
+      !table_fits(h->hit_offset, h->hit_count, sizeof(text_hit), size) ||
+      !table_fits(h->token_offset, h->token_count, sizeof(text_token),
+                  size) ||
+      !table_fits(h->posting_offset, h->posting_count, sizeof(uint32_t),
+                  size) ||
+      !table_fits(h->doc_offset, h->doc_count, sizeof(uint64_t), size) ||
+      !table_fits(h->string_offset, h->string_size, 1, size) ||
+      h->hit_offset % 8 != 0 || h->token_offset % 8 != 0 ||
+      h->posting_offset % 8 != 0 || h->doc_offset % 8 != 0 ||
+      h->string_size == 0 ||
+      base[h->string_offset + h->string_size - 1] != '\0') {
+    munmap(map, size);
+    return DEMO_CORRUPT_DEMO;
+  }
+
+  ti = calloc(1, sizeof(text_index));
+  if (ti == NULL) {
+    munmap(map, size);
+    return DEMO_NO_MEMORY;
+  }
+
+  // never written to, a loaded index is read only
+  ti->hits = (text_hit *) (base + h->hit_offset);
+  ti->hit_count = h->hit_count;
+  ti->tokens = (text_token *) (base + h->token_offset);
+  ti->token_count = h->token_count;
+  ti->postings = (uint32_t *) (base + h->posting_offset);
+  ti->posting_count = h->posting_count;
+  ti->docs = (uint64_t *) (base + h->doc_offset);
+  ti->doc_count = h->doc_count;
+  ti->strings = (char *) (base + h->string_offset);
+  ti->string_size = h->string_size;
+  ti->map = map;
+  ti->map_size = size;
+
+  *t = ti;
+  return DEMO_OK;
+}
+
+int demo_text_free(text_index *t)
+{
+  if (t == NULL) {
+    return DEMO_OK;
+  }
+
+  if (t->map != NULL) {
+    munmap(t->map, t->map_size);
+  }
+  else {
+    free(t->hits);
+    free(t->tokens);
+    free(t->postings);
+    free(t->docs);
+    free(t->strings);
+    free(t->texts.refs);
+    free(t->texts.ids);
+    free(t->words.refs);
+    free(t->words.ids);
+    free(t->word_refs);
+  }
+  free(t);
+
+  return DEMO_OK;
+}
+
+/*****************************************************************************
+ *                                                                           *
+ *                COLLECT FUNCTIONS                                          *
+ *                                                                           *
+ *****************************************************************************/
+
+static int begin_doc(text_index *t, const char *name, collector *c)
+{
+  uint64_t ref;
+  int added;
+  int ret;
+
+  if (t->map != NULL) {
+    return DEMO_BAD_PARAMS;
+  }
+
+  if (name == NULL) {
+    name = "";
+  }
+  ret = intern(t, &t->texts, name, strlen(name), &ref, &added);
+  if (ret != DEMO_OK) {
+    return ret;
+  }
+
+  ret = grow_array((void **) &t->docs, &t->doc_capacity, t->doc_count + 1,
+                   sizeof(uint64_t));
+  if (ret != DEMO_OK) {
+    return ret;
+  }
+  t->docs[t->doc_count] = ref;
+
+  memset(c, 0, sizeof(*c));
+  c->t = t;
+  c->doc = t->doc_count++;
+  return DEMO_OK;
+}
+
+static int collect_block(collector *c, uint32_t protocol, block *b)
+{
+  message *m;
+  const uint8_t *end;
+  int ret = DEMO_OK;
+
+  for (m = b->messages; m != NULL && ret == DEMO_OK; m = m->next) {
+    switch (m->type) {
+    case TIME:
+      if (m->size == 4) {
+        memcpy(&c->time, m->data, 4);
+      }
+      break;
+
+    case PRINT:
+    case STUFFTEXT:
+    case CENTERPRINT:
+    case FINALE:
+    case CUTSCENE:
+      ret = add_hit(c, m->type, m->data, m->size);
+      break;
+
+    case UPDATENAME:
+      // slot, then the name
+      if (m->size > 1) {
+        ret = add_hit(c, m->type, m->data + 1, m->size - 1);
+      }
+      break;
+
+    case BJP3SHOWLMP:
+      // slot name, then lmp file name, then x and y
+      if (protocol == PROTOCOL_BJP3) {
+        end = memchr(m->data, '\0', m->size);
+        ret = add_hit(c, m->type, m->data, m->size);
+        if (ret == DEMO_OK && end != NULL) {
+          ret = add_hit(c, m->type, end + 1, m->data + m->size - end - 1);
+        }
+      }
+      break;
+
+    case BJP3HIDELMP:
+      if (protocol == PROTOCOL_BJP3) {
+        ret = add_hit(c, m->type, m->data, m->size);
+      }
+      break;
+    }
+  }
+
+  c->block++;
+  return ret;
+}
+
+static int collect_scan_cb(void *ctx, demo *hdr, block **b)
+{
+  return collect_block((collector *) ctx, hdr->protocol, *b);
+}
+
+/* Adds the NUL terminated string at s, if there is one in size bytes.
+ * Empty strings are not worth a hit.
+ */
+static int add_hit(collector *c, uint32_t type, const uint8_t *s,
+                   size_t size)
+{
+  text_index *t = c->t;
+  const uint8_t *end;
+  text_hit *h;
+  uint64_t ref;
+  int added;
+  int ret;
+
+  end = (s != NULL) ? memchr(s, '\0', size) : NULL;
+  if (end == NULL || end == s) {
+    return DEMO_OK;
+  }
+
+  ret = intern(t, &t->texts, (const char *) s, end - s, &ref, &added);
+  if (ret != DEMO_OK) {
+    return ret;
+  }
+
+  ret = grow_array((void **) &t->hits, &t->hit_capacity, t->hit_count + 1,
+                   sizeof(text_hit));
+  if (ret != DEMO_OK) {
+    return ret;
+  }
+
+  h = &t->hits[t->hit_count++];
+  h->doc = c->doc;
+  h->block = c->block;
+  h->time = c->time;
+  h->type = type;
+  h->text = ref;
+
+  t->dirty = 1;
+  return DEMO_OK;
+}
+
+/*****************************************************************************
+ *                                                                           *
+ *                TOKEN FUNCTIONS                                            *
+ *                                                                           *
+ *****************************************************************************/
+
+/* Rebuilds the dictionary and postings from the hits. Words are interned
+ * once and keep their ids between rebuilds. The postings of a word are
+ * filled in hit order, so they come out sorted without a sort.
+ */
+static int build_tokens(text_index *t)
+{
+  char word[MAX_STRING];
+  const char *s;
+  uint32_t *counts = NULL;
+  uint32_t *last = NULL;
+  uint64_t *next = NULL;
+  word_key *keys = NULL;
+  uint64_t ref;
+  uint64_t total;
+  size_t offset;
+  size_t len;
+  size_t slot;
+  size_t i;
+  uint32_t id;
+  int added;
+  int ret = DEMO_NO_MEMORY;
+
+  if (!t->dirty) {
+    return DEMO_OK;
+  }
+
+  // intern every word, the pool may move while the string is walked
+  for (i = 0; i < t->hit_count; i++) {
+    s = demo_text_string(t, t->hits[i].text);
+    while ((s = next_word(s, word, &len)) != NULL) {
+      offset = s - t->strings;
+      ret = intern(t, &t->words, word, len, &ref, &added);
+      if (ret != DEMO_OK) {
+        return ret;
+      }
+      s = t->strings + offset;
+    }
+  }
+
+  counts = calloc(t->word_count + 1, sizeof(uint32_t));
+  last = malloc((t->word_count + 1) * sizeof(uint32_t));
+  next = malloc((t->word_count + 1) * sizeof(uint64_t));
+  keys = malloc((t->word_count + 1) * sizeof(word_key));
+  if (counts == NULL || last == NULL || next == NULL || keys == NULL) {
+    goto build_tokens_failure;
+  }
+
+  // count the hits of every word, a word twice in a hit counts once
+  memset(last, 0xFF, t->word_count * sizeof(uint32_t));
+  total = 0;
+  for (i = 0; i < t->hit_count; i++) {
+    s = demo_text_string(t, t->hits[i].text);
+    while ((s = next_word(s, word, &len)) != NULL) {
+      table_find(&t->words, t->strings, word, len, &slot);
+      id = t->words.ids[slot];
+      if (last[id] != i) {
+        last[id] = i;
+        counts[id]++;
+        total++;
+      }
+    }
+  }
+
+  free(t->tokens);
+  free(t->postings);
+  t->tokens = malloc((t->word_count + 1) * sizeof(text_token));
+  t->postings = malloc((total + 1) * sizeof(uint32_t));
+  t->token_count = 0;
+  t->posting_count = 0;
+  if (t->tokens == NULL || t->postings == NULL) {
+    goto build_tokens_failure;
+  }
+
+  // lay the postings out in word id order, then fill them
+  total = 0;
+  for (id = 0; id < t->word_count; id++) {
+    next[id] = total;
+    total += counts[id];
+  }
+  memset(last, 0xFF, t->word_count * sizeof(uint32_t));
+  for (i = 0; i < t->hit_count; i++) {
+    s = demo_text_string(t, t->hits[i].text);
+    while ((s = next_word(s, word, &len)) != NULL) {
+      table_find(&t->words, t->strings, word, len, &slot);
+      id = t->words.ids[slot];
+      if (last[id] != i) {
+        last[id] = i;
+        t->postings[next[id]++] = i;
+      }
+    }
+  }
+  t->posting_count = total;
+
+  // the dictionary is sorted by word for binary search
+  for (id = 0; id < t->word_count; id++) {
+    keys[id].word = t->strings + t->word_refs[id];
+    keys[id].id = id;
+  }
+  qsort(keys, t->word_count, sizeof(word_key), compare_keys);
+  for (i = 0; i < t->word_count; i++) {
+    id = keys[i].id;
+    if (counts[id] == 0) {
+      continue;
+    }
+    t->tokens[t->token_count].word = t->word_refs[id];
+    t->tokens[t->token_count].first = next[id] - counts[id];
+    t->tokens[t->token_count].count = counts[id];
+    t->tokens[t->token_count].reserved = 0;
+    t->token_count++;
+  }
+
+  t->dirty = 0;
+  ret = DEMO_OK;
+
+ build_tokens_failure:
+  free(counts);
+  free(last);
+  free(next);
+  free(keys);
+  return ret;
+}
+
+/* Returns the reference of the string s of len bytes, adding it to the
+ * pool and the table if it is new. New words also get the next word id.
+ */
+static int intern(text_index *t, string_table *st, const char *s,
+                  size_t len, uint64_t *ref, int *added)
+{
+  size_t slot;
+  int ret;
+
+  if (st->used * 2 >= st->size) {
+    ret = table_grow(st, t->strings);
+    if (ret != DEMO_OK) {
+      return ret;
+    }
+  }
+
+  *added = 0;
+  if (table_find(st, t->strings, s, len, &slot)) {
+    *ref = st->refs[slot];
+    return DEMO_OK;
+  }
+
+  // the empty string is reference 0 and never goes into a table
+  if (len == 0) {
+    *ref = 0;
+    return DEMO_OK;
+  }
+
+  ret = grow_array((void **) &t->strings, &t->string_capacity,
+                   t->string_size + len + 1, 1);
+  if (ret != DEMO_OK) {
+    return ret;
+  }
+  memcpy(t->strings + t->string_size, s, len);
+  t->strings[t->string_size + len] = '\0';
+  *ref = t->string_size;
+  t->string_size += len + 1;
+
+  if (st == &t->words) {
+    ret = grow_array((void **) &t->word_refs, &t->word_capacity,
+                     t->word_count + 1, sizeof(uint64_t));
+    if (ret != DEMO_OK) {
+      return ret;
+    }
+    t->word_refs[t->word_count] = *ref;
+    st->ids[slot] = t->word_count++;
+  }
+
+  st->refs[slot] = *ref;
+  st->used++;
+  *added = 1;
+  return DEMO_OK;
+}
+
+/* Looks s up, returning 1 and its slot if it is there, or 0 and the free
+ * slot it would go into.
+ */
+static int table_find(const string_table *st, const char *pool,
+                      const char *s, size_t len, size_t *slot)
+{
+  size_t mask = st->size - 1;
+  size_t i = fnv1a(s, len) & mask;
+  const char *p;
+
+  while (st->refs[i] != 0) {
+    p = pool + st->refs[i];
+    if (strncmp(p, s, len) == 0 && p[len] == '\0') {
+      *slot = i;
+      return 1;
+    }
+    i = (i + 1) & mask;
+  }
+
+  *slot = i;
+  return 0;
+}
+
+static int table_grow(string_table *st, const char *pool)
+{
+  string_table n;
+  size_t slot;
+  size_t i;
+  const char *p;
+
+  n.size = (st->size == 0) ? INITIAL_TABLE_SIZE : st->size * 2;
+  n.used = st->used;
+  n.refs = calloc(n.size, sizeof(uint64_t));
+  n.ids = calloc(n.size, sizeof(uint32_t));
+  if (n.refs == NULL || n.ids == NULL) {
+    free(n.refs);
+    free(n.ids);
+    return DEMO_NO_MEMORY;
+  }
+
+  for (i = 0; i < st->size; i++) {
+    if (st->refs[i] != 0) {
+      p = pool + st->refs[i];
+      table_find(&n, pool, p, strlen(p), &slot);
+      n.refs[slot] = st->refs[i];
+      n.ids[slot] = st->ids[i];
+    }
+  }
+
+  free(st->refs);
+  free(st->ids);
+  *st = n;
+  return DEMO_OK;
+}
+
+/* Makes room for count elements of size bytes, doubling the capacity.
+ */
+static int grow_array(void **array, size_t *capacity, size_t count,
+                      size_t size)
+{
+  size_t n = *capacity;
+  void *p;
+
+  if (count <= n) {
+    return DEMO_OK;
+  }
+
+  if (n == 0) {
+    n = 64;
+  }
+  while (n < count) {
+    n *= 2;
+  }
+
+  p = realloc(*array, n * size);
+  if (p == NULL) {
+    return DEMO_NO_MEMORY;
+  }
+
+  *array = p;
+  *capacity = n;
+  return DEMO_OK;
+}
+
+/*****************************************************************************
+ *                                                                           *
+ *                SEARCH FUNCTIONS                                           *
+ *                                                                           *
+ *****************************************************************************/
+
+/* Binary search of the dictionary. Tokens whose postings lie outside the
+ * posting array, as in a damaged file, are not found.
+ */
+static const text_token *find_token(const text_index *t, const char *word)
+{
+  const text_token *tok;
+  uint64_t lo = 0;
+  uint64_t hi = t->token_count;
+  uint64_t mid;
+  int cmp;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    tok = &t->tokens[mid];
+    cmp = strcmp(demo_text_string(t, tok->word), word);
+    if (cmp == 0) {
+      if (tok->first > t->posting_count ||
+          tok->count > t->posting_count - tok->first) {
+        return NULL;
+      }
+      return tok;
+    }
+    if (cmp < 0) {
+      lo = mid + 1;
+    }
+    else {
+      hi = mid;
+    }
+  }
+
+  return NULL;
+}
+
+/* Intersects the postings of all query words, shortest list first.
+ */
+static int find_tokens(text_index *t, const char *query, text_cb_t cb,
+                       void *ctx)
+{
+  char word[MAX_STRING];
+  const text_token **toks = NULL;
+  const uint32_t *p;
+  uint32_t *cand = NULL;
+  size_t ntoks = 0;
+  size_t ncand;
+  size_t len;
+  size_t i;
+  size_t j;
+  size_t k;
+  size_t n;
+  const char *s;
+  int ret = DEMO_OK;
+
+  // words are separated, so there are at most half as many as characters
+  n = strlen(query) / 2 + 1;
+  toks = malloc(n * sizeof(text_token *));
+  if (toks == NULL) {
+    return DEMO_NO_MEMORY;
+  }
+
+  for (s = query; (s = next_word(s, word, &len)) != NULL; ntoks++) {
+    toks[ntoks] = find_token(t, word);
+    if (toks[ntoks] == NULL) {
+      goto find_tokens_done; // a missing word matches nothing
+    }
+  }
+  if (ntoks == 0) {
+    goto find_tokens_done;
+  }
+
+  qsort(toks, ntoks, sizeof(text_token *), compare_counts);
+
+  ncand = toks[0]->count;
+  cand = malloc((ncand + 1) * sizeof(uint32_t));
+  if (cand == NULL) {
+    ret = DEMO_NO_MEMORY;
+    goto find_tokens_done;
+  }
+  memcpy(cand, t->postings + toks[0]->first, ncand * sizeof(uint32_t));
+
+  // both lists are sorted, merge them
+  for (i = 1; i < ntoks && ncand > 0; i++) {
+    p = t->postings + toks[i]->first;
+    n = toks[i]->count;
+    for (j = 0, k = 0, len = 0; j < ncand && k < n;) {
+      if (cand[j] < p[k]) {
+        j++;
+      }
+      else if (cand[j] > p[k]) {
+        k++;
+      }
+      else {
+        cand[len++] = cand[j];
+        j++;
+        k++;
+      }
+    }
+    ncand = len;
+  }
+
+  for (i = 0; i < ncand && ret == DEMO_OK; i++) {
+    ret = emit(t, cand[i], cb, ctx);
+  }
+
+ find_tokens_done:
+  free(toks);
+  free(cand);
+  return ret;
+}
+
+/* Marks the hits of every dictionary word holding the longest word of the
+ * query, then checks those hits against the whole query. A query without
+ * a word character has to be checked against every hit.
+ */
+static int find_substring(text_index *t, const char *query, text_cb_t cb,
+                          void *ctx)
+{
+  char word[MAX_STRING];
+  char anchor[MAX_STRING];
+  char *q;
+  uint8_t *marks;
+  const text_token *tok;
+  const char *s;
+  size_t alen = 0;
+  size_t len;
+  size_t i;
+  uint64_t j;
+  int ret = DEMO_OK;
+
+  len = strlen(query);
+  q = malloc(len + 1);
+  marks = calloc(t->hit_count + 1, 1);
+  if (q == NULL || marks == NULL) {
+    free(q);
+    free(marks);
+    return DEMO_NO_MEMORY;
+  }
+  for (i = 0; i <= len; i++) {
+    q[i] = (char) norm_char(query[i]);
+  }
+
+  for (s = q; (s = next_word(s, word, &len)) != NULL;) {
+    if (len > alen) {
+      memcpy(anchor, word, len + 1);
+      alen = len;
+    }
+  }
+
+  if (alen == 0) {
+    memset(marks, 1, t->hit_count);
+  }
+  for (i = 0; alen > 0 && i < t->token_count; i++) {
+    tok = &t->tokens[i];
+    if (tok->first > t->posting_count ||
+        tok->count > t->posting_count - tok->first ||
+        strstr(demo_text_string(t, tok->word), anchor) == NULL) {
+      continue;
+    }
+    for (j = 0; j < tok->count; j++) {
+      if (t->postings[tok->first + j] < t->hit_count) {
+        marks[t->postings[tok->first + j]] = 1;
+      }
+    }
+  }
+
+  for (j = 0; j < t->hit_count && ret == DEMO_OK; j++) {
+    if (marks[j] && contains(demo_text_string(t, t->hits[j].text), q)) {
+      ret = emit(t, j, cb, ctx);
+    }
+  }
+
+  free(q);
+  free(marks);
+  return ret;
+}
+
+static int emit(text_index *t, uint32_t hit, text_cb_t cb, void *ctx)
+{
+  if (hit >= t->hit_count) {
+    return DEMO_OK;
+  }
+
+  return cb(ctx, t, &t->hits[hit]);
+}
+
+/*****************************************************************************
+ *                                                                           *
+ *                HELPER FUNCTIONS                                           *
+ *                                                                           *
+ *****************************************************************************/
+
+/* Copies the next word of s into word, normalized, and returns the rest of
+ * s, or NULL if there is no word left. word holds MAX_STRING bytes, longer
+ * words can only come from queries and are cut.
+ */
+static const char *next_word(const char *s, char *word, size_t *len)
+{
+  size_t n = 0;
+
+  while (*s != '\0' && !is_word_char(norm_char(*s))) {
+    s++;
+  }
+  if (*s == '\0') {
+    return NULL;
+  }
+
+  while (*s != '\0' && is_word_char(norm_char(*s))) {
+    if (n < MAX_STRING - 1) {
+      word[n++] = (char) norm_char(*s);
+    }
+    s++;
+  }
+  word[n] = '\0';
+
+  *len = n;
+  return s;
+}
+
+/* Whether count entries of size bytes at offset lie within total bytes.
+ */
+static int table_fits(uint64_t offset, uint64_t count, size_t size,
+                      uint64_t total)
+{
+  if (offset > total) {
+    return 0;
+  }
+
+  return count <= (total - offset) / size;
+}
+
+/* Whether text, normalized, holds the normalized query.
+ */
+static int contains(const char *text, const char *query)
+{
+  size_t i;
+
+  for (; *text != '\0'; text++) {
+    for (i = 0; query[i] != '\0'; i++) {
+      if (text[i] == '\0' || norm_char(text[i]) != query[i]) {
+        break;
+      }
+    }
+    if (query[i] == '\0') {
+      return 1;
+    }
+  }
+
+  return query[0] == '\0';
+}
+
+/* Quake's character set: the high bit selects the colored version of a
+ * character, 0x12 - 0x1b are the digits of the console number font.
+ */
+static int norm_char(unsigned char c)
+{
+  c &= 0x7F;
+  if (c >= 0x12 && c <= 0x1B) {
+    return '0' + (c - 0x12);
+  }
+  if (c >= 'A' && c <= 'Z') {
+    return c - 'A' + 'a';
+  }
+  return c;
+}
+
+static int is_word_char(int c)
+{
+  return (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9');
+}
+
+static int compare_keys(const void *a, const void *b)
+{
+  return strcmp(((const word_key *) a)->word, ((const word_key *) b)->word);
+}
+
+static int compare_counts(const void *a, const void *b)
+{
+  uint32_t ca = (*(const text_token *const *) a)->count;
+  uint32_t cb = (*(const text_token *const *) b)->count;
+
+  return (ca > cb) - (ca < cb);
+}
+
+static uint64_t fnv1a(const char *s, size_t len)
+{
+  uint64_t hash = FNV_OFFSET;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    hash ^= (uint8_t) s[i];
+    hash *= FNV_PRIME;
+  }
+
+  return hash;
+}
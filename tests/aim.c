@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "demo.h"
+#include "demo_simd.h"
+#include "demo_angles.h"
+#include "demo_aim.h"
+
+/* Checks the vector aim kernels against the scalar reference. Every level
+ * the CPU supports is pinned with demo_simd_select() in turn, and the
+ * deltas and statistics compared bit for bit with those of
+ * DEMO_SIMD_SCALAR, for series lengths around the vector widths and the
+ * kernel chunk. The angles include the values plain conversion to integer
+ * gets wrong: infinities, NaNs, and deltas of 2^31 turns and more. Any two
+ * NaNs count as equal, their payloads are not part of the contract.
+ */
+
+#define MAX_COUNT 2100
+#define GUARD 8 // floats past the end that must stay untouched
+#define POISON 0x7F
+
+static const size_t counts[] = {
+  0, 1, 2, 3, 4, 5, 8, 9, 10, 16, 17, 33, 1024, 1025, 1026, 2049, MAX_COUNT
+};
+
+static const float specials[] = {
+  INFINITY, -INFINITY, NAN, -NAN, 0.0f, -0.0f,
+  180.0f, -180.0f, 540.0f, -540.0f, 900.0f, 179.99998f, 180.00002f,
+  8388608.0f * 360.0f, -8388608.0f * 360.0f, 7.73094e11f, -7.73094e11f,
+  1e20f, -1e20f, 3.0e38f, -3.0e38f
+};
+
+typedef struct {
+  float pitch[MAX_COUNT + GUARD];
+  float yaw[MAX_COUNT + GUARD];
+  float velocity[MAX_COUNT + GUARD];
+} output;
+
+static float times[MAX_COUNT];
+static float pitches[MAX_COUNT];
+static float yaws[MAX_COUNT];
+static output ref;
+static output out;
+static int failures;
+static int checks;
+
+/*****************************************************************************
+ *                                                                           *
+ *                HELPER FUNCTIONS                                           *
+ *                                                                           *
+ *****************************************************************************/
+
+static float random_angle(int wild)
+{
+  if (wild && rand() % 4 == 0) {
+    return specials[rand() % (sizeof(specials) / sizeof(specials[0]))];
+  }
+
+  return (float) rand() / RAND_MAX * 1440.0f - 720.0f;
+}
+
+/* Mostly increasing times, with repeats and steps back so that the
+ * invalid velocity lanes come up as well
+ */
+static void make_series(int wild)
+{
+  float t = 0;
+  size_t i;
+
+  for (i = 0; i < MAX_COUNT; i++) {
+    switch (rand() % 8) {
+    case 0:
+      break;
+
+    case 1:
+      t -= 0.01f;
+      break;
+
+    default:
+      t += 1.0f / 72.0f;
+      break;
+    }
+    times[i] = t;
+    pitches[i] = random_angle(wild);
+    yaws[i] = random_angle(wild);
+  }
+}
+
+static void poison(output *o)
+{
+  memset(o, POISON, sizeof(*o));
+}
+
+static int same_floats(const float *a, const float *b, size_t n)
+{
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    if (isnan(a[i]) && isnan(b[i])) {
+      continue;
+    }
+    if (memcmp(&a[i], &b[i], sizeof(float)) != 0) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+static void check(const char *what, int level, size_t n, int ok)
+{
+  checks++;
+  if (!ok) {
+    printf("FAIL %s, level %d, n %zu\n", what, level, n);
+    failures++;
+  }
+}
+
+/*****************************************************************************
+ *                                                                           *
+ *                CHECKS                                                     *
+ *                                                                           *
+ *****************************************************************************/
+
+static void check_deltas(int level, size_t n)
+{
+  angle_series series;
+  size_t size = n + GUARD;
+
+  memset(&series, 0, sizeof(series));
+  series.time = times;
+  series.pitch = pitches;
+  series.yaw = yaws;
+  series.count = n;
+
+  demo_simd_select(DEMO_SIMD_SCALAR);
+  poison(&ref);
+  demo_aim_deltas(&series, ref.pitch, ref.yaw, ref.velocity);
+
+  demo_simd_select(level);
+  poison(&out);
+  demo_aim_deltas(&series, out.pitch, out.yaw, out.velocity);
+
+  check("pitch deltas", level, n, same_floats(ref.pitch, out.pitch, size));
+  check("yaw deltas", level, n, same_floats(ref.yaw, out.yaw, size));
+  check("velocities", level, n,
+        same_floats(ref.velocity, out.velocity, size));
+}
+
+static void check_analysis(int level, size_t n)
+{
+  angle_series series;
+  aim_stats a;
+  aim_stats b;
+
+  memset(&series, 0, sizeof(series));
+  series.time = times;
+  series.pitch = pitches;
+  series.yaw = yaws;
+  series.count = n;
+
+  demo_simd_select(DEMO_SIMD_SCALAR);
+  memset(&a, 0, sizeof(a));
+  demo_aim_analyse(&series, NULL, &a);
+
+  demo_simd_select(level);
+  memset(&b, 0, sizeof(b));
+  demo_aim_analyse(&series, NULL, &b);
+
+  check("statistics", level, n, memcmp(&a, &b, sizeof(a)) == 0);
+}
+
+/*****************************************************************************
+ *                                                                           *
+ *                MAIN                                                       *
+ *                                                                           *
+ *****************************************************************************/
+
+int main(void)
+{
+  size_t i;
+  int level;
+  int wild;
+
+  srand(1);
+
+  for (level = DEMO_SIMD_SSE2; level <= DEMO_SIMD_AVX2; level++) {
+    if (demo_simd_select(level) != level) {
+      printf("aim: level %d not supported, skipped\n", level);
+      continue;
+    }
+
+    for (wild = 0; wild < 2; wild++) {
+      make_series(wild);
+      for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+        check_deltas(level, counts[i]);
+        if (!wild) {
+          check_analysis(level, counts[i]);
+        }
+      }
+    }
+  }
+  demo_simd_select(DEMO_SIMD_AUTO);
+
+  printf("aim: %d checks, %d failed\n", checks, failures);
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
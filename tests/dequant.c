@@ -0,0 +1,226 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "demo.h"
+#include "demo_simd.h"
+
+/* Checks the vector dequantization kernels against the scalar reference.
+ * Every level the CPU supports is pinned with demo_simd_select() in turn,
+ * and its output compared bit for bit with that of DEMO_SIMD_SCALAR, for
+ * batch lengths around the vector widths and the decoder's staging batch.
+ */
+
+#define MAX_COUNT 1100
+#define PAYLOAD 32 // more than any entity update or CLIENTDATA needs
+#define GUARD 8 // floats past the end that must stay untouched
+#define POISON 0x7F
+
+static const size_t counts[] = {
+  0, 1, 2, 3, 5, 7, 8, 9, 15, 16, 17, 31, 32, 33, 63, 65,
+  255, 256, 257, 511, 513, 1021, MAX_COUNT
+};
+
+static const uint32_t protocols[] = {
+  PROTOCOL_NETQUAKE, PROTOCOL_FITZQUAKE, PROTOCOL_BJP3
+};
+
+typedef struct {
+  float a[(MAX_COUNT + GUARD) * 3];
+  float b[(MAX_COUNT + GUARD) * 3];
+  float c[(MAX_COUNT + GUARD) * 3];
+  uint32_t bits[MAX_COUNT + GUARD];
+  uint16_t entities[MAX_COUNT + GUARD];
+} output;
+
+static message msgs[MAX_COUNT];
+static message *ptrs[MAX_COUNT];
+static uint8_t payloads[MAX_COUNT][PAYLOAD];
+static uint8_t raw[MAX_COUNT * 3 * 2 + 1];
+static output ref;
+static output out;
+static int failures;
+static int checks;
+
+/*****************************************************************************
+ *                                                                           *
+ *                HELPER FUNCTIONS                                           *
+ *                                                                           *
+ *****************************************************************************/
+
+static void fill_random(uint8_t *p, size_t n)
+{
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    p[i] = (uint8_t) (rand() >> 7);
+  }
+}
+
+/* Random payloads, so every combination of mask bits comes up
+ */
+static void make_messages(int clientdata)
+{
+  size_t i;
+
+  fill_random(&payloads[0][0], sizeof(payloads));
+  for (i = 0; i < MAX_COUNT; i++) {
+    if (clientdata) {
+      msgs[i].type = CLIENTDATA;
+    }
+    else {
+      msgs[i].type = 0x80 | (rand() & 0x7F);
+    }
+    msgs[i].size = PAYLOAD;
+    msgs[i].data = payloads[i];
+    ptrs[i] = &msgs[i];
+  }
+}
+
+static void poison(output *o)
+{
+  memset(o, POISON, sizeof(*o));
+}
+
+static void check(const char *what, int level, size_t n, const void *a,
+                  const void *b, size_t size)
+{
+  checks++;
+  if (memcmp(a, b, size) != 0) {
+    printf("FAIL %s, level %d, n %zu\n", what, level, n);
+    failures++;
+  }
+}
+
+/*****************************************************************************
+ *                                                                           *
+ *                CHECKS                                                     *
+ *                                                                           *
+ *****************************************************************************/
+
+/* The raw kernels, also from an odd address
+ */
+static void check_kernels(int level, size_t n, size_t misalign)
+{
+  size_t size = (n + GUARD) * sizeof(float);
+
+  demo_simd_select(DEMO_SIMD_SCALAR);
+  poison(&ref);
+  demo_dequant_coords(raw + misalign, ref.a, n);
+  demo_dequant_angles(raw + misalign, ref.b, n);
+
+  demo_simd_select(level);
+  poison(&out);
+  demo_dequant_coords(raw + misalign, out.a, n);
+  demo_dequant_angles(raw + misalign, out.b, n);
+
+  check("coords", level, n, ref.a, out.a, size);
+  check("angles", level, n, ref.b, out.b, size);
+}
+
+static void check_entity_updates(int level, uint32_t protocol, size_t n)
+{
+  int ret;
+
+  demo_simd_select(DEMO_SIMD_SCALAR);
+  poison(&ref);
+  ret = demo_decode_entity_updates(protocol, ptrs, n, ref.entities, ref.bits,
+                                   ref.a, ref.b);
+  if (ret != DEMO_OK) {
+    printf("FAIL entity updates, scalar, n %zu: %s\n", n, demo_error(ret));
+    failures++;
+    return;
+  }
+
+  demo_simd_select(level);
+  poison(&out);
+  ret = demo_decode_entity_updates(protocol, ptrs, n, out.entities, out.bits,
+                                   out.a, out.b);
+  if (ret != DEMO_OK) {
+    printf("FAIL entity updates, level %d, n %zu: %s\n", level, n,
+           demo_error(ret));
+    failures++;
+    return;
+  }
+
+  check("entity numbers", level, n, ref.entities, out.entities,
+        sizeof(ref.entities));
+  check("entity bits", level, n, ref.bits, out.bits, sizeof(ref.bits));
+  check("entity origins", level, n, ref.a, out.a, sizeof(ref.a));
+  check("entity angles", level, n, ref.b, out.b, sizeof(ref.b));
+}
+
+static void check_clientdata(int level, uint32_t protocol, size_t n)
+{
+  int ret;
+
+  demo_simd_select(DEMO_SIMD_SCALAR);
+  poison(&ref);
+  ret = demo_decode_clientdata(protocol, ptrs, n, ref.bits, ref.a, ref.b,
+                               ref.c);
+  if (ret != DEMO_OK) {
+    printf("FAIL clientdata, scalar, n %zu: %s\n", n, demo_error(ret));
+    failures++;
+    return;
+  }
+
+  demo_simd_select(level);
+  poison(&out);
+  ret = demo_decode_clientdata(protocol, ptrs, n, out.bits, out.a, out.b,
+                               out.c);
+  if (ret != DEMO_OK) {
+    printf("FAIL clientdata, level %d, n %zu: %s\n", level, n,
+           demo_error(ret));
+    failures++;
+    return;
+  }
+
+  check("clientdata bits", level, n, ref.bits, out.bits, sizeof(ref.bits));
+  check("clientdata view", level, n, ref.a, out.a, sizeof(ref.a));
+  check("clientdata punch", level, n, ref.b, out.b, sizeof(ref.b));
+  check("clientdata velocity", level, n, ref.c, out.c, sizeof(ref.c));
+}
+
+/*****************************************************************************
+ *                                                                           *
+ *                MAIN                                                       *
+ *                                                                           *
+ *****************************************************************************/
+
+int main(void)
+{
+  size_t i;
+  size_t p;
+  int level;
+
+  srand(1);
+  fill_random(raw, sizeof(raw));
+
+  for (level = DEMO_SIMD_SSE2; level <= DEMO_SIMD_AVX2; level++) {
+    if (demo_simd_select(level) != level) {
+      printf("dequant: level %d not supported, skipped\n", level);
+      continue;
+    }
+
+    for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+      check_kernels(level, counts[i], 0);
+      check_kernels(level, counts[i], 1);
+    }
+
+    for (p = 0; p < sizeof(protocols) / sizeof(protocols[0]); p++) {
+      make_messages(0);
+      for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+        check_entity_updates(level, protocols[p], counts[i]);
+      }
+      make_messages(1);
+      for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+        check_clientdata(level, protocols[p], counts[i]);
+      }
+    }
+  }
+  demo_simd_select(DEMO_SIMD_AUTO);
+
+  printf("dequant: %d checks, %d failed\n", checks, failures);
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,298 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "demo.h"
+#include "demo_simd.h"
+#include "demo_hash.h"
+
+/* Checks the stripe kernels of the hash. Every level the CPU supports is
+ * pinned with demo_simd_select() in turn, and demo_hash64(),
+ * demo_hash_block() and demo_hashes_fingerprint() compared with those of
+ * DEMO_SIMD_SCALAR, for lengths around the stripe and the scramble round,
+ * from odd addresses and fed in pieces. Known answers pin the values
+ * themselves at every level, including the scalar one, since corpus
+ * indexes store them.
+ */
+
+#define MAX_LENGTH 5000
+#define BLOCKS 40
+#define MESSAGES 6 // per block
+#define MAX_PAYLOAD 300
+#define PATTERN_SEED 0x2545F4914F6CDD1DULL
+
+static const size_t lengths[] = {
+  0, 1, 3, 7, 8, 15, 31, 32, 33, 63, 64, 65, 127, 128, 129, 255, 256, 257,
+  1023, 1024, 1025, 1087, 2048, 2111, 4096, MAX_LENGTH
+};
+
+static const struct {
+  size_t length;
+  uint64_t seed;
+  uint64_t hash;
+} known[] = {
+  { 0, 0, 0x5862BA7C1E88C0E3ULL },
+  { 1, 0, 0x6738F81B9DC9FBA6ULL },
+  { 63, 0, 0x9784DB7A47332649ULL },
+  { 64, 0, 0x6977138ECCE73B23ULL },
+  { 65, 1, 0xD467EAE9895EAE42ULL },
+  { 1024, 0, 0xEBADF05C10375F51ULL },
+  { 1025, 0xDEADBEEFULL, 0xBC7B8EB90E5872D9ULL },
+  { MAX_LENGTH, 0x0123456789ABCDEFULL, 0x25DABE2FD191CCFEULL },
+};
+
+#define KNOWN_BLOCK 0xEDDBB0498027186AULL // of the first block
+#define KNOWN_FINGERPRINT 0xF6045A7636A7C025ULL
+
+static uint8_t input[MAX_LENGTH + 1];
+static uint8_t payloads[BLOCKS][MESSAGES][MAX_PAYLOAD];
+static message msgs[BLOCKS][MESSAGES];
+static block blocks[BLOCKS];
+static demo sample;
+static int failures;
+static int checks;
+
+/*****************************************************************************
+ *                                                                           *
+ *                HELPER FUNCTIONS                                           *
+ *                                                                           *
+ *****************************************************************************/
+
+/* A fixed byte sequence, independent of the C library's rand(), so the
+ * known answers hold everywhere
+ */
+static void fill_pattern(uint8_t *p, size_t n, uint64_t *x)
+{
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    *x = *x * 6364136223846793005ULL + 1442695040888963407ULL;
+    p[i] = (uint8_t) (*x >> 56);
+  }
+}
+
+/* A demo of BLOCKS blocks of MESSAGES messages, with block lengths
+ * matching the messages
+ */
+static void make_demo(void)
+{
+  uint64_t x = PATTERN_SEED;
+  uint8_t r[2];
+  int i;
+  int j;
+
+  memset(&sample, 0, sizeof(sample));
+  memset(blocks, 0, sizeof(blocks));
+  memset(msgs, 0, sizeof(msgs));
+  fill_pattern(&payloads[0][0][0], sizeof(payloads), &x);
+
+  sample.protocol = PROTOCOL_NETQUAKE;
+  sample.track = -1;
+  sample.blocks = &blocks[0];
+  for (i = 0; i < BLOCKS; i++) {
+    for (j = 0; j < MESSAGES; j++) {
+      fill_pattern(r, sizeof(r), &x);
+      msgs[i][j].type = r[0];
+      msgs[i][j].size = (r[1] * (i + j + 1)) % MAX_PAYLOAD;
+      msgs[i][j].data = payloads[i][j];
+      msgs[i][j].next = (j + 1 < MESSAGES) ? &msgs[i][j + 1] : NULL;
+      blocks[i].length += msgs[i][j].size + 1;
+    }
+    blocks[i].angles[0] = i * 0.5f;
+    blocks[i].angles[1] = -i * 1.25f;
+    blocks[i].angles[2] = 0;
+    blocks[i].messages = &msgs[i][0];
+    blocks[i].next = (i + 1 < BLOCKS) ? &blocks[i + 1] : NULL;
+  }
+}
+
+/* The block as write_block() lays it out, little endian
+ */
+static size_t serialize_block(const block *b, uint8_t *out)
+{
+  const message *m;
+  uint32_t v;
+  size_t n = 0;
+  int i;
+  int k;
+
+  for (i = 0; i < 4; i++) {
+    if (i == 0) {
+      v = b->length;
+    }
+    else {
+      memcpy(&v, &b->angles[i - 1], 4);
+    }
+    for (k = 0; k < 4; k++) {
+      out[n++] = (uint8_t) (v >> (k * 8));
+    }
+  }
+  for (m = b->messages; m != NULL; m = m->next) {
+    out[n++] = (uint8_t) m->type;
+    memcpy(out + n, m->data, m->size);
+    n += m->size;
+  }
+
+  return n;
+}
+
+static uint64_t fingerprint(void)
+{
+  demo_hashes *h;
+  uint64_t f = 0;
+
+  if (demo_hashes_new(&h) != DEMO_OK) {
+    printf("FAIL creating the hash list\n");
+    failures++;
+    return 0;
+  }
+  if (demo_hashes_build(h, &sample) == DEMO_OK) {
+    f = demo_hashes_fingerprint(h);
+  }
+  else {
+    printf("FAIL building the hash list\n");
+    failures++;
+  }
+  demo_hashes_free(h);
+
+  return f;
+}
+
+/* Hashes data through a state, in pieces of up to max bytes
+ */
+static uint64_t hash_pieces(const uint8_t *p, size_t n, uint64_t seed,
+                            size_t max)
+{
+  demo_hash_state s;
+  size_t piece;
+
+  demo_hash_init(&s, seed);
+  while (n > 0) {
+    piece = (size_t) rand() % max + 1;
+    if (piece > n) {
+      piece = n;
+    }
+    demo_hash_update(&s, p, piece);
+    p += piece;
+    n -= piece;
+  }
+
+  return demo_hash_final(&s);
+}
+
+static void check(const char *what, int level, size_t n, uint64_t a,
+                  uint64_t b)
+{
+  checks++;
+  if (a != b) {
+    printf("FAIL %s, level %d, n %zu: %016llx, expected %016llx\n", what,
+           level, n, (unsigned long long) b, (unsigned long long) a);
+    failures++;
+  }
+}
+
+/*****************************************************************************
+ *                                                                           *
+ *                CHECKS                                                     *
+ *                                                                           *
+ *****************************************************************************/
+
+static void check_known(int level)
+{
+  size_t i;
+
+  for (i = 0; i < sizeof(known) / sizeof(known[0]); i++) {
+    check("known hash", level, known[i].length, known[i].hash,
+          demo_hash64(input, known[i].length, known[i].seed));
+  }
+  check("known block hash", level, 0, KNOWN_BLOCK,
+        demo_hash_block(&blocks[0]));
+  check("known fingerprint", level, BLOCKS, KNOWN_FINGERPRINT,
+        fingerprint());
+}
+
+/* One shot, from an odd address and in pieces of 1 byte up to a few
+ * stripes
+ */
+static void check_lengths(int level, size_t n)
+{
+  uint64_t seed = 0x9E3779B97F4A7C15ULL * (n + 1);
+  uint64_t a[2];
+  uint64_t b[2];
+
+  demo_simd_select(DEMO_SIMD_SCALAR);
+  a[0] = demo_hash64(input, n, seed);
+  a[1] = demo_hash64(input + 1, n, 0);
+
+  demo_simd_select(level);
+  b[0] = demo_hash64(input, n, seed);
+  b[1] = demo_hash64(input + 1, n, 0);
+
+  check("hash64", level, n, a[0], b[0]);
+  check("hash64 misaligned", level, n, a[1], b[1]);
+  check("hash pieces", level, n, a[0], hash_pieces(input, n, seed, 1));
+  check("hash pieces", level, n, a[0], hash_pieces(input, n, seed, 200));
+}
+
+static void check_blocks(int level)
+{
+  static uint8_t raw[16 + MESSAGES * (MAX_PAYLOAD + 1)];
+  uint64_t a;
+  size_t n;
+  int i;
+
+  for (i = 0; i < BLOCKS; i++) {
+    demo_simd_select(DEMO_SIMD_SCALAR);
+    a = demo_hash_block(&blocks[i]);
+
+    demo_simd_select(level);
+    check("block hash", level, i, a, demo_hash_block(&blocks[i]));
+
+    n = serialize_block(&blocks[i], raw);
+    check("block hash of the file data", level, i, a,
+          demo_hash64(raw, n, 0));
+  }
+
+  demo_simd_select(DEMO_SIMD_SCALAR);
+  a = fingerprint();
+  demo_simd_select(level);
+  check("fingerprint", level, BLOCKS, a, fingerprint());
+}
+
+/*****************************************************************************
+ *                                                                           *
+ *                MAIN                                                       *
+ *                                                                           *
+ *****************************************************************************/
+
+int main(void)
+{
+  uint64_t x = PATTERN_SEED;
+  size_t i;
+  int level;
+
+  srand(1);
+  fill_pattern(input, sizeof(input), &x);
+  make_demo();
+
+  demo_simd_select(DEMO_SIMD_SCALAR);
+  check_known(DEMO_SIMD_SCALAR);
+
+  for (level = DEMO_SIMD_SSE2; level <= DEMO_SIMD_AVX2; level++) {
+    if (demo_simd_select(level) != level) {
+      printf("hash: level %d not supported, skipped\n", level);
+      continue;
+    }
+
+    check_known(level);
+    for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+      check_lengths(level, lengths[i]);
+    }
+    check_blocks(level);
+  }
+  demo_simd_select(DEMO_SIMD_AUTO);
+
+  printf("hash: %d checks, %d failed\n", checks, failures);
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
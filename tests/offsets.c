@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include "demo.h"
+
+/* Checks that offsets past 4 GiB survive the reader. A sparse file is
+ * grown past UINT32_MAX with ftruncate(), a small demo is written at its
+ * end and scanned from there through READFLAG_FP; the 64 bit progress
+ * offsets and the position the stream is left at must be exact.
+ */
+
+#define DEMO_OFFSET (((off_t) 1 << 32) + 4096) // where the demo starts
+#define BLOCKS 5000 // enough for a few CB_BLOCKS progress callbacks
+#define BLOCK_SIZE (4 + 12 + 5 + 1) // length, angles, TIME, NOP
+#define STOP_AFTER 3000 // past the first progress callback
+#define HEADER "-1\n"
+
+static uint64_t last_offset;
+static uint64_t low_offset = UINT64_MAX;
+static int callbacks;
+static int blocks;
+static int failures;
+
+/*****************************************************************************
+ *                                                                           *
+ *                HELPER FUNCTIONS                                           *
+ *                                                                           *
+ *****************************************************************************/
+
+static void put_uint32(uint8_t *p, uint32_t v)
+{
+  p[0] = v & 0xFF;
+  p[1] = (v >> 8) & 0xFF;
+  p[2] = (v >> 16) & 0xFF;
+  p[3] = (v >> 24) & 0xFF;
+}
+
+/* Writes the cd track line and BLOCKS frames of a TIME and a NOP message
+ */
+static int write_demo(FILE *fp)
+{
+  uint8_t b[BLOCK_SIZE];
+  float time;
+  uint32_t bits;
+  int i;
+
+  if (fwrite(HEADER, strlen(HEADER), 1, fp) != 1) {
+    return -1;
+  }
+
+  memset(b, 0, sizeof(b));
+  put_uint32(b, 6);
+  b[16] = TIME;
+  b[21] = NOP;
+  for (i = 0; i < BLOCKS; i++) {
+    time = i / 72.0f;
+    memcpy(&bits, &time, sizeof(bits));
+    put_uint32(b + 17, bits);
+    if (fwrite(b, sizeof(b), 1, fp) != 1) {
+      return -1;
+    }
+  }
+
+  return fflush(fp);
+}
+
+static void progress64(uint64_t offset)
+{
+  callbacks++;
+  last_offset = offset;
+  if (offset < low_offset) {
+    low_offset = offset;
+  }
+}
+
+static int count_cb(void *ctx, demo *header, block **b)
+{
+  int stop = *(int *) ctx;
+
+  blocks++;
+  return (stop > 0 && blocks == stop) ? DEMO_SCAN_STOP : DEMO_OK;
+}
+
+static void expect(int ok, const char *what)
+{
+  if (!ok) {
+    printf("FAIL %s\n", what);
+    failures++;
+  }
+}
+
+/*****************************************************************************
+ *                                                                           *
+ *                CHECKS                                                     *
+ *                                                                           *
+ *****************************************************************************/
+
+static void check_scan(FILE *fp, int stop)
+{
+  off_t first = DEMO_OFFSET + strlen(HEADER);
+  off_t end;
+  flagfield flags[3];
+  int ret;
+
+  flags[0].flag = READFLAG_FP;
+  flags[0].value = fp;
+  flags[1].flag = READFLAG_PROGRESS64_CB;
+  flags[1].value = (void *) progress64;
+  flags[2].flag = READFLAG_END;
+  flags[2].value = NULL;
+
+  last_offset = 0;
+  low_offset = UINT64_MAX;
+  callbacks = 0;
+  blocks = 0;
+
+  if (fseeko(fp, DEMO_OFFSET, SEEK_SET) != 0) {
+    expect(0, "seek to the demo");
+    return;
+  }
+  ret = demo_scan(flags, count_cb, &stop);
+  end = first + (off_t) blocks * BLOCK_SIZE;
+
+  expect(ret == DEMO_OK, "scan result");
+  expect(blocks == (stop > 0 ? stop : BLOCKS), "block count");
+  expect(callbacks > 0, "progress callbacks made");
+  expect(low_offset > UINT32_MAX, "progress offsets past 4 GiB");
+  expect(last_offset <= (uint64_t) end, "progress offsets within the demo");
+  expect((last_offset - first) % BLOCK_SIZE == 0,
+         "progress offsets on block boundaries");
+  expect(ftello(fp) == end, "stream left after the last block");
+}
+
+/*****************************************************************************
+ *                                                                           *
+ *                MAIN                                                       *
+ *                                                                           *
+ *****************************************************************************/
+
+int main(void)
+{
+  char name[] = "/tmp/demo_offsets_XXXXXX";
+  FILE *fp;
+  int fd;
+
+  if (sizeof(off_t) < 8) {
+    printf("offsets: no 64 bit off_t, skipped\n");
+    return EXIT_SUCCESS;
+  }
+
+  fd = mkstemp(name);
+  if (fd < 0) {
+    printf("offsets: cannot create %s, skipped\n", name);
+    return EXIT_SUCCESS;
+  }
+  unlink(name);
+
+  // the file system must take a sparse file this size
+  if (ftruncate(fd, DEMO_OFFSET) != 0) {
+    printf("offsets: no sparse file past 4 GiB, skipped\n");
+    close(fd);
+    return EXIT_SUCCESS;
+  }
+
+  fp = fdopen(fd, "w+b");
+  if (fp == NULL || fseeko(fp, DEMO_OFFSET, SEEK_SET) != 0 ||
+      write_demo(fp) != 0) {
+    printf("FAIL writing the demo\n");
+    return EXIT_FAILURE;
+  }
+
+  check_scan(fp, 0);
+  check_scan(fp, STOP_AFTER);
+  fclose(fp);
+
+  printf("offsets: %d failed\n", failures);
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
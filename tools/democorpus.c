@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "demo.h"
+#include "demo_corpus.h"
+
+/* Command line front end to the corpus index.
+ *
+ *   democorpus update <index> <dir>
+ *   democorpus query <index> [-p protocol] [-m map] [-n player]
+ *                            [-min seconds] [-max seconds]
+ */
+
+static int print_entry(void *ctx, const demo_corpus *c, const corpus_entry *e)
+{
+  const corpus_level *l = demo_corpus_levels(c, e);
+  uint32_t i;
+
+  printf("%s\t%u\t%.1f\t", demo_corpus_string(c, e->path), e->protocol,
+         e->duration);
+  for (i = 0; l != NULL && i < e->level_count; i++) {
+    printf("%s%s", i ? "," : "", demo_corpus_string(c, l[i].map));
+  }
+  printf("\n");
+
+  (*(size_t *) ctx)++;
+  return DEMO_OK;
+}
+
+static int usage(void)
+{
+  fprintf(stderr,
+          "usage: democorpus update <index> <dir>\n"
+          "       democorpus query <index> [-p protocol] [-m map] "
+          "[-n player] [-min seconds] [-max seconds]\n");
+  return 2;
+}
+
+static int update(int argc, char **argv)
+{
+  corpus_stats stats;
+  int ret;
+
+  if (argc != 4) {
+    return usage();
+  }
+
+  ret = demo_corpus_update(argv[2], argv[3], &stats);
+  if (ret != DEMO_OK) {
+    fprintf(stderr, "democorpus: %s\n", demo_error(ret));
+    return 1;
+  }
+
+  fprintf(stderr, "scanned %zu (%zu failed), reused %zu, removed %zu\n",
+          stats.scanned, stats.failed, stats.reused, stats.removed);
+  return 0;
+}
+
+static int query(int argc, char **argv)
+{
+  demo_corpus *c;
+  corpus_query q;
+  size_t found = 0;
+  int ret;
+  int i;
+
+  if (argc < 3) {
+    return usage();
+  }
+
+  demo_corpus_query_init(&q);
+  for (i = 3; i < argc; i++) {
+    if (i + 1 == argc) {
+      return usage();
+    }
+    if (strcmp(argv[i], "-p") == 0) {
+      q.protocol = strtoul(argv[++i], NULL, 10);
+    }
+    else if (strcmp(argv[i], "-m") == 0) {
+      q.map = argv[++i];
+    }
+    else if (strcmp(argv[i], "-n") == 0) {
+      q.player = argv[++i];
+    }
+    else if (strcmp(argv[i], "-min") == 0) {
+      q.min_duration = strtof(argv[++i], NULL);
+    }
+    else if (strcmp(argv[i], "-max") == 0) {
+      q.max_duration = strtof(argv[++i], NULL);
+    }
+    else {
+      return usage();
+    }
+  }
+
+  ret = demo_corpus_open(argv[2], &c);
+  if (ret != DEMO_OK) {
+    fprintf(stderr, "democorpus: %s\n", demo_error(ret));
+    return 1;
+  }
+
+  ret = demo_corpus_query(c, &q, print_entry, &found);
+  demo_corpus_close(c);
+  if (ret != DEMO_OK) {
+    fprintf(stderr, "democorpus: %s\n", demo_error(ret));
+    return 1;
+  }
+
+  fprintf(stderr, "%zu matching demos\n", found);
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc >= 2 && strcmp(argv[1], "update") == 0) {
+    return update(argc, argv);
+  }
+  if (argc >= 2 && strcmp(argv[1], "query") == 0) {
+    return query(argc, argv);
+  }
+
+  return usage();
+}